@@ -0,0 +1,816 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * End-to-end benchmark of the measurement engines against netbenchd on the
+ * loopback interface
+ * The cost of the client (this process) is reported in CPU cycles per byte
+ * from the CPU time, so that the server sharing the CPUs does not count.
+ * The checks (e.g., of the TLS) fail the run if not passed.
+ */
+
+#include "config.h"
+#include <netbench.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#endif
+
+#define SERVER_ADDR     "127.0.0.1"
+#define SERVER_NAME     "localhost"     /* Of the test certificate */
+#define DEFAULT_SERVER  "../toolset/netbenchd"
+#define REPETITIONS     5
+#define DURATION        2.0
+#define HUGE_SIZE       "1000000000000"
+#define SMALL_REQUESTS  2000
+#define PING_ROUNDS     32
+#define PING_BURST      32
+#define CLOCK_CALLS     10000000
+#define UDP_SIZE        1472
+#define UDP_RATE        1e9
+#define UDP_LOSS_MAX    0.001           /* Of the loopback */
+
+static char port[16];
+static char tlsport[16];
+static char tlsdir[] = "/tmp/nbbench.XXXXXX";
+static char certfile[64];
+static char keyfile[64];
+static double cpuhz;
+static int failures;
+
+/*
+ * CPU time of this process in seconds
+ */
+static double
+cputime(void)
+{
+    struct rusage ru;
+
+    if ( 0 != getrusage(RUSAGE_SELF, &ru) ) {
+        return 0.0;
+    }
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+/*
+ * Maximum clock frequency of the CPU from cpufreq, or the current one of
+ * /proc/cpuinfo if not available (0 if unknown)
+ */
+static double
+cpu_frequency(void)
+{
+    FILE *fp;
+    char line[256];
+    double khz;
+    double mhz;
+
+    fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+    if ( NULL != fp ) {
+        khz = 0.0;
+        if ( 1 != fscanf(fp, "%lf", &khz) ) {
+            khz = 0.0;
+        }
+        fclose(fp);
+        if ( khz > 0.0 ) {
+            return khz * 1e3;
+        }
+    }
+
+    fp = fopen("/proc/cpuinfo", "r");
+    if ( NULL == fp ) {
+        return 0.0;
+    }
+    mhz = 0.0;
+    while ( NULL != fgets(line, sizeof(line), fp) ) {
+        if ( 1 == sscanf(line, "cpu MHz : %lf", &mhz) ) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return mhz * 1e6;
+}
+
+/*
+ * Print the client cost per byte
+ */
+static void
+print_cost(const char *name, double gbps, double cpu, off_t bytes)
+{
+    if ( cpuhz > 0.0 ) {
+        printf("%-24s %8.2lf Gbps %8.3lf cycles/B\n", name, gbps,
+               cpu * cpuhz / bytes);
+    } else {
+        printf("%-24s %8.2lf Gbps %8.3lf ns/B\n", name, gbps,
+               cpu * 1e9 / bytes);
+    }
+}
+
+/*
+ * Report a check, which fails the run unless passed
+ */
+static void
+check(const char *name, int passed)
+{
+    printf("%-24s %s\n", name, passed ? "ok" : "FAILED");
+    if ( !passed ) {
+        failures++;
+    }
+}
+
+/*
+ * Create a self-signed certificate of the server name and its key for the
+ * TLS listener, which is also trusted by the client
+ */
+static int
+tls_credentials(void)
+{
+#if HAVE_OPENSSL
+    EVP_PKEY_CTX *kctx;
+    EVP_PKEY *pkey;
+    X509 *x;
+    X509_NAME *name;
+    X509_EXTENSION *ext;
+    X509V3_CTX v3;
+    FILE *fp;
+    int ret;
+
+    if ( NULL == mkdtemp(tlsdir) ) {
+        return -1;
+    }
+    snprintf(certfile, sizeof(certfile), "%s/cert.pem", tlsdir);
+    snprintf(keyfile, sizeof(keyfile), "%s/key.pem", tlsdir);
+
+    /* ECDSA P-256 key */
+    pkey = NULL;
+    kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if ( NULL == kctx || EVP_PKEY_keygen_init(kctx) <= 0
+         || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+                                                   NID_X9_62_prime256v1) <= 0
+         || EVP_PKEY_keygen(kctx, &pkey) <= 0 ) {
+        EVP_PKEY_CTX_free(kctx);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(kctx);
+
+    /* Certificate valid for a day */
+    ret = -1;
+    x = X509_new();
+    if ( NULL == x ) {
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+    (void)X509_set_version(x, 2);
+    (void)ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    (void)X509_gmtime_adj(X509_getm_notBefore(x), -60);
+    (void)X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+    (void)X509_set_pubkey(x, pkey);
+    name = X509_get_subject_name(x);
+    (void)X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                     (const unsigned char *)SERVER_NAME, -1,
+                                     -1, 0);
+    (void)X509_set_issuer_name(x, name);
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, x, x, NULL, NULL, 0);
+    ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name,
+                              "DNS:" SERVER_NAME);
+    if ( NULL != ext && X509_add_ext(x, ext, -1)
+         && X509_sign(x, pkey, EVP_sha256()) > 0 ) {
+        fp = fopen(certfile, "w");
+        if ( NULL != fp ) {
+            if ( PEM_write_X509(fp, x) ) {
+                ret = 0;
+            }
+            fclose(fp);
+        }
+        fp = fopen(keyfile, "w");
+        if ( NULL == fp || !PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0,
+                                                 NULL, NULL) ) {
+            ret = -1;
+        }
+        if ( NULL != fp ) {
+            fclose(fp);
+        }
+    }
+    X509_EXTENSION_free(ext);
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Remove the certificate and the key
+ */
+static void
+tls_cleanup(void)
+{
+    if ( '\0' != certfile[0] ) {
+        (void)unlink(certfile);
+        (void)unlink(keyfile);
+        (void)rmdir(tlsdir);
+    }
+}
+
+/*
+ * Take a free port of the server address from the kernel
+ */
+static int
+free_port(char *buf, size_t len)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(SERVER_ADDR);
+    sin.sin_port = 0;
+    sinlen = sizeof(sin);
+    if ( sock < 0 || 0 != bind(sock, (struct sockaddr *)&sin, sizeof(sin))
+         || 0 != getsockname(sock, (struct sockaddr *)&sin, &sinlen) ) {
+        if ( sock >= 0 ) {
+            (void)close(sock);
+        }
+        return -1;
+    }
+    (void)close(sock);
+    snprintf(buf, len, "%d", ntohs(sin.sin_port));
+
+    return 0;
+}
+
+/*
+ * Start netbenchd on a free port (and TLS on another if the credentials are
+ * ready)
+ */
+static pid_t
+server_start(const char *path)
+{
+    struct sockaddr_in sin;
+    pid_t pid;
+    int sock;
+    int fd;
+    int i;
+
+    if ( 0 != free_port(port, sizeof(port)) ) {
+        return -1;
+    }
+    if ( '\0' != certfile[0] && 0 != free_port(tlsport, sizeof(tlsport)) ) {
+        return -1;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(SERVER_ADDR);
+    sin.sin_port = htons(atoi(port));
+
+    pid = fork();
+    if ( 0 == pid ) {
+        fd = open("/dev/null", O_WRONLY);
+        if ( fd >= 0 ) {
+            (void)dup2(fd, STDOUT_FILENO);
+        }
+        if ( '\0' != tlsport[0] ) {
+            execl(path, "netbenchd", "-a", SERVER_ADDR, "-p", port,
+                  "-S", tlsport, "-C", certfile, "-K", keyfile,
+                  (char *)NULL);
+        } else {
+            execl(path, "netbenchd", "-a", SERVER_ADDR, "-p", port,
+                  (char *)NULL);
+        }
+        _exit(127);
+    } else if ( pid < 0 ) {
+        return -1;
+    }
+
+    /* Wait for the server to listen */
+    for ( i = 0; i < 500; i++ ) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if ( 0 == connect(sock, (struct sockaddr *)&sin, sizeof(sin)) ) {
+            (void)close(sock);
+            return pid;
+        }
+        (void)close(sock);
+        if ( 0 != waitpid(pid, NULL, WNOHANG) ) {
+            /* Exited */
+            return -1;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    (void)waitpid(pid, NULL, 0);
+
+    return -1;
+}
+
+/*
+ * Transfer of a benchmark with the mode (of the receive or the direction) to
+ * the URL; the bytes and the elapsed time are returned
+ */
+typedef int (*bench_xfer_f)(int, const char *, off_t *, double *);
+
+/*
+ * Run the transfer the times, and report the best throughput with the
+ * client cost of that run
+ */
+static void
+bench_rate(const char *name, bench_xfer_f xfer, int mode, const char *url)
+{
+    off_t bytes;
+    off_t bestbytes;
+    double elapsed;
+    double cpu;
+    double gbps;
+    double best;
+    double bestcpu;
+    int i;
+
+    best = 0.0;
+    bestcpu = 0.0;
+    bestbytes = 1;
+    for ( i = 0; i < REPETITIONS; i++ ) {
+        cpu = cputime();
+        if ( 0 != xfer(mode, url, &bytes, &elapsed) ) {
+            printf("%-24s failed\n", name);
+            return;
+        }
+        cpu = cputime() - cpu;
+        gbps = elapsed > 0.0 ? bytes * 8.0 / elapsed / 1e9 : 0.0;
+        if ( gbps > best ) {
+            best = gbps;
+            bestcpu = cpu;
+            bestbytes = bytes;
+        }
+    }
+    print_cost(name, best, bestcpu, bestbytes);
+}
+
+/*
+ * Download at the maximum rate for the duration
+ */
+static int
+xfer_get(int rmode, const char *url, off_t *bytes, double *elapsed)
+{
+    nb_http_get_t *obj;
+    nb_http_get_result_t *res;
+
+    obj = nb_http_get_new("BENCH");
+    if ( NULL == obj ) {
+        return -1;
+    }
+    if ( 0 != nb_http_get_set_recv_mode(obj, rmode)
+         || 0 != nb_http_get_exec(obj, url, AF_INET, DURATION) ) {
+        nb_http_get_delete(obj);
+        return -1;
+    }
+    res = obj->last_result;
+    *bytes = res->payload;
+    *elapsed = res->timing.body - res->timing.header;
+    nb_http_get_delete(obj);
+
+    return 0;
+}
+
+/*
+ * Upload at the maximum rate for the duration
+ */
+static int
+xfer_post(int mode, const char *url, off_t *bytes, double *elapsed)
+{
+    nb_http_post_t *obj;
+    nb_http_post_result_t *res;
+
+    obj = nb_http_post_new("BENCH");
+    if ( NULL == obj ) {
+        return -1;
+    }
+    if ( 0 != nb_http_post_exec(obj, url, AF_INET,
+                                (off_t)strtoll(HUGE_SIZE, NULL, 10),
+                                DURATION) ) {
+        nb_http_post_delete(obj);
+        return -1;
+    }
+    res = obj->last_result;
+    *bytes = res->items[res->cnt - 1].btx;
+    *elapsed = res->items[res->cnt - 1].tm - res->items[0].tm;
+    nb_http_post_delete(obj);
+
+    return 0;
+}
+
+/*
+ * Raw TCP transfer at the maximum rate for the duration (both directions
+ * are counted in the bidirectional mode)
+ */
+static int
+xfer_tcp(int dir, const char *url, off_t *bytes, double *elapsed)
+{
+    nb_tcp_t *obj;
+    nb_tcp_result_t *res;
+
+    obj = nb_tcp_new();
+    if ( NULL == obj ) {
+        return -1;
+    }
+    if ( 0 != nb_tcp_exec(obj, SERVER_ADDR, port, AF_INET, dir, DURATION) ) {
+        nb_tcp_delete(obj);
+        return -1;
+    }
+    res = obj->last_result;
+    *bytes = res->items[res->cnt - 1].rx + res->items[res->cnt - 1].btx;
+    *elapsed = res->end - res->start;
+    nb_tcp_delete(obj);
+
+    return 0;
+}
+
+/*
+ * Small requests over a kept-alive connection (the fixed cost per request)
+ */
+static void
+bench_requests(void)
+{
+    nb_http_pool_t *pool;
+    nb_http_get_t *obj;
+    char url[256];
+    double t0;
+    double cpu;
+    int i;
+
+    pool = nb_http_pool_new(10.0, 1);
+    obj = nb_http_get_new("BENCH");
+    if ( NULL == pool || NULL == obj ) {
+        return;
+    }
+    (void)nb_http_get_set_pool(obj, pool);
+    snprintf(url, sizeof(url), "http://%s:%s/scr/download.php?size=1",
+             SERVER_ADDR, port);
+    t0 = nb_microtime();
+    cpu = cputime();
+    for ( i = 0; i < SMALL_REQUESTS; i++ ) {
+        if ( 0 != nb_http_get_exec(obj, url, AF_INET, DURATION) ) {
+            printf("%-24s failed\n", "keep-alive requests");
+            break;
+        }
+    }
+    cpu = cputime() - cpu;
+    t0 = nb_microtime() - t0;
+    printf("%-24s %8.0lf req/s %8.1lf us CPU/req\n", "keep-alive requests",
+           i / t0, cpu * 1e6 / i);
+    nb_http_get_delete(obj);
+    nb_http_pool_delete(pool);
+}
+
+/*
+ * Round of the probes of a benchmark; the replies are accounted to the
+ * count, the elapsed time and the minimum RTT
+ */
+typedef int (*bench_round_f)(void *, int *, double *, double *);
+
+/*
+ * Run the rounds of the probes, and report the rate and the minimum RTT
+ */
+static void
+bench_probes(const char *name, bench_round_f round, void *obj)
+{
+    double elapsed;
+    double minrtt;
+    int n;
+    int i;
+
+    n = 0;
+    elapsed = 0.0;
+    minrtt = -1.0;
+    for ( i = 0; i < PING_ROUNDS; i++ ) {
+        if ( 0 != round(obj, &n, &elapsed, &minrtt) ) {
+            printf("%-24s failed\n", name);
+            return;
+        }
+    }
+    if ( n > 0 && elapsed > 0.0 ) {
+        printf("%-24s %8.0lf probes/s %6.1lf us min RTT (%d/%d)\n", name,
+               n / elapsed, minrtt * 1e6, n, PING_ROUNDS * PING_BURST);
+    } else {
+        printf("%-24s no reply\n", name);
+    }
+}
+
+/*
+ * Account a reply to the probes
+ */
+static void
+probe_account(double rtt, int *n, double *minrtt)
+{
+    if ( *minrtt < 0.0 || rtt < *minrtt ) {
+        *minrtt = rtt;
+    }
+    (*n)++;
+}
+
+/*
+ * Burst of pings (small enough not to overflow the socket buffer), from the
+ * first sent to the last received
+ */
+static int
+round_ping(void *arg, int *n, double *elapsed, double *minrtt)
+{
+    nb_ping_t *obj;
+    nb_ping_result_t *res;
+    double first;
+    double last;
+    size_t i;
+
+    obj = (nb_ping_t *)arg;
+    if ( 0 != nb_ping_exec(obj, SERVER_ADDR, 56, PING_BURST, 0.0, 1.0) ) {
+        return -1;
+    }
+    res = obj->last_results;
+    first = -1.0;
+    last = 0.0;
+    for ( i = 0; i < res->cnt; i++ ) {
+        if ( res->items[i].stat <= 0 ) {
+            continue;
+        }
+        if ( first < 0.0 || res->items[i].sent < first ) {
+            first = res->items[i].sent;
+        }
+        if ( res->items[i].recv > last ) {
+            last = res->items[i].recv;
+        }
+        probe_account(res->items[i].recv - res->items[i].sent, n, minrtt);
+    }
+    if ( first >= 0.0 ) {
+        *elapsed += last - first;
+    }
+
+    return 0;
+}
+
+/*
+ * Concurrent handshakes to the server (a burst of targets at once)
+ */
+static int
+round_tcpping(void *arg, int *n, double *elapsed, double *minrtt)
+{
+    nb_tcpping_t *obj;
+    nb_tcpping_result_t *res;
+    const char *targets[PING_BURST];
+    double t0;
+    size_t i;
+
+    obj = (nb_tcpping_t *)arg;
+    for ( i = 0; i < PING_BURST; i++ ) {
+        targets[i] = SERVER_ADDR;
+    }
+    t0 = nb_microtime();
+    if ( 0 != nb_tcpping_exec(obj, targets, PING_BURST, port, AF_INET, 1,
+                              0.0, 1.0) ) {
+        return -1;
+    }
+    *elapsed += nb_microtime() - t0;
+    res = obj->last_result;
+    for ( i = 0; i < res->cnt; i++ ) {
+        if ( NB_TCPPING_OK == res->items[i].stat ) {
+            probe_account(res->items[i].rtt, n, minrtt);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * UDP at a fixed offered load reflected by the server
+ */
+static void
+bench_udp(void)
+{
+    nb_udp_t *obj;
+    nb_udp_result_t *res;
+    double cpu;
+
+    obj = nb_udp_new();
+    if ( NULL == obj ) {
+        return;
+    }
+    cpu = cputime();
+    if ( 0 != nb_udp_exec(obj, SERVER_ADDR, port, AF_INET, UDP_SIZE, UDP_RATE,
+                          DURATION, 1.0) ) {
+        printf("%-24s failed\n", "nb_udp_exec");
+        nb_udp_delete(obj);
+        return;
+    }
+    cpu = cputime() - cpu;
+    res = obj->last_result;
+    if ( res->received > 1 ) {
+        printf("%-24s %8.2lf Gbps %6.2lf %% loss %6.1lf us jitter "
+               "%6.0lf ns CPU/pkt\n", "nb_udp_exec (1 Gbps)",
+               res->bytes * 8.0 / (res->last - res->first) / 1e9,
+               100.0 * (res->cnt - res->received) / res->cnt,
+               res->jitter * 1e6, cpu * 1e9 / res->cnt);
+    } else {
+        printf("%-24s no reply\n", "nb_udp_exec");
+    }
+    check("UDP loss", res->cnt - res->received <= res->cnt * UDP_LOSS_MAX);
+    check("UDP ordering", 0 == res->reordered && 0 == res->duplicates);
+    nb_udp_delete(obj);
+}
+
+/*
+ * G.711 stream reflected by the server (the precision of the pacing)
+ */
+static void
+bench_voip(void)
+{
+    nb_voip_t *obj;
+    nb_voip_result_t *res;
+
+    obj = nb_voip_new();
+    if ( NULL == obj ) {
+        return;
+    }
+    if ( 0 != nb_voip_exec(obj, SERVER_ADDR, port, AF_INET, NB_VOIP_G711,
+                           DURATION, 1.0) ) {
+        printf("%-24s failed\n", "nb_voip_exec");
+        nb_voip_delete(obj);
+        return;
+    }
+    res = obj->last_result;
+    printf("%-24s %8.1lf us late (max %.1lf us) MOS %.2lf\n",
+           "nb_voip_exec (G.711)", res->pacing_avg * 1e6,
+           res->pacing_max * 1e6, res->mos);
+    nb_voip_delete(obj);
+}
+
+/*
+ * HTTPS against the TLS listener: the verification of the certificate, the
+ * full handshake, the resumption of the session, then the throughput
+ */
+static void
+bench_tls(void)
+{
+    nb_http_get_t *obj;
+    nb_http_get_result_t *res;
+    char url[256];
+    int ret;
+
+    if ( '\0' == tlsport[0] ) {
+        printf("%-24s skipped (no TLS listener)\n", "TLS");
+        return;
+    }
+
+    /* A name not in the certificate must be rejected */
+    obj = nb_http_get_new("BENCH");
+    if ( NULL == obj ) {
+        return;
+    }
+    snprintf(url, sizeof(url), "https://%s:%s/scr/download.php?size=1024",
+             SERVER_ADDR, tlsport);
+    ret = nb_http_get_exec(obj, url, AF_INET, DURATION);
+    check("TLS name mismatch", 0 != ret);
+    nb_http_get_delete(obj);
+
+    /* The full handshake, then the resumption by the next connection */
+    obj = nb_http_get_new("BENCH");
+    if ( NULL == obj ) {
+        return;
+    }
+    snprintf(url, sizeof(url), "https://%s:%s/scr/download.php?size=1024",
+             SERVER_NAME, tlsport);
+    ret = nb_http_get_exec(obj, url, AF_INET, DURATION);
+    res = obj->last_result;
+    check("TLS verified handshake", 0 == ret && NB_TLS_FULL == res->tls
+          && 1024 == res->payload);
+    ret = nb_http_get_exec(obj, url, AF_INET, DURATION);
+    res = obj->last_result;
+    check("TLS resumption", 0 == ret && NB_TLS_RESUMED == res->tls
+          && 1024 == res->payload);
+
+    nb_http_get_delete(obj);
+
+    /* Throughput of the decryption */
+    snprintf(url, sizeof(url), "https://%s:%s/scr/download.php?size="
+             HUGE_SIZE, SERVER_NAME, tlsport);
+    bench_rate("nb_http_get_exec (TLS)", xfer_get, NB_RECV_AUTO, url);
+}
+
+/*
+ * Cost of a timestamp
+ */
+static void
+bench_clock(void)
+{
+    volatile double tm;
+    double t0;
+    int i;
+
+    t0 = nb_microtime();
+    for ( i = 0; i < CLOCK_CALLS; i++ ) {
+        tm = nb_microtime();
+    }
+    (void)tm;
+    printf("%-24s %8.1lf ns/call\n", "nb_microtime",
+           (nb_microtime() - t0) / CLOCK_CALLS * 1e9);
+}
+
+/*
+ * Main routine
+ */
+int
+main(int argc, const char *const argv[])
+{
+    nb_ping_t *ping;
+    nb_tcpping_t *tcpping;
+    char url[256];
+    pid_t pid;
+
+    /* The raw TCP transfers may write to the connections closed by the
+       server */
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    cpuhz = cpu_frequency();
+
+    /* The client trusts the test certificate only */
+    if ( 0 == tls_credentials() ) {
+        (void)setenv("SSL_CERT_FILE", certfile, 1);
+    } else {
+        tls_cleanup();
+        certfile[0] = '\0';
+    }
+    pid = server_start(argc > 1 ? argv[1] : DEFAULT_SERVER);
+    if ( pid < 0 ) {
+        fprintf(stderr, "Cannot start netbenchd; skipping the loopback "
+                "benchmark.\n");
+        tls_cleanup();
+        return 0;
+    }
+
+    bench_clock();
+    snprintf(url, sizeof(url), "http://%s:%s/scr/download.php?size="
+             HUGE_SIZE, SERVER_ADDR, port);
+    bench_rate("nb_http_get_exec (auto)", xfer_get, NB_RECV_AUTO, url);
+    bench_rate("nb_http_get_exec (copy)", xfer_get, NB_RECV_COPY, url);
+    snprintf(url, sizeof(url), "http://%s:%s/scr/upload.php", SERVER_ADDR,
+             port);
+    bench_rate("nb_http_post_exec", xfer_post, 0, url);
+    bench_rate("nb_tcp_exec (download)", xfer_tcp, NB_TCP_DOWNLOAD, NULL);
+    bench_rate("nb_tcp_exec (upload)", xfer_tcp, NB_TCP_UPLOAD, NULL);
+    bench_rate("nb_tcp_exec (bidir)", xfer_tcp, NB_TCP_BIDIR, NULL);
+    bench_requests();
+    ping = nb_ping_open(AF_INET);
+    if ( NULL != ping ) {
+        bench_probes("nb_ping_exec", round_ping, ping);
+        nb_ping_close(ping);
+    } else {
+        printf("%-24s skipped (%s)\n", "nb_ping_exec", strerror(errno));
+    }
+    tcpping = nb_tcpping_new();
+    if ( NULL != tcpping ) {
+        bench_probes("nb_tcpping_exec", round_tcpping, tcpping);
+        nb_tcpping_delete(tcpping);
+    }
+    bench_udp();
+    bench_voip();
+    bench_tls();
+
+    kill(pid, SIGTERM);
+    (void)waitpid(pid, NULL, 0);
+    tls_cleanup();
+
+    return failures > 0 ? EXIT_FAILURE : 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -9,10 +9,19 @@
 #define _NETBENCH_H
 
 #include <stdint.h>
+#include <sys/socket.h>
 #include <netdb.h>
 
 #define USER_AGENT "NetBench/0.1"
 
+/*
+ * Receive engines for the downloaded body
+ */
+#define NB_RECV_AUTO                    0
+#define NB_RECV_COPY                    1
+#define NB_RECV_TRUNC                   2
+#define NB_RECV_SPLICE                  3
+
 /*
  * Measurement results of ping
  */
@@ -41,6 +50,142 @@ struct _ping {
     int cancel;
 };
 
+/*
+ * TCP handshake RTT (tcpping) to many targets at once
+ */
+#define NB_TCPPING_OK                   0       /* SYN-ACK received */
+#define NB_TCPPING_REFUSED              1       /* RST received */
+#define NB_TCPPING_TIMEOUT              2
+#define NB_TCPPING_ERROR                3       /* Unresolved or unreachable */
+typedef struct _tcpping_target {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;          /* 0 if not resolved */
+} nb_tcpping_target_t;
+typedef struct _tcpping_result_item {
+    int target;                 /* Index of the target */
+    int stat;                   /* NB_TCPPING_* (-1 if not completed) */
+    int err;                    /* errno of the failure */
+    double sent;                /* SYN sent */
+    double recv;                /* Completed or failed (0 if timed out) */
+    double rtt;                 /* SYN to SYN-ACK by TCP_INFO if available,
+                                   otherwise recv - sent */
+} nb_tcpping_result_item_t;
+typedef struct _tcpping_result {
+    size_t ntargets;
+    nb_tcpping_target_t *targets;
+    size_t cnt;                 /* Probes of all the targets by rounds */
+    nb_tcpping_result_item_t *items;
+} nb_tcpping_result_t;
+typedef struct _tcpping nb_tcpping_t;
+typedef void (*nb_tcpping_cb_f)(nb_tcpping_t *, int, int, double);
+struct _tcpping {
+    nb_tcpping_cb_f cb;
+    void *user;
+    nb_tcpping_result_t *last_result;
+    int cancel;
+};
+
+/*
+ * Selection of the measurement server by the handshake RTT
+ */
+typedef struct _server_select_item {
+    int sent;
+    int received;               /* Handshakes completed */
+    double loss;                /* Ratio of the probes not completed */
+    double rtt_min;
+    double rtt_median;          /* -1 if none completed */
+} nb_server_select_item_t;
+typedef struct _server_select_result {
+    int n;
+    nb_server_select_item_t *items;     /* In the order of the candidates */
+    int *rank;                  /* Candidates from the best */
+    int winner;                 /* -1 if none is reachable */
+    double elapsed;
+} nb_server_select_result_t;
+typedef struct _server_select nb_server_select_t;
+typedef void (*nb_server_select_cb_f)(nb_server_select_t *, int, int, double);
+struct _server_select {
+    nb_server_select_cb_f cb;
+    void *user;
+    int samples;
+    double interval;
+    double timeout;
+    nb_tcpping_t *probe;
+    nb_server_select_result_t *last_result;
+    int cancel;
+};
+
+/*
+ * UDP throughput, loss and jitter at a fixed offered load
+ */
+#define NB_UDP_HEADER_SIZE              20      /* Minimum datagram size */
+#define NB_UDP_BATCH_MAX                64
+typedef struct _udp_result_item {
+    double sent;                /* Sent (by the clock of the sender) */
+    double recv;                /* Received or reflected back (0 if lost) */
+} nb_udp_result_item_t;
+typedef struct _udp_result {
+    size_t cnt;                 /* Datagrams sent (or announced) */
+    nb_udp_result_item_t *items;
+    size_t size;                /* Datagram size */
+    uint64_t received;          /* Distinct datagrams received */
+    uint64_t duplicates;
+    uint64_t reordered;         /* Arrived after a later one */
+    off_t bytes;                /* Bytes of the distinct datagrams */
+    double first;               /* First arrival */
+    double last;                /* Last arrival */
+    double jitter;              /* Interarrival jitter (RFC 3550) */
+    double delay_min;           /* RTT if reflected, otherwise one-way delay
+                                   including the offset of the clocks */
+    double delay_max;
+} nb_udp_result_t;
+typedef struct _udp nb_udp_t;
+typedef void (*nb_udp_cb_f)(nb_udp_t *, double, double, uint64_t, uint64_t);
+struct _udp {
+    nb_udp_cb_f cb;
+    double cbfreq;
+    void *user;
+    int batch;                  /* Datagrams per system call */
+    nb_udp_result_t *last_result;
+    int cancel;
+};
+
+/*
+ * Emulated VoIP/video stream and the call quality (E-model)
+ */
+#define NB_VOIP_G711                    0
+#define NB_VOIP_G729                    1
+#define NB_VOIP_VIDEO                   2       /* No MOS */
+typedef struct _voip_result {
+    int codec;
+    uint64_t sent;
+    uint64_t received;          /* Reflected back */
+    uint64_t lost;
+    uint64_t late;              /* Discarded by the jitter buffer */
+    uint64_t duplicates;
+    double rtt_min;
+    double rtt_avg;
+    double rtt_max;
+    double jitter;              /* Interarrival jitter (RFC 3550, one-way) */
+    double jb_delay;            /* Mean playout delay of the jitter buffer */
+    double pacing_avg;          /* Lateness of the sender to the schedule */
+    double pacing_max;
+    double burst_ratio;         /* BurstR of the losses (1: random) */
+    double delay;               /* Mouth-to-ear delay */
+    double rfactor;
+    double mos;
+} nb_voip_result_t;
+typedef struct _voip nb_voip_t;
+typedef void (*nb_voip_cb_f)(nb_voip_t *, double, double, uint64_t, uint64_t,
+                             double);
+struct _voip {
+    nb_voip_cb_f cb;
+    double cbfreq;
+    void *user;
+    nb_voip_result_t *last_result;
+    int cancel;
+};
+
 /*
  * Traceroute
  */
@@ -69,9 +214,192 @@ struct _traceroute {
     int cancel;
 };
 
+/*
+ * TCP_INFO samples
+ */
+typedef struct _tcp_info_item {
+    double tm;
+    uint32_t srtt;              /* Smoothed RTT (usec) */
+    uint32_t rttvar;            /* RTT variance (usec) */
+    uint32_t cwnd;              /* Congestion window (segments) */
+    uint32_t retrans;           /* Total retransmissions (segments) */
+    uint64_t delivery_rate;     /* Bytes per second */
+    uint64_t pacing_rate;       /* Bytes per second */
+    uint64_t busy;              /* Time busy sending data (usec) */
+    uint64_t rwnd_limited;      /* Time limited by receive window (usec) */
+    uint64_t sndbuf_limited;    /* Time limited by send buffer (usec) */
+} nb_tcp_info_item_t;
+typedef struct _tcp_info_series {
+    double interval;
+    double last;
+    size_t cnt;
+    size_t cntres;
+    nb_tcp_info_item_t *items;
+} nb_tcp_info_series_t;
+
+/*
+ * Fixed-interval throughput series
+ */
+typedef struct _rate_bucket {
+    off_t bytes;                /* Bytes transferred in the bucket */
+    double maxrate;             /* Max rate of the samples (bytes/sec) */
+    double minrate;             /* Min rate of the samples (bytes/sec) */
+    uint32_t cnt;               /* Number of the samples */
+} nb_rate_bucket_t;
+typedef struct _rate_series {
+    double t0;
+    double resolution;
+    size_t nbuckets;
+    size_t cnt;
+    uint64_t dropped;           /* Buckets not kept since the series was
+                                   full */
+    double lasttm;
+    off_t lastbytes;
+    nb_rate_bucket_t *buckets;
+} nb_rate_series_t;
+
+/*
+ * Windows of a cumulative byte count, and the ramp-up (the slow start) over
+ * them, shared by the estimator and the steady-state analysis
+ */
+#define NB_RATE_WINDOW_OPEN             0       /* Not closed yet */
+#define NB_RATE_WINDOW_RAMP             1       /* Closed in the ramp-up */
+#define NB_RATE_WINDOW_STEADY           2       /* Closed after the ramp-up */
+typedef struct _rate_window {
+    double wstart;              /* Start of the current window */
+    off_t wbytes;               /* Bytes at the start of the window */
+    double prevrate;            /* Of the previous window in the ramp-up */
+    int ramped;                 /* The ramp-up is over */
+} nb_rate_window_t;
+
+/*
+ * Throughput estimate over sliding windows after the slow start
+ */
+typedef struct _estimate {
+    double rate;                /* Mean of the windows (bytes/sec; 0 if not
+                                   estimated) */
+    double halfwidth;           /* Of the 95% confidence interval */
+    int nwindows;               /* Windows in the estimate */
+    int converged;              /* Ended early by the convergence */
+    double tm;                  /* Converged */
+    off_t saved;                /* Bytes not transferred by ending early */
+} nb_estimate_t;
+
+/*
+ * Steady-state analysis of a throughput series
+ * The rates of the windows after the ramp-up are kept in a histogram of 32
+ * bins per decade from 1 byte/sec, so that the percentiles are within about
+ * 4% without keeping the windows.
+ */
+#define NB_RATE_ANALYSIS_WINDOW_DEFAULT 0.1
+#define NB_RATE_ANALYSIS_BINS_PER_DECADE 32
+#define NB_RATE_ANALYSIS_BINS           (13 * NB_RATE_ANALYSIS_BINS_PER_DECADE)
+typedef struct _rate_analysis {
+    double window;              /* Width of the windows */
+    double t0;                  /* First sample (negative if none) */
+    off_t b0;
+    nb_rate_window_t win;
+    /* Ramp-up */
+    double rampend;             /* Since the first sample */
+    off_t rampbytes;
+    /* Complete windows after the ramp-up (the last incomplete window, the
+       tail, not counted) */
+    uint64_t nwindows;
+    double duration;
+    off_t bytes;
+    double steady;              /* bytes / duration (bytes/sec) */
+    double peak;
+    double min;
+    uint32_t hist[NB_RATE_ANALYSIS_BINS];
+} nb_rate_analysis_t;
+
+/*
+ * Connection establishment (Happy Eyeballs)
+ */
+#define NB_CONNECT_ATTEMPTS_MAX         8
+#define NB_CONGESTION_NAME_MAX          16      /* TCP_CA_NAME_MAX */
+typedef struct _connect_attempt {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    double start;
+    double end;                 /* Completed, failed or cancelled */
+    int err;                    /* 0 on success, otherwise errno */
+} nb_connect_attempt_t;
+typedef struct _connect_result {
+    double resolved;            /* Name resolved */
+    double connected;           /* Connection established */
+    int winner;                 /* Index of the winning attempt, or -1 */
+    int nattempts;
+    nb_connect_attempt_t attempts[NB_CONNECT_ATTEMPTS_MAX];
+    char congestion[NB_CONGESTION_NAME_MAX]; /* In use (empty if unknown) */
+} nb_connect_result_t;
+
+/*
+ * Socket options applied before connecting (0 or empty for the system
+ * defaults)
+ */
+typedef struct _sockopt {
+    int sndbuf;                 /* SO_SNDBUF (bytes) */
+    int rcvbuf;                 /* SO_RCVBUF (bytes) */
+    char congestion[NB_CONGESTION_NAME_MAX]; /* TCP_CONGESTION */
+    int notsent_lowat;          /* TCP_NOTSENT_LOWAT (bytes) */
+    uint64_t max_pacing_rate;   /* SO_MAX_PACING_RATE (bytes/sec) */
+} nb_sockopt_t;
+
+/*
+ * Timestamps of the phases of an HTTP transaction
+ */
+typedef struct _http_timing {
+    double start;               /* Started (before name resolution) */
+    double dns;                 /* Name resolved */
+    double connect;             /* TCP connection established */
+    double tls;                 /* TLS handshake completed (= connect
+                                   without TLS) */
+    double reqsent;             /* Request (including the body) written */
+    double ttfb;                /* First byte of the response received */
+    double header;              /* Response header completed */
+    double body;                /* Response body completed */
+} nb_http_timing_t;
+
+/*
+ * HTTP keep-alive connection pool
+ */
+typedef struct _http_pool_conn nb_http_pool_conn_t;
+struct _http_pool_conn {
+    char *host;
+    char *port;
+    int family;
+    int sock;
+    double last;                /* Last time returned to the pool */
+    nb_http_pool_conn_t *next;
+};
+/*
+ * TLS context keeping the session to resume (opaque; https:// requires
+ * OpenSSL)
+ */
+#define NB_TLS_NONE                     0
+#define NB_TLS_FULL                     1       /* Full handshake */
+#define NB_TLS_RESUMED                  2       /* Session resumed */
+typedef struct _tls_ctx nb_tls_ctx_t;
+
+typedef struct _http_pool {
+    double idle_timeout;
+    int max_idle;               /* Max idle connections per key */
+    nb_http_pool_conn_t *idle;
+} nb_http_pool_t;
+
 /*
  * HTTP (GET)
  */
+typedef struct _http_segment {
+    off_t first;                /* Byte range [first, last] of the object */
+    off_t last;
+    off_t received;
+    int conn;                   /* Connection fetching it (-1 if not yet) */
+    int stolen;                 /* Split off the rest of another segment */
+    double requested;
+    double done;                /* Completed (0 if not) */
+} nb_http_segment_t;
 typedef struct _http_get_result_item {
     double tm;
     off_t tx;
@@ -84,7 +412,20 @@ typedef struct _http_get_result {
     nb_http_get_result_item_t *items;
     off_t hlen;
     off_t clen;
+    off_t payload;              /* Decoded body bytes */
     int mss;
+    int rmode;                  /* Receive engine used */
+    int reused;                 /* Warm connection from the pool */
+    int tls;                    /* TLS handshake (NB_TLS_*) */
+    nb_http_timing_t timing;
+    nb_connect_result_t conn;   /* Connection attempts (if not reused) */
+    nb_tcp_info_series_t tcpi;
+    nb_rate_series_t rate;      /* Received bytes */
+    nb_estimate_t est;          /* Of the body */
+    /* Range-segmented download (no TCP_INFO samples and no estimate) */
+    int nconns;                 /* Connections (1 if not segmented) */
+    size_t nsegs;
+    nb_http_segment_t *segs;    /* NULL if not segmented */
 } nb_http_get_result_t;
 typedef struct _http_get nb_http_get_t;
 typedef void (*nb_http_get_cb_f)(nb_http_get_t *, off_t, off_t, double, double,
@@ -94,6 +435,17 @@ struct _http_get {
     double cbfreq;
     void *user;
     char *mid;
+    int rmode;
+    double tcpi_interval;
+    double resolution;
+    double connect_timeout;
+    double tolerance;           /* Of the early termination (0: disabled) */
+    nb_sockopt_t opts;
+    int nconns;                 /* Of the segmented download (1: disabled) */
+    off_t segsize;
+    nb_http_pool_t *pool;
+    int tls_verify;
+    nb_tls_ctx_t *tls;
     nb_http_get_result_t *last_result;
     int cancel;
 };
@@ -113,7 +465,15 @@ typedef struct _http_post_result {
     nb_http_post_result_item_t *items;
     off_t hlen;
     off_t clen;
+    off_t payload;              /* Decoded response body bytes */
     int mss;
+    int reused;                 /* Warm connection from the pool */
+    int tls;                    /* TLS handshake (NB_TLS_*) */
+    nb_http_timing_t timing;
+    nb_connect_result_t conn;   /* Connection attempts (if not reused) */
+    nb_tcp_info_series_t tcpi;
+    nb_rate_series_t rate;      /* Acknowledged (or buffered) bytes */
+    nb_estimate_t est;          /* Of the acknowledged (or buffered) body */
 } nb_http_post_result_t;
 typedef struct _http_post nb_http_post_t;
 typedef void (*nb_http_post_cb_f)(nb_http_post_t *, off_t, off_t, double,
@@ -123,10 +483,106 @@ struct _http_post {
     double cbfreq;
     char *mid;
     void *user;
+    double tcpi_interval;
+    double resolution;
+    double connect_timeout;
+    double tolerance;           /* Of the early termination (0: disabled) */
+    nb_sockopt_t opts;
+    nb_http_pool_t *pool;
+    int tls_verify;
+    nb_tls_ctx_t *tls;
     nb_http_post_result_t *last_result;
     int cancel;
 };
 
+/*
+ * Bulk transfer over a raw TCP connection (without HTTP framing)
+ */
+#define NB_TCP_DOWNLOAD                 0       /* Server to client */
+#define NB_TCP_UPLOAD                   1       /* Client to server */
+#define NB_TCP_BIDIR                    2       /* Both at the same time */
+typedef struct _tcp_result_item {
+    double tm;
+    off_t tx;                   /* Acknowledged (buffered if not tracked) */
+    off_t btx;                  /* Buffered TX */
+    off_t rx;
+} nb_tcp_result_item_t;
+typedef struct _tcp_result {
+    size_t cnt;
+    size_t cntres;
+    nb_tcp_result_item_t *items;
+    int dir;
+    int mss;
+    int rmode;                  /* Receive engine used */
+    int zerocopy;               /* Sent by sendfile from the kernel */
+    int sndbuf;                 /* Buffer sizes in effect */
+    int rcvbuf;
+    double start;               /* Started the transfer */
+    double end;                 /* Finished the transfer */
+    nb_connect_result_t conn;
+    nb_tcp_info_series_t tcpi;
+    nb_rate_series_t rate;      /* Received bytes */
+    nb_rate_series_t txrate;    /* Acknowledged (or buffered) bytes */
+} nb_tcp_result_t;
+typedef struct _tcp nb_tcp_t;
+typedef void (*nb_tcp_cb_f)(nb_tcp_t *, double, double, off_t, off_t, off_t);
+struct _tcp {
+    nb_tcp_cb_f cb;
+    double cbfreq;
+    void *user;
+    int rmode;
+    int raw;                    /* No command line (discard/chargen) */
+    nb_sockopt_t opts;
+    double tcpi_interval;
+    double resolution;
+    double connect_timeout;
+    nb_tcp_result_t *last_result;
+    int cancel;
+};
+
+/*
+ * Comparison of the socket options on the same HTTP transfer
+ */
+#define NB_COMPARE_GET                  0
+#define NB_COMPARE_POST                 1
+#define NB_COMPARE_SEQUENTIAL           0       /* Back-to-back */
+#define NB_COMPARE_PARALLEL             1       /* All at once */
+typedef struct _compare_item {
+    int err;                    /* 0 on success, otherwise errno */
+    char congestion[NB_CONGESTION_NAME_MAX]; /* In use */
+    double start;
+    double elapsed;             /* Of the body */
+    off_t bytes;                /* Body received (or acknowledged) */
+    double rate;                /* Overall (bytes/sec) */
+    double steady;              /* After the ramp-up (-1 if not reached) */
+    double peak;
+    double ttfb;                /* Request sent to the response (sec; -1 if
+                                   not received) */
+    double rtt_min;             /* Smoothed RTT during the transfer (sec; -1
+                                   if unknown) */
+    double rtt_mean;
+    double rtt_max;
+    uint32_t retrans;           /* Retransmitted segments */
+} nb_compare_item_t;
+typedef struct _compare_result {
+    int method;                 /* NB_COMPARE_GET or NB_COMPARE_POST */
+    int mode;
+    int n;
+    nb_compare_item_t *items;   /* In the order of the settings */
+} nb_compare_result_t;
+typedef struct _compare nb_compare_t;
+typedef void (*nb_compare_cb_f)(nb_compare_t *, int, const nb_compare_item_t *);
+struct _compare {
+    nb_compare_cb_f cb;
+    void *user;
+    char *mid;
+    int mode;
+    int n;
+    int nres;
+    nb_sockopt_t *settings;
+    nb_compare_result_t *last_result;
+};
+
 /*
  * Parsed URL
  */
@@ -141,6 +597,26 @@ typedef struct _parsed_url {
     char *password;             /* optional */
 } nb_parsed_url_t;
 
+/*
+ * Sink of a streamed HTTP body (returns 0 to continue, -1 to abort)
+ */
+typedef int (*nb_http_sink_f)(const char *, size_t, void *);
+
+/*
+ * Well-known HTTP header fields indexed at parsing
+ */
+#define NB_HTTP_HDR_CONTENT_LENGTH      0
+#define NB_HTTP_HDR_TRANSFER_ENCODING   1
+#define NB_HTTP_HDR_CONNECTION          2
+#define NB_HTTP_HDR_KEEP_ALIVE          3
+#define NB_HTTP_HDR_CONTENT_TYPE        4
+#define NB_HTTP_HDR_CONTENT_ENCODING    5
+#define NB_HTTP_HDR_SERVER_TIMING       6
+#define NB_HTTP_HDR_LOCATION            7
+#define NB_HTTP_HDR_SERVER              8
+#define NB_HTTP_HDR_DATE                9
+#define NB_HTTP_HDR_MAX                 10
+
 /*
  * HTTP header
  */
@@ -164,8 +640,46 @@ typedef struct _http_header {
     char *version;
     /* Attributes */
     nb_http_header_attr_list_t *attrs;
+    /* Well-known attributes (NB_HTTP_HDR_*) */
+    nb_http_header_attr_t *index[NB_HTTP_HDR_MAX];
+    /* Pre-parsed values */
+    off_t content_length;       /* -1 if absent or invalid */
+    int chunked;
+    int keepalive;
 } nb_http_header_t;
 
+/*
+ * HTTP header parsed in place (without memory allocation)
+ * The fields beyond NB_HTTP_HEADER_FIELDS_MAX are not kept, except the first
+ * of each well-known one, for which the room is reserved.
+ */
+#define NB_HTTP_HEADER_FIELDS_MAX       64
+typedef struct _http_str {
+    size_t off;                 /* Offset in the buffer */
+    size_t len;
+} nb_http_str_t;
+typedef struct _http_header_field {
+    nb_http_str_t key;
+    nb_http_str_t value;
+} nb_http_header_field_t;
+typedef struct _http_header_view {
+    const char *buf;
+    size_t len;                 /* Including the empty line */
+    nb_http_str_t method;
+    nb_http_str_t uri;
+    nb_http_str_t version;
+    int nfields;
+    int nskipped;               /* Fields not kept */
+    nb_http_header_field_t fields[NB_HTTP_HEADER_FIELDS_MAX
+                                  + NB_HTTP_HDR_MAX];
+    /* Index of the well-known fields (NB_HTTP_HDR_*; -1 if absent) */
+    int index[NB_HTTP_HDR_MAX];
+    /* Pre-parsed values */
+    off_t content_length;       /* -1 if absent or invalid */
+    int chunked;
+    int keepalive;
+} nb_http_header_view_t;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -173,16 +687,77 @@ extern "C" {
 
     /* Generic functions */
     double nb_microtime(void);
+    double nb_monotime(void);
     uint16_t nb_checksum(const uint8_t *, size_t);
     nb_parsed_url_t * nb_parse_url(const char *);
     void nb_parsed_url_free(nb_parsed_url_t *);
+    const nb_rate_bucket_t *
+    nb_rate_series_get(const nb_rate_series_t *, size_t, double *);
+
+    /* Steady-state analysis */
+    int nb_rate_analysis_init(nb_rate_analysis_t *, double);
+    void nb_rate_analysis_add(nb_rate_analysis_t *, double, off_t);
+    double nb_rate_analysis_percentile(const nb_rate_analysis_t *, double);
+    void
+    nb_rate_analysis_http_get(nb_rate_analysis_t *,
+                              const nb_http_get_result_t *);
+    void
+    nb_rate_analysis_http_post(nb_rate_analysis_t *,
+                               const nb_http_post_result_t *);
     nb_http_header_t * nb_parse_http_header(const char *, size_t);
     void nb_http_header_delete(nb_http_header_t *);
     off_t nb_http_header_get_content_length(nb_http_header_t *);
+    const char * nb_http_header_get_attr(nb_http_header_t *, const char *);
+    int nb_http_header_is_keepalive(nb_http_header_t *);
+    int nb_http_header_is_chunked(nb_http_header_t *);
+    int
+    nb_http_header_view_parse(nb_http_header_view_t *, const char *, size_t);
+    const nb_http_header_field_t *
+    nb_http_header_view_find(const nb_http_header_view_t *, const char *);
+    const char *
+    nb_http_header_view_get(const nb_http_header_view_t *, int, size_t *);
+    int nb_http_header_view_get_status(const nb_http_header_view_t *);
+    off_t
+    nb_http_header_view_get_content_length(const nb_http_header_view_t *);
+    int nb_http_header_view_is_chunked(const nb_http_header_view_t *);
+    int nb_http_header_view_is_keepalive(const nb_http_header_view_t *);
     int nb_http_get(const char *url, char **, off_t *);
     int
     nb_http_post(const char *, const char *, const char *, size_t, char **,
                  off_t *);
+    int nb_http_get_sink(const char *, nb_http_sink_f, void *);
+    int
+    nb_http_post_sink(const char *, const char *, const char *, size_t,
+                      nb_http_sink_f, void *);
+    int
+    nb_http_post_fd(const char *, const char *, int, off_t, nb_http_sink_f,
+                    void *);
+    int nb_http_fd_sink(const char *, size_t, void *);
+
+    /* HTTP keep-alive connection pool */
+    nb_http_pool_t * nb_http_pool_new(double, int);
+    void nb_http_pool_delete(nb_http_pool_t *);
+    int
+    nb_http_pool_acquire(nb_http_pool_t *, const char *, const char *, int,
+                         double, const nb_sockopt_t *, int *,
+                         nb_connect_result_t *);
+    void
+    nb_http_pool_release(nb_http_pool_t *, const char *, const char *, int,
+                         int, int);
+    void nb_http_pool_expire(nb_http_pool_t *);
+    int nb_http_pool_get(nb_http_pool_t *, const char *, char **, off_t *);
+    int
+    nb_http_pool_post(nb_http_pool_t *, const char *, const char *,
+                      const char *, size_t, char **, off_t *);
+    int
+    nb_http_pool_get_sink(nb_http_pool_t *, const char *, nb_http_sink_f,
+                          void *);
+    int
+    nb_http_pool_post_sink(nb_http_pool_t *, const char *, const char *,
+                           const char *, size_t, nb_http_sink_f, void *);
+    int
+    nb_http_pool_post_fd(nb_http_pool_t *, const char *, const char *, int,
+                         off_t, nb_http_sink_f, void *);
 
     /* Ping */
     nb_ping_t * nb_ping_open(int);
@@ -190,6 +765,46 @@ extern "C" {
     int nb_ping_exec(nb_ping_t *, const char *, size_t, int, double, double);
     void nb_ping_close(nb_ping_t *);
 
+    /* TCP handshake RTT */
+    nb_tcpping_t * nb_tcpping_new(void);
+    int nb_tcpping_set_callback(nb_tcpping_t *, nb_tcpping_cb_f, void *);
+    int
+    nb_tcpping_exec(nb_tcpping_t *, const char *const *, int, const char *,
+                    int, int, double, double);
+    void nb_tcpping_delete(nb_tcpping_t *);
+
+    /* Server selection */
+    nb_server_select_t * nb_server_select_new(void);
+    int
+    nb_server_select_set_callback(nb_server_select_t *,
+                                  nb_server_select_cb_f, void *);
+    int
+    nb_server_select_set_probes(nb_server_select_t *, int, double, double);
+    int
+    nb_server_select_exec(nb_server_select_t *, const char *const *, int,
+                          const char *, int);
+    void nb_server_select_delete(nb_server_select_t *);
+
+    /* UDP */
+    nb_udp_t * nb_udp_new(void);
+    int nb_udp_set_callback(nb_udp_t *, nb_udp_cb_f, double, void *);
+    int nb_udp_set_batch(nb_udp_t *, int);
+    int
+    nb_udp_exec(nb_udp_t *, const char *, const char *, int, size_t, double,
+                double, double);
+    int
+    nb_udp_listen_exec(nb_udp_t *, const char *, const char *, int, int,
+                       double);
+    void nb_udp_delete(nb_udp_t *);
+
+    /* VoIP */
+    nb_voip_t * nb_voip_new(void);
+    int nb_voip_set_callback(nb_voip_t *, nb_voip_cb_f, double, void *);
+    int
+    nb_voip_exec(nb_voip_t *, const char *, const char *, int, int, double,
+                 double);
+    void nb_voip_delete(nb_voip_t *);
+
     /* Traceroute */
     nb_traceroute_t * nb_traceroute_new(void);
     int
@@ -201,6 +816,15 @@ extern "C" {
     nb_http_get_t * nb_http_get_new(const char *);
     int
     nb_http_get_set_callback(nb_http_get_t *, nb_http_get_cb_f, double, void *);
+    int nb_http_get_set_recv_mode(nb_http_get_t *, int);
+    int nb_http_get_set_tcp_info(nb_http_get_t *, double);
+    int nb_http_get_set_resolution(nb_http_get_t *, double);
+    int nb_http_get_set_pool(nb_http_get_t *, nb_http_pool_t *);
+    int nb_http_get_set_connect_timeout(nb_http_get_t *, double);
+    int nb_http_get_set_tls_verify(nb_http_get_t *, int);
+    int nb_http_get_set_early_stop(nb_http_get_t *, double);
+    int nb_http_get_set_sockopt(nb_http_get_t *, const nb_sockopt_t *);
+    int nb_http_get_set_segments(nb_http_get_t *, int, off_t);
     int nb_http_get_exec(nb_http_get_t *, const char *, int, double);
     void nb_http_get_delete(nb_http_get_t *);
 
@@ -209,9 +833,39 @@ extern "C" {
     int
     nb_http_post_set_callback(nb_http_post_t *, nb_http_post_cb_f, double,
                               void *);
+    int nb_http_post_set_tcp_info(nb_http_post_t *, double);
+    int nb_http_post_set_resolution(nb_http_post_t *, double);
+    int nb_http_post_set_pool(nb_http_post_t *, nb_http_pool_t *);
+    int nb_http_post_set_connect_timeout(nb_http_post_t *, double);
+    int nb_http_post_set_tls_verify(nb_http_post_t *, int);
+    int nb_http_post_set_early_stop(nb_http_post_t *, double);
+    int nb_http_post_set_sockopt(nb_http_post_t *, const nb_sockopt_t *);
     int nb_http_post_exec(nb_http_post_t *, const char *, int, off_t, double);
     void nb_http_post_delete(nb_http_post_t *);
 
+    /* Raw TCP */
+    nb_tcp_t * nb_tcp_new(void);
+    int nb_tcp_set_callback(nb_tcp_t *, nb_tcp_cb_f, double, void *);
+    int nb_tcp_set_recv_mode(nb_tcp_t *, int);
+    int nb_tcp_set_sockbuf(nb_tcp_t *, int, int);
+    int nb_tcp_set_sockopt(nb_tcp_t *, const nb_sockopt_t *);
+    int nb_tcp_set_tcp_info(nb_tcp_t *, double);
+    int nb_tcp_set_resolution(nb_tcp_t *, double);
+    int nb_tcp_set_connect_timeout(nb_tcp_t *, double);
+    int nb_tcp_set_raw(nb_tcp_t *, int);
+    int
+    nb_tcp_exec(nb_tcp_t *, const char *, const char *, int, int, double);
+    void nb_tcp_delete(nb_tcp_t *);
+
+    /* Comparison of the socket options */
+    nb_compare_t * nb_compare_new(const char *);
+    int nb_compare_set_callback(nb_compare_t *, nb_compare_cb_f, void *);
+    int nb_compare_set_mode(nb_compare_t *, int);
+    int nb_compare_add(nb_compare_t *, const nb_sockopt_t *);
+    int
+    nb_compare_exec(nb_compare_t *, int, const char *, int, off_t, double);
+    void nb_compare_delete(nb_compare_t *);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,234 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * Steady-state analysis of a throughput series
+ * The samples of the cumulative bytes are cut into windows in one pass as
+ * they arrive.  The ramp-up (the slow start) is detected over the windows as
+ * by the estimator; the following complete windows make the steady state,
+ * and the incomplete one at the end (the tail) is ignored.  The drain at the
+ * end of the transfer is not detected otherwise.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+/* Prototype declarations */
+static int _bin(double);
+static void _feed_series(nb_rate_analysis_t *, const nb_rate_series_t *);
+
+/*
+ * Prepare an analysis with the windows of the width in seconds (the default
+ * if zero)
+ */
+int
+nb_rate_analysis_init(nb_rate_analysis_t *a, double window)
+{
+    if ( window < 0.0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    bzero(a, sizeof(nb_rate_analysis_t));
+    a->window = window > 0.0 ? window : NB_RATE_ANALYSIS_WINDOW_DEFAULT;
+    a->t0 = -1.0;
+    a->min = -1.0;
+
+    return 0;
+}
+
+/*
+ * Histogram bin of the rate
+ */
+static int
+_bin(double rate)
+{
+    int b;
+
+    if ( rate < 1.0 ) {
+        return 0;
+    }
+    b = (int)(log10(rate) * NB_RATE_ANALYSIS_BINS_PER_DECADE);
+    if ( b >= NB_RATE_ANALYSIS_BINS ) {
+        b = NB_RATE_ANALYSIS_BINS - 1;
+    }
+
+    return b;
+}
+
+/*
+ * Add a sample of the cumulative bytes at the time
+ */
+void
+nb_rate_analysis_add(nb_rate_analysis_t *a, double tm, off_t bytes)
+{
+    double wstart;
+    off_t wbytes;
+    int ramped;
+    int phase;
+    double rate;
+
+    if ( a->t0 < 0.0 ) {
+        /* The first sample */
+        a->t0 = tm;
+        a->b0 = bytes;
+        nb_rate_window_start(&a->win, tm, bytes);
+        return;
+    }
+
+    /* The window to be closed */
+    wstart = a->win.wstart;
+    wbytes = a->win.wbytes;
+    ramped = a->win.ramped;
+    phase = nb_rate_window_add(&a->win, a->window, tm, bytes, &rate);
+    if ( NB_RATE_WINDOW_OPEN == phase ) {
+        return;
+    }
+    if ( rate > a->peak ) {
+        a->peak = rate;
+    }
+    if ( NB_RATE_WINDOW_RAMP == phase ) {
+        /* Still ramping up */
+        return;
+    }
+    if ( !ramped ) {
+        /* The first window in the steady state */
+        a->rampend = wstart - a->t0;
+        a->rampbytes = wbytes - a->b0;
+    }
+
+    /* A window in the steady state */
+    a->nwindows++;
+    a->duration += tm - wstart;
+    a->bytes += bytes - wbytes;
+    a->steady = (double)a->bytes / a->duration;
+    if ( a->min < 0.0 || rate < a->min ) {
+        a->min = rate;
+    }
+    a->hist[_bin(rate)]++;
+}
+
+/*
+ * Get the p-th percentile (0 to 100) of the window rates in the steady state
+ * Returns -1 if no window is in the steady state.
+ */
+double
+nb_rate_analysis_percentile(const nb_rate_analysis_t *a, double p)
+{
+    uint64_t rank;
+    uint64_t acc;
+    double rate;
+    int b;
+
+    if ( 0 == a->nwindows ) {
+        return -1.0;
+    }
+    if ( p <= 0.0 ) {
+        return a->min;
+    }
+    if ( p >= 100.0 ) {
+        return a->peak;
+    }
+    rank = (uint64_t)ceil(p / 100.0 * a->nwindows);
+    acc = 0;
+    for ( b = 0; b < NB_RATE_ANALYSIS_BINS - 1; b++ ) {
+        acc += a->hist[b];
+        if ( acc >= rank ) {
+            break;
+        }
+    }
+
+    /* The geometric middle of the bin, within the observed range */
+    rate = b > 0 ? pow(10.0, (b + 0.5) / NB_RATE_ANALYSIS_BINS_PER_DECADE)
+        : 0.0;
+    if ( rate < a->min ) {
+        rate = a->min;
+    }
+    if ( rate > a->peak ) {
+        rate = a->peak;
+    }
+
+    return rate;
+}
+
+/*
+ * Feed a series of samples, or of the fixed-interval buckets if recorded so
+ */
+static void
+_feed_series(nb_rate_analysis_t *a, const nb_rate_series_t *series)
+{
+    const nb_rate_bucket_t *b;
+    double tm;
+    off_t bytes;
+    size_t i;
+
+    bytes = 0;
+    for ( i = 0; i < series->cnt; i++ ) {
+        b = nb_rate_series_get(series, i, &tm);
+        if ( 0 == i ) {
+            nb_rate_analysis_add(a, tm, 0);
+        }
+        bytes += b->bytes;
+        nb_rate_analysis_add(a, tm + series->resolution, bytes);
+    }
+}
+
+/*
+ * Analyze the received bytes of an HTTP (GET) result
+ */
+void
+nb_rate_analysis_http_get(nb_rate_analysis_t *a,
+                          const nb_http_get_result_t *result)
+{
+    size_t i;
+
+    if ( NULL != result->rate.buckets ) {
+        _feed_series(a, &result->rate);
+        return;
+    }
+    for ( i = 0; i < result->cnt; i++ ) {
+        nb_rate_analysis_add(a, result->items[i].tm, result->items[i].rx);
+    }
+}
+
+/*
+ * Analyze the acknowledged bytes of an HTTP (POST) result, or the buffered
+ * bytes if the acknowledgements could not be tracked
+ */
+void
+nb_rate_analysis_http_post(nb_rate_analysis_t *a,
+                           const nb_http_post_result_t *result)
+{
+    size_t i;
+    int acked;
+
+    if ( NULL != result->rate.buckets ) {
+        _feed_series(a, &result->rate);
+        return;
+    }
+    acked = result->cnt > 0 && result->items[result->cnt - 1].tx > 0;
+    for ( i = 0; i < result->cnt; i++ ) {
+        nb_rate_analysis_add(a, result->items[i].tm,
+                             acked ? result->items[i].tx
+                             : result->items[i].btx);
+    }
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,337 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define HTTP_BUF_INIT_SIZE              4096
+#define CHUNK_SIZE_DIGITS_MAX           15
+
+/* States of the chunked decoder */
+#define CHUNK_SIZE                      0
+#define CHUNK_EXT                       1
+#define CHUNK_DATA                      2
+#define CHUNK_DATA_CR                   3
+#define CHUNK_DATA_LF                   4
+#define CHUNK_TRAILER                   5
+
+/* Prototype declarations */
+static int _sink(nb_http_body_t *, const char *, size_t);
+static ssize_t _feed_chunked(nb_http_body_t *, const char *, size_t);
+
+/*
+ * Prepare the decoder of the response body framed as the header tells
+ * The decoded payload is passed to the sink if it is not NULL.
+ */
+int
+nb_http_body_init(nb_http_body_t *body, const nb_http_header_view_t *view,
+                  nb_http_sink_f sink, void *user)
+{
+    int code;
+
+    body->state = CHUNK_SIZE;
+    body->remain = 0;
+    body->ndigits = 0;
+    body->lineempty = 1;
+    body->payload = 0;
+    body->done = 0;
+    body->sink = sink;
+    body->user = user;
+
+    code = nb_http_header_view_get_status(view);
+    if ( code < 0 ) {
+        /* Invalid status line */
+        errno = EINVAL;
+        return -1;
+    }
+    if ( (code >= 100 && code < 200) || 204 == code || 304 == code ) {
+        /* No body */
+        body->framing = NB_HTTP_BODY_NONE;
+        body->done = 1;
+    } else if ( view->chunked ) {
+        /* The transfer coding overrides the content length */
+        body->framing = NB_HTTP_BODY_CHUNKED;
+    } else if ( view->content_length >= 0 ) {
+        body->framing = NB_HTTP_BODY_LENGTH;
+        body->remain = view->content_length;
+        if ( 0 == body->remain ) {
+            body->done = 1;
+        }
+    } else if ( NULL != nb_http_header_view_get(view,
+                                                NB_HTTP_HDR_CONTENT_LENGTH,
+                                                NULL) ) {
+        /* Invalid content length */
+        errno = EINVAL;
+        return -1;
+    } else {
+        /* Delimited by the close of the connection */
+        body->framing = NB_HTTP_BODY_CLOSE;
+    }
+
+    return 0;
+}
+
+/*
+ * Pass the payload to the sink
+ */
+static int
+_sink(nb_http_body_t *body, const char *buf, size_t len)
+{
+    body->payload += len;
+    if ( NULL != body->sink && NULL != buf && len > 0 ) {
+        return body->sink(buf, len, body->user);
+    }
+
+    return 0;
+}
+
+/*
+ * Decode the chunked transfer coding
+ */
+static ssize_t
+_feed_chunked(nb_http_body_t *body, const char *buf, size_t len)
+{
+    size_t pos;
+    size_t n;
+    int c;
+
+    pos = 0;
+    while ( pos < len && !body->done ) {
+        switch ( body->state ) {
+        case CHUNK_SIZE:
+        case CHUNK_EXT:
+            c = (unsigned char)buf[pos++];
+            if ( '\n' == c ) {
+                /* End of the chunk-size line */
+                if ( 0 == body->ndigits ) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                body->ndigits = 0;
+                if ( 0 == body->remain ) {
+                    /* Last chunk */
+                    body->state = CHUNK_TRAILER;
+                    body->lineempty = 1;
+                } else {
+                    body->state = CHUNK_DATA;
+                }
+            } else if ( CHUNK_EXT == body->state || '\r' == c ) {
+                /* Ignore the chunk extensions */
+            } else if ( ';' == c || ' ' == c || '\t' == c ) {
+                body->state = CHUNK_EXT;
+            } else if ( body->ndigits >= CHUNK_SIZE_DIGITS_MAX ) {
+                /* Too large */
+                errno = EINVAL;
+                return -1;
+            } else if ( c >= '0' && c <= '9' ) {
+                body->remain = body->remain * 16 + (c - '0');
+                body->ndigits++;
+            } else if ( c >= 'a' && c <= 'f' ) {
+                body->remain = body->remain * 16 + (c - 'a' + 10);
+                body->ndigits++;
+            } else if ( c >= 'A' && c <= 'F' ) {
+                body->remain = body->remain * 16 + (c - 'A' + 10);
+                body->ndigits++;
+            } else {
+                errno = EINVAL;
+                return -1;
+            }
+            break;
+        case CHUNK_DATA:
+            n = len - pos;
+            if ( (off_t)n > body->remain ) {
+                n = (size_t)body->remain;
+            }
+            if ( 0 != _sink(body, buf + pos, n) ) {
+                errno = ECANCELED;
+                return -1;
+            }
+            pos += n;
+            body->remain -= n;
+            if ( 0 == body->remain ) {
+                body->state = CHUNK_DATA_CR;
+            }
+            break;
+        case CHUNK_DATA_CR:
+        case CHUNK_DATA_LF:
+            c = (unsigned char)buf[pos++];
+            if ( '\r' == c && CHUNK_DATA_CR == body->state ) {
+                body->state = CHUNK_DATA_LF;
+            } else if ( '\n' == c ) {
+                body->state = CHUNK_SIZE;
+            } else {
+                errno = EINVAL;
+                return -1;
+            }
+            break;
+        case CHUNK_TRAILER:
+            /* Skip the trailer fields until an empty line */
+            c = (unsigned char)buf[pos++];
+            if ( '\n' == c ) {
+                if ( body->lineempty ) {
+                    body->done = 1;
+                }
+                body->lineempty = 1;
+            } else if ( '\r' != c ) {
+                body->lineempty = 0;
+            }
+            break;
+        }
+    }
+
+    return (ssize_t)pos;
+}
+
+/*
+ * Feed the received bytes to the decoder
+ * Returns the number of bytes consumed, which is less than len if the body
+ * ends in the middle, or -1 on a framing error or the abort by the sink.
+ * The bytes may be NULL (only counted) unless the body is chunked.
+ */
+ssize_t
+nb_http_body_feed(nb_http_body_t *body, const char *buf, size_t len)
+{
+    size_t n;
+
+    if ( body->done ) {
+        return 0;
+    }
+
+    switch ( body->framing ) {
+    case NB_HTTP_BODY_CHUNKED:
+        if ( NULL == buf ) {
+            errno = EINVAL;
+            return -1;
+        }
+        return _feed_chunked(body, buf, len);
+    case NB_HTTP_BODY_LENGTH:
+        n = len;
+        if ( (off_t)n > body->remain ) {
+            n = (size_t)body->remain;
+        }
+        body->remain -= n;
+        if ( 0 == body->remain ) {
+            body->done = 1;
+        }
+        break;
+    default:
+        n = len;
+        break;
+    }
+    if ( 0 != _sink(body, buf, n) ) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    return (ssize_t)n;
+}
+
+/*
+ * Notify the close of the connection
+ * Returns 0 if the body is complete, or -1 if it is truncated.
+ */
+int
+nb_http_body_eof(nb_http_body_t *body)
+{
+    if ( NB_HTTP_BODY_CLOSE == body->framing ) {
+        body->done = 1;
+    }
+
+    return body->done ? 0 : -1;
+}
+
+/*
+ * Reserve the space for len more bytes (and the null termination)
+ */
+int
+nb_http_buf_reserve(nb_http_buf_t *hbuf, size_t len)
+{
+    size_t size;
+    char *buf;
+
+    if ( hbuf->len + len + 1 <= hbuf->size ) {
+        return 0;
+    }
+    size = hbuf->size > 0 ? hbuf->size : HTTP_BUF_INIT_SIZE;
+    while ( size < hbuf->len + len + 1 ) {
+        size *= 2;
+    }
+    buf = realloc(hbuf->buf, size);
+    if ( NULL == buf ) {
+        return -1;
+    }
+    hbuf->buf = buf;
+    hbuf->size = size;
+
+    return 0;
+}
+
+/*
+ * Sink appending the payload to the growable buffer (nb_http_buf_t)
+ * The payload decoded in place in the reserved space of the buffer is moved
+ * to the tail without any reallocation.  The buffer is not null-terminated
+ * here not to overwrite the bytes not decoded yet.
+ */
+int
+nb_http_buf_sink(const char *buf, size_t len, void *user)
+{
+    nb_http_buf_t *hbuf;
+
+    hbuf = (nb_http_buf_t *)user;
+    if ( !(buf >= hbuf->buf && buf < hbuf->buf + hbuf->size) ) {
+        if ( 0 != nb_http_buf_reserve(hbuf, len) ) {
+            return -1;
+        }
+    }
+    if ( buf != hbuf->buf + hbuf->len ) {
+        (void)memmove(hbuf->buf + hbuf->len, buf, len);
+    }
+    hbuf->len += len;
+
+    return 0;
+}
+
+/*
+ * Sink writing the payload to the file descriptor pointed by user (int *)
+ */
+int
+nb_http_fd_sink(const char *buf, size_t len, void *user)
+{
+    int fd;
+    ssize_t nw;
+
+    fd = *(int *)user;
+    while ( len > 0 ) {
+        nw = write(fd, buf, len);
+        if ( nw < 0 ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nw;
+        len -= nw;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,427 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * Comparison of the socket options (e.g., the congestion control algorithms)
+ * The same HTTP transfer is run once per setting, back-to-back or all at once
+ * on their own threads, and the throughput and the latency under the load
+ * are reported side by side.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define COMPARE_RESERVE_UNIT            4
+#define COMPARE_TCP_INFO_INTERVAL       0.05
+
+/* A run of the transfer on a thread */
+typedef struct _compare_run {
+    const nb_compare_t *obj;
+    int method;
+    const char *url;
+    int family;
+    off_t size;
+    double duration;
+    const nb_sockopt_t *opts;
+    nb_compare_item_t *item;
+} nb_compare_run_t;
+
+/* Prototype declarations */
+static void _result_delete(nb_compare_result_t *);
+static void _summarize_tcpi(nb_compare_item_t *, const nb_tcp_info_series_t *);
+static int _run_get(nb_compare_run_t *);
+static int _run_post(nb_compare_run_t *);
+static void * _run(void *);
+
+/*
+ * Create new compare instance
+ */
+nb_compare_t *
+nb_compare_new(const char *mid)
+{
+    nb_compare_t *obj;
+
+    obj = malloc(sizeof(nb_compare_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->mid = strdup(mid);
+    if ( NULL == obj->mid ) {
+        free(obj);
+        return NULL;
+    }
+    obj->cb = NULL;
+    obj->user = NULL;
+    obj->mode = NB_COMPARE_SEQUENTIAL;
+    obj->n = 0;
+    obj->nres = 0;
+    obj->settings = NULL;
+    obj->last_result = NULL;
+
+    return obj;
+}
+
+/*
+ * Set a callback function called on each run completed
+ * It is called on the caller's thread, after all the runs in the parallel
+ * mode.
+ */
+int
+nb_compare_set_callback(nb_compare_t *obj, nb_compare_cb_f cbfunc,
+                        void *user)
+{
+    obj->cb = cbfunc;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Run the settings back-to-back (NB_COMPARE_SEQUENTIAL) or all at once
+ * (NB_COMPARE_PARALLEL)
+ */
+int
+nb_compare_set_mode(nb_compare_t *obj, int mode)
+{
+    if ( NB_COMPARE_SEQUENTIAL != mode && NB_COMPARE_PARALLEL != mode ) {
+        return -1;
+    }
+    obj->mode = mode;
+
+    return 0;
+}
+
+/*
+ * Add a setting of the socket options (the system defaults if NULL)
+ * Returns the index of the setting, or -1 on failure.
+ */
+int
+nb_compare_add(nb_compare_t *obj, const nb_sockopt_t *opts)
+{
+    nb_sockopt_t *settings;
+    int nres;
+
+    if ( obj->n >= obj->nres ) {
+        nres = obj->nres + COMPARE_RESERVE_UNIT;
+        settings = realloc(obj->settings, sizeof(nb_sockopt_t) * nres);
+        if ( NULL == settings ) {
+            return -1;
+        }
+        obj->settings = settings;
+        obj->nres = nres;
+    }
+    if ( NULL != opts ) {
+        obj->settings[obj->n] = *opts;
+    } else {
+        bzero(&obj->settings[obj->n], sizeof(nb_sockopt_t));
+    }
+
+    return obj->n++;
+}
+
+/*
+ * Delete a result
+ */
+static void
+_result_delete(nb_compare_result_t *result)
+{
+    free(result->items);
+    free(result);
+}
+
+/*
+ * Delete a compare instance
+ */
+void
+nb_compare_delete(nb_compare_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    free(obj->settings);
+    free(obj->mid);
+    free(obj);
+}
+
+/*
+ * Summarize the smoothed RTT and the retransmissions during the transfer
+ */
+static void
+_summarize_tcpi(nb_compare_item_t *item, const nb_tcp_info_series_t *tcpi)
+{
+    double rtt;
+    double sum;
+    size_t n;
+    size_t i;
+
+    item->rtt_min = -1.0;
+    item->rtt_mean = -1.0;
+    item->rtt_max = -1.0;
+    item->retrans = 0;
+    sum = 0.0;
+    n = 0;
+    for ( i = 0; i < tcpi->cnt; i++ ) {
+        if ( 0 == tcpi->items[i].srtt ) {
+            continue;
+        }
+        rtt = tcpi->items[i].srtt / 1000000.0;
+        if ( item->rtt_min < 0.0 || rtt < item->rtt_min ) {
+            item->rtt_min = rtt;
+        }
+        if ( rtt > item->rtt_max ) {
+            item->rtt_max = rtt;
+        }
+        sum += rtt;
+        n++;
+    }
+    if ( n > 0 ) {
+        item->rtt_mean = sum / n;
+    }
+    if ( tcpi->cnt > 0 ) {
+        item->retrans = tcpi->items[tcpi->cnt - 1].retrans;
+    }
+}
+
+/*
+ * Run the download
+ */
+static int
+_run_get(nb_compare_run_t *run)
+{
+    nb_http_get_t *hget;
+    nb_http_get_result_t *res;
+    nb_rate_analysis_t ana;
+    nb_compare_item_t *item;
+
+    hget = nb_http_get_new(run->obj->mid);
+    if ( NULL == hget ) {
+        return -1;
+    }
+    if ( 0 != nb_http_get_set_sockopt(hget, run->opts)
+         || 0 != nb_http_get_set_tcp_info(hget, COMPARE_TCP_INFO_INTERVAL) ) {
+        nb_http_get_delete(hget);
+        errno = EINVAL;
+        return -1;
+    }
+    if ( 0 != nb_http_get_exec(hget, run->url, run->family,
+                               run->duration) ) {
+        nb_http_get_delete(hget);
+        return -1;
+    }
+    res = hget->last_result;
+    item = run->item;
+
+    memcpy(item->congestion, res->conn.congestion, NB_CONGESTION_NAME_MAX);
+    item->start = res->timing.start;
+    item->elapsed = res->timing.body - res->timing.header;
+    item->bytes = res->payload;
+    item->rate = item->elapsed > 0.0 ? item->bytes / item->elapsed : 0.0;
+    item->ttfb = res->timing.ttfb - res->timing.reqsent;
+    (void)nb_rate_analysis_init(&ana, 0.0);
+    nb_rate_analysis_http_get(&ana, res);
+    item->steady = ana.nwindows > 0 ? ana.steady : -1.0;
+    item->peak = ana.peak;
+    _summarize_tcpi(item, &res->tcpi);
+
+    nb_http_get_delete(hget);
+
+    return 0;
+}
+
+/*
+ * Run the upload
+ */
+static int
+_run_post(nb_compare_run_t *run)
+{
+    nb_http_post_t *hpost;
+    nb_http_post_result_t *res;
+    nb_rate_analysis_t ana;
+    nb_compare_item_t *item;
+    off_t bytes;
+    off_t prev;
+    double tm;
+    size_t i;
+    int acked;
+
+    hpost = nb_http_post_new(run->obj->mid);
+    if ( NULL == hpost ) {
+        return -1;
+    }
+    if ( 0 != nb_http_post_set_sockopt(hpost, run->opts)
+         || 0 != nb_http_post_set_tcp_info(hpost,
+                                           COMPARE_TCP_INFO_INTERVAL) ) {
+        nb_http_post_delete(hpost);
+        errno = EINVAL;
+        return -1;
+    }
+    if ( 0 != nb_http_post_exec(hpost, run->url, run->family, run->size,
+                                run->duration) ) {
+        nb_http_post_delete(hpost);
+        return -1;
+    }
+    res = hpost->last_result;
+    item = run->item;
+
+    /* The body is done when the acknowledged (or buffered) bytes stop
+       increasing */
+    acked = res->cnt > 0 && res->items[res->cnt - 1].tx > 0;
+    prev = 0;
+    tm = res->timing.start;
+    for ( i = 0; i < res->cnt; i++ ) {
+        bytes = acked ? res->items[i].tx : res->items[i].btx;
+        if ( bytes > prev ) {
+            prev = bytes;
+            tm = res->items[i].tm;
+        }
+    }
+    memcpy(item->congestion, res->conn.congestion, NB_CONGESTION_NAME_MAX);
+    item->start = res->timing.start;
+    item->elapsed = res->cnt > 1 ? tm - res->items[1].tm : 0.0;
+    item->bytes = prev > res->hlen ? prev - res->hlen : 0;
+    item->rate = item->elapsed > 0.0 ? item->bytes / item->elapsed : 0.0;
+    item->ttfb = res->timing.ttfb > 0.0
+        ? res->timing.ttfb - res->timing.reqsent : -1.0;
+    (void)nb_rate_analysis_init(&ana, 0.0);
+    nb_rate_analysis_http_post(&ana, res);
+    item->steady = ana.nwindows > 0 ? ana.steady : -1.0;
+    item->peak = ana.peak;
+    _summarize_tcpi(item, &res->tcpi);
+
+    nb_http_post_delete(hpost);
+
+    return 0;
+}
+
+/*
+ * Run a setting (the entry point of the threads)
+ */
+static void *
+_run(void *arg)
+{
+    nb_compare_run_t *run;
+    int ret;
+
+    run = (nb_compare_run_t *)arg;
+    errno = 0;
+    if ( NB_COMPARE_POST == run->method ) {
+        ret = _run_post(run);
+    } else {
+        ret = _run_get(run);
+    }
+    run->item->err = 0 == ret ? 0 : (0 != errno ? errno : EIO);
+
+    return NULL;
+}
+
+/*
+ * Execute the transfer (NB_COMPARE_GET, or NB_COMPARE_POST of the size) of
+ * the duration under each of the settings
+ * A run failed (e.g., the congestion control is not available) is reported
+ * by the err of the item; the others are not affected.
+ */
+int
+nb_compare_exec(nb_compare_t *obj, int method, const char *url, int family,
+                off_t size, double duration)
+{
+    nb_compare_result_t *result;
+    nb_compare_run_t *runs;
+    pthread_t *threads;
+    int *started;
+    int i;
+
+    if ( obj->n <= 0
+         || (NB_COMPARE_GET != method && NB_COMPARE_POST != method) ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Allocate for the results */
+    result = malloc(sizeof(nb_compare_result_t));
+    if ( NULL == result ) {
+        return -1;
+    }
+    result->method = method;
+    result->mode = obj->mode;
+    result->n = obj->n;
+    result->items = calloc(obj->n, sizeof(nb_compare_item_t));
+    runs = malloc(sizeof(nb_compare_run_t) * obj->n);
+    threads = malloc(sizeof(pthread_t) * obj->n);
+    started = calloc(obj->n, sizeof(int));
+    if ( NULL == result->items || NULL == runs || NULL == threads
+         || NULL == started ) {
+        free(started);
+        free(threads);
+        free(runs);
+        _result_delete(result);
+        return -1;
+    }
+    for ( i = 0; i < obj->n; i++ ) {
+        runs[i].obj = obj;
+        runs[i].method = method;
+        runs[i].url = url;
+        runs[i].family = family;
+        runs[i].size = size;
+        runs[i].duration = duration;
+        runs[i].opts = &obj->settings[i];
+        runs[i].item = &result->items[i];
+    }
+
+    if ( NB_COMPARE_PARALLEL == obj->mode ) {
+        /* All at once, sharing the path */
+        for ( i = 0; i < obj->n; i++ ) {
+            if ( 0 == pthread_create(&threads[i], NULL, _run, &runs[i]) ) {
+                started[i] = 1;
+            } else {
+                result->items[i].err = EAGAIN;
+            }
+        }
+        for ( i = 0; i < obj->n; i++ ) {
+            if ( started[i] ) {
+                (void)pthread_join(threads[i], NULL);
+            }
+        }
+        for ( i = 0; NULL != obj->cb && i < obj->n; i++ ) {
+            obj->cb(obj, i, &result->items[i]);
+        }
+    } else {
+        /* Back-to-back */
+        for ( i = 0; i < obj->n; i++ ) {
+            (void)_run(&runs[i]);
+            if ( NULL != obj->cb ) {
+                obj->cb(obj, i, &result->items[i]);
+            }
+        }
+    }
+    free(started);
+    free(threads);
+    free(runs);
+
+    /* Update the result */
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    obj->last_result = result;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
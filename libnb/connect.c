@@ -0,0 +1,422 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+/* Delay between the connection attempts (RFC 8305) */
+#define CONNECT_ATTEMPT_DELAY           0.25
+#define CONNECT_TIMEOUT_DEFAULT         10.0
+
+/* Prototype declarations */
+static int _sort_addrinfo(struct addrinfo *, struct addrinfo **, int);
+static int _sockopt_apply(int, const nb_sockopt_t *);
+static int _connect_start(struct addrinfo *, const nb_sockopt_t *, int *);
+static int _connect_finish(int);
+
+/*
+ * Are any of the socket options other than the system defaults?
+ */
+int
+nb_sockopt_is_set(const nb_sockopt_t *opts)
+{
+    if ( NULL == opts ) {
+        return 0;
+    }
+
+    return opts->sndbuf > 0 || opts->rcvbuf > 0
+        || '\0' != opts->congestion[0] || opts->notsent_lowat > 0
+        || opts->max_pacing_rate > 0;
+}
+
+/*
+ * Get the congestion control algorithm of the socket (empty if unknown)
+ */
+void
+nb_sockopt_get_congestion(int sock, char *name)
+{
+    socklen_t optlen;
+
+    name[0] = '\0';
+#ifdef TCP_CONGESTION
+    optlen = NB_CONGESTION_NAME_MAX;
+    if ( 0 != getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, name, &optlen) ) {
+        name[0] = '\0';
+        return;
+    }
+    name[optlen < NB_CONGESTION_NAME_MAX ? optlen
+         : NB_CONGESTION_NAME_MAX - 1] = '\0';
+#else
+    (void)optlen;
+#endif
+}
+
+/*
+ * Order the addresses interleaving the address families (RFC 8305)
+ * The family of the first address (preferred by getaddrinfo) goes first.
+ */
+static int
+_sort_addrinfo(struct addrinfo *res, struct addrinfo **list, int max)
+{
+    struct addrinfo *first;
+    struct addrinfo *other;
+    int pfamily;
+    int n;
+
+    pfamily = res->ai_family;
+    first = res;
+    other = res;
+    n = 0;
+    while ( n < max && (NULL != first || NULL != other) ) {
+        /* Next one of the preferred family */
+        while ( NULL != first && pfamily != first->ai_family ) {
+            first = first->ai_next;
+        }
+        if ( NULL != first ) {
+            list[n++] = first;
+            first = first->ai_next;
+        }
+        if ( n >= max ) {
+            break;
+        }
+        /* Next one of the other families */
+        while ( NULL != other && pfamily == other->ai_family ) {
+            other = other->ai_next;
+        }
+        if ( NULL != other ) {
+            list[n++] = other;
+            other = other->ai_next;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Apply the socket options
+ * The buffer sizes are capped by the system, and the others are ignored if
+ * not supported, but the congestion control explicitly requested must be
+ * available, not to mislabel the measurement.
+ */
+static int
+_sockopt_apply(int sock, const nb_sockopt_t *opts)
+{
+    if ( opts->sndbuf > 0 ) {
+        (void)setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf,
+                         sizeof(opts->sndbuf));
+    }
+    if ( opts->rcvbuf > 0 ) {
+        (void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf,
+                         sizeof(opts->rcvbuf));
+    }
+    if ( '\0' != opts->congestion[0] ) {
+#ifdef TCP_CONGESTION
+        if ( 0 != setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION,
+                             opts->congestion,
+                             strnlen(opts->congestion,
+                                     NB_CONGESTION_NAME_MAX)) ) {
+            return -1;
+        }
+#else
+        errno = ENOPROTOOPT;
+        return -1;
+#endif
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if ( opts->notsent_lowat > 0 ) {
+        (void)setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                         &opts->notsent_lowat, sizeof(opts->notsent_lowat));
+    }
+#endif
+#ifdef SO_MAX_PACING_RATE
+    if ( opts->max_pacing_rate > 0 ) {
+        (void)setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE,
+                         &opts->max_pacing_rate,
+                         sizeof(opts->max_pacing_rate));
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Start a non-blocking connection attempt
+ * The socket options are set before connect(2) so that the buffer sizes
+ * take effect on the window scale negotiated in the handshake.
+ * Returns 1 if connected immediately, 0 if in progress, -1 on failure.
+ */
+static int
+_connect_start(struct addrinfo *ai, const nb_sockopt_t *opts, int *sock)
+{
+    int flags;
+
+    *sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if ( *sock < 0 ) {
+        return -1;
+    }
+    if ( NULL != opts && 0 != _sockopt_apply(*sock, opts) ) {
+        flags = errno;
+        (void)close(*sock);
+        *sock = -1;
+        errno = flags;
+        return -1;
+    }
+    flags = fcntl(*sock, F_GETFL, 0);
+    if ( flags < 0 || fcntl(*sock, F_SETFL, flags | O_NONBLOCK) < 0 ) {
+        (void)close(*sock);
+        *sock = -1;
+        return -1;
+    }
+    if ( 0 == connect(*sock, ai->ai_addr, ai->ai_addrlen) ) {
+        return 1;
+    }
+    if ( EINPROGRESS != errno ) {
+        flags = errno;
+        (void)close(*sock);
+        *sock = -1;
+        errno = flags;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Get the result of the connection attempt, and restore the blocking mode
+ * Returns 0 on success, otherwise the error number.
+ */
+static int
+_connect_finish(int sock)
+{
+    int err;
+    int flags;
+    socklen_t optlen;
+
+    optlen = sizeof(err);
+    if ( 0 != getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &optlen) ) {
+        return errno;
+    }
+    if ( 0 != err ) {
+        return err;
+    }
+    flags = fcntl(sock, F_GETFL, 0);
+    if ( flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0 ) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Open a TCP socket
+ * The connection attempts to the resolved addresses race each other in the
+ * manner of Happy Eyeballs (RFC 8305): a new attempt starts every 250 ms, or
+ * as soon as all the pending ones have failed, alternating the address
+ * families.  The first established connection wins and the others are
+ * cancelled.  The whole procedure gives up after the timeout in seconds (the
+ * default if it is not positive).  The socket options are applied to every
+ * attempt unless opts is NULL.  The resolution and connection times and each
+ * attempt are recorded to conn unless it is NULL.
+ */
+int
+nb_open_stream_socket(const char *host, const char *service, int family,
+                      double timeout, const nb_sockopt_t *opts,
+                      nb_connect_result_t *conn)
+{
+    nb_connect_result_t tmp;
+    nb_connect_attempt_t *at;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *list[NB_CONNECT_ATTEMPTS_MAX];
+    struct pollfd fds[NB_CONNECT_ATTEMPTS_MAX];
+    int idx[NB_CONNECT_ATTEMPTS_MAX];
+    int naddrs;
+    int lasterr;
+    int npending;
+    int next;
+    int sock;
+    int err;
+    int ret;
+    int i;
+    int n;
+    double tmstart;
+    double tmnext;
+    double now;
+    double wait;
+
+    if ( NULL == conn ) {
+        conn = &tmp;
+    }
+    conn->resolved = 0.0;
+    conn->connected = 0.0;
+    conn->winner = -1;
+    conn->nattempts = 0;
+    conn->congestion[0] = '\0';
+    if ( timeout <= 0.0 ) {
+        timeout = CONNECT_TIMEOUT_DEFAULT;
+    }
+
+    /* Resolve the name */
+    tmstart = nb_microtime();
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host, service, &hints, &res);
+    if ( 0 != err ) {
+        /* Error */
+        return -1;
+    }
+    conn->resolved = nb_microtime();
+    naddrs = _sort_addrinfo(res, list, NB_CONNECT_ATTEMPTS_MAX);
+
+    /* Race the connection attempts */
+    sock = -1;
+    lasterr = ECONNREFUSED;
+    npending = 0;
+    next = 0;
+    tmnext = conn->resolved;
+    now = conn->resolved;
+    while ( sock < 0 ) {
+        /* Start the next attempt if it is the time */
+        while ( next < naddrs && (now >= tmnext || 0 == npending) ) {
+            at = &conn->attempts[conn->nattempts];
+            memcpy(&at->addr, list[next]->ai_addr, list[next]->ai_addrlen);
+            at->addrlen = list[next]->ai_addrlen;
+            at->start = now;
+            at->end = 0.0;
+            at->err = EINPROGRESS;
+            ret = _connect_start(list[next], opts, &fds[npending].fd);
+            next++;
+            if ( ret < 0 ) {
+                /* Try the next one immediately */
+                at->end = nb_microtime();
+                at->err = errno;
+                lasterr = errno;
+                conn->nattempts++;
+                continue;
+            }
+            tmnext = now + CONNECT_ATTEMPT_DELAY;
+            if ( ret > 0 ) {
+                /* Connected immediately (e.g., loopback) */
+                at->end = nb_microtime();
+                if ( 0 == (err = _connect_finish(fds[npending].fd)) ) {
+                    at->err = 0;
+                    conn->winner = conn->nattempts;
+                    sock = fds[npending].fd;
+                } else {
+                    at->err = err;
+                    lasterr = err;
+                    (void)close(fds[npending].fd);
+                }
+                conn->nattempts++;
+                break;
+            }
+            fds[npending].events = POLLOUT;
+            fds[npending].revents = 0;
+            idx[npending] = conn->nattempts;
+            npending++;
+            conn->nattempts++;
+            break;
+        }
+        if ( sock >= 0 || (0 == npending && next >= naddrs) ) {
+            break;
+        }
+        if ( 0 == npending ) {
+            continue;
+        }
+
+        /* Wait for any of the pending attempts until the next one starts */
+        wait = tmstart + timeout - now;
+        if ( next < naddrs && tmnext - now < wait ) {
+            wait = tmnext - now;
+        }
+        if ( wait < 0.0 ) {
+            wait = 0.0;
+        }
+        n = poll(fds, npending, (int)(wait * 1000 + 0.999));
+        now = nb_microtime();
+        if ( n < 0 && EINTR != errno ) {
+            break;
+        }
+        for ( i = 0; n > 0 && i < npending; i++ ) {
+            if ( 0 == fds[i].revents ) {
+                continue;
+            }
+            at = &conn->attempts[idx[i]];
+            at->end = now;
+            at->err = _connect_finish(fds[i].fd);
+            if ( 0 == at->err ) {
+                conn->winner = idx[i];
+                sock = fds[i].fd;
+            } else {
+                /* Start the next one without waiting for the delay */
+                (void)close(fds[i].fd);
+                lasterr = at->err;
+                tmnext = now;
+            }
+            /* Remove it from the pending list */
+            npending--;
+            fds[i] = fds[npending];
+            idx[i] = idx[npending];
+            i--;
+            n--;
+            if ( sock >= 0 ) {
+                break;
+            }
+        }
+        if ( sock < 0 && now - tmstart >= timeout ) {
+            /* Timed out */
+            lasterr = ETIMEDOUT;
+            break;
+        }
+    }
+
+    /* Cancel the others */
+    now = nb_microtime();
+    for ( i = 0; i < npending; i++ ) {
+        if ( sock == fds[i].fd ) {
+            continue;
+        }
+        conn->attempts[idx[i]].end = now;
+        conn->attempts[idx[i]].err = sock < 0 ? ETIMEDOUT : ECANCELED;
+        (void)close(fds[i].fd);
+    }
+    freeaddrinfo(res);
+
+    if ( sock < 0 ) {
+        /* No connection established */
+        errno = lasterr;
+        return -1;
+    }
+    conn->connected = conn->attempts[conn->winner].end;
+    nb_sockopt_get_congestion(sock, conn->congestion);
+
+    return sock;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,253 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DISCARD_BUFFER_SIZE             (1024 * 1024)
+#define DISCARD_COPY_SIZE               65536
+#define DISCARD_PIPE_SIZE               (1024 * 1024)
+
+/* Prototype declarations */
+static int _splice_probe(nb_discard_t *);
+static ssize_t _recv_copy(nb_discard_t *, int);
+static ssize_t _recv_trunc(nb_discard_t *, int);
+static ssize_t _recv_splice(nb_discard_t *, int);
+
+/*
+ * Prepare the pipe to /dev/null and check that the kernel can splice it
+ */
+static int
+_splice_probe(nb_discard_t *dis)
+{
+#if defined(HAVE_SPLICE) && defined(F_SETPIPE_SZ)
+    int sz;
+    ssize_t n;
+    char c;
+
+    if ( pipe(dis->pipefd) < 0 ) {
+        dis->pipefd[0] = -1;
+        dis->pipefd[1] = -1;
+        return -1;
+    }
+    dis->nullfd = open("/dev/null", O_WRONLY);
+    if ( dis->nullfd < 0 ) {
+        return -1;
+    }
+
+    /* Enlarge the pipe so that a single splice can move a large chunk */
+    sz = fcntl(dis->pipefd[1], F_SETPIPE_SZ, DISCARD_PIPE_SIZE);
+    if ( sz < 0 ) {
+        sz = fcntl(dis->pipefd[1], F_GETPIPE_SZ);
+    }
+    if ( sz <= 0 ) {
+        return -1;
+    }
+    dis->pipesz = (size_t)sz;
+
+    /* Some kernels cannot splice a pipe into /dev/null */
+    c = 0;
+    if ( 1 != write(dis->pipefd[1], &c, 1) ) {
+        return -1;
+    }
+    n = splice(dis->pipefd[0], NULL, dis->nullfd, NULL, 1, SPLICE_F_MOVE);
+    if ( 1 != n ) {
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Initialize the receive engine
+ */
+int
+nb_discard_init(nb_discard_t *dis, int mode)
+{
+    dis->pipefd[0] = -1;
+    dis->pipefd[1] = -1;
+    dis->nullfd = -1;
+    dis->pipesz = 0;
+    dis->bufsz = 0;
+    dis->buf = NULL;
+
+    switch ( mode ) {
+    case NB_RECV_AUTO:
+#if TARGET_LINUX
+        mode = NB_RECV_TRUNC;
+#else
+        mode = NB_RECV_COPY;
+#endif
+        break;
+    case NB_RECV_COPY:
+        break;
+    case NB_RECV_TRUNC:
+#if !TARGET_LINUX
+        /* MSG_TRUNC does not discard stream data on the other systems */
+        mode = NB_RECV_COPY;
+#endif
+        break;
+    case NB_RECV_SPLICE:
+        if ( 0 != _splice_probe(dis) ) {
+            /* Fall back */
+            nb_discard_release(dis);
+            return nb_discard_init(dis, NB_RECV_AUTO);
+        }
+        break;
+    default:
+        return -1;
+    }
+    dis->mode = mode;
+
+    /* The buffer of MSG_TRUNC only sets the size to be dropped at once and
+       is never touched by the kernel; the others read into it by the copy
+       size at most (in the fallback for the splice) */
+    dis->bufsz = NB_RECV_TRUNC == mode
+        ? DISCARD_BUFFER_SIZE : DISCARD_COPY_SIZE;
+    dis->buf = malloc(dis->bufsz);
+    if ( NULL == dis->buf ) {
+        nb_discard_release(dis);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the receive engine
+ */
+void
+nb_discard_release(nb_discard_t *dis)
+{
+    if ( dis->pipefd[0] >= 0 ) {
+        (void)close(dis->pipefd[0]);
+    }
+    if ( dis->pipefd[1] >= 0 ) {
+        (void)close(dis->pipefd[1]);
+    }
+    if ( dis->nullfd >= 0 ) {
+        (void)close(dis->nullfd);
+    }
+    dis->pipefd[0] = -1;
+    dis->pipefd[1] = -1;
+    dis->nullfd = -1;
+    free(dis->buf);
+    dis->buf = NULL;
+}
+
+/*
+ * Receive into the user-space buffer
+ */
+static ssize_t
+_recv_copy(nb_discard_t *dis, int sock)
+{
+    return recv(sock, dis->buf, DISCARD_COPY_SIZE, 0);
+}
+
+/*
+ * Receive and drop the data in the kernel
+ */
+static ssize_t
+_recv_trunc(nb_discard_t *dis, int sock)
+{
+#ifdef MSG_TRUNC
+    ssize_t nr;
+
+    nr = recv(sock, dis->buf, dis->bufsz, MSG_TRUNC);
+    if ( nr < 0 && (EINVAL == errno || EOPNOTSUPP == errno) ) {
+        /* Not supported by this socket; fall back permanently */
+        dis->mode = NB_RECV_COPY;
+        return _recv_copy(dis, sock);
+    }
+
+    return nr;
+#else
+    dis->mode = NB_RECV_COPY;
+    return _recv_copy(dis, sock);
+#endif
+}
+
+/*
+ * Move the data into the pipe and flush it to /dev/null
+ */
+static ssize_t
+_recv_splice(nb_discard_t *dis, int sock)
+{
+#ifdef HAVE_SPLICE
+    ssize_t nr;
+    ssize_t n;
+    ssize_t rest;
+
+    nr = splice(sock, NULL, dis->pipefd[1], NULL, dis->pipesz, SPLICE_F_MOVE);
+    if ( nr < 0 && EINVAL == errno ) {
+        /* Not supported by this socket; fall back permanently */
+        dis->mode = NB_RECV_COPY;
+        return _recv_copy(dis, sock);
+    }
+    if ( nr <= 0 ) {
+        return nr;
+    }
+
+    /* Drain the pipe so that the next splice does not block */
+    rest = nr;
+    while ( rest > 0 ) {
+        n = splice(dis->pipefd[0], NULL, dis->nullfd, NULL, (size_t)rest,
+                   SPLICE_F_MOVE);
+        if ( n <= 0 ) {
+            if ( n < 0 && EINTR == errno ) {
+                continue;
+            }
+            return -1;
+        }
+        rest -= n;
+    }
+
+    return nr;
+#else
+    dis->mode = NB_RECV_COPY;
+    return _recv_copy(dis, sock);
+#endif
+}
+
+/*
+ * Receive data from the socket and discard it
+ * Returns the number of bytes received, which is exact in all the modes.
+ */
+ssize_t
+nb_discard_recv(nb_discard_t *dis, int sock)
+{
+    switch ( dis->mode ) {
+    case NB_RECV_TRUNC:
+        return _recv_trunc(dis, sock);
+    case NB_RECV_SPLICE:
+        return _recv_splice(dis, sock);
+    default:
+        return _recv_copy(dis, sock);
+    }
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
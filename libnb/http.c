@@ -6,7 +6,9 @@
  *      Hirochika Asai  <asai@scyphus.co.jp>
  */
 
+#include "config.h"
 #include "netbench.h"
+#include "netbench_private.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,7 +26,6 @@
 
 #define HTTP_SOCKET_TIMEOUT             30.0
 #define RESULT_ITEMS_RESERVE_UNIT       4096
-#define UPLOAD_WAIT_USLEEP              1000
 #define BUFFER_SIZE                     65536
 #define DEFAULT_MSS_SIZE                1500
 
@@ -48,6 +49,17 @@ nb_http_get_new(const char *mid)
     }
 
     obj->cb = NULL;
+    obj->rmode = NB_RECV_AUTO;
+    obj->tcpi_interval = 0.0;
+    obj->resolution = 0.0;
+    obj->connect_timeout = 0.0;
+    obj->tolerance = 0.0;
+    bzero(&obj->opts, sizeof(nb_sockopt_t));
+    obj->nconns = 1;
+    obj->segsize = 0;
+    obj->pool = NULL;
+    obj->tls_verify = 1;
+    obj->tls = NULL;
     obj->last_result = NULL;
     obj->cancel = 0;
 
@@ -73,6 +85,14 @@ nb_http_post_new(const char *mid)
     }
 
     obj->cb = NULL;
+    obj->tcpi_interval = 0.0;
+    obj->resolution = 0.0;
+    obj->connect_timeout = 0.0;
+    obj->tolerance = 0.0;
+    bzero(&obj->opts, sizeof(nb_sockopt_t));
+    obj->pool = NULL;
+    obj->tls_verify = 1;
+    obj->tls = NULL;
     obj->last_result = NULL;
     obj->cancel = 0;
 
@@ -94,6 +114,146 @@ nb_http_get_set_callback(nb_http_get_t *obj, nb_http_get_cb_f cbfunc,
     return 0;
 }
 
+/*
+ * Set the receive engine for the downloaded body
+ */
+int
+nb_http_get_set_recv_mode(nb_http_get_t *obj, int rmode)
+{
+    switch ( rmode ) {
+    case NB_RECV_AUTO:
+    case NB_RECV_COPY:
+    case NB_RECV_TRUNC:
+    case NB_RECV_SPLICE:
+        obj->rmode = rmode;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Enable the TCP_INFO sampling at the interval (disabled if zero)
+ */
+int
+nb_http_get_set_tcp_info(nb_http_get_t *obj, double interval)
+{
+    if ( interval < 0.0 ) {
+        return -1;
+    }
+    obj->tcpi_interval = interval;
+
+    return 0;
+}
+
+/*
+ * Record the throughput in fixed-interval buckets of the resolution instead
+ * of an item per receive call (disabled if zero)
+ */
+int
+nb_http_get_set_resolution(nb_http_get_t *obj, double resolution)
+{
+    if ( resolution < 0.0 ) {
+        return -1;
+    }
+    obj->resolution = resolution;
+
+    return 0;
+}
+
+/*
+ * Take the connection from the pool and return it after the measurement if
+ * the response is complete (NULL to open a new connection every time)
+ */
+int
+nb_http_get_set_pool(nb_http_get_t *obj, nb_http_pool_t *pool)
+{
+    obj->pool = pool;
+
+    return 0;
+}
+
+/*
+ * Give up establishing the connection after the timeout in seconds (the
+ * default if zero)
+ */
+int
+nb_http_get_set_connect_timeout(nb_http_get_t *obj, double timeout)
+{
+    if ( timeout < 0.0 ) {
+        return -1;
+    }
+    obj->connect_timeout = timeout;
+
+    return 0;
+}
+
+/*
+ * Verify the certificate of the https:// server (enabled by default)
+ * The session kept for the resumption is discarded.
+ */
+int
+nb_http_get_set_tls_verify(nb_http_get_t *obj, int verify)
+{
+    nb_tls_ctx_delete(obj->tls);
+    obj->tls = NULL;
+    obj->tls_verify = verify;
+
+    return 0;
+}
+
+/*
+ * End the download once the 95% confidence interval of the throughput is
+ * narrower than the tolerance relative to the estimate (disabled if zero)
+ */
+int
+nb_http_get_set_early_stop(nb_http_get_t *obj, double tolerance)
+{
+    if ( tolerance < 0.0 ) {
+        return -1;
+    }
+    obj->tolerance = tolerance;
+
+    return 0;
+}
+
+/*
+ * Set the socket options of the connection (the system defaults if NULL)
+ * The connection is not taken from or returned to the pool if any are set.
+ */
+int
+nb_http_get_set_sockopt(nb_http_get_t *obj, const nb_sockopt_t *opts)
+{
+    if ( NULL == opts ) {
+        bzero(&obj->opts, sizeof(nb_sockopt_t));
+        return 0;
+    }
+    if ( opts->sndbuf < 0 || opts->rcvbuf < 0 || opts->notsent_lowat < 0 ) {
+        return -1;
+    }
+    obj->opts = *opts;
+    obj->opts.congestion[NB_CONGESTION_NAME_MAX - 1] = '\0';
+
+    return 0;
+}
+
+/*
+ * Download the object in segments of the size (the default if zero) by
+ * "Range:" requests over the connections at once (not segmented if one)
+ * The segmented download uses neither the pool nor the early termination.
+ */
+int
+nb_http_get_set_segments(nb_http_get_t *obj, int nconns, off_t segsize)
+{
+    if ( nconns <= 0 || segsize < 0 ) {
+        return -1;
+    }
+    obj->nconns = nconns;
+    obj->segsize = segsize;
+
+    return 0;
+}
+
 /*
  * Set a callback function
  */
@@ -110,182 +270,165 @@ nb_http_post_set_callback(nb_http_post_t *obj, nb_http_post_cb_f cbfunc,
 }
 
 /*
- * Delete an http_get instance
+ * Enable the TCP_INFO sampling at the interval (disabled if zero)
  */
-void
-nb_http_get_delete(nb_http_get_t *obj)
+int
+nb_http_post_set_tcp_info(nb_http_post_t *obj, double interval)
 {
-    if ( NULL != obj->last_result ) {
-        free(obj->last_result->items);
-        free(obj->last_result);
+    if ( interval < 0.0 ) {
+        return -1;
     }
-    free(obj->mid);
-    free(obj);
+    obj->tcpi_interval = interval;
+
+    return 0;
 }
 
 /*
- * Delete an http_post instance
+ * Record the throughput in fixed-interval buckets of the resolution instead
+ * of an item per send call (disabled if zero)
  */
-void
-nb_http_post_delete(nb_http_post_t *obj)
+int
+nb_http_post_set_resolution(nb_http_post_t *obj, double resolution)
 {
-    if ( NULL != obj->last_result ) {
-        free(obj->last_result->items);
-        free(obj->last_result);
+    if ( resolution < 0.0 ) {
+        return -1;
     }
-    free(obj->mid);
-    free(obj);
+    obj->resolution = resolution;
+
+    return 0;
+}
+
+/*
+ * Take the connection from the pool and return it after the measurement if
+ * the response is complete (NULL to open a new connection every time)
+ */
+int
+nb_http_post_set_pool(nb_http_post_t *obj, nb_http_pool_t *pool)
+{
+    obj->pool = pool;
+
+    return 0;
 }
 
+/*
+ * Give up establishing the connection after the timeout in seconds (the
+ * default if zero)
+ */
+int
+nb_http_post_set_connect_timeout(nb_http_post_t *obj, double timeout)
+{
+    if ( timeout < 0.0 ) {
+        return -1;
+    }
+    obj->connect_timeout = timeout;
 
+    return 0;
+}
 
 /*
- * Open a TCP socket
+ * Verify the certificate of the https:// server (enabled by default)
+ * The session kept for the resumption is discarded.
  */
-static int
-_open_stream_socket(const char *host, const char *service, int family)
+int
+nb_http_post_set_tls_verify(nb_http_post_t *obj, int verify)
 {
-    int sock;
-    struct addrinfo hints;
-    struct addrinfo *res;
-    struct addrinfo *ressave;
-    int err;
+    nb_tls_ctx_delete(obj->tls);
+    obj->tls = NULL;
+    obj->tls_verify = verify;
 
-    /* Open a socket */
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = family;
-    hints.ai_socktype = SOCK_STREAM;
-    err = getaddrinfo(host, service, &hints, &res);
-    if ( 0 != err ) {
-        /* Error */
+    return 0;
+}
+
+/*
+ * End the upload once the 95% confidence interval of the throughput is
+ * narrower than the tolerance relative to the estimate (disabled if zero)
+ */
+int
+nb_http_post_set_early_stop(nb_http_post_t *obj, double tolerance)
+{
+    if ( tolerance < 0.0 ) {
         return -1;
     }
+    obj->tolerance = tolerance;
 
-    /* Get first connection */
-    ressave = res;
-    sock = -1;
-    do {
-        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if ( sock < 0 ) {
-            /* ignore a connection error. */
-            continue;
-        }
-        err = connect(sock, res->ai_addr, res->ai_addrlen);
-        if ( 0 != err ) {
-            /* Error */
-            (void)close(sock);
-            sock = -1;
-        } else {
-            /* Succeed */
-            break;
-        }
-    } while ( NULL != (res = res->ai_next) );
+    return 0;
+}
 
-    if ( sock < 0 ) {
-        /* No socket found */
-        freeaddrinfo(ressave);
+/*
+ * Set the socket options of the connection (the system defaults if NULL)
+ * The connection is not taken from or returned to the pool if any are set.
+ */
+int
+nb_http_post_set_sockopt(nb_http_post_t *obj, const nb_sockopt_t *opts)
+{
+    if ( NULL == opts ) {
+        bzero(&obj->opts, sizeof(nb_sockopt_t));
+        return 0;
+    }
+    if ( opts->sndbuf < 0 || opts->rcvbuf < 0 || opts->notsent_lowat < 0 ) {
         return -1;
     }
+    obj->opts = *opts;
+    obj->opts.congestion[NB_CONGESTION_NAME_MAX - 1] = '\0';
 
-    freeaddrinfo(ressave);
+    return 0;
+}
 
-    return sock;
+/*
+ * Delete a result of http_get
+ */
+static void
+_get_result_delete(nb_http_get_result_t *result)
+{
+    nb_tcp_info_series_release(&result->tcpi);
+    nb_rate_series_release(&result->rate);
+    free(result->segs);
+    free(result->items);
+    free(result);
 }
 
 /*
- * Read the response header
- * Note that a part of response body is possibly read due to the buffer size
+ * Delete a result of http_post
  */
-static int
-_read_response_header(int sock, char **hdrstr, off_t *hdrlen, char **bdystr,
-                      off_t *bdylen)
+static void
+_post_result_delete(nb_http_post_result_t *result)
 {
-    /* Buffer */
-    char buf[4096];
-    /* Counters */
-    ssize_t i;
-    ssize_t nr;
-    ssize_t n;
-    int nl;
-    /* A flag of end-of-header */
-    int eoh;
-    /* Temporary string */
-    char *tmpstr;
-
-    /* Read until the end of the response header */
-    eoh = 0;
-    nl = 0;
-    nr = 0;
-    *hdrlen = 0;
-    *hdrstr = NULL;
-    while ( !eoh ) {
-        /* Receive */
-        n = read(sock, buf, sizeof(buf));
-        if ( n <= 0 ) {
-            /* Cannot read any more response */
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ETIMEDOUT;
-        }
-        /* Search the end-of-header */
-        for ( i = 0; i < n; i++ ) {
-            if ( '\n' == buf[i] ) {
-                nl++;
-            } else if ( '\r' == buf[i] && i + 1 < n && '\n' == buf[i+1] ) {
-                i++;
-                nl++;
-            } else {
-                nl = 0;
-            }
-            if ( 2 == nl ) {
-                /* End-of-header */
-                eoh = 1;
-                i++;
-                break;
-            }
-        }
-        *hdrlen += i;
-
-        /* Extend the response header buffer */
-        tmpstr = realloc(*hdrstr, sizeof(char) * (size_t)(*hdrlen + 1));
-        if ( NULL == tmpstr ) {
-            /* Memory error */
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ENOMEM;
-        }
-        *hdrstr = tmpstr;
-        (void)memcpy((*hdrstr) + nr, buf, i);
-        /* Convert asciz to reduce buffer overflow risk */
-        (*hdrstr)[*hdrlen] = '\0';
-
-        nr += n;
-    }
-
-    /* Read body */
-    if ( nr > *hdrlen ) {
-        /* Compute the loaded body length */
-        *bdylen = nr - *hdrlen;
-        /* +1 for null termination for safety */
-        *bdystr = malloc(sizeof(char) * (size_t)(*bdylen + 1));
-        if ( NULL ==  *bdystr ) {
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ENOMEM;
-        }
-        (void)memcpy(*bdystr, buf + i, (size_t)*bdylen);
-        (*bdystr)[*bdylen] = '\0';
-    } else {
-        *bdystr = NULL;
-        *bdylen = 0;
+    nb_tcp_info_series_release(&result->tcpi);
+    nb_rate_series_release(&result->rate);
+    free(result->items);
+    free(result);
+}
+
+/*
+ * Delete an http_get instance
+ */
+void
+nb_http_get_delete(nb_http_get_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _get_result_delete(obj->last_result);
     }
+    nb_tls_ctx_delete(obj->tls);
+    free(obj->mid);
+    free(obj);
+}
 
-    return 0;
+/*
+ * Delete an http_post instance
+ */
+void
+nb_http_post_delete(nb_http_post_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _post_result_delete(obj->last_result);
+    }
+    nb_tls_ctx_delete(obj->tls);
+    free(obj->mid);
+    free(obj);
 }
 
+
+
 /*
  * Build Request-URI corresponding the input parsed URL
  */
@@ -363,12 +506,10 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     char *path;
     struct timeval tv;
     char req[BUFFER_SIZE];
-    char buf[BUFFER_SIZE];
-    char *hdrstr;
+    nb_http_rbuf_t rbuf;
     off_t hdrlen;
-    char *bdystr;
     off_t bdylen;
-    nb_http_header_t *hdr;
+    nb_http_header_view_t hdr;
     ssize_t nw;
     ssize_t nr;
     double t0;
@@ -379,9 +520,16 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     off_t tx;
     off_t rx;
     off_t clen;
-    off_t tsize;
     socklen_t optlen;
     int opt;
+    int keep;
+    nb_discard_t dis;
+    nb_http_body_t body;
+    ssize_t n;
+    nb_http_pool_t *pool;
+    nb_tls_t *tls;
+    nb_estimator_t est;
+    int conv;
 
     /* Allocate for the results */
     result = malloc(sizeof(nb_http_get_result_t));
@@ -397,35 +545,97 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     }
     result->hlen = 0;
     result->clen = 0;
+    result->payload = 0;
+    bzero(&result->timing, sizeof(nb_http_timing_t));
+    bzero(&result->est, sizeof(nb_estimate_t));
+    result->nconns = 1;
+    result->nsegs = 0;
+    result->segs = NULL;
+    if ( 0 != nb_tcp_info_series_init(&result->tcpi, obj->tcpi_interval,
+                                      duration) ) {
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    if ( 0 != nb_rate_series_init(&result->rate, 0.0, obj->resolution,
+                                  duration) ) {
+        nb_tcp_info_series_release(&result->tcpi);
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    nb_estimator_init(&est, obj->tolerance);
 
     /* Parse the URL */
     purl = nb_parse_url(url);
     if ( NULL == purl ) {
-        free(result->items);
-        free(result);
+        _get_result_delete(result);
         return -1;
     }
-    /* Only the scheme "http" is supported. */
-    if ( strcasecmp("http", purl->scheme) ) {
+    /* The schemes "http" and "https" (with OpenSSL) are supported. */
+    tls = NULL;
+    result->tls = NB_TLS_NONE;
+    if ( 0 == strcasecmp("https", purl->scheme) ) {
+        if ( NULL == obj->tls ) {
+            obj->tls = nb_tls_ctx_new(obj->tls_verify);
+        }
+        if ( NULL == obj->tls ) {
+            nb_parsed_url_free(purl);
+            _get_result_delete(result);
+            return -1;
+        }
+        result->tls = NB_TLS_FULL;
+    } else if ( strcasecmp("http", purl->scheme) ) {
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _get_result_delete(result);
         return -1;
     }
     port = purl->port;
     if ( NULL == port ) {
         /* Set default port */
-        port = "80";
+        port = NB_TLS_NONE != result->tls ? "443" : "80";
+    }
+    /* The TLS connections, and the ones with the socket options, are not
+       pooled */
+    pool = NB_TLS_NONE != result->tls || nb_sockopt_is_set(&obj->opts)
+        ? NULL : obj->pool;
+
+    if ( obj->nconns > 1 ) {
+        /* Range-segmented download over the connections of its own */
+        result->reused = 0;
+        path = _build_request_uri(purl);
+        if ( NULL == path
+             || 0 != nb_http_get_segmented(obj, result, purl->host, port,
+                                           path, family, duration) ) {
+            free(path);
+            nb_parsed_url_free(purl);
+            _get_result_delete(result);
+            return -1;
+        }
+        free(path);
+        nb_parsed_url_free(purl);
+
+        /* Update the result */
+        if ( NULL != obj->last_result ) {
+            _get_result_delete(obj->last_result);
+        }
+        obj->last_result = result;
+
+        return 0;
     }
 
     /* Open a socket */
-    sock = _open_stream_socket(purl->host, port, family);
+    result->timing.start = nb_microtime();
+    sock = nb_http_pool_acquire(pool, purl->host, port, family,
+                                obj->connect_timeout, &obj->opts,
+                                &result->reused, &result->conn);
     if ( sock < 0 ) {
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _get_result_delete(result);
         return -1;
     }
+    result->timing.dns = result->conn.resolved;
+    result->timing.connect = result->conn.connected;
     /* Get MSS */
     optlen = sizeof(opt);
     err = getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &opt, &optlen);
@@ -444,11 +654,24 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
         /* Error */
         (void)close(sock);
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _get_result_delete(result);
         return -1;
     }
 
+    /* TLS handshake */
+    result->timing.tls = result->timing.connect;
+    if ( NB_TLS_NONE != result->tls ) {
+        tls = nb_tls_connect(obj->tls, sock, purl->host, port, &err);
+        if ( NULL == tls ) {
+            (void)close(sock);
+            nb_parsed_url_free(purl);
+            _get_result_delete(result);
+            return -1;
+        }
+        result->tls = err ? NB_TLS_RESUMED : NB_TLS_FULL;
+        result->timing.tls = nb_microtime();
+    }
+
     /* Initialize the variables for saving statistics */
     tx = 0;
     rx = 0;
@@ -457,25 +680,23 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     path = _build_request_uri(purl);
     if ( NULL ==  path ) {
         /* Error */
+        nb_tls_close(tls);
         (void)close(sock);
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _get_result_delete(result);
         return -1;
     }
     snprintf(req, sizeof(req), "GET %.1024s HTTP/1.1\r\n"
              "Host: %.1024s\r\n"
              "User-Agent: %s\r\n"
              "X-Measurement-Id: %.100s\r\n"
-             "Connection: close\r\n\r\n", path, purl->host, USER_AGENT,
-             obj->mid);
+             "Connection: %s\r\n\r\n", path, purl->host, USER_AGENT,
+             obj->mid, NULL != pool ? "keep-alive" : "close");
     free(path);
 
-    /* Free the parsed url */
-    nb_parsed_url_free(purl);
-
     /* Obtain the current time */
     t0 = nb_microtime();
+    nb_rate_series_start(&result->rate, t0);
     /* For result */
     result->items[result->cnt].tm = t0;
     result->items[result->cnt].tx = tx;
@@ -483,51 +704,70 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     result->cnt++;
 
     /* Send request header */
-    nw = send(sock, req, strlen(req), 0);
+    if ( NULL != tls ) {
+        nw = nb_tls_send(tls, req, strlen(req));
+    } else {
+        nw = send(sock, req, strlen(req), 0);
+    }
     if ( nw != strlen(req) ) {
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _get_result_delete(result);
         return -1;
     }
     tx += nw;
+    result->timing.reqsent = nb_microtime();
 
     /* Read the response header */
-    err = _read_response_header(sock, &hdrstr, &hdrlen, &bdystr, &bdylen);
+    err = nb_http_read_header(sock, tls, &rbuf, &result->timing.ttfb);
     if ( err < 0 ) {
         /* Error */
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _get_result_delete(result);
         return -1;
     }
     t1 = nb_microtime();
+    result->timing.header = t1;
+    hdrlen = (off_t)rbuf.hdrlen;
+    bdylen = (off_t)(rbuf.len - rbuf.hdrlen);
     rx += hdrlen + bdylen;
 
     /* Parse the response header */
-    hdr = nb_parse_http_header(hdrstr, (size_t)hdrlen);
-    if ( NULL == hdr ) {
+    if ( 0 != nb_http_header_view_parse(&hdr, rbuf.buf, rbuf.hdrlen) ) {
         /* Error */
-        free(hdrstr);
-        if ( NULL != bdystr ) {
-            free(bdystr);
-        }
+        nb_http_rbuf_release(&rbuf);
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _get_result_delete(result);
         return -1;
     }
-    /* Free the response */
-    free(hdrstr);
-    if ( NULL != bdystr ) {
-        free(bdystr);
-    }
 
     /* Get content length */
-    clen = nb_http_header_get_content_length(hdr);
+    clen = nb_http_header_view_get_content_length(&hdr);
+    keep = nb_http_header_view_is_keepalive(&hdr);
 
-    /* Free the HTTP header */
-    nb_http_header_delete(hdr);
+    /* Prepare the body decoder to count the payload */
+    if ( 0 != nb_http_body_init(&body, &hdr, NULL, NULL) ) {
+        nb_http_rbuf_release(&rbuf);
+        nb_tls_close(tls);
+        close(sock);
+        nb_parsed_url_free(purl);
+        _get_result_delete(result);
+        return -1;
+    }
+    /* The body bytes read together with the header */
+    nr = nb_http_body_feed(&body, rbuf.buf + rbuf.hdrlen, (size_t)bdylen);
+    if ( nr < bdylen ) {
+        /* Garbage after the body, or invalid framing */
+        keep = 0;
+    }
+
+    /* Free the response */
+    nb_http_rbuf_release(&rbuf);
 
     /* For result */
     result->hlen = hdrlen;
@@ -536,26 +776,52 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
     result->items[result->cnt].tx = tx;
     result->items[result->cnt].rx = rx;
     result->cnt++;
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, t1, 1);
 
     /* Call a callback function */
     if ( NULL != obj->cb ) {
         obj->cb(obj, result->hlen, result->clen, t0, t1, tx, rx);
     }
 
-    /* Set read length */
-    tsize = bdylen;
+    /* Prepare the receive engine (the chunked body needs the data to be
+       decoded, and TLS to be decrypted) */
+    if ( 0 != nb_discard_init(&dis, NB_HTTP_BODY_CHUNKED == body.framing
+                              || NULL != tls ? NB_RECV_COPY : obj->rmode) ) {
+        nb_tls_close(tls);
+        close(sock);
+        nb_parsed_url_free(purl);
+        _get_result_delete(result);
+        return -1;
+    }
+    result->rmode = dis.mode;
 
-    /* Download the body */
+    /* Download the body (until the end of the body, not to wait for the
+       close of a kept-alive connection) */
+    nb_estimator_start(&est, t1, rx);
+    conv = 0;
     prevtm = t1;
-    while ( (nr = recv(sock, buf, sizeof(buf), 0)) > 0 ) {
+    curtm = t1;
+    while ( nr >= 0 && !body.done
+            && (nr = (NULL != tls ? nb_tls_recv(tls, dis.buf, dis.bufsz)
+                      : nb_discard_recv(&dis, sock))) > 0 ) {
         curtm = nb_microtime();
 
         /* Update the information */
-        tsize += nr;
         rx += nr;
 
+        /* Decode the body (the data is available only in the copy mode) */
+        n = nb_http_body_feed(&body, NB_RECV_COPY == dis.mode ? dis.buf : NULL,
+                              (size_t)nr);
+        if ( n < nr ) {
+            /* Garbage after the body, or invalid framing */
+            keep = 0;
+        }
+
         /* Insert a result item */
-        if ( result->cnt >= result->cntres ) {
+        if ( NULL != result->rate.buckets ) {
+            /* Aggregate into the fixed-interval buckets instead */
+            nb_rate_series_add(&result->rate, curtm, rx);
+        } else if ( result->cnt >= result->cntres ) {
             /* Realloc */
             cntres = result->cntres + RESULT_ITEMS_RESERVE_UNIT;
             items = realloc(result->items,
@@ -575,6 +841,12 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
             result->cnt++;
         }
 
+        /* Sample the TCP information */
+        (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 0);
+
+        /* Update the throughput estimate */
+        conv = nb_estimator_add(&est, curtm, rx);
+
         /* Report by calling a callback function */
         if ( NULL != obj->cb ) {
             if ( curtm - prevtm >= obj->cbfreq ) {
@@ -582,10 +854,16 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
                 prevtm = curtm;
             }
         }
-        if ( curtm - t0 > duration ) {
+        if ( n < 0 || curtm - t0 > duration || conv ) {
             break;
         }
     }
+    if ( 0 == nr && !body.done ) {
+        /* Closed by the peer */
+        (void)nb_http_body_eof(&body);
+        keep = 0;
+    }
+    result->payload = body.payload;
     if ( curtm != prevtm ) {
         if ( NULL != obj->cb ) {
             obj->cb(obj, result->hlen, result->clen, t0, curtm, tx, rx);
@@ -594,15 +872,36 @@ nb_http_get_exec(nb_http_get_t *obj, const char *url, int family,
 
     /* Completed time of the download */
     t2 = prevtm;
+    result->timing.body = curtm;
+
+    /* The bytes saved by ending early (the rest of the body if known) */
+    if ( conv && !body.done ) {
+        nb_estimator_finish(&est, duration - (curtm - t0),
+                            clen >= 0 ? hdrlen + clen - rx : -1);
+    }
+    result->est = est.est;
+
+    /* The last sample of the TCP information */
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 1);
 
-    /* Close the socket */
-    shutdown(sock, SHUT_RDWR);
-    (void)close(sock);
+    /* Release the receive engine */
+    result->rmode = dis.mode;
+    nb_discard_release(&dis);
+
+    /* Return the connection to the pool if the response is complete */
+    if ( !body.done ) {
+        keep = 0;
+    }
+    nb_tls_close(tls);
+    if ( NULL == pool || !keep ) {
+        shutdown(sock, SHUT_RDWR);
+    }
+    nb_http_pool_release(pool, purl->host, port, family, sock, keep);
+    nb_parsed_url_free(purl);
 
     /* Update the result */
     if ( NULL != obj->last_result ) {
-        free(obj->last_result->items);
-        free(obj->last_result);
+        _get_result_delete(obj->last_result);
     }
     obj->last_result = result;
 
@@ -627,11 +926,10 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     struct timeval tv;
     char req[BUFFER_SIZE];
     char buf[BUFFER_SIZE];
-    char *hdrstr;
+    nb_http_rbuf_t rbuf;
     off_t hdrlen;
-    char *bdystr;
     off_t bdylen;
-    nb_http_header_t *hdr;
+    nb_http_header_view_t hdr;
     ssize_t nw;
     ssize_t nr;
     double t0;
@@ -643,13 +941,20 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     off_t btx;
     off_t rx;
     off_t reshlen;
-    off_t resclen;
-    off_t tsize;
     off_t rest;
     socklen_t optlen;
     int opt;
-    int prevopt;
+    off_t unacked;
+    off_t prevunacked;
     int segsize;
+    int keep;
+    nb_txprog_t txp;
+    nb_http_body_t body;
+    ssize_t n;
+    nb_http_pool_t *pool;
+    nb_tls_t *tls;
+    nb_estimator_t est;
+    int conv;
 
     /* Allocate for the results */
     result = malloc(sizeof(nb_http_post_result_t));
@@ -665,35 +970,69 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     }
     result->hlen = 0;
     result->clen = 0;
+    result->payload = 0;
+    bzero(&result->timing, sizeof(nb_http_timing_t));
+    if ( 0 != nb_tcp_info_series_init(&result->tcpi, obj->tcpi_interval,
+                                      duration) ) {
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    if ( 0 != nb_rate_series_init(&result->rate, 0.0, obj->resolution,
+                                  duration) ) {
+        nb_tcp_info_series_release(&result->tcpi);
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    nb_estimator_init(&est, obj->tolerance);
 
     /* Parse the URL */
     purl = nb_parse_url(url);
     if ( NULL == purl ) {
-        free(result->items);
-        free(result);
+        _post_result_delete(result);
         return -1;
     }
-    /* Only the scheme "http" is supported. */
-    if ( strcasecmp("http", purl->scheme) ) {
+    /* The schemes "http" and "https" (with OpenSSL) are supported. */
+    tls = NULL;
+    result->tls = NB_TLS_NONE;
+    if ( 0 == strcasecmp("https", purl->scheme) ) {
+        if ( NULL == obj->tls ) {
+            obj->tls = nb_tls_ctx_new(obj->tls_verify);
+        }
+        if ( NULL == obj->tls ) {
+            nb_parsed_url_free(purl);
+            _post_result_delete(result);
+            return -1;
+        }
+        result->tls = NB_TLS_FULL;
+    } else if ( strcasecmp("http", purl->scheme) ) {
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _post_result_delete(result);
         return -1;
     }
     port = purl->port;
     if ( NULL == port ) {
         /* Set default port */
-        port = "80";
+        port = NB_TLS_NONE != result->tls ? "443" : "80";
     }
+    /* The TLS connections, and the ones with the socket options, are not
+       pooled */
+    pool = NB_TLS_NONE != result->tls || nb_sockopt_is_set(&obj->opts)
+        ? NULL : obj->pool;
 
     /* Open a socket */
-    sock = _open_stream_socket(purl->host, port, family);
+    result->timing.start = nb_microtime();
+    sock = nb_http_pool_acquire(pool, purl->host, port, family,
+                                obj->connect_timeout, &obj->opts,
+                                &result->reused, &result->conn);
     if ( sock < 0 ) {
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _post_result_delete(result);
         return -1;
     }
+    result->timing.dns = result->conn.resolved;
+    result->timing.connect = result->conn.connected;
     /* Get MSS */
     optlen = sizeof(opt);
     err = getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &opt, &optlen);
@@ -714,11 +1053,24 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
         /* Error */
         (void)close(sock);
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _post_result_delete(result);
         return -1;
     }
 
+    /* TLS handshake */
+    result->timing.tls = result->timing.connect;
+    if ( NB_TLS_NONE != result->tls ) {
+        tls = nb_tls_connect(obj->tls, sock, purl->host, port, &err);
+        if ( NULL == tls ) {
+            (void)close(sock);
+            nb_parsed_url_free(purl);
+            _post_result_delete(result);
+            return -1;
+        }
+        result->tls = err ? NB_TLS_RESUMED : NB_TLS_FULL;
+        result->timing.tls = nb_microtime();
+    }
+
     /* Prepare the body */
     for ( nr = 0; nr < sizeof(buf); nr++ ) {
         buf[nr] = nr % 0x100;
@@ -733,10 +1085,10 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     path = _build_request_uri(purl);
     if ( NULL ==  path ) {
         /* Error */
+        nb_tls_close(tls);
         (void)close(sock);
         nb_parsed_url_free(purl);
-        free(result->items);
-        free(result);
+        _post_result_delete(result);
         return -1;
     }
     snprintf(req, sizeof(req), "POST %.1024s HTTP/1.1\r\n"
@@ -744,15 +1096,13 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
              "User-Agent: %s\r\n"
              "Content-Length: %llu\r\n"
              "X-Measurement-Id: %.100s\r\n"
-             "Connection: close\r\n\r\n", path, purl->host, USER_AGENT, size,
-             obj->mid);
+             "Connection: %s\r\n\r\n", path, purl->host, USER_AGENT, size,
+             obj->mid, NULL != pool ? "keep-alive" : "close");
     free(path);
 
-    /* Free the parsed url */
-    nb_parsed_url_free(purl);
-
     /* Obtain the current time */
     t0 = nb_microtime();
+    nb_rate_series_start(&result->rate, t0);
     /* For result */
     result->items[result->cnt].tm = t0;
     result->items[result->cnt].tx = tx;
@@ -760,12 +1110,25 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     result->items[result->cnt].rx = rx;
     result->cnt++;
 
+    /* Prepare for tracking the acknowledged bytes (not over TLS, as the
+       kernel counts the records on the wire, not the bytes written) */
+    (void)nb_txprog_init(&txp, sock);
+    if ( NULL != tls ) {
+        txp.method = NB_TXPROG_NONE;
+    }
+
     /* Send request header */
-    nw = send(sock, req, strlen(req), 0);
+    if ( NULL != tls ) {
+        nw = nb_tls_send(tls, req, strlen(req));
+    } else {
+        nw = send(sock, req, strlen(req), 0);
+    }
     if ( nw != strlen(req) ) {
+        nb_txprog_release(&txp);
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _post_result_delete(result);
         return -1;
     }
     btx += nw;
@@ -773,17 +1136,8 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     /* Get the current time */
     t1 = nb_microtime();
 
-    /* Get the buffered size */
-    optlen = sizeof(opt);
-#ifdef SO_NWRITE
-    if ( 0 == getsockopt(sock, SOL_SOCKET, SO_NWRITE, &opt, &optlen) ) {
-        tx = btx - opt;
-    } else {
-        tx = 0;
-    }
-#else
-    tx = 0;
-#endif
+    /* Get the acknowledged size */
+    (void)nb_txprog_get(&txp, sock, btx, &tx, NULL);
 
     /* Set result */
     result->hlen = strlen(req);
@@ -794,6 +1148,7 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     result->items[result->cnt].tx = tx;
     result->items[result->cnt].rx = rx;
     result->cnt++;
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, t1, 1);
 
     /* Call a callback function */
     if ( NULL != obj->cb ) {
@@ -801,31 +1156,30 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     }
 
     /* Upload the body */
+    nb_estimator_start(&est, t1, NB_TXPROG_NONE != txp.method ? tx : btx);
+    conv = 0;
     prevtm = t1;
     rest = size;
-    while ( (nw = send(sock, buf,
-                       rest > segsize ? segsize : (size_t)rest,
-                       0)) > 0 ) {
+    while ( (nw = (NULL != tls
+                   ? nb_tls_send(tls, buf,
+                                 rest > segsize ? segsize : (size_t)rest)
+                   : send(sock, buf, rest > segsize ? segsize : (size_t)rest,
+                          0))) > 0 ) {
         curtm = nb_microtime();
 
         /* Update the information */
         rest -= nw;
         btx += nw;
 
-        /* Get the buffered size */
-        optlen = sizeof(opt);
-#ifdef SO_NWRITE
-        if ( 0 == getsockopt(sock, SOL_SOCKET, SO_NWRITE, &opt, &optlen) ) {
-            tx = btx - opt;
-        } else {
-            tx = 0;
-        }
-#else
-        tx = 0;
-#endif
+        /* Get the acknowledged size */
+        (void)nb_txprog_get(&txp, sock, btx, &tx, NULL);
 
         /* Append a result item */
-        if ( result->cnt >= result->cntres ) {
+        if ( NULL != result->rate.buckets ) {
+            /* Aggregate into the fixed-interval buckets instead */
+            nb_rate_series_add(&result->rate, curtm,
+                               NB_TXPROG_NONE != txp.method ? tx : btx);
+        } else if ( result->cnt >= result->cntres ) {
             /* Realloc */
             cntres = result->cntres + RESULT_ITEMS_RESERVE_UNIT;
             items = realloc(result->items,
@@ -847,6 +1201,13 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
             result->cnt++;
         }
 
+        /* Sample the TCP information */
+        (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 0);
+
+        /* Update the throughput estimate */
+        conv = nb_estimator_add(&est, curtm,
+                                NB_TXPROG_NONE != txp.method ? tx : btx);
+
         /* Report by calling a callback function */
         if ( NULL != obj->cb ) {
             if ( curtm - prevtm >= obj->cbfreq ) {
@@ -856,7 +1217,7 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
             }
         }
 
-        if ( curtm - t0 > duration ) {
+        if ( curtm - t0 > duration || conv ) {
             /* End-of-measurement */
             if ( curtm != prevtm ) {
                 if ( NULL != obj->cb ) {
@@ -865,14 +1226,23 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
                 }
             }
 
+            /* The bytes saved by ending early (not written yet; the ones
+               written but not acknowledged are to be transferred anyway) */
+            nb_estimator_finish(&est, duration - (curtm - t0),
+                                result->hlen + size - btx);
+            result->est = est.est;
+
             /* Close the socket */
+            (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 1);
+            nb_txprog_release(&txp);
+            nb_tls_close(tls);
             shutdown(sock, SHUT_RDWR);
             (void)close(sock);
+            nb_parsed_url_free(purl);
 
             /* Set the result */
             if ( NULL != obj->last_result ) {
-                free(obj->last_result->items);
-                free(obj->last_result);
+                _post_result_delete(obj->last_result);
             }
             obj->last_result = result;
 
@@ -880,26 +1250,29 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
         }
     }
 
+    /* The whole request has been written to the socket buffer */
+    result->timing.reqsent = nb_microtime();
+
     /* Wait for sending out the buffered data */
-    prevopt = 0;
+    prevunacked = 0;
     for ( ;; ) {
         curtm = nb_microtime();
 
-        /* Get the buffered size */
-        optlen = sizeof(opt);
-#ifdef SO_NWRITE
-        if ( 0 == getsockopt(sock, SOL_SOCKET, SO_NWRITE, &opt, &optlen) ) {
-            tx = btx - opt;
+        /* Get the acknowledged size */
+        if ( 0 == nb_txprog_get(&txp, sock, btx, &tx, NULL) ) {
+            unacked = btx - tx;
         } else {
-            tx = 0;
+            /* Cannot track the progress */
+            unacked = 0;
         }
-#else
-        tx = 0;
-#endif
 
-        if ( prevopt != opt ) {
+        if ( prevunacked != unacked ) {
             /* Append a result item */
-            if ( result->cnt >= result->cntres ) {
+            if ( NULL != result->rate.buckets ) {
+                /* Aggregate into the fixed-interval buckets instead */
+                nb_rate_series_add(&result->rate, curtm,
+                                   NB_TXPROG_NONE != txp.method ? tx : btx);
+            } else if ( result->cnt >= result->cntres ) {
                 cntres = result->cntres + RESULT_ITEMS_RESERVE_UNIT;
                 items = realloc(result->items,
                                 sizeof(nb_http_post_result_item_t) * cntres);
@@ -920,6 +1293,13 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
                 result->cnt++;
             }
 
+            /* Sample the TCP information */
+            (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 0);
+
+            /* Update the throughput estimate */
+            conv = nb_estimator_add(&est, curtm,
+                                    NB_TXPROG_NONE != txp.method ? tx : btx);
+
             /* Report by calling a callback function */
             if ( NULL != obj->cb ) {
                 if ( curtm - prevtm >= obj->cbfreq ) {
@@ -929,10 +1309,10 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
                 }
             }
         }
-        if ( opt <= 0 ) {
+        if ( unacked <= 0 ) {
             /* Buffer becomes empty */
             break;
-        } else if ( curtm - t0 > duration ) {
+        } else if ( curtm - t0 > duration || conv ) {
             /* End-of-measurement */
             if ( curtm != prevtm ) {
                 if ( NULL != obj->cb ) {
@@ -941,62 +1321,88 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
                 }
             }
 
+            /* The bytes saved by ending early (not written yet; the ones
+               written but not acknowledged are to be transferred anyway) */
+            nb_estimator_finish(&est, duration - (curtm - t0),
+                                result->hlen + size - btx);
+            result->est = est.est;
+
             /* Close the socket */
+            (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 1);
+            nb_txprog_release(&txp);
+            nb_tls_close(tls);
             shutdown(sock, SHUT_RDWR);
             (void)close(sock);
+            nb_parsed_url_free(purl);
 
             /* Set the result */
             if ( NULL != obj->last_result ) {
-                free(obj->last_result->items);
-                free(obj->last_result);
+                _post_result_delete(obj->last_result);
             }
             obj->last_result = result;
 
             return 0;
         }
-        prevopt = opt;
-        usleep(UPLOAD_WAIT_USLEEP);
+        prevunacked = unacked;
+
+        /* Wait for the acknowledgements */
+        if ( 0 != nb_txprog_wait(&txp, sock, duration - (curtm - t0)) ) {
+            /* The response arrived (or an error), i.e., no need to wait */
+            break;
+        }
     }
+    nb_txprog_release(&txp);
+    result->est = est.est;
 
     /* Read the response header */
-    err = _read_response_header(sock, &hdrstr, &hdrlen, &bdystr, &bdylen);
+    err = nb_http_read_header(sock, tls, &rbuf, &result->timing.ttfb);
     if ( err < 0 ) {
         /* Error */
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _post_result_delete(result);
         return -1;
     }
     t1 = nb_microtime();
+    result->timing.header = t1;
+    hdrlen = (off_t)rbuf.hdrlen;
+    bdylen = (off_t)(rbuf.len - rbuf.hdrlen);
     rx += hdrlen + bdylen;
 
     /* Parse the response header */
-    hdr = nb_parse_http_header(hdrstr, (size_t)hdrlen);
-    if ( NULL == hdr ) {
+    if ( 0 != nb_http_header_view_parse(&hdr, rbuf.buf, rbuf.hdrlen) ) {
         /* Error */
-        free(hdrstr);
-        if ( NULL != bdystr ) {
-            free(bdystr);
-        }
+        nb_http_rbuf_release(&rbuf);
+        nb_tls_close(tls);
         close(sock);
-        free(result->items);
-        free(result);
+        nb_parsed_url_free(purl);
+        _post_result_delete(result);
         return -1;
     }
-    /* Free the response */
-    free(hdrstr);
-    if ( NULL != bdystr ) {
-        free(bdystr);
-    }
 
     /* Response header length */
     reshlen = hdrlen;
 
-    /* Get content length */
-    resclen = nb_http_header_get_content_length(hdr);
+    /* Prepare the body decoder */
+    keep = nb_http_header_view_is_keepalive(&hdr);
+    if ( 0 != nb_http_body_init(&body, &hdr, NULL, NULL) ) {
+        nb_http_rbuf_release(&rbuf);
+        nb_tls_close(tls);
+        close(sock);
+        nb_parsed_url_free(purl);
+        _post_result_delete(result);
+        return -1;
+    }
+    /* The body bytes read together with the header */
+    nr = nb_http_body_feed(&body, rbuf.buf + rbuf.hdrlen, (size_t)bdylen);
+    if ( nr < bdylen ) {
+        /* Garbage after the body, or invalid framing */
+        keep = 0;
+    }
 
-    /* Free the HTTP header */
-    nb_http_header_delete(hdr);
+    /* Free the response */
+    nb_http_rbuf_release(&rbuf);
 
     /* For result */
     result->items[result->cnt].tm = t1;
@@ -1004,24 +1410,31 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
     result->items[result->cnt].tx = tx;
     result->items[result->cnt].rx = rx;
     result->cnt++;
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, t1, 1);
 
     /* Call a callback function */
     if ( NULL != obj->cb ) {
         obj->cb(obj, result->hlen, result->clen, t0, t1, btx, tx, rx);
     }
 
-    /* Set read length */
-    tsize = bdylen;
-
     /* Download the body */
     prevtm = t1;
-    while ( (nr = recv(sock, buf, sizeof(buf), 0)) > 0 ) {
+    curtm = t1;
+    while ( nr >= 0 && !body.done
+            && (nr = (NULL != tls ? nb_tls_recv(tls, buf, sizeof(buf))
+                      : recv(sock, buf, sizeof(buf), 0))) > 0 ) {
         curtm = nb_microtime();
 
         /* Update the information */
-        tsize += nr;
         rx += nr;
 
+        /* Decode the body */
+        n = nb_http_body_feed(&body, buf, (size_t)nr);
+        if ( n < nr ) {
+            /* Garbage after the body, or invalid framing */
+            keep = 0;
+        }
+
         /* Insert a result item */
         if ( result->cnt >= result->cntres ) {
             /* Realloc */
@@ -1045,6 +1458,9 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
             result->cnt++;
         }
 
+        /* Sample the TCP information */
+        (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 0);
+
         /* Report by calling a callback function */
         if ( NULL != obj->cb ) {
             if ( curtm - prevtm >= obj->cbfreq ) {
@@ -1053,10 +1469,16 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
                 prevtm = curtm;
             }
         }
-        if ( curtm - t0 > duration ) {
+        if ( n < 0 || curtm - t0 > duration ) {
             break;
         }
     }
+    if ( 0 == nr && !body.done ) {
+        /* Closed by the peer */
+        (void)nb_http_body_eof(&body);
+        keep = 0;
+    }
+    result->payload = body.payload;
     if ( curtm != prevtm ) {
         if ( NULL != obj->cb ) {
             obj->cb(obj, result->hlen, result->clen, t0, curtm, btx, tx, rx);
@@ -1065,15 +1487,23 @@ nb_http_post_exec(nb_http_post_t *obj, const char *url, int family,
 
     /* Completed time of the download */
     t2 = prevtm;
+    result->timing.body = curtm;
 
-    /* Close the socket */
-    shutdown(sock, SHUT_RDWR);
-    (void)close(sock);
+    /* Return the connection to the pool if the response is complete */
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 1);
+    if ( !body.done ) {
+        keep = 0;
+    }
+    nb_tls_close(tls);
+    if ( NULL == pool || !keep ) {
+        shutdown(sock, SHUT_RDWR);
+    }
+    nb_http_pool_release(pool, purl->host, port, family, sock, keep);
+    nb_parsed_url_free(purl);
 
     /* Update the result */
     if ( NULL != obj->last_result ) {
-        free(obj->last_result->items);
-        free(obj->last_result);
+        _post_result_delete(obj->last_result);
     }
     obj->last_result = result;
 
@@ -5,6 +5,7 @@
  *      Hirochika Asai  <asai@scyphus.co.jp>
  */
 
+#include "config.h"
 #include "netbench_private.h"
 #include "netbench.h"
 #include <stdio.h>
@@ -13,10 +14,35 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#if TARGET_LINUX && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#endif
+
+/* Receive buffer for the response header */
+#define HTTP_RBUF_INIT_SIZE             4096
+#define HTTP_HEADER_MAX                 (1024 * 1024)
+
+/* Receive size for the body of nb_http_get() and nb_http_post() */
+#define HTTP_RECV_SIZE                  65536
+
+/* Send size for the request body read from a file descriptor */
+#define HTTP_SEND_SIZE                  65536
+
+/* Not to overflow off_t */
+#define CONTENT_LENGTH_DIGITS_MAX       18
 
 /* Prototype declarations */
 static __inline__ int _is_scheme_char(int);
+static int _next_field(const char *, size_t, size_t *,
+                       nb_http_header_field_t *);
+static int _lookup_field(const char *, size_t);
+static void _view_index(nb_http_header_view_t *);
+static off_t _parse_content_length(const char *, size_t);
+static int _has_token(const char *, size_t, const char *);
+static int _is_keepalive(const char *, size_t, const char *, size_t);
+static int _send_fd(int, int, off_t);
 
 /*
  * Check whether the character is permitted in scheme string
@@ -34,9 +60,18 @@ _is_scheme_char(int c)
 double
 nb_microtime(void)
 {
+#if HAVE_CLOCK_GETTIME
+    struct timespec ts;
+#endif
     struct timeval tv;
     double microsec;
 
+#if HAVE_CLOCK_GETTIME
+    /* Nanosecond resolution if available */
+    if ( 0 == clock_gettime(CLOCK_REALTIME, &ts) ) {
+        return (double)ts.tv_sec + (1.0 * ts.tv_nsec / 1000000000);
+    }
+#endif
     if ( 0 != gettimeofday(&tv, NULL) ) {
         return 0.0;
     }
@@ -46,6 +81,24 @@ nb_microtime(void)
     return microsec;
 }
 
+/*
+ * Get current time of the monotonic clock, which is not stepped with the
+ * wall clock (for the schedules and the intervals, not for the timestamps)
+ */
+double
+nb_monotime(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if ( 0 == clock_gettime(CLOCK_MONOTONIC, &ts) ) {
+        return (double)ts.tv_sec + (1.0 * ts.tv_nsec / 1000000000);
+    }
+#endif
+
+    return nb_microtime();
+}
+
 /*
  * Calculate checksum
  */
@@ -380,562 +433,884 @@ nb_parsed_url_free(nb_parsed_url_t *purl)
 
 
 /*
- * Trim right-side whitespaces
+ * Is control character in HTTP
  */
-static void
-_strrtrim(char *str)
+static __inline__ int
+_isctl(int c)
 {
-    size_t len;
-    ssize_t rptr;
+    if ( c <= 31 || c >= 127 ) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
 
-    len = strlen(str);
-    rptr = len - 1;
+/*
+ * Find the end of the line (LF or CR-LF) at or after the position
+ * Returns the position of the line terminator and stores its length to eol,
+ * or returns sz (with eol of zero) if the line is not terminated.
+ */
+static __inline__ size_t
+_find_eol(const char *buf, size_t sz, size_t pos, size_t *eol)
+{
+    const char *lf;
+    size_t end;
 
-    while ( rptr >= 0 ) {
-        if ( ' ' == str[rptr] ) {
-            str[rptr] = '\0';
-        } else {
-            break;
-        }
-        rptr--;
+    lf = memchr(buf + pos, '\n', sz - pos);
+    if ( NULL == lf ) {
+        *eol = 0;
+        return sz;
+    }
+    end = (size_t)(lf - buf);
+    if ( end > pos && '\r' == buf[end - 1] ) {
+        *eol = 2;
+        return end - 1;
     }
+    *eol = 1;
+
+    return end;
 }
 
 /*
- * Eat token by the next space
+ * Parse the field at the position, and advance the position to the next one
+ * Returns 1 for a field, 0 at the end of the header, or -1 on error.
  */
-static char *
-_eat_by_space(const char *buf, size_t sz, char **remain)
+static int
+_next_field(const char *buf, size_t sz, size_t *ppos,
+            nb_http_header_field_t *f)
 {
     size_t pos;
-    char *str;
-    int space;
+    size_t bpos;
+    size_t end;
+    size_t eol;
 
-    /* Search the separator */
-    pos = 0;
-    space = 0;
-    for ( ;; ) {
-        if ( ' ' == buf[pos] ) {
-            /* Found space */
-            space = 1;
-            break;
-        } else if ( '\r' == buf[pos] || '\n' == buf[pos] || '\0' == buf[pos] ) {
-            /* Found newline or other special chars */
-            break;
-        } else if ( pos + 1 == sz ) {
-            /* End-of-buffer */
-            break;
+    pos = *ppos;
+    if ( pos >= sz ) {
+        return 0;
+    }
+
+    /* Check end-of-header */
+    if ( '\n' == buf[pos] ) {
+        *ppos = pos + 1;
+        return 0;
+    } else if ( '\r' == buf[pos] && pos + 1 < sz && '\n' == buf[pos+1] ) {
+        *ppos = pos + 2;
+        return 0;
+    }
+
+    /* Key */
+    bpos = pos;
+    while ( pos < sz && ':' != buf[pos] ) {
+        if ( _isctl(buf[pos]) ) {
+            /* Invalid format */
+            errno = EINVAL;
+            return -1;
         }
         pos++;
     }
-
-    /* Allocate for the token */
-    str = malloc(sizeof(char) * pos + 1);
-    if ( NULL == str ) {
-        return NULL;
+    end = pos;
+    /* Trim right-side whitespaces */
+    while ( end > bpos && ' ' == buf[end - 1] ) {
+        end--;
+    }
+    f->key.off = bpos;
+    f->key.len = end - bpos;
+    if ( pos < sz ) {
+        pos++;
     }
-    if ( pos > 0 ) {
-        (void)memcpy(str, buf, pos);
+
+    /* Skip white space */
+    while ( pos < sz && ' ' == buf[pos] ) {
+        pos++;
     }
-    str[pos] = '\0';
 
-    /* Set remaining to a pointer */
-    if ( NULL != remain ) {
-        *remain = (char *)buf + pos + space;
+    /* Value (with the continuation lines) */
+    bpos = pos;
+    for ( ;; ) {
+        end = _find_eol(buf, sz, pos, &eol);
+        if ( NULL != memchr(buf + pos, '\0', end - pos) ) {
+            /* Should be ascii */
+            errno = EINVAL;
+            return -1;
+        }
+        pos = end + eol;
+        if ( eol > 0 && pos < sz && (' ' == buf[pos] || '\t' == buf[pos]) ) {
+            /* Continue */
+            continue;
+        }
+        break;
     }
+    f->value.off = bpos;
+    f->value.len = end - bpos;
+    *ppos = pos;
 
-    return str;
+    return 1;
 }
+
 /*
- * Eat token by the next newline
+ * Parse HTTP header into the view without any memory allocation
+ * The strings in the view are the ranges of the buffer, which must be kept
+ * by the caller while the view is used.  The start line is split into the
+ * method, the URI and the version; for a response, they are the version,
+ * the status code and the reason phrase, respectively.  A value continued
+ * over multiple lines (obsolete line folding) spans the line breaks.
+ * The fields beyond NB_HTTP_HEADER_FIELDS_MAX are counted in nskipped, but
+ * the well-known ones among them are still kept and indexed.
  */
-static char *
-_eat_by_newline(const char *buf, size_t sz, char **remain)
+int
+nb_http_header_view_parse(nb_http_header_view_t *view, const char *buf,
+                          size_t sz)
 {
+    nb_http_header_field_t field;
     size_t pos;
-    char *str;
-    int space;
+    size_t bpos;
+    size_t end;
+    size_t eol;
+    int ret;
+    int id;
+    int i;
 
-    /* Search the separator */
+    view->buf = buf;
+    view->len = 0;
+    view->nfields = 0;
+    view->nskipped = 0;
+
+    /* Start line */
+    end = _find_eol(buf, sz, 0, &eol);
+    if ( NULL != memchr(buf, '\0', end) ) {
+        /* Should be ascii */
+        errno = EINVAL;
+        return -1;
+    }
     pos = 0;
-    space = 0;
-    for ( ;; ) {
-        if ( '\n' == buf[pos] ) {
-            /* Found LF */
-            space = 1;
-            break;
-        } else if ( '\r' == buf[pos] && pos + 1 < sz && '\n' == buf[pos+1] ) {
-            /* Found CR-LF */
-            space = 2;
-            break;
-        } else if ( '\0' == buf[pos] ) {
-            /* Found special chars */
-            break;
-        } else if ( pos + 1 == sz ) {
-            /* End-of-buffer */
-            break;
-        }
+    bpos = pos;
+    while ( pos < end && ' ' != buf[pos] ) {
         pos++;
     }
-
-    /* Allocate for the token */
-    str = malloc(sizeof(char) * (pos + 1));
-    if ( NULL == str ) {
-        return NULL;
+    view->method.off = bpos;
+    view->method.len = pos - bpos;
+    if ( pos < end ) {
+        pos++;
     }
-    if ( pos > 0 ) {
-        (void)memcpy(str, buf, pos);
+    bpos = pos;
+    while ( pos < end && ' ' != buf[pos] ) {
+        pos++;
     }
-    str[pos] = '\0';
-
-    /* Set remaining to a pointer */
-    if ( NULL != remain ) {
-        *remain = (char *)buf + pos + space;
+    view->uri.off = bpos;
+    view->uri.len = pos - bpos;
+    if ( pos < end ) {
+        pos++;
+    }
+    view->version.off = pos;
+    view->version.len = end - pos;
+    pos = end + eol;
+
+    /* Fields */
+    for ( i = 0; i < NB_HTTP_HDR_MAX; i++ ) {
+        view->index[i] = -1;
+    }
+    while ( (ret = _next_field(buf, sz, &pos, &field)) > 0 ) {
+        id = _lookup_field(buf + field.key.off, field.key.len);
+        if ( view->nfields >= NB_HTTP_HEADER_FIELDS_MAX
+             && (id < 0 || view->index[id] >= 0) ) {
+            /* Too many fields; keep only the first well-known ones, in
+               the room reserved for them */
+            view->nskipped++;
+            continue;
+        }
+        if ( id >= 0 && view->index[id] < 0 ) {
+            /* The first one */
+            view->index[id] = view->nfields;
+        }
+        view->fields[view->nfields++] = field;
+    }
+    if ( ret < 0 ) {
+        return -1;
     }
+    view->len = pos;
+
+    /* Parse the values of the well-known fields */
+    _view_index(view);
 
-    return str;
+    return 0;
 }
 
 /*
- * Is control character in HTTP
+ * Compare the string with the lower-case string ignoring case (ASCII only)
  */
 static __inline__ int
-_isctl(int c)
+_strncaseeq(const char *str, const char *lower, size_t len)
 {
-    if ( c <= 31 || c >= 127 ) {
-        return 1;
-    } else {
-        return 0;
+    size_t i;
+    int c;
+
+    for ( i = 0; i < len; i++ ) {
+        c = (unsigned char)str[i];
+        if ( c >= 'A' && c <= 'Z' ) {
+            c += 'a' - 'A';
+        }
+        if ( c != lower[i] ) {
+            return 0;
+        }
     }
+
+    return 1;
 }
 
 /*
- * Delete an attribute list
+ * Compare the field name with the lower-case name ignoring case
+ * Eight bytes are folded at once; this is exact for the field names, which
+ * consist of letters and '-', as long as the input has no control character.
  */
-static void
-_attr_list_delete(nb_http_header_attr_list_t *attrs)
+static __inline__ int
+_namecaseeq(const char *str, const char *lower, size_t len)
 {
-    nb_http_header_attr_list_t *tmp;
-
-    while ( NULL != attrs ) {
-        tmp = attrs->next;
-        free(attrs->attr->key);
-        free(attrs->attr->value);
-        free(attrs->attr);
-        free(attrs);
-        attrs = tmp;
+    uint64_t a;
+    uint64_t b;
+
+    while ( len >= 8 ) {
+        (void)memcpy(&a, str, 8);
+        (void)memcpy(&b, lower, 8);
+        if ( (a | 0x2020202020202020ULL) != b ) {
+            return 0;
+        }
+        str += 8;
+        lower += 8;
+        len -= 8;
+    }
+    while ( len > 0 ) {
+        if ( (*str | 0x20) != *lower ) {
+            return 0;
+        }
+        str++;
+        lower++;
+        len--;
     }
+
+    return 1;
 }
 
 /*
- * Parse request header
+ * Get the identifier of the well-known field name (-1 if unknown)
+ * Dispatched by the length and the first character.
  */
-static nb_http_header_attr_list_t *
-_parse_attrs(const char *buf, size_t sz)
+static int
+_lookup_field(const char *key, size_t len)
 {
-    nb_http_header_attr_list_t *attrs;
-    nb_http_header_attr_list_t *nattr;
-    size_t pos;
-    size_t bpos;
-    size_t prevsz;
-    int space;
-    char *value;
-    char *tmpstr;
-    int errno_save;
-
-    attrs = NULL;
-
-    pos = 0;
-    while ( pos < sz ) {
-        /* Check end-of-header */
-        if ( '\n' == buf[pos] ) {
-            pos++;
-            break;
-        } else if ( '\r' == buf[pos] && pos + 1 < sz && '\n' == buf[pos+1] ) {
-            pos += 2;
-            break;
-        }
-
-        /* Allocate entry */
-        nattr = malloc(sizeof(nb_http_header_attr_list_t));
-        if ( NULL == nattr ) {
-            errno_save = errno;
-            if ( NULL != attrs ) {
-                _attr_list_delete(attrs->head);
-            }
-            errno = errno_save;
-            return NULL;
-        }
-        nattr->attr = malloc(sizeof(nb_http_header_attr_t));
-        if ( NULL == nattr->attr ) {
-            errno_save = errno;
-            if ( NULL != attrs ) {
-                _attr_list_delete(attrs->head);
-            }
-            free(nattr);
-            errno = errno_save;
-            return NULL;
+    const char *name;
+    int id;
+
+    switch ( len ) {
+    case 4:
+        name = "date";
+        id = NB_HTTP_HDR_DATE;
+        break;
+    case 6:
+        name = "server";
+        id = NB_HTTP_HDR_SERVER;
+        break;
+    case 8:
+        name = "location";
+        id = NB_HTTP_HDR_LOCATION;
+        break;
+    case 10:
+        if ( 'c' == key[0] || 'C' == key[0] ) {
+            name = "connection";
+            id = NB_HTTP_HDR_CONNECTION;
+        } else {
+            name = "keep-alive";
+            id = NB_HTTP_HDR_KEEP_ALIVE;
         }
-        nattr->head = NULL;
-        nattr->prev = NULL;
-        nattr->next = NULL;
+        break;
+    case 12:
+        name = "content-type";
+        id = NB_HTTP_HDR_CONTENT_TYPE;
+        break;
+    case 13:
+        name = "server-timing";
+        id = NB_HTTP_HDR_SERVER_TIMING;
+        break;
+    case 14:
+        name = "content-length";
+        id = NB_HTTP_HDR_CONTENT_LENGTH;
+        break;
+    case 16:
+        name = "content-encoding";
+        id = NB_HTTP_HDR_CONTENT_ENCODING;
+        break;
+    case 17:
+        name = "transfer-encoding";
+        id = NB_HTTP_HDR_TRANSFER_ENCODING;
+        break;
+    default:
+        return -1;
+    }
+    if ( !_namecaseeq(key, name, len) ) {
+        return -1;
+    }
 
-        /* Key */
-        bpos = pos;
-        space = 0;
-        while ( pos < sz ) {
-            if ( ':' == buf[pos] ) {
-                space = 1;
-                break;
-            } else if ( _isctl(buf[pos]) ) {
-                /* Invalid format */
-                if ( NULL != attrs ) {
-                    _attr_list_delete(attrs->head);
-                }
-                free(nattr->attr);
-                free(nattr);
-                errno = EINVAL;
-                return NULL;
-            }
-            pos++;
-        }
-        nattr->attr->key = malloc(sizeof(char) * (pos - bpos + 1));
-        if ( NULL == nattr->attr->key ) {
-            errno_save = errno;
-            if ( NULL != attrs ) {
-                _attr_list_delete(attrs->head);
-            }
-            free(nattr->attr);
-            free(nattr);
-            errno = errno_save;
-            return NULL;
-        }
-        (void)memcpy(nattr->attr->key, buf + bpos, pos - bpos);
-        nattr->attr->key[pos - bpos] = '\0';
-        /* Trim right-side whitespaces */
-        _strrtrim(nattr->attr->key);
-        pos += space;
+    return id;
+}
 
-        /* Skip white space */
-        while ( pos < sz ) {
-            if ( ' ' != buf[pos] ) {
-                break;
-            }
-            pos++;
-        }
+/*
+ * Parse the values of the indexed well-known fields
+ */
+static void
+_view_index(nb_http_header_view_t *view)
+{
+    const nb_http_header_field_t *f;
+    const char *conn;
+    size_t connlen;
+
+    /* Content-Length */
+    view->content_length = -1;
+    if ( view->index[NB_HTTP_HDR_CONTENT_LENGTH] >= 0 ) {
+        f = &view->fields[view->index[NB_HTTP_HDR_CONTENT_LENGTH]];
+        view->content_length = _parse_content_length(view->buf + f->value.off,
+                                                     f->value.len);
+    }
+
+    /* Transfer-Encoding */
+    view->chunked = 0;
+    if ( view->index[NB_HTTP_HDR_TRANSFER_ENCODING] >= 0 ) {
+        f = &view->fields[view->index[NB_HTTP_HDR_TRANSFER_ENCODING]];
+        view->chunked = _has_token(view->buf + f->value.off, f->value.len,
+                                   "chunked");
+    }
+
+    /* Connection (the status line is stored as method/uri/version) */
+    conn = NULL;
+    connlen = 0;
+    if ( view->index[NB_HTTP_HDR_CONNECTION] >= 0 ) {
+        f = &view->fields[view->index[NB_HTTP_HDR_CONNECTION]];
+        conn = view->buf + f->value.off;
+        connlen = f->value.len;
+    }
+    view->keepalive = _is_keepalive(view->buf + view->method.off,
+                                    view->method.len, conn, connlen);
+}
 
-        /* Value */
-        value = NULL;
-        prevsz = 0;
-        while ( pos < sz ) {
-            /* Parse value */
-            bpos = pos;
-            space = 0;
-            while ( pos < sz ) {
-                if ( '\n' == buf[pos] ) {
-                    space = 1;
-                    break;
-                } else if ( '\r' == buf[pos] && pos + 1 < sz
-                            && '\n' == buf[pos+1] ) {
-                    space = 2;
-                    break;
-                } else if ( '\0' == buf[pos] ) {
-                    /* Should be ascii */
-                    if ( NULL != value ) {
-                        free(value);
-                    }
-                    if ( NULL != attrs ) {
-                        _attr_list_delete(attrs->head);
-                    }
-                    free(nattr->attr->key);
-                    free(nattr->attr);
-                    free(nattr);
-                    errno = EINVAL;
-                    return NULL;
-                }
-                pos++;
-            }
-            /* Resize the allocated memory for this value  */
-            tmpstr = realloc(value, sizeof(char) * (prevsz + pos - bpos + 1));
-            if ( NULL == tmpstr ) {
-                errno_save = errno;
-                if ( NULL != value ) {
-                    free(value);
-                }
-                if ( NULL != attrs ) {
-                    _attr_list_delete(attrs->head);
-                }
-                free(nattr->attr->key);
-                free(nattr->attr);
-                free(nattr);
-                errno = errno_save;
-                return NULL;
-            }
-            value = tmpstr;
-            (void)memcpy(value + prevsz, buf + bpos, pos - bpos);
-            value[prevsz + pos - bpos] = '\0';
-            prevsz += pos - bpos;
-            pos += space;
-
-            /* Continue? */
-            if ( ' ' == buf[pos] ) {
-                pos++;
-            } else if ( '\t' == buf[pos] ) {
-                /* Nothing */
-            } else {
-                break;
-            }
-        }
-        nattr->attr->value = value;
+/*
+ * Find the field in the view (case-insensitive)
+ */
+const nb_http_header_field_t *
+nb_http_header_view_find(const nb_http_header_view_t *view, const char *key)
+{
+    const nb_http_header_field_t *f;
+    size_t len;
+    int id;
+    int i;
 
-        /* Append */
-        if ( NULL != attrs ) {
-            /* Inherit the pointer to head */
-            nattr->head = attrs->head;
-            /* Set this as next */
-            attrs->next = nattr;
-        } else {
-            /* Set this as head */
-            nattr->head = nattr;
+    len = strlen(key);
+    id = _lookup_field(key, len);
+    if ( id >= 0 ) {
+        /* Well-known field */
+        return view->index[id] >= 0 ? &view->fields[view->index[id]] : NULL;
+    }
+    for ( i = 0; i < view->nfields; i++ ) {
+        f = &view->fields[i];
+        if ( f->key.len == len
+             && 0 == strncasecmp(view->buf + f->key.off, key, len) ) {
+            return f;
         }
-        /* Set the previous pointer */
-        nattr->prev = attrs;
-        /* Update the tail */
-        attrs = nattr;
     }
 
-    if ( NULL != attrs ) {
-        return attrs->head;
-    } else {
-        return NULL;
-    }
+    return NULL;
 }
 
 /*
- * Parse HTTP header
+ * Get the value of the well-known field (NB_HTTP_HDR_*) in the view
+ * The value is not null-terminated; its length is stored to len.
  */
-nb_http_header_t *
-nb_parse_http_header(const char *buf, size_t sz)
+const char *
+nb_http_header_view_get(const nb_http_header_view_t *view, int id,
+                        size_t *len)
 {
-    nb_http_header_t *hdr;
-    char *cptr;
-    size_t rsz;
-    char *remain;
-    int errno_saved;
+    const nb_http_header_field_t *f;
 
-    /* Allocate the structure */
-    hdr = malloc(sizeof(nb_http_header_t));
-    if ( NULL == hdr ) {
+    if ( id < 0 || id >= NB_HTTP_HDR_MAX || view->index[id] < 0 ) {
         return NULL;
     }
-    bzero(hdr, sizeof(nb_http_header_t));
-
-    cptr = (char *)buf;
-    rsz = sz;
-
-    /* Method */
-    hdr->method = _eat_by_space(cptr, rsz, &remain);
-    rsz = rsz - (size_t)(remain - cptr);
-    cptr = remain;
-    if ( NULL == hdr->method ) {
-        errno_saved = errno;
-        free(hdr);
-        errno = errno_saved;
-        return NULL;
+    f = &view->fields[view->index[id]];
+    if ( NULL != len ) {
+        *len = f->value.len;
     }
 
-    /* URI */
-    hdr->uri = _eat_by_space(cptr, rsz, &remain);
-    rsz = rsz - (size_t)(remain - cptr);
-    cptr = remain;
-    if ( NULL == hdr->uri ) {
-        errno_saved = errno;
-        free(hdr->method);
-        free(hdr);
-        errno = errno_saved;
-        return NULL;
-    }
+    return view->buf + f->value.off;
+}
 
-    /* Version */
-    hdr->version = _eat_by_newline(cptr, rsz, &remain);
-    rsz = rsz - (size_t)(remain - cptr);
-    cptr = remain;
-    if ( NULL == hdr->version ) {
-        errno_saved = errno;
-        free(hdr->uri);
-        free(hdr->method);
-        free(hdr);
-        errno = errno_saved;
-        return NULL;
-    }
+/*
+ * Parse the decimal string as a content length
+ */
+static off_t
+_parse_content_length(const char *str, size_t len)
+{
+    off_t clen;
+    size_t i;
 
-    /* Attributes */
-    errno = 0;
-    hdr->attrs = _parse_attrs(cptr, rsz);;
-    if ( NULL == hdr->attrs && errno ) {
-        errno_saved = errno;
-        free(hdr->version);
-        free(hdr->uri);
-        free(hdr->method);
-        free(hdr);
-        errno = errno_saved;
-        return NULL;
+    if ( 0 == len || len > CONTENT_LENGTH_DIGITS_MAX ) {
+        /* Empty or too large */
+        return -1;
+    }
+    clen = 0;
+    for ( i = 0; i < len; i++ ) {
+        if ( str[i] < '0' || str[i] > '9' ) {
+            /* Invalid */
+            return -1;
+        }
+        clen = clen * 10 + (str[i] - '0');
     }
 
-    return hdr;
+    return clen;
 }
 
 /*
- * Delete HTTP header
+ * Get the status code of the response from the view (-1 if invalid)
  */
-void
-nb_http_header_delete(nb_http_header_t *hdr)
+int
+nb_http_header_view_get_status(const nb_http_header_view_t *view)
 {
-    if ( NULL != hdr->method ) {
-        free(hdr->method);
-    }
-    if ( NULL != hdr->uri ) {
-        free(hdr->uri);
-    }
-    if ( NULL != hdr->version ) {
-        free(hdr->version);
+    const char *str;
+    int code;
+    size_t i;
+
+    /* The status line is stored as method/uri/version */
+    if ( 3 != view->uri.len ) {
+        return -1;
     }
-    if ( NULL != hdr->attrs ) {
-        _attr_list_delete(hdr->attrs);
+    str = view->buf + view->uri.off;
+    code = 0;
+    for ( i = 0; i < 3; i++ ) {
+        if ( str[i] < '0' || str[i] > '9' ) {
+            return -1;
+        }
+        code = code * 10 + (str[i] - '0');
     }
-    free(hdr);
+
+    return code;
 }
 
 /*
- * Get "Content-Length" attribute
+ * Get "Content-Length" from the view
  */
 off_t
-nb_http_header_get_content_length(nb_http_header_t *hdr)
+nb_http_header_view_get_content_length(const nb_http_header_view_t *view)
 {
-    off_t clen;
-    char *remain;
-    nb_http_header_attr_list_t *attrs;
-
-    errno = 0;
-    attrs = hdr->attrs;
-    clen = -1;
-    while ( NULL != attrs ) {
-        if ( 0 == strcasecmp(attrs->attr->key, "Content-Length") ) {
-            clen = strtoll(attrs->attr->value, &remain, 10);
-            if ( 0 != strcmp("", remain) || clen < 0 ) {
-                /* Invalid */
-                clen = -1;
-            }
-            break;
-        }
-        attrs = attrs->next;
-    }
+    return view->content_length;
+}
 
-    return clen;
+/*
+ * Is the body in the chunked transfer coding?
+ */
+int
+nb_http_header_view_is_chunked(const nb_http_header_view_t *view)
+{
+    return view->chunked;
 }
 
 /*
- * Read the response header
- * Note that a part of response body is possibly read due to the buffer size
+ * Does the comma-separated list contain the (lower-case) token?
  */
 static int
-_read_response_header(int sock, char **hdrstr, off_t *hdrlen, char **bdystr,
-                      off_t *bdylen)
+_has_token(const char *list, size_t sz, const char *token)
 {
-    /* Buffer */
-    char buf[4096];
-    /* Counters */
-    ssize_t i;
-    ssize_t nr;
-    ssize_t n;
-    int nl;
-    /* A flag of end-of-header */
-    int eoh;
-    /* Temporary string */
-    char *tmpstr;
-
-    /* Read until the end of the response header */
-    eoh = 0;
-    nl = 0;
-    nr = 0;
-    *hdrlen = 0;
-    *hdrstr = NULL;
-    while ( !eoh ) {
-        /* Receive */
-        n = read(sock, buf, sizeof(buf));
-        if ( n <= 0 ) {
-            /* Cannot read any more response */
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ETIMEDOUT;
-        }
-        /* Search the end-of-header */
-        for ( i = 0; i < n; i++ ) {
-            if ( '\n' == buf[i] ) {
-                nl++;
-            } else if ( '\r' == buf[i] && i + 1 < n && '\n' == buf[i+1] ) {
-                i++;
-                nl++;
-            } else {
-                nl = 0;
-            }
-            if ( 2 == nl ) {
-                /* End-of-header */
-                eoh = 1;
-                i++;
-                break;
-            }
-        }
-        *hdrlen += i;
+    size_t len;
+    size_t pos;
 
-        /* Extend the response header buffer */
-        tmpstr = realloc(*hdrstr, sizeof(char) * (size_t)(*hdrlen + 1));
-        if ( NULL == tmpstr ) {
-            /* Memory error */
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ENOMEM;
+    len = strlen(token);
+    pos = 0;
+    while ( pos < sz ) {
+        /* Skip separators */
+        while ( pos < sz
+                && (' ' == list[pos] || '\t' == list[pos] || ',' == list[pos]) ) {
+            pos++;
         }
-        *hdrstr = tmpstr;
-        (void)memcpy((*hdrstr) + nr, buf, i);
-        /* Convert asciz to reduce buffer overflow risk */
-        (*hdrstr)[*hdrlen] = '\0';
-
-        nr += n;
-    }
-
-    /* Read body */
-    if ( nr > *hdrlen ) {
-        /* Compute the loaded body length */
-        *bdylen = nr - *hdrlen;
-        /* +1 for null termination for safety */
-        *bdystr = malloc(sizeof(char) * (size_t)(*bdylen + 1));
-        if ( NULL ==  *bdystr ) {
-            if ( NULL != *hdrstr ) {
-                free(*hdrstr);
-            }
-            return -ENOMEM;
+        if ( pos + len <= sz && _strncaseeq(list + pos, token, len)
+             && (pos + len == sz || ',' == list[pos + len]
+                 || ' ' == list[pos + len] || '\t' == list[pos + len]) ) {
+            return 1;
+        }
+        /* Next token */
+        while ( pos < sz && ',' != list[pos] ) {
+            pos++;
         }
-        (void)memcpy(*bdystr, buf + i, (size_t)*bdylen);
-        (*bdystr)[*bdylen] = '\0';
-    } else {
-        *bdystr = NULL;
-        *bdylen = 0;
     }
 
     return 0;
 }
 
 /*
- * Build Request-URI corresponding the input parsed URL
+ * Can the connection be kept alive after the response?
  */
-static char *
-_build_request_uri(nb_parsed_url_t *purl)
+static int
+_is_keepalive(const char *version, size_t vlen, const char *conn, size_t clen)
 {
-    size_t len1;
-    size_t len2;
+    if ( NULL != conn && _has_token(conn, clen, "close") ) {
+        return 0;
+    }
+    if ( 8 == vlen && _strncaseeq(version, "http/1.0", 8) ) {
+        /* HTTP/1.0 closes unless keep-alive is requested */
+        return NULL != conn && _has_token(conn, clen, "keep-alive");
+    }
+
+    return 1;
+}
+
+/*
+ * Can the connection be kept alive after the response in the view?
+ */
+int
+nb_http_header_view_is_keepalive(const nb_http_header_view_t *view)
+{
+    return view->keepalive;
+}
+
+/*
+ * Copy a value unfolding the continuation lines
+ * A line break is removed together with a following space (a tab is kept).
+ */
+static size_t
+_copy_unfolded(char *dst, const char *src, size_t len)
+{
+    const char *lf;
+    size_t pos;
+    size_t end;
+    size_t n;
+
+    n = 0;
+    pos = 0;
+    while ( pos < len ) {
+        lf = memchr(src + pos, '\n', len - pos);
+        if ( NULL == lf ) {
+            (void)memcpy(dst + n, src + pos, len - pos);
+            n += len - pos;
+            break;
+        }
+        end = (size_t)(lf - src);
+        if ( end > pos && '\r' == src[end - 1] ) {
+            end--;
+        }
+        (void)memcpy(dst + n, src + pos, end - pos);
+        n += end - pos;
+        pos = (size_t)(lf - src) + 1;
+        if ( pos < len && ' ' == src[pos] ) {
+            pos++;
+        }
+    }
+    dst[n] = '\0';
+
+    return n;
+}
+
+/*
+ * Copy a string view to the string
+ */
+static char *
+_copy_str(char *dst, const char *buf, const nb_http_str_t *str)
+{
+    (void)memcpy(dst, buf + str->off, str->len);
+    dst[str->len] = '\0';
+
+    return dst + str->len + 1;
+}
+
+/*
+ * Parse HTTP header
+ * This is a compatibility layer on the view: the structure, the attribute
+ * list and all the strings are allocated in a single memory block.  The
+ * fields beyond the view are parsed again, so that all of them are kept.
+ */
+nb_http_header_t *
+nb_parse_http_header(const char *buf, size_t sz)
+{
+    nb_http_header_view_t view;
+    nb_http_header_t *hdr;
+    nb_http_header_attr_list_t *list;
+    nb_http_header_attr_t *attr;
+    nb_http_header_field_t *fields;
+    char *str;
+    size_t len;
+    size_t pos;
+    size_t eol;
+    int n;
+    int id;
+    int i;
+
+    if ( 0 != nb_http_header_view_parse(&view, buf, sz) ) {
+        return NULL;
+    }
+    n = view.nfields + view.nskipped;
+    fields = view.fields;
+    if ( view.nskipped > 0 ) {
+        /* All the fields in order */
+        fields = malloc(sizeof(nb_http_header_field_t) * n);
+        if ( NULL == fields ) {
+            return NULL;
+        }
+        pos = _find_eol(buf, sz, 0, &eol) + eol;
+        for ( i = 0; i < n; i++ ) {
+            (void)_next_field(buf, sz, &pos, &fields[i]);
+        }
+    }
+
+    /* Calculate the size of the block */
+    len = sizeof(nb_http_header_t)
+        + (sizeof(nb_http_header_attr_list_t) + sizeof(nb_http_header_attr_t))
+        * n + view.method.len + view.uri.len + view.version.len + 3;
+    for ( i = 0; i < n; i++ ) {
+        len += fields[i].key.len + fields[i].value.len + 2;
+    }
+    hdr = malloc(len);
+    if ( NULL == hdr ) {
+        if ( fields != view.fields ) {
+            free(fields);
+        }
+        return NULL;
+    }
+    list = (nb_http_header_attr_list_t *)(hdr + 1);
+    attr = (nb_http_header_attr_t *)(list + n);
+    str = (char *)(attr + n);
+
+    /* Start line */
+    hdr->method = str;
+    str = _copy_str(str, buf, &view.method);
+    hdr->uri = str;
+    str = _copy_str(str, buf, &view.uri);
+    hdr->version = str;
+    str = _copy_str(str, buf, &view.version);
+
+    /* Attributes */
+    hdr->attrs = n > 0 ? list : NULL;
+    for ( i = 0; i < n; i++ ) {
+        attr[i].key = str;
+        str = _copy_str(str, buf, &fields[i].key);
+        attr[i].value = str;
+        str += _copy_unfolded(str, buf + fields[i].value.off,
+                              fields[i].value.len) + 1;
+        list[i].attr = &attr[i];
+        list[i].head = list;
+        list[i].prev = i > 0 ? &list[i - 1] : NULL;
+        list[i].next = i + 1 < n ? &list[i + 1] : NULL;
+    }
+
+    /* Index and the pre-parsed values */
+    if ( fields == view.fields ) {
+        for ( i = 0; i < NB_HTTP_HDR_MAX; i++ ) {
+            hdr->index[i] = view.index[i] >= 0 ? &attr[view.index[i]] : NULL;
+        }
+    } else {
+        for ( i = 0; i < NB_HTTP_HDR_MAX; i++ ) {
+            hdr->index[i] = NULL;
+        }
+        for ( i = 0; i < n; i++ ) {
+            id = _lookup_field(buf + fields[i].key.off, fields[i].key.len);
+            if ( id >= 0 && NULL == hdr->index[id] ) {
+                hdr->index[id] = &attr[i];
+            }
+        }
+        free(fields);
+    }
+    hdr->content_length = view.content_length;
+    hdr->chunked = view.chunked;
+    hdr->keepalive = view.keepalive;
+
+    return hdr;
+}
+
+/*
+ * Delete HTTP header
+ */
+void
+nb_http_header_delete(nb_http_header_t *hdr)
+{
+    /* Allocated in a single block */
+    free(hdr);
+}
+
+/*
+ * Get "Content-Length" attribute
+ */
+off_t
+nb_http_header_get_content_length(nb_http_header_t *hdr)
+{
+    return hdr->content_length;
+}
+
+/*
+ * Is the body in the chunked transfer coding?
+ */
+int
+nb_http_header_is_chunked(nb_http_header_t *hdr)
+{
+    return hdr->chunked;
+}
+
+/*
+ * Get the value of an attribute
+ */
+const char *
+nb_http_header_get_attr(nb_http_header_t *hdr, const char *key)
+{
+    nb_http_header_attr_list_t *attrs;
+    int id;
+
+    id = _lookup_field(key, strlen(key));
+    if ( id >= 0 ) {
+        /* Well-known field */
+        return NULL != hdr->index[id] ? hdr->index[id]->value : NULL;
+    }
+    attrs = hdr->attrs;
+    while ( NULL != attrs ) {
+        if ( 0 == strcasecmp(attrs->attr->key, key) ) {
+            return attrs->attr->value;
+        }
+        attrs = attrs->next;
+    }
+
+    return NULL;
+}
+
+/*
+ * Can the connection be kept alive after the response?
+ */
+int
+nb_http_header_is_keepalive(nb_http_header_t *hdr)
+{
+    return hdr->keepalive;
+}
+
+/*
+ * Search the end of the header (an empty line) from the position
+ * Returns the length of the header including the empty line, or -1 if not
+ * found; the position is advanced to where the next search starts.
+ */
+static ssize_t
+_find_eoh(const char *buf, size_t len, size_t *pos)
+{
+    const char *lf;
+    size_t i;
+
+    while ( *pos < len ) {
+        lf = memchr(buf + *pos, '\n', len - *pos);
+        if ( NULL == lf ) {
+            *pos = len;
+            return -1;
+        }
+        i = (size_t)(lf - buf);
+        if ( i + 1 >= len ) {
+            /* Need the next byte */
+            *pos = i;
+            return -1;
+        }
+        if ( '\n' == buf[i + 1] ) {
+            return i + 2;
+        } else if ( '\r' == buf[i + 1] ) {
+            if ( i + 2 >= len ) {
+                /* Need the next byte */
+                *pos = i;
+                return -1;
+            }
+            if ( '\n' == buf[i + 2] ) {
+                return i + 3;
+            }
+        }
+        *pos = i + 1;
+    }
+
+    return -1;
+}
+
+/*
+ * Read the response header into the receive buffer
+ * The buffer grows until it holds the whole header; the body bytes received
+ * together follow the header in the buffer.  The time when the first byte is
+ * received is stored to tfirst if not NULL.  The data is read through the
+ * TLS connection if tls is not NULL.  The buffer must be released by
+ * nb_http_rbuf_release() on success.
+ */
+int
+nb_http_read_header(int sock, nb_tls_t *tls, nb_http_rbuf_t *rbuf,
+                    double *tfirst)
+{
+    ssize_t n;
+    ssize_t eoh;
+    size_t pos;
+    size_t size;
+    char *buf;
+
+    rbuf->buf = NULL;
+    rbuf->size = 0;
+    rbuf->len = 0;
+    rbuf->hdrlen = 0;
+
+    pos = 0;
+    eoh = -1;
+    while ( eoh < 0 ) {
+        if ( rbuf->len + 1 >= rbuf->size ) {
+            /* Extend the buffer (+1 for null termination for safety) */
+            size = rbuf->size > 0 ? rbuf->size * 2 : HTTP_RBUF_INIT_SIZE;
+            if ( size > HTTP_HEADER_MAX ) {
+                /* Too long header */
+                nb_http_rbuf_release(rbuf);
+                return -EMSGSIZE;
+            }
+            buf = realloc(rbuf->buf, size);
+            if ( NULL == buf ) {
+                nb_http_rbuf_release(rbuf);
+                return -ENOMEM;
+            }
+            rbuf->buf = buf;
+            rbuf->size = size;
+        }
+
+        /* Receive */
+        if ( NULL != tls ) {
+            n = nb_tls_recv(tls, rbuf->buf + rbuf->len,
+                            rbuf->size - rbuf->len - 1);
+        } else {
+            n = recv(sock, rbuf->buf + rbuf->len, rbuf->size - rbuf->len - 1,
+                     0);
+        }
+        if ( n <= 0 ) {
+            /* Cannot read any more response */
+            nb_http_rbuf_release(rbuf);
+            return -ETIMEDOUT;
+        }
+        if ( 0 == rbuf->len && NULL != tfirst ) {
+            *tfirst = nb_microtime();
+        }
+        rbuf->len += n;
+
+        /* Search the end-of-header only in the new bytes */
+        eoh = _find_eoh(rbuf->buf, rbuf->len, &pos);
+    }
+    rbuf->hdrlen = (size_t)eoh;
+    rbuf->buf[rbuf->len] = '\0';
+
+    return 0;
+}
+
+/*
+ * Release the receive buffer
+ */
+void
+nb_http_rbuf_release(nb_http_rbuf_t *rbuf)
+{
+    free(rbuf->buf);
+    rbuf->buf = NULL;
+    rbuf->size = 0;
+    rbuf->len = 0;
+    rbuf->hdrlen = 0;
+}
+
+/*
+ * Build Request-URI corresponding the input parsed URL
+ */
+static char *
+_build_request_uri(nb_parsed_url_t *purl)
+{
+    size_t len1;
+    size_t len2;
     char *str1;
     char *str2;
     char *rurl;
@@ -989,202 +1364,99 @@ _build_request_uri(nb_parsed_url_t *purl)
 }
 
 /*
- * Get data via HTTP
+ * Send the request body read from the file descriptor
+ * The file is sent by sendfile(2) from the current offset if the kernel
+ * supports it for the descriptor; otherwise it is read and sent by chunks.
  */
-int
-nb_http_get(const char *url, char **resstr, off_t *reslen)
+static int
+_send_fd(int sock, int fd, off_t sz)
 {
-    nb_parsed_url_t *purl;
-    int sock;
-    struct addrinfo hints, *res, *ressave;
-    char *port;
-    char *path;
-    int err;
-    char servhost[NI_MAXHOST];
-    char servservice[NI_MAXSERV];
-
-    nb_http_header_t *reqhdr;
-    char *reqhdrstr;
-    off_t reqhdrlen;
-    char *reqbdystr;
-    off_t reqbdylen;
-
-    char req[4096];
-    char buf[4096];
-    ssize_t nw;
+    char buf[HTTP_SEND_SIZE];
     ssize_t nr;
-    size_t tsize;
-    off_t clen;
-    struct timeval timeout;
-    double gtimeout = 60.0;
-
-
-    /* Parse the URL */
-    purl = nb_parse_url(url);
-    if ( NULL == purl ) {
-        return -1;
-    }
-    /* Only the scheme "http" is supported. */
-    if ( strcasecmp("http", purl->scheme) ) {
-        nb_parsed_url_free(purl);
-        return -1;
-    }
-
-    port = purl->port;
-    if ( NULL == port ) {
-        /* Set default port */
-        port = "80";
-    }
-
-    /* Open a socket */
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    err = getaddrinfo(purl->host, port, &hints, &res);
-    if ( 0 != err ) {
-        /* Error */
-        nb_parsed_url_free(purl);
-        return -1;
+    ssize_t nw;
+    size_t n;
+    off_t sent;
+
+    sent = 0;
+#if TARGET_LINUX && defined(HAVE_SENDFILE)
+    while ( sent < sz ) {
+        n = sz - sent > HTTP_SEND_SIZE * 16
+            ? HTTP_SEND_SIZE * 16 : (size_t)(sz - sent);
+        nw = sendfile(sock, fd, NULL, n);
+        if ( nw < 0 ) {
+            if ( 0 == sent && (EINVAL == errno || ENOSYS == errno) ) {
+                /* Not supported for this descriptor */
+                break;
+            }
+            return -1;
+        } else if ( 0 == nw ) {
+            /* Shorter than the content length */
+            errno = EIO;
+            return -1;
+        }
+        sent += nw;
     }
+#endif
 
-    /* Get first connection */
-    ressave = res;
-    sock = -1;
-    do {
-        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if ( sock < 0 ) {
-            /* ignore a connection error. */
-            continue;
+    while ( sent < sz ) {
+        n = sz - sent > HTTP_SEND_SIZE ? HTTP_SEND_SIZE : (size_t)(sz - sent);
+        nr = read(fd, buf, n);
+        if ( nr <= 0 ) {
+            if ( 0 == nr ) {
+                errno = EIO;
+            }
+            return -1;
         }
-        err = connect(sock, res->ai_addr, res->ai_addrlen);
-        if ( 0 != err ) {
-            /* Error */
-            (void)close(sock);
-            sock = -1;
-        } else {
-            /* Succeed */
-            break;
+        n = 0;
+        while ( n < (size_t)nr ) {
+            nw = send(sock, buf + n, nr - n, 0);
+            if ( nw <= 0 ) {
+                return -1;
+            }
+            n += nw;
         }
-    } while ( NULL != (res = res->ai_next) );
-
-    if ( sock < 0 ) {
-        /* No socket found */
-        freeaddrinfo(ressave);
-        nb_parsed_url_free(purl);
-        return -1;
+        sent += nr;
     }
 
-    /* Resolve the host and service */
-    err = getnameinfo(res->ai_addr, res->ai_addrlen, servhost, sizeof(servhost),
-                      servservice, sizeof(servservice),
-                      NI_NUMERICHOST | NI_NUMERICSERV);
-    if ( 0 != err ) {
-        /* Error */
-    }
-
-    /* Free */
-    freeaddrinfo(ressave);
-
-    /* Set timeout */
-    timeout.tv_sec = (time_t)gtimeout;
-    timeout.tv_usec = (suseconds_t)((gtimeout - (time_t)gtimeout) * 1000000);
-    if ( 0 != setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                         sizeof(struct timeval)) ) {
-        /* Error */
-        (void)close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
-    }
+    return 0;
+}
 
-    /* Build and send a request */
-    path = _build_request_uri(purl);
-    if ( NULL ==  path ) {
-        /* Error */
-        (void)close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
-    }
-    snprintf(req, sizeof(req), "GET %.1024s HTTP/1.1\r\n"
-             "Host: %.1024s\r\n"
-             "User-Agent: %s\r\n"
-             "Connection: close\r\n\r\n", path, purl->host, USER_AGENT);
-    free(path);
+/*
+ * Send a request and read the response header
+ * The request body is taken from data, or from fd if data is NULL.
+ */
+static int
+_http_exchange(int sock, const char *req, const char *data, int fd, off_t sz,
+               nb_http_rbuf_t *rbuf)
+{
+    ssize_t nw;
+    off_t sent;
 
     /* Send the header */
     nw = send(sock, req, strlen(req), 0);
     if ( nw != strlen(req) ) {
-        close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
-    }
-
-    /* Read response header */
-    err = _read_response_header(sock, &reqhdrstr, &reqhdrlen, &reqbdystr,
-                                &reqbdylen);
-    if ( err < 0 ) {
-        /* Error */
-        close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
-    }
-
-    /* Parse the response header */
-    reqhdr = nb_parse_http_header(reqhdrstr, (size_t)reqhdrlen);
-    if ( NULL == reqhdr ) {
-        /* Error */
-        free(reqhdrstr);
-        if ( NULL != reqbdystr ) {
-            free(reqbdystr);
-        }
-        close(sock);
-        nb_parsed_url_free(purl);
         return -1;
     }
 
-    /* Get content length */
-    clen = nb_http_header_get_content_length(reqhdr);
-
-    /* Allocate */
-    *reslen = clen;
-    if ( clen > 0 ) {
-        *resstr = malloc(sizeof(char) * (*reslen));
-        if ( NULL == *resstr ) {
-            nb_http_header_delete(reqhdr);
-            free(reqhdrstr);
-            if ( NULL != reqbdystr ) {
-                free(reqbdystr);
-            }
-            close(sock);
-            nb_parsed_url_free(purl);
+    /* Upload the body */
+    if ( NULL == data && fd >= 0 ) {
+        if ( 0 != _send_fd(sock, fd, sz) ) {
             return -1;
         }
     } else {
-        *resstr = NULL;
-    }
-    if ( reqbdylen > 0 && reqbdylen <= clen ) {
-        (void)memcpy(*resstr, reqbdystr, reqbdylen);
-        tsize = (size_t)reqbdylen;
-    }
-
-    /* Download the body */
-    while ( (nr = recv(sock, buf, sizeof(buf), 0)) > 0 ) {
-        (void)memcpy(*resstr + tsize, buf, nr);
-        tsize += nr;
+        sent = 0;
+        while ( sent < sz ) {
+            nw = send(sock, data + sent, sz - sent, 0);
+            if ( nw <= 0 ) {
+                /* Error */
+                return -1;
+            }
+            sent += nw;
+        }
     }
 
-    nb_http_header_delete(reqhdr);
-    free(reqhdrstr);
-    if ( NULL != reqbdystr ) {
-        free(reqbdystr);
-    }
-    shutdown(sock, SHUT_RDWR);
-    close(sock);
-    nb_parsed_url_free(purl);
-
-    if ( tsize < clen ) {
-        if ( NULL != resstr ) {
-            free(resstr);
-        }
+    /* Read response header */
+    if ( nb_http_read_header(sock, NULL, rbuf, NULL) < 0 ) {
         return -1;
     }
 
@@ -1192,32 +1464,38 @@ nb_http_get(const char *url, char **resstr, off_t *reslen)
 }
 
 /*
- * Post data via HTTP
+ * Issue an HTTP request and stream the response body to the sink
+ * The request is a POST if data is not NULL or fd is not negative; the body
+ * of sz bytes is taken from data, or from the current offset of fd.  The
+ * connection is taken from and returned to the pool if it is not NULL.  With
+ * nb_http_buf_sink, the body is received directly into the buffer.
  */
-int
-nb_http_post(const char *url, const char *content_type, const char *data,
-             size_t sz, char **resstr, off_t *reslen)
+static int
+_http_request(nb_http_pool_t *pool, const char *url, const char *content_type,
+              const char *data, int fd, off_t sz, nb_http_sink_f sink,
+              void *user)
 {
     nb_parsed_url_t *purl;
     int sock;
-    struct addrinfo hints, *res, *ressave;
     char *port;
     char *path;
     int err;
-    char servhost[NI_MAXHOST];
-    char servservice[NI_MAXSERV];
-
-    nb_http_header_t *reqhdr;
-    char *reqhdrstr;
-    off_t reqhdrlen;
-    char *reqbdystr;
-    off_t reqbdylen;
+    int reused;
+    int retry;
+    int keep;
+    int post;
+
+    nb_http_header_view_t reqhdr;
+    nb_http_rbuf_t rbuf;
+    nb_http_body_t body;
+    nb_http_buf_t *res;
+    char *buf;
+    off_t bdylen;
+    off_t pos;
 
     char req[4096];
-    char buf[4096];
-    ssize_t nw;
     ssize_t nr;
-    size_t tsize;
+    ssize_t n;
     off_t clen;
     struct timeval timeout;
     double gtimeout = 60.0;
@@ -1239,176 +1517,302 @@ nb_http_post(const char *url, const char *content_type, const char *data,
         port = "80";
     }
 
-    /* Open a socket */
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    err = getaddrinfo(purl->host, port, &hints, &res);
-    if ( 0 != err ) {
+    /* Remember the offset of the file to rewind at the retry */
+    post = (NULL != data || fd >= 0);
+    pos = -1;
+    if ( NULL == data && fd >= 0 ) {
+        pos = lseek(fd, 0, SEEK_CUR);
+    }
+
+    /* Build a request */
+    path = _build_request_uri(purl);
+    if ( NULL ==  path ) {
         /* Error */
         nb_parsed_url_free(purl);
         return -1;
     }
+    if ( post ) {
+        snprintf(req, sizeof(req), "POST %.1024s HTTP/1.1\r\n"
+                 "Host: %.1024s\r\n"
+                 "User-Agent: %s\r\n"
+                 "Content-Type: %.1024s\r\n"
+                 "Content-Length: %lld\r\n"
+                 "Connection: %s\r\n\r\n", path, purl->host, USER_AGENT,
+                 content_type, (long long)sz,
+                 NULL != pool ? "keep-alive" : "close");
+    } else {
+        snprintf(req, sizeof(req), "GET %.1024s HTTP/1.1\r\n"
+                 "Host: %.1024s\r\n"
+                 "User-Agent: %s\r\n"
+                 "Connection: %s\r\n\r\n", path, purl->host, USER_AGENT,
+                 NULL != pool ? "keep-alive" : "close");
+    }
+    free(path);
 
-    /* Get first connection */
-    ressave = res;
-    sock = -1;
-    do {
-        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    /* Retry once with a new connection if a reused one has gone stale */
+    for ( retry = 0; ; retry++ ) {
+        /* Open a socket */
+        sock = nb_http_pool_acquire(pool, purl->host, port, AF_UNSPEC, 0.0,
+                                    NULL, &reused, NULL);
         if ( sock < 0 ) {
-            /* ignore a connection error. */
-            continue;
+            nb_parsed_url_free(purl);
+            return -1;
         }
-        err = connect(sock, res->ai_addr, res->ai_addrlen);
-        if ( 0 != err ) {
+
+        /* Set timeout */
+        timeout.tv_sec = (time_t)gtimeout;
+        timeout.tv_usec = (suseconds_t)((gtimeout - (time_t)gtimeout)
+                                        * 1000000);
+        if ( 0 != setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                             sizeof(struct timeval)) ) {
             /* Error */
             (void)close(sock);
-            sock = -1;
-        } else {
-            /* Succeed */
-            break;
+            nb_parsed_url_free(purl);
+            return -1;
         }
-    } while ( NULL != (res = res->ai_next) );
-
-    if ( sock < 0 ) {
-        /* No socket found */
-        freeaddrinfo(ressave);
-        nb_parsed_url_free(purl);
-        return -1;
-    }
 
-    /* Resolve the host and service */
-    err = getnameinfo(res->ai_addr, res->ai_addrlen, servhost, sizeof(servhost),
-                      servservice, sizeof(servservice),
-                      NI_NUMERICHOST | NI_NUMERICSERV);
-    if ( 0 != err ) {
-        /* Error */
-    }
-
-    /* Free */
-    freeaddrinfo(ressave);
-
-    /* Set timeout */
-    timeout.tv_sec = (time_t)gtimeout;
-    timeout.tv_usec = (suseconds_t)((gtimeout - (time_t)gtimeout) * 1000000);
-    if ( 0 != setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                         sizeof(struct timeval)) ) {
-        /* Error */
+        /* Send the request and read response header */
+        err = _http_exchange(sock, req, data, fd, post ? sz : 0, &rbuf);
+        if ( 0 == err ) {
+            break;
+        }
         (void)close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
+        if ( !reused || retry > 0 ) {
+            /* Error */
+            nb_parsed_url_free(purl);
+            return -1;
+        }
+        if ( NULL == data && fd >= 0
+             && (pos < 0 || lseek(fd, pos, SEEK_SET) < 0) ) {
+            /* The body cannot be sent again */
+            nb_parsed_url_free(purl);
+            return -1;
+        }
     }
 
-    /* Build and send a request */
-    path = _build_request_uri(purl);
-    if ( NULL ==  path ) {
+    /* Parse the response header */
+    if ( 0 != nb_http_header_view_parse(&reqhdr, rbuf.buf, rbuf.hdrlen) ) {
         /* Error */
-        (void)close(sock);
+        nb_http_rbuf_release(&rbuf);
+        close(sock);
         nb_parsed_url_free(purl);
         return -1;
     }
-    snprintf(req, sizeof(req), "POST %.1024s HTTP/1.1\r\n"
-             "Host: %.1024s\r\n"
-             "User-Agent: %s\r\n"
-             "Content-Type: %.1024s\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n\r\n", path, purl->host, USER_AGENT,
-             content_type, sz);
-    free(path);
 
-    /* Send the header */
-    nw = send(sock, req, strlen(req), 0);
-    if ( nw != strlen(req) ) {
+    /* Prepare the body decoder */
+    keep = nb_http_header_view_is_keepalive(&reqhdr);
+    if ( 0 != nb_http_body_init(&body, &reqhdr, sink, user) ) {
+        nb_http_rbuf_release(&rbuf);
         close(sock);
         nb_parsed_url_free(purl);
         return -1;
     }
-
-    /* Upload the body */
-    ssize_t sent = 0;
-    while ( (nw = send(sock, data+sent, sz - sent, 0)) > 0 ) {
-        sent += nw;
+    if ( nb_http_buf_sink == sink ) {
+        /* Allocate at once if the length is known */
+        res = (nb_http_buf_t *)user;
+        buf = NULL;
+        clen = nb_http_header_view_get_content_length(&reqhdr);
+        err = nb_http_buf_reserve(res, NB_HTTP_BODY_LENGTH == body.framing
+                                  ? (size_t)clen : 0);
+    } else {
+        res = NULL;
+        buf = malloc(HTTP_RECV_SIZE);
+        err = (NULL == buf) ? -1 : 0;
     }
-    if ( nw < 0 ) {
-        /* Error */
+    if ( 0 != err ) {
+        nb_http_rbuf_release(&rbuf);
         close(sock);
         nb_parsed_url_free(purl);
         return -1;
     }
 
-    /* Read response header */
-    err = _read_response_header(sock, &reqhdrstr, &reqhdrlen, &reqbdystr,
-                                &reqbdylen);
-    if ( err < 0 ) {
-        /* Error */
-        close(sock);
-        nb_parsed_url_free(purl);
-        return -1;
+    /* The body bytes read together with the header */
+    bdylen = (off_t)(rbuf.len - rbuf.hdrlen);
+    nr = nb_http_body_feed(&body, rbuf.buf + rbuf.hdrlen, (size_t)bdylen);
+    nb_http_rbuf_release(&rbuf);
+    if ( nr < bdylen ) {
+        /* Garbage after the body */
+        keep = 0;
     }
 
-    /* Parse the response header */
-    reqhdr = nb_parse_http_header(reqhdrstr, (size_t)reqhdrlen);
-    if ( NULL == reqhdr ) {
-        /* Error */
-        free(reqhdrstr);
-        if ( NULL != reqbdystr ) {
-            free(reqbdystr);
+    /* Download the body; into the tail of the buffer for nb_http_buf_sink,
+       where the decoder moves the payload forward in place */
+    while ( nr >= 0 && !body.done ) {
+        if ( NULL != res ) {
+            if ( NB_HTTP_BODY_LENGTH == body.framing ) {
+                /* Already allocated */
+                n = (ssize_t)body.remain;
+            } else {
+                n = HTTP_RECV_SIZE;
+            }
+            if ( 0 != nb_http_buf_reserve(res, (size_t)n) ) {
+                break;
+            }
+            nr = recv(sock, res->buf + res->len, res->size - res->len - 1, 0);
+        } else {
+            nr = recv(sock, buf, HTTP_RECV_SIZE, 0);
         }
+        if ( nr <= 0 ) {
+            /* Closed (the end of the body if delimited by the close) */
+            (void)nb_http_body_eof(&body);
+            keep = 0;
+            break;
+        }
+        n = nb_http_body_feed(&body, NULL != res ? res->buf + res->len : buf,
+                              (size_t)nr);
+        if ( n < nr ) {
+            /* Garbage after the body */
+            keep = 0;
+        }
+        nr = n;
+    }
+    free(buf);
+    if ( !body.done ) {
         close(sock);
         nb_parsed_url_free(purl);
         return -1;
     }
 
-    /* Get content length */
-    clen = nb_http_header_get_content_length(reqhdr);
-
-    /* Allocate */
-    *reslen = clen;
-    if ( clen > 0 ) {
-        *resstr = malloc(sizeof(char) * (*reslen));
-        if ( NULL == *resstr ) {
-            nb_http_header_delete(reqhdr);
-            free(reqhdrstr);
-            if ( NULL != reqbdystr ) {
-                free(reqbdystr);
-            }
-            close(sock);
-            nb_parsed_url_free(purl);
-            return -1;
-        }
-    } else {
-        *resstr = NULL;
-    }
-    if ( reqbdylen > 0 && reqbdylen <= clen ) {
-        (void)memcpy(*resstr, reqbdystr, reqbdylen);
-        tsize = (size_t)reqbdylen;
+    /* Return the connection to the pool if it can be reused */
+    if ( NULL == pool || !keep ) {
+        shutdown(sock, SHUT_RDWR);
     }
-
-    /* Download the body */
-    while ( (nr = recv(sock, buf, sizeof(buf), 0)) > 0 ) {
-        (void)memcpy(*resstr + tsize, buf, nr);
-        tsize += nr;
-    }
-
-    nb_http_header_delete(reqhdr);
-    free(reqhdrstr);
-    if ( NULL != reqbdystr ) {
-        free(reqbdystr);
-    }
-    shutdown(sock, SHUT_RDWR);
-    close(sock);
+    nb_http_pool_release(pool, purl->host, port, AF_UNSPEC, sock, keep);
     nb_parsed_url_free(purl);
 
-    if ( tsize < clen ) {
-        if ( NULL != resstr ) {
-            free(resstr);
-        }
+    return 0;
+}
+
+/*
+ * Issue an HTTP request and receive the whole response body
+ */
+static int
+_http_request_buf(nb_http_pool_t *pool, const char *url,
+                  const char *content_type, const char *data, size_t sz,
+                  char **resstr, off_t *reslen)
+{
+    nb_http_buf_t res;
+
+    res.buf = NULL;
+    res.len = 0;
+    res.size = 0;
+    if ( 0 != _http_request(pool, url, content_type, data, -1, (off_t)sz,
+                            nb_http_buf_sink, &res) ) {
+        free(res.buf);
         return -1;
     }
+    res.buf[res.len] = '\0';
+    *resstr = res.buf;
+    *reslen = (off_t)res.len;
 
     return 0;
 }
 
+/*
+ * Get data via HTTP
+ */
+int
+nb_http_get(const char *url, char **resstr, off_t *reslen)
+{
+    return _http_request_buf(NULL, url, NULL, NULL, 0, resstr, reslen);
+}
+
+/*
+ * Post data via HTTP
+ */
+int
+nb_http_post(const char *url, const char *content_type, const char *data,
+             size_t sz, char **resstr, off_t *reslen)
+{
+    return _http_request_buf(NULL, url, content_type, data, sz, resstr,
+                             reslen);
+}
+
+/*
+ * Get data via HTTP streaming the body to the sink
+ */
+int
+nb_http_get_sink(const char *url, nb_http_sink_f sink, void *user)
+{
+    return _http_request(NULL, url, NULL, NULL, -1, 0, sink, user);
+}
+
+/*
+ * Post data via HTTP streaming the response body to the sink
+ */
+int
+nb_http_post_sink(const char *url, const char *content_type, const char *data,
+                  size_t sz, nb_http_sink_f sink, void *user)
+{
+    return _http_request(NULL, url, content_type, data, -1, (off_t)sz, sink,
+                         user);
+}
+
+/*
+ * Post sz bytes from the current offset of the file descriptor via HTTP
+ * streaming the response body to the sink
+ */
+int
+nb_http_post_fd(const char *url, const char *content_type, int fd, off_t sz,
+                nb_http_sink_f sink, void *user)
+{
+    return _http_request(NULL, url, content_type, NULL, fd, sz, sink, user);
+}
+
+/*
+ * Get data via HTTP over a connection from the pool
+ */
+int
+nb_http_pool_get(nb_http_pool_t *pool, const char *url, char **resstr,
+                 off_t *reslen)
+{
+    return _http_request_buf(pool, url, NULL, NULL, 0, resstr, reslen);
+}
+
+/*
+ * Post data via HTTP over a connection from the pool
+ */
+int
+nb_http_pool_post(nb_http_pool_t *pool, const char *url,
+                  const char *content_type, const char *data, size_t sz,
+                  char **resstr, off_t *reslen)
+{
+    return _http_request_buf(pool, url, content_type, data, sz, resstr,
+                             reslen);
+}
+
+/*
+ * nb_http_get_sink() over a connection from the pool
+ */
+int
+nb_http_pool_get_sink(nb_http_pool_t *pool, const char *url,
+                      nb_http_sink_f sink, void *user)
+{
+    return _http_request(pool, url, NULL, NULL, -1, 0, sink, user);
+}
+
+/*
+ * nb_http_post_sink() over a connection from the pool
+ */
+int
+nb_http_pool_post_sink(nb_http_pool_t *pool, const char *url,
+                       const char *content_type, const char *data, size_t sz,
+                       nb_http_sink_f sink, void *user)
+{
+    return _http_request(pool, url, content_type, data, -1, (off_t)sz, sink,
+                         user);
+}
+
+/*
+ * nb_http_post_fd() over a connection from the pool
+ */
+int
+nb_http_pool_post_fd(nb_http_pool_t *pool, const char *url,
+                     const char *content_type, int fd, off_t sz,
+                     nb_http_sink_f sink, void *user)
+{
+    return _http_request(pool, url, content_type, NULL, fd, sz, sink, user);
+}
 
 
 /*
@@ -8,11 +8,233 @@
 #ifndef _NETBENCH_PRIVATE_H
 #define _NETBENCH_PRIVATE_H
 
+#include "netbench.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Receive engine discarding the payload
+ */
+typedef struct _discard {
+    int mode;
+    char *buf;
+    size_t bufsz;
+    int pipefd[2];
+    size_t pipesz;
+    int nullfd;
+} nb_discard_t;
+
+/*
+ * TCP_INFO of Linux
+ * This mirrors struct tcp_info of <linux/tcp.h> since the one in
+ * <netinet/tcp.h> lacks the recent members.  The kernel fills the prefix it
+ * knows and returns its length.
+ */
+typedef struct _tcp_info {
+    uint8_t tcpi_state;
+    uint8_t tcpi_ca_state;
+    uint8_t tcpi_retransmits;
+    uint8_t tcpi_probes;
+    uint8_t tcpi_backoff;
+    uint8_t tcpi_options;
+    uint8_t tcpi_wscale;
+    uint8_t tcpi_flags;
+
+    uint32_t tcpi_rto;
+    uint32_t tcpi_ato;
+    uint32_t tcpi_snd_mss;
+    uint32_t tcpi_rcv_mss;
+
+    uint32_t tcpi_unacked;
+    uint32_t tcpi_sacked;
+    uint32_t tcpi_lost;
+    uint32_t tcpi_retrans;
+    uint32_t tcpi_fackets;
+
+    uint32_t tcpi_last_data_sent;
+    uint32_t tcpi_last_ack_sent;
+    uint32_t tcpi_last_data_recv;
+    uint32_t tcpi_last_ack_recv;
+
+    uint32_t tcpi_pmtu;
+    uint32_t tcpi_rcv_ssthresh;
+    uint32_t tcpi_rtt;
+    uint32_t tcpi_rttvar;
+    uint32_t tcpi_snd_ssthresh;
+    uint32_t tcpi_snd_cwnd;
+    uint32_t tcpi_advmss;
+    uint32_t tcpi_reordering;
+
+    uint32_t tcpi_rcv_rtt;
+    uint32_t tcpi_rcv_space;
+
+    uint32_t tcpi_total_retrans;
+
+    uint64_t tcpi_pacing_rate;
+    uint64_t tcpi_max_pacing_rate;
+    uint64_t tcpi_bytes_acked;
+    uint64_t tcpi_bytes_received;
+    uint32_t tcpi_segs_out;
+    uint32_t tcpi_segs_in;
+
+    uint32_t tcpi_notsent_bytes;
+    uint32_t tcpi_min_rtt;
+    uint32_t tcpi_data_segs_in;
+    uint32_t tcpi_data_segs_out;
+
+    uint64_t tcpi_delivery_rate;
+
+    uint64_t tcpi_busy_time;
+    uint64_t tcpi_rwnd_limited;
+    uint64_t tcpi_sndbuf_limited;
+} nb_tcp_info_t;
+
+/* Does the returned tcp_info contain the member? */
+#define TCP_INFO_HAS(len, member) \
+    ((len) >= offsetof(nb_tcp_info_t, member) \
+     + sizeof(((nb_tcp_info_t *)0)->member))
+
+/*
+ * Transmission progress of a stream socket
+ */
+#define NB_TXPROG_NONE                  0
+#define NB_TXPROG_TCPINFO               1
+#define NB_TXPROG_OUTQ                  2
+#define NB_TXPROG_NWRITE                3
+typedef struct _txprog {
+    int method;
+    uint64_t base;              /* Bytes acknowledged before the request */
+    int sock;
+    int lowat;                  /* TCP_NOTSENT_LOWAT to restore (-1 if not
+                                   known) */
+    int lowatset;               /* TCP_NOTSENT_LOWAT is changed */
+    int epfd;
+    uint32_t events;
+} nb_txprog_t;
+
+/*
+ * Throughput estimator for the early termination
+ */
+#define NB_ESTIMATOR_WINDOWS            16
+typedef struct _estimator {
+    double tolerance;           /* Relative half-width to converge (0: never) */
+    nb_rate_window_t win;
+    int head;
+    int cnt;
+    double rates[NB_ESTIMATOR_WINDOWS];
+    nb_estimate_t est;
+} nb_estimator_t;
+
+/*
+ * Receive buffer holding the response header and the body bytes read with it
+ */
+typedef struct _http_rbuf {
+    char *buf;
+    size_t size;                /* Allocated size */
+    size_t len;                 /* Received bytes */
+    size_t hdrlen;              /* Header length including the empty line */
+} nb_http_rbuf_t;
+
+/*
+ * TLS connection (with OpenSSL)
+ */
+typedef struct _tls nb_tls_t;
+
+/*
+ * Streaming decoder of the HTTP body
+ */
+#define NB_HTTP_BODY_NONE               0
+#define NB_HTTP_BODY_LENGTH             1
+#define NB_HTTP_BODY_CHUNKED            2
+#define NB_HTTP_BODY_CLOSE              3
+typedef struct _http_body {
+    int framing;
+    int state;                  /* State of the chunked decoder */
+    off_t remain;               /* Rest of the body or the chunk */
+    int ndigits;
+    int lineempty;
+    off_t payload;              /* Decoded bytes */
+    int done;
+    nb_http_sink_f sink;
+    void *user;
+} nb_http_body_t;
+
+/*
+ * Growable buffer
+ */
+typedef struct _http_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+} nb_http_buf_t;
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    /* Connection */
+    int
+    nb_open_stream_socket(const char *, const char *, int, double,
+                          const nb_sockopt_t *, nb_connect_result_t *);
+    int nb_sockopt_is_set(const nb_sockopt_t *);
+    void nb_sockopt_get_congestion(int, char *);
+
+    /* HTTP */
+    int nb_http_read_header(int, nb_tls_t *, nb_http_rbuf_t *, double *);
+    int
+    nb_http_get_segmented(nb_http_get_t *, nb_http_get_result_t *,
+                          const char *, const char *, const char *, int,
+                          double);
+    void nb_http_rbuf_release(nb_http_rbuf_t *);
+    int
+    nb_http_body_init(nb_http_body_t *, const nb_http_header_view_t *,
+                      nb_http_sink_f, void *);
+    ssize_t nb_http_body_feed(nb_http_body_t *, const char *, size_t);
+    int nb_http_body_eof(nb_http_body_t *);
+    int nb_http_buf_reserve(nb_http_buf_t *, size_t);
+    int nb_http_buf_sink(const char *, size_t, void *);
+
+    /* TLS */
+    nb_tls_ctx_t * nb_tls_ctx_new(int);
+    void nb_tls_ctx_delete(nb_tls_ctx_t *);
+    nb_tls_t *
+    nb_tls_connect(nb_tls_ctx_t *, int, const char *, const char *, int *);
+    ssize_t nb_tls_recv(nb_tls_t *, void *, size_t);
+    ssize_t nb_tls_send(nb_tls_t *, const void *, size_t);
+    void nb_tls_close(nb_tls_t *);
+
+    /* Receive engine */
+    int nb_discard_init(nb_discard_t *, int);
+    ssize_t nb_discard_recv(nb_discard_t *, int);
+    void nb_discard_release(nb_discard_t *);
+
+    /* TCP information */
+    int nb_tcp_info(int, nb_tcp_info_t *);
+    int nb_txprog_init(nb_txprog_t *, int);
+    int nb_txprog_get(nb_txprog_t *, int, off_t, off_t *, off_t *);
+    int nb_txprog_wait(nb_txprog_t *, int, double);
+    void nb_txprog_release(nb_txprog_t *);
+    int nb_tcp_info_series_init(nb_tcp_info_series_t *, double, double);
+    int nb_tcp_info_series_sample(nb_tcp_info_series_t *, int, double, int);
+    void nb_tcp_info_series_release(nb_tcp_info_series_t *);
+
+    /* Fixed-interval throughput series */
+    int nb_rate_series_init(nb_rate_series_t *, double, double, double);
+    void nb_rate_series_start(nb_rate_series_t *, double);
+    void nb_rate_series_add(nb_rate_series_t *, double, off_t);
+    void nb_rate_series_release(nb_rate_series_t *);
+
+    /* Throughput estimator */
+    void nb_rate_window_start(nb_rate_window_t *, double, off_t);
+    int nb_rate_window_add(nb_rate_window_t *, double, double, off_t,
+                           double *);
+    void nb_estimator_init(nb_estimator_t *, double);
+    void nb_estimator_start(nb_estimator_t *, double, off_t);
+    int nb_estimator_add(nb_estimator_t *, double, off_t);
+    void nb_estimator_finish(nb_estimator_t *, double, off_t);
+
 #ifdef __cplusplus
 }
 #endif
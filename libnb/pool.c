@@ -0,0 +1,252 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <poll.h>
+
+/* Prototype declarations */
+static void _conn_delete(nb_http_pool_conn_t *);
+static int _conn_is_healthy(nb_http_pool_conn_t *);
+static int _conn_match(nb_http_pool_conn_t *, const char *, const char *, int);
+
+/*
+ * Create a new connection pool
+ */
+nb_http_pool_t *
+nb_http_pool_new(double idle_timeout, int max_idle)
+{
+    nb_http_pool_t *pool;
+
+    pool = malloc(sizeof(nb_http_pool_t));
+    if ( NULL == pool ) {
+        return NULL;
+    }
+    pool->idle_timeout = idle_timeout;
+    pool->max_idle = max_idle;
+    pool->idle = NULL;
+
+    return pool;
+}
+
+/*
+ * Delete the connection pool with closing all the idle connections
+ */
+void
+nb_http_pool_delete(nb_http_pool_t *pool)
+{
+    nb_http_pool_conn_t *conn;
+
+    while ( NULL != pool->idle ) {
+        conn = pool->idle;
+        pool->idle = conn->next;
+        _conn_delete(conn);
+    }
+    free(pool);
+}
+
+/*
+ * Close and free an idle connection
+ */
+static void
+_conn_delete(nb_http_pool_conn_t *conn)
+{
+    (void)close(conn->sock);
+    free(conn->host);
+    free(conn->port);
+    free(conn);
+}
+
+/*
+ * Check the connection is still usable
+ * An idle connection must not be readable; readable means the peer has
+ * closed it or has sent something unexpected.
+ */
+static int
+_conn_is_healthy(nb_http_pool_conn_t *conn)
+{
+    struct pollfd fds[1];
+    int err;
+    socklen_t optlen;
+
+    fds[0].fd = conn->sock;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if ( 0 != poll(fds, 1, 0) ) {
+        return 0;
+    }
+    optlen = sizeof(err);
+    if ( 0 != getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &optlen)
+         || 0 != err ) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Does the connection have the key?
+ */
+static int
+_conn_match(nb_http_pool_conn_t *conn, const char *host, const char *port,
+            int family)
+{
+    return family == conn->family && 0 == strcasecmp(host, conn->host)
+        && 0 == strcmp(port, conn->port);
+}
+
+/*
+ * Close the connections idle longer than the timeout
+ */
+void
+nb_http_pool_expire(nb_http_pool_t *pool)
+{
+    nb_http_pool_conn_t **pconn;
+    nb_http_pool_conn_t *conn;
+    double now;
+
+    now = nb_microtime();
+    pconn = &pool->idle;
+    while ( NULL != *pconn ) {
+        conn = *pconn;
+        if ( now - conn->last > pool->idle_timeout ) {
+            *pconn = conn->next;
+            _conn_delete(conn);
+        } else {
+            pconn = &conn->next;
+        }
+    }
+}
+
+/*
+ * Get a connection to (host, port, family)
+ * A warm idle connection is returned if available (reused is set to 1);
+ * otherwise a new connection is opened within the timeout.  The pool may be
+ * NULL.  The connection attempts are recorded to conn if it is not NULL; for
+ * a reused connection, no attempt is recorded and the times of name
+ * resolution and connection establishment are the current time.  A new
+ * connection is always opened if any of the socket options are set, so that
+ * they take effect from the handshake.
+ */
+int
+nb_http_pool_acquire(nb_http_pool_t *pool, const char *host, const char *port,
+                     int family, double timeout, const nb_sockopt_t *opts,
+                     int *reused, nb_connect_result_t *conn)
+{
+    nb_http_pool_conn_t **pconn;
+    nb_http_pool_conn_t *pc;
+    int sock;
+
+    if ( NULL != reused ) {
+        *reused = 0;
+    }
+    if ( NULL != pool && !nb_sockopt_is_set(opts) ) {
+        nb_http_pool_expire(pool);
+
+        /* Take the most recently used one */
+        pconn = &pool->idle;
+        while ( NULL != *pconn ) {
+            pc = *pconn;
+            if ( !_conn_match(pc, host, port, family) ) {
+                pconn = &pc->next;
+                continue;
+            }
+            *pconn = pc->next;
+            if ( !_conn_is_healthy(pc) ) {
+                _conn_delete(pc);
+                continue;
+            }
+            sock = pc->sock;
+            free(pc->host);
+            free(pc->port);
+            free(pc);
+            if ( NULL != reused ) {
+                *reused = 1;
+            }
+            if ( NULL != conn ) {
+                conn->resolved = nb_microtime();
+                conn->connected = conn->resolved;
+                conn->winner = -1;
+                conn->nattempts = 0;
+                nb_sockopt_get_congestion(sock, conn->congestion);
+            }
+            return sock;
+        }
+    }
+
+    return nb_open_stream_socket(host, port, family, timeout, opts, conn);
+}
+
+/*
+ * Return a connection to the pool
+ * The connection is closed instead if keep is zero, the pool is NULL, or
+ * the pool already has enough idle connections to the key.
+ */
+void
+nb_http_pool_release(nb_http_pool_t *pool, const char *host, const char *port,
+                     int family, int sock, int keep)
+{
+    nb_http_pool_conn_t *conn;
+    int n;
+
+    if ( NULL == pool || !keep ) {
+        (void)close(sock);
+        return;
+    }
+
+    /* Count the idle connections to the same key */
+    n = 0;
+    for ( conn = pool->idle; NULL != conn; conn = conn->next ) {
+        if ( _conn_match(conn, host, port, family) ) {
+            n++;
+        }
+    }
+    if ( n >= pool->max_idle ) {
+        (void)close(sock);
+        return;
+    }
+
+    conn = malloc(sizeof(nb_http_pool_conn_t));
+    if ( NULL == conn ) {
+        (void)close(sock);
+        return;
+    }
+    conn->host = strdup(host);
+    conn->port = strdup(port);
+    if ( NULL == conn->host || NULL == conn->port ) {
+        free(conn->host);
+        free(conn->port);
+        free(conn);
+        (void)close(sock);
+        return;
+    }
+    conn->family = family;
+    conn->sock = sock;
+    conn->last = nb_microtime();
+
+    /* Push to the head so that the warmest one is taken first */
+    conn->next = pool->idle;
+    pool->idle = conn;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,880 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * Range-segmented download of a single object
+ * The object is cut into segments fetched by "Range:" requests over several
+ * connections at once, each on its own thread.  A connection that has
+ * finished its segment takes the next one not requested yet; when none is
+ * left, it steals the second half of the rest of the segment expected to
+ * complete last.  The connection of a segment cut short is closed once it
+ * has received its part, since the rest of its response is not needed, and
+ * a new one is opened for the next segment.  A connection that fails leaves
+ * the rest of its segment pending and is reopened.  The workers without a
+ * segment wait for the ones in progress, so that a segment given up by one
+ * is taken by another; the download fails if a segment is left incomplete.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define SEGMENT_SOCKET_TIMEOUT          30.0
+#define SEGMENT_SIZE_DEFAULT            (4 * 1024 * 1024)
+#define SEGMENT_STEAL_MIN               (256 * 1024)
+#define SEGMENT_RESERVE_UNIT            64
+#define SEGMENT_WAIT_MAX                0.1     /* To check the end */
+#define SEGMENT_RETRY_MAX               3       /* Failures in a row */
+#define RESULT_ITEMS_RESERVE_UNIT       4096
+#define REQUEST_SIZE                    4096
+
+typedef struct _seg_state nb_seg_state_t;
+
+/* Connection with its worker thread */
+typedef struct _seg_conn {
+    nb_seg_state_t *st;
+    int idx;
+    int sock;
+    nb_tls_t *tls;
+    int seg;                    /* Segment in progress (-1 if none) */
+    off_t first;                /* Range requested */
+    off_t last;
+    off_t remain;               /* Rest of the response body */
+    int keep;
+    int stopped;                /* The end of the measurement (seen under the
+                                   mutex) */
+    int nopen;                  /* Times opened */
+    int fails;                  /* Failures in a row */
+    pthread_t thread;
+    int started;
+} nb_seg_conn_t;
+
+/* State shared by the connections (under the mutex) */
+struct _seg_state {
+    nb_http_get_t *obj;
+    nb_http_get_result_t *result;
+    const char *host;
+    const char *port;
+    const char *path;
+    int family;
+    off_t size;                 /* Of the object (-1 if unknown yet) */
+    size_t nsegsres;
+    double t0;
+    double prevtm;
+    double duration;
+    off_t tx;
+    off_t rx;
+    int stop;
+    int err;                    /* errno of the first failure */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* A segment completed or given up */
+};
+
+/* Prototype declarations */
+static int _seg_add(nb_seg_state_t *, off_t, off_t, int);
+static int _seg_take(nb_seg_state_t *, int, double);
+static int _seg_incomplete(nb_seg_state_t *);
+static int _seg_wait(nb_seg_state_t *, nb_seg_conn_t *);
+static void _seg_release(nb_seg_state_t *, nb_seg_conn_t *);
+static void _append(nb_seg_state_t *, double);
+static int _account(nb_seg_conn_t *, double, off_t, off_t);
+static int _content_range(const nb_http_header_view_t *, off_t *, off_t *,
+                          off_t *);
+static int _request(nb_seg_conn_t *);
+static int _open(nb_seg_conn_t *);
+static void _close(nb_seg_conn_t *);
+static int _fail(nb_seg_conn_t *);
+static void * _worker(void *);
+
+/*
+ * Add a segment of the range (to the connection, or pending if -1)
+ * Returns the index, or -1 on failure.
+ */
+static int
+_seg_add(nb_seg_state_t *st, off_t first, off_t last, int conn)
+{
+    nb_http_get_result_t *result;
+    nb_http_segment_t *segs;
+    nb_http_segment_t *s;
+    size_t nres;
+
+    result = st->result;
+    if ( result->nsegs >= st->nsegsres ) {
+        nres = st->nsegsres + SEGMENT_RESERVE_UNIT;
+        segs = realloc(result->segs, sizeof(nb_http_segment_t) * nres);
+        if ( NULL == segs ) {
+            return -1;
+        }
+        result->segs = segs;
+        st->nsegsres = nres;
+    }
+    s = &result->segs[result->nsegs];
+    s->first = first;
+    s->last = last;
+    s->received = 0;
+    s->conn = conn;
+    s->stolen = 0;
+    s->requested = 0.0;
+    s->done = 0.0;
+
+    return (int)result->nsegs++;
+}
+
+/*
+ * Take a segment for the connection: a pending one, or the second half of
+ * the rest of the one expected to complete last
+ * Returns the index, or -1 if no work is left.
+ */
+static int
+_seg_take(nb_seg_state_t *st, int conn, double now)
+{
+    nb_http_segment_t *s;
+    off_t rem;
+    off_t mid;
+    double rate;
+    double eta;
+    double besteta;
+    int best;
+    int i;
+
+    /* Pending one */
+    for ( i = 0; i < (int)st->result->nsegs; i++ ) {
+        s = &st->result->segs[i];
+        if ( s->conn < 0 && 0.0 == s->done ) {
+            s->conn = conn;
+            s->requested = now;
+            return i;
+        }
+    }
+
+    /* Steal from the slowest one */
+    best = -1;
+    besteta = -1.0;
+    for ( i = 0; i < (int)st->result->nsegs; i++ ) {
+        s = &st->result->segs[i];
+        if ( s->conn < 0 || s->conn == conn || 0.0 != s->done ) {
+            continue;
+        }
+        rem = s->last - s->first + 1 - s->received;
+        if ( rem < 2 * SEGMENT_STEAL_MIN ) {
+            continue;
+        }
+        rate = s->received > 0 && now > s->requested
+            ? s->received / (now - s->requested) : 0.0;
+        /* Nothing received yet goes first */
+        eta = rate > 0.0 ? rem / rate : 1e30 + rem;
+        if ( eta > besteta ) {
+            besteta = eta;
+            best = i;
+        }
+    }
+    if ( best < 0 ) {
+        return -1;
+    }
+    s = &st->result->segs[best];
+    rem = s->last - s->first + 1 - s->received;
+    mid = s->first + s->received + rem / 2;
+    i = _seg_add(st, mid, s->last, conn);
+    if ( i < 0 ) {
+        return -1;
+    }
+    /* The segments may have been reallocated */
+    st->result->segs[best].last = mid - 1;
+    st->result->segs[i].stolen = 1;
+    st->result->segs[i].requested = now;
+
+    return i;
+}
+
+/*
+ * Is any segment incomplete?
+ */
+static int
+_seg_incomplete(nb_seg_state_t *st)
+{
+    size_t i;
+
+    for ( i = 0; i < st->result->nsegs; i++ ) {
+        if ( 0.0 == st->result->segs[i].done ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for a segment to take, as long as any is in progress by the others
+ * (it may be given up)
+ * Returns the index, or -1 if no work is left or at the end of the
+ * measurement.
+ */
+static int
+_seg_wait(nb_seg_state_t *st, nb_seg_conn_t *c)
+{
+    struct timespec ts;
+    double now;
+    int seg;
+
+    (void)pthread_mutex_lock(&st->mutex);
+    for ( ;; ) {
+        now = nb_microtime();
+        if ( now - st->t0 > st->duration || st->obj->cancel ) {
+            st->stop = 1;
+        }
+        if ( st->stop ) {
+            seg = -1;
+            break;
+        }
+        seg = _seg_take(st, c->idx, now);
+        if ( seg >= 0 || !_seg_incomplete(st) ) {
+            break;
+        }
+        now += SEGMENT_WAIT_MAX;
+        ts.tv_sec = (time_t)now;
+        ts.tv_nsec = (long)((now - ts.tv_sec) * 1000000000);
+        (void)pthread_cond_timedwait(&st->cond, &st->mutex, &ts);
+    }
+    (void)pthread_mutex_unlock(&st->mutex);
+
+    return seg;
+}
+
+/*
+ * Give up the segment of the connection (on failure), leaving the rest
+ * pending for the others
+ */
+static void
+_seg_release(nb_seg_state_t *st, nb_seg_conn_t *c)
+{
+    nb_http_segment_t *s;
+    off_t next;
+    off_t last;
+
+    (void)pthread_cond_broadcast(&st->cond);
+    s = &st->result->segs[c->seg];
+    if ( st->stop || 0.0 != s->done ) {
+        /* Incomplete at the end of the measurement */
+        return;
+    }
+    next = s->first + s->received;
+    last = s->last;
+    if ( s->received > 0 ) {
+        s->last = next - 1;
+        s->done = nb_microtime();
+        (void)_seg_add(st, next, last, -1);
+    } else {
+        s->conn = -1;
+        s->requested = 0.0;
+    }
+}
+
+/*
+ * Append a result item of the aggregate
+ */
+static void
+_append(nb_seg_state_t *st, double tm)
+{
+    nb_http_get_result_t *result;
+    nb_http_get_result_item_t *items;
+    size_t cntres;
+
+    result = st->result;
+    if ( NULL != result->rate.buckets ) {
+        /* Aggregate into the fixed-interval buckets instead */
+        nb_rate_series_add(&result->rate, tm, st->rx);
+        return;
+    }
+    if ( result->cnt >= result->cntres ) {
+        cntres = result->cntres + RESULT_ITEMS_RESERVE_UNIT;
+        items = realloc(result->items,
+                        sizeof(nb_http_get_result_item_t) * cntres);
+        if ( NULL == items ) {
+            return;
+        }
+        result->items = items;
+        result->cntres = cntres;
+    }
+    result->items[result->cnt].tm = tm;
+    result->items[result->cnt].tx = st->tx;
+    result->items[result->cnt].rx = st->rx;
+    result->cnt++;
+}
+
+/*
+ * Account the header and the body bytes received by the connection
+ * Returns 1 if the segment is completed, otherwise 0.
+ */
+static int
+_account(nb_seg_conn_t *c, double tm, off_t hdrlen, off_t n)
+{
+    nb_seg_state_t *st;
+    nb_http_get_t *obj;
+    nb_http_segment_t *s;
+    off_t want;
+    int done;
+
+    st = c->st;
+    obj = st->obj;
+    (void)pthread_mutex_lock(&st->mutex);
+
+    /* The bytes beyond the segment cut short are not counted */
+    s = &st->result->segs[c->seg];
+    want = s->last - s->first + 1 - s->received;
+    if ( n < want ) {
+        want = n;
+    }
+    s->received += want;
+    st->result->payload += want;
+    st->result->hlen += hdrlen;
+    st->rx += hdrlen + n;
+    done = 0;
+    if ( s->received >= s->last - s->first + 1 && 0.0 == s->done ) {
+        s->done = tm;
+        done = 1;
+        (void)pthread_cond_broadcast(&st->cond);
+    }
+    _append(st, tm);
+
+    /* Report by calling a callback function */
+    if ( NULL != obj->cb && tm - st->prevtm >= obj->cbfreq ) {
+        obj->cb(obj, st->result->hlen, st->result->clen, st->t0, tm, st->tx,
+                st->rx);
+        st->prevtm = tm;
+    }
+    if ( tm - st->t0 > st->duration || obj->cancel ) {
+        st->stop = 1;
+        (void)pthread_cond_broadcast(&st->cond);
+    }
+    c->stopped = st->stop;
+
+    (void)pthread_mutex_unlock(&st->mutex);
+
+    return done;
+}
+
+/*
+ * Parse "Content-Range: bytes first-last/size", or "bytes *" "/size" of the
+ * unsatisfiable range (then first and last are -1)
+ */
+static int
+_content_range(const nb_http_header_view_t *view, off_t *first, off_t *last,
+               off_t *size)
+{
+    const nb_http_header_field_t *f;
+    char buf[128];
+    long long a;
+    long long b;
+    long long n;
+
+    f = nb_http_header_view_find(view, "content-range");
+    if ( NULL == f || f->value.len >= sizeof(buf) ) {
+        return -1;
+    }
+    memcpy(buf, view->buf + f->value.off, f->value.len);
+    buf[f->value.len] = '\0';
+    if ( 1 == sscanf(buf, "bytes */%lld", &n) && n >= 0 ) {
+        a = -1;
+        b = -1;
+    } else if ( 3 != sscanf(buf, "bytes %lld-%lld/%lld", &a, &b, &n)
+                || a < 0 || b < a || n <= b ) {
+        return -1;
+    }
+    *first = (off_t)a;
+    *last = (off_t)b;
+    *size = (off_t)n;
+
+    return 0;
+}
+
+/*
+ * Request the range of the segment, and read the response header with the
+ * body bytes following it
+ * The size of the object is learned from the first response; the whole
+ * object is a segment if the server ignores the range.
+ * Returns 1 if the segment is completed, 0 if in progress, or -1 on failure.
+ */
+static int
+_request(nb_seg_conn_t *c)
+{
+    nb_seg_state_t *st;
+    nb_http_get_result_t *result;
+    nb_http_rbuf_t rbuf;
+    nb_http_header_view_t hdr;
+    char req[REQUEST_SIZE];
+    off_t first;
+    off_t last;
+    off_t size;
+    off_t hdrlen;
+    off_t bdylen;
+    double ttfb;
+    ssize_t nw;
+    int code;
+    int probe;
+
+    st = c->st;
+    result = st->result;
+    (void)pthread_mutex_lock(&st->mutex);
+    c->first = result->segs[c->seg].first;
+    c->last = result->segs[c->seg].last;
+    probe = st->size < 0;
+    (void)pthread_mutex_unlock(&st->mutex);
+
+    snprintf(req, sizeof(req), "GET %.1024s HTTP/1.1\r\n"
+             "Host: %.1024s\r\n"
+             "User-Agent: %s\r\n"
+             "X-Measurement-Id: %.100s\r\n"
+             "Range: bytes=%lld-%lld\r\n"
+             "Connection: keep-alive\r\n\r\n", st->path, st->host, USER_AGENT,
+             st->obj->mid, (long long)c->first, (long long)c->last);
+    if ( NULL != c->tls ) {
+        nw = nb_tls_send(c->tls, req, strlen(req));
+    } else {
+        nw = send(c->sock, req, strlen(req), 0);
+    }
+    if ( nw != (ssize_t)strlen(req) ) {
+        return -1;
+    }
+    (void)pthread_mutex_lock(&st->mutex);
+    st->tx += nw;
+    if ( probe ) {
+        result->timing.reqsent = nb_microtime();
+    }
+    (void)pthread_mutex_unlock(&st->mutex);
+
+    /* Read the response header */
+    if ( nb_http_read_header(c->sock, c->tls, &rbuf, &ttfb) < 0 ) {
+        return -1;
+    }
+    if ( 0 != nb_http_header_view_parse(&hdr, rbuf.buf, rbuf.hdrlen)
+         || nb_http_header_view_is_chunked(&hdr)
+         || nb_http_header_view_get_content_length(&hdr) < 0 ) {
+        nb_http_rbuf_release(&rbuf);
+        errno = EPROTO;
+        return -1;
+    }
+    code = nb_http_header_view_get_status(&hdr);
+    c->remain = nb_http_header_view_get_content_length(&hdr);
+    c->keep = nb_http_header_view_is_keepalive(&hdr);
+    if ( 206 == code ) {
+        if ( 0 != _content_range(&hdr, &first, &last, &size)
+             || first != c->first || (!probe && last != c->last)
+             || last - first + 1 != c->remain ) {
+            nb_http_rbuf_release(&rbuf);
+            errno = EPROTO;
+            return -1;
+        }
+    } else if ( 200 == code && probe ) {
+        /* The range is not supported */
+        size = c->remain;
+        last = size - 1;
+    } else if ( 416 == code && probe
+                && 0 == _content_range(&hdr, &first, &last, &size)
+                && 0 == size ) {
+        /* Empty object */
+        c->remain = 0;
+    } else {
+        nb_http_rbuf_release(&rbuf);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if ( probe ) {
+        /* The object may be smaller than the segment */
+        (void)pthread_mutex_lock(&st->mutex);
+        st->size = size;
+        result->clen = size;
+        result->segs[c->seg].last = last;
+        c->last = last;
+        result->timing.ttfb = ttfb;
+        result->timing.header = nb_microtime();
+        (void)pthread_mutex_unlock(&st->mutex);
+    }
+
+    /* The body bytes read together with the header */
+    hdrlen = (off_t)rbuf.hdrlen;
+    bdylen = (off_t)(rbuf.len - rbuf.hdrlen);
+    if ( bdylen > c->remain ) {
+        bdylen = c->remain;
+    }
+    c->remain -= bdylen;
+    nb_http_rbuf_release(&rbuf);
+
+    return _account(c, nb_microtime(), hdrlen, bdylen);
+}
+
+/*
+ * Open the connection with the socket options of the measurement
+ * The first connection is of the timing of the result.
+ */
+static int
+_open(nb_seg_conn_t *c)
+{
+    nb_seg_state_t *st;
+    nb_http_get_result_t *result;
+    nb_connect_result_t conn;
+    struct timeval tv;
+    socklen_t optlen;
+    int first;
+    int opt;
+    int err;
+
+    st = c->st;
+    result = st->result;
+    first = 0 == c->idx && 0 == c->nopen;
+    c->sock = nb_open_stream_socket(st->host, st->port, st->family,
+                                    st->obj->connect_timeout, &st->obj->opts,
+                                    first ? &result->conn : &conn);
+    if ( c->sock < 0 ) {
+        return -1;
+    }
+    c->nopen++;
+    if ( first ) {
+        result->timing.dns = result->conn.resolved;
+        result->timing.connect = result->conn.connected;
+        optlen = sizeof(opt);
+        err = getsockopt(c->sock, IPPROTO_TCP, TCP_MAXSEG, &opt, &optlen);
+        result->mss = 0 == err ? opt : -1;
+    }
+
+    /* Set timeout */
+    tv.tv_sec = (time_t)SEGMENT_SOCKET_TIMEOUT;
+    tv.tv_usec = (suseconds_t)((SEGMENT_SOCKET_TIMEOUT
+                                - (time_t)SEGMENT_SOCKET_TIMEOUT) * 1000000);
+    if ( 0 != setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
+                         sizeof(struct timeval)) ) {
+        (void)close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+
+    /* TLS handshake */
+    c->tls = NULL;
+    if ( NB_TLS_NONE != result->tls ) {
+        c->tls = nb_tls_connect(st->obj->tls, c->sock, st->host, st->port,
+                                &err);
+        if ( NULL == c->tls ) {
+            (void)close(c->sock);
+            c->sock = -1;
+            return -1;
+        }
+        if ( first ) {
+            result->tls = err ? NB_TLS_RESUMED : NB_TLS_FULL;
+            result->timing.tls = nb_microtime();
+        }
+    } else if ( first ) {
+        result->timing.tls = result->timing.connect;
+    }
+
+    return 0;
+}
+
+/*
+ * Close the connection
+ */
+static void
+_close(nb_seg_conn_t *c)
+{
+    if ( c->sock < 0 ) {
+        return;
+    }
+    nb_tls_close(c->tls);
+    c->tls = NULL;
+    shutdown(c->sock, SHUT_RDWR);
+    (void)close(c->sock);
+    c->sock = -1;
+}
+
+/*
+ * Give up the segment of the connection on failure
+ * Returns 1 to retry by a new connection, otherwise 0.
+ */
+static int
+_fail(nb_seg_conn_t *c)
+{
+    nb_seg_state_t *st;
+
+    st = c->st;
+    (void)pthread_mutex_lock(&st->mutex);
+    if ( c->seg >= 0 ) {
+        _seg_release(st, c);
+        c->seg = -1;
+    }
+    if ( !st->stop && 0 == st->err ) {
+        st->err = 0 != errno ? errno : EIO;
+    }
+    (void)pthread_mutex_unlock(&st->mutex);
+    _close(c);
+    c->fails++;
+
+    return c->fails < SEGMENT_RETRY_MAX;
+}
+
+/*
+ * Worker thread of a connection
+ */
+static void *
+_worker(void *arg)
+{
+    nb_seg_conn_t *c;
+    nb_seg_state_t *st;
+    nb_discard_t dis;
+    ssize_t nr;
+    int done;
+
+    c = (nb_seg_conn_t *)arg;
+    st = c->st;
+
+    /* Prepare the receive engine (TLS needs the data to be decrypted) */
+    if ( 0 != nb_discard_init(&dis, NB_TLS_NONE != st->result->tls
+                              ? NB_RECV_COPY : st->obj->rmode) ) {
+        (void)_fail(c);
+        return NULL;
+    }
+
+    /* The first segment may be requested already */
+    done = c->seg >= 0 && c->remain <= 0;
+    for ( ;; ) {
+        if ( c->seg < 0 ) {
+            c->seg = _seg_wait(st, c);
+            if ( c->seg < 0 ) {
+                break;
+            }
+            if ( c->sock < 0 && 0 != _open(c) ) {
+                if ( _fail(c) ) {
+                    continue;
+                }
+                break;
+            }
+            done = _request(c);
+        }
+
+        /* Receive the body of the segment */
+        while ( 0 == done && c->remain > 0 && !c->stopped ) {
+            nr = NULL != c->tls ? nb_tls_recv(c->tls, dis.buf, dis.bufsz)
+                : nb_discard_recv(&dis, c->sock);
+            if ( nr <= 0 ) {
+                if ( 0 == nr ) {
+                    errno = ECONNRESET;
+                }
+                done = -1;
+                break;
+            }
+            if ( nr > c->remain ) {
+                /* Garbage after the body */
+                nr = c->remain;
+            }
+            c->remain -= nr;
+            done = _account(c, nb_microtime(), 0, nr);
+        }
+        if ( 1 != done ) {
+            /* Failed, or the end of the measurement */
+            if ( c->stopped || !_fail(c) ) {
+                break;
+            }
+            done = 0;
+            continue;
+        }
+        c->seg = -1;
+        c->fails = 0;
+        done = 0;
+        if ( c->remain > 0 || !c->keep ) {
+            /* Cut short by the stealing, or not kept alive; the next
+               segment is of a new connection */
+            _close(c);
+        }
+    }
+    if ( c->seg >= 0 ) {
+        /* Incomplete at the end of the measurement */
+        (void)pthread_mutex_lock(&st->mutex);
+        _seg_release(st, c);
+        (void)pthread_mutex_unlock(&st->mutex);
+    }
+    nb_discard_release(&dis);
+    _close(c);
+
+    return NULL;
+}
+
+/*
+ * Download the object of the path over the connections of the measurement,
+ * each segment by a "Range:" request
+ * The result is prepared by nb_http_get_exec().  The callback function is
+ * called on the worker threads (one at a time).
+ */
+int
+nb_http_get_segmented(nb_http_get_t *obj, nb_http_get_result_t *result,
+                      const char *host, const char *port, const char *path,
+                      int family, double duration)
+{
+    nb_seg_state_t st;
+    nb_seg_conn_t *conns;
+    nb_seg_conn_t *c;
+    off_t segsize;
+    off_t off;
+    double end;
+    int nconns;
+    int i;
+
+    segsize = obj->segsize > 0 ? obj->segsize : SEGMENT_SIZE_DEFAULT;
+    conns = malloc(sizeof(nb_seg_conn_t) * obj->nconns);
+    if ( NULL == conns ) {
+        return -1;
+    }
+    st.obj = obj;
+    st.result = result;
+    st.host = host;
+    st.port = port;
+    st.path = path;
+    st.family = family;
+    st.size = -1;
+    st.nsegsres = 0;
+    st.duration = duration;
+    st.tx = 0;
+    st.rx = 0;
+    st.stop = 0;
+    st.err = 0;
+    if ( 0 != pthread_mutex_init(&st.mutex, NULL) ) {
+        free(conns);
+        return -1;
+    }
+    if ( 0 != pthread_cond_init(&st.cond, NULL) ) {
+        (void)pthread_mutex_destroy(&st.mutex);
+        free(conns);
+        return -1;
+    }
+    for ( i = 0; i < obj->nconns; i++ ) {
+        conns[i].st = &st;
+        conns[i].idx = i;
+        conns[i].sock = -1;
+        conns[i].tls = NULL;
+        conns[i].seg = -1;
+        conns[i].remain = 0;
+        conns[i].stopped = 0;
+        conns[i].nopen = 0;
+        conns[i].fails = 0;
+        conns[i].started = 0;
+    }
+    result->nconns = 0;
+    result->rmode = NB_TLS_NONE != result->tls ? NB_RECV_COPY : obj->rmode;
+
+    /* The first connection learns the size of the object by the first
+       segment */
+    c = &conns[0];
+    result->timing.start = nb_microtime();
+    if ( 0 != _open(c) ) {
+        (void)pthread_cond_destroy(&st.cond);
+        (void)pthread_mutex_destroy(&st.mutex);
+        free(conns);
+        return -1;
+    }
+    st.t0 = nb_microtime();
+    st.prevtm = st.t0;
+    nb_rate_series_start(&result->rate, st.t0);
+    _append(&st, st.t0);
+    c->seg = _seg_add(&st, 0, segsize - 1, 0);
+    if ( c->seg < 0 ) {
+        _close(c);
+        (void)pthread_cond_destroy(&st.cond);
+        (void)pthread_mutex_destroy(&st.mutex);
+        free(conns);
+        return -1;
+    }
+    result->segs[c->seg].requested = st.t0;
+    if ( _request(c) < 0 ) {
+        _close(c);
+        (void)pthread_cond_destroy(&st.cond);
+        (void)pthread_mutex_destroy(&st.mutex);
+        free(conns);
+        return -1;
+    }
+
+    /* The rest of the object is pending */
+    (void)pthread_mutex_lock(&st.mutex);
+    for ( off = result->segs[0].last + 1; off < st.size; off += segsize ) {
+        if ( _seg_add(&st, off, off + segsize < st.size
+                      ? off + segsize - 1 : st.size - 1, -1) < 0 ) {
+            break;
+        }
+    }
+    nconns = (int)result->nsegs < obj->nconns
+        ? (int)result->nsegs : obj->nconns;
+    (void)pthread_mutex_unlock(&st.mutex);
+
+    /* Start the workers, opening the other connections */
+    for ( i = 0; i < nconns; i++ ) {
+        c = &conns[i];
+        if ( i > 0 && 0 != _open(c) ) {
+            continue;
+        }
+        if ( 0 != pthread_create(&c->thread, NULL, _worker, c) ) {
+            if ( c->seg >= 0 ) {
+                (void)pthread_mutex_lock(&st.mutex);
+                _seg_release(&st, c);
+                (void)pthread_mutex_unlock(&st.mutex);
+            }
+            _close(c);
+            continue;
+        }
+        c->started = 1;
+        result->nconns++;
+    }
+    for ( i = 0; i < nconns; i++ ) {
+        if ( conns[i].started ) {
+            (void)pthread_join(conns[i].thread, NULL);
+        }
+    }
+
+    /* Completed time of the download */
+    end = st.prevtm;
+    for ( i = 0; i < (int)result->nsegs; i++ ) {
+        if ( result->segs[i].done > end ) {
+            end = result->segs[i].done;
+        }
+    }
+    if ( result->cnt > 0 && result->items[result->cnt - 1].tm > end ) {
+        end = result->items[result->cnt - 1].tm;
+    }
+    result->timing.body = end;
+    if ( NULL != obj->cb && end != st.prevtm ) {
+        obj->cb(obj, result->hlen, result->clen, st.t0, end, st.tx, st.rx);
+    }
+
+    (void)pthread_cond_destroy(&st.cond);
+    (void)pthread_mutex_destroy(&st.mutex);
+    free(conns);
+
+    /* A segment left with no connection to fetch it */
+    if ( !st.stop && _seg_incomplete(&st) ) {
+        errno = 0 != st.err ? st.err : EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
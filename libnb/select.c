@@ -0,0 +1,280 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * Selection of the measurement server
+ * All the candidates are probed at once by the TCP handshake (which needs no
+ * privilege, unlike ICMP, and goes to the port serving the measurement), and
+ * ranked by the loss, then by the median RTT.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* A few hundred milliseconds in total by default */
+#define SELECT_SAMPLES_DEFAULT          3
+#define SELECT_INTERVAL_DEFAULT         0.05
+#define SELECT_TIMEOUT_DEFAULT          0.25
+
+/* Prototype declarations */
+static void _result_delete(nb_server_select_result_t *);
+static void _probe_cb(nb_tcpping_t *, int, int, double);
+static int _cmp_double(const void *, const void *);
+static int _cmp_rank(const nb_server_select_item_t *, int, int);
+
+/*
+ * Create new server_select instance
+ */
+nb_server_select_t *
+nb_server_select_new(void)
+{
+    nb_server_select_t *obj;
+
+    obj = malloc(sizeof(nb_server_select_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->probe = nb_tcpping_new();
+    if ( NULL == obj->probe ) {
+        free(obj);
+        return NULL;
+    }
+    (void)nb_tcpping_set_callback(obj->probe, _probe_cb, obj);
+    obj->cb = NULL;
+    obj->user = NULL;
+    obj->samples = SELECT_SAMPLES_DEFAULT;
+    obj->interval = SELECT_INTERVAL_DEFAULT;
+    obj->timeout = SELECT_TIMEOUT_DEFAULT;
+    obj->last_result = NULL;
+    obj->cancel = 0;
+
+    return obj;
+}
+
+/*
+ * Set a callback function called on each probe completed
+ */
+int
+nb_server_select_set_callback(nb_server_select_t *obj,
+                              nb_server_select_cb_f cbfunc, void *user)
+{
+    obj->cb = cbfunc;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Set the number of the probes per candidate, the interval between them and
+ * the timeout of a probe
+ */
+int
+nb_server_select_set_probes(nb_server_select_t *obj, int samples,
+                            double interval, double timeout)
+{
+    if ( samples <= 0 || interval < 0.0 || timeout <= 0.0 ) {
+        return -1;
+    }
+    obj->samples = samples;
+    obj->interval = interval;
+    obj->timeout = timeout;
+
+    return 0;
+}
+
+/*
+ * Delete a result
+ */
+static void
+_result_delete(nb_server_select_result_t *result)
+{
+    free(result->items);
+    free(result->rank);
+    free(result);
+}
+
+/*
+ * Delete a server_select instance
+ */
+void
+nb_server_select_delete(nb_server_select_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    nb_tcpping_delete(obj->probe);
+    free(obj);
+}
+
+/*
+ * Relay the completion of a probe, and the cancel to the probe
+ */
+static void
+_probe_cb(nb_tcpping_t *probe, int target, int stat, double rtt)
+{
+    nb_server_select_t *obj;
+
+    obj = (nb_server_select_t *)probe->user;
+    probe->cancel = obj->cancel;
+    if ( NULL != obj->cb ) {
+        obj->cb(obj, target, stat, rtt);
+    }
+}
+
+/*
+ * Compare doubles for qsort()
+ */
+static int
+_cmp_double(const void *a, const void *b)
+{
+    double x;
+    double y;
+
+    x = *(const double *)a;
+    y = *(const double *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Compare the candidates a and b: fewer losses, lower median RTT, then lower
+ * minimum RTT first
+ */
+static int
+_cmp_rank(const nb_server_select_item_t *items, int a, int b)
+{
+    const nb_server_select_item_t *x;
+    const nb_server_select_item_t *y;
+
+    x = &items[a];
+    y = &items[b];
+    if ( x->received != y->received ) {
+        return x->received > y->received ? -1 : 1;
+    }
+    if ( x->rtt_median != y->rtt_median ) {
+        return x->rtt_median < y->rtt_median ? -1 : 1;
+    }
+    if ( x->rtt_min != y->rtt_min ) {
+        return x->rtt_min < y->rtt_min ? -1 : 1;
+    }
+
+    /* Keep the order of the candidates */
+    return a - b;
+}
+
+/*
+ * Probe the candidate hosts on the port, and rank them
+ * The best one is result->winner, or -1 if none of them is reachable.
+ */
+int
+nb_server_select_exec(nb_server_select_t *obj, const char *const *hosts,
+                      int n, const char *port, int family)
+{
+    nb_server_select_result_t *result;
+    nb_server_select_item_t *item;
+    nb_tcpping_result_t *pres;
+    nb_tcpping_result_item_t *pitem;
+    double *rtts;
+    double t0;
+    size_t i;
+    int c;
+    int k;
+
+    if ( n <= 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Allocate for the results */
+    result = malloc(sizeof(nb_server_select_result_t));
+    if ( NULL == result ) {
+        return -1;
+    }
+    result->n = n;
+    result->items = malloc(sizeof(nb_server_select_item_t) * n);
+    result->rank = malloc(sizeof(int) * n);
+    rtts = malloc(sizeof(double) * obj->samples);
+    if ( NULL == result->items || NULL == result->rank || NULL == rtts ) {
+        free(rtts);
+        _result_delete(result);
+        return -1;
+    }
+
+    /* Probe all the candidates at once */
+    t0 = nb_microtime();
+    obj->probe->cancel = obj->cancel;
+    if ( 0 != nb_tcpping_exec(obj->probe, hosts, n, port, family,
+                              obj->samples, obj->interval, obj->timeout) ) {
+        free(rtts);
+        _result_delete(result);
+        return -1;
+    }
+    result->elapsed = nb_microtime() - t0;
+    pres = obj->probe->last_result;
+
+    /* Summarize each candidate; the items are ordered by the rounds */
+    for ( c = 0; c < n; c++ ) {
+        item = &result->items[c];
+        item->sent = 0;
+        item->received = 0;
+        for ( i = c; i < pres->cnt; i += n ) {
+            pitem = &pres->items[i];
+            if ( pitem->sent > 0.0 ) {
+                item->sent++;
+            }
+            if ( NB_TCPPING_OK == pitem->stat ) {
+                rtts[item->received++] = pitem->rtt;
+            }
+        }
+        item->loss = 1.0 - (double)item->received / obj->samples;
+        if ( item->received > 0 ) {
+            qsort(rtts, item->received, sizeof(double), _cmp_double);
+            k = item->received / 2;
+            item->rtt_min = rtts[0];
+            item->rtt_median = item->received % 2
+                ? rtts[k] : (rtts[k - 1] + rtts[k]) / 2.0;
+        } else {
+            item->rtt_min = -1.0;
+            item->rtt_median = -1.0;
+        }
+    }
+    free(rtts);
+
+    /* Rank the candidates (insertion sort; they are a few) */
+    for ( c = 0; c < n; c++ ) {
+        for ( k = c; k > 0 && _cmp_rank(result->items, c,
+                                         result->rank[k - 1]) < 0; k-- ) {
+            result->rank[k] = result->rank[k - 1];
+        }
+        result->rank[k] = c;
+    }
+    result->winner = result->items[result->rank[0]].received > 0
+        ? result->rank[0] : -1;
+
+    /* Update the result */
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    obj->last_result = result;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,376 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RATE_SERIES_MAX                 (1024 * 1024)
+
+/* The ramp-up (the slow start) is over once a window grows by 10% or less */
+#define RATE_RAMP_GROWTH                0.1
+
+/* Estimator: windows of 200 ms, and at least 8 windows are needed to
+   converge */
+#define ESTIMATOR_WINDOW                0.2
+#define ESTIMATOR_WINDOWS_MIN           8
+
+/* Student's t at 97.5% for 1-15 degrees of freedom */
+static const double _student_t[NB_ESTIMATOR_WINDOWS - 1] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131
+};
+
+/* Prototype declarations */
+static nb_rate_bucket_t * _bucket(nb_rate_series_t *, uint64_t);
+static void _bucket_add(nb_rate_bucket_t *, double, double);
+static void _estimator_update(nb_estimator_t *);
+
+/*
+ * Prepare a fixed-interval series for the duration starting at t0
+ * All the buckets are preallocated; if the measurement runs longer than the
+ * duration, the buckets after the last one are not kept but counted in
+ * dropped.
+ */
+int
+nb_rate_series_init(nb_rate_series_t *series, double t0, double resolution,
+                    double duration)
+{
+    size_t n;
+
+    series->t0 = t0;
+    series->resolution = resolution;
+    series->nbuckets = 0;
+    series->cnt = 0;
+    series->dropped = 0;
+    series->lasttm = t0;
+    series->lastbytes = 0;
+    series->buckets = NULL;
+
+    if ( resolution <= 0.0 ) {
+        /* Disabled */
+        return 0;
+    }
+
+    /* +2 for the partial buckets at both ends */
+    n = (size_t)(duration / resolution) + 2;
+    if ( n > RATE_SERIES_MAX ) {
+        n = RATE_SERIES_MAX;
+    }
+    series->buckets = malloc(sizeof(nb_rate_bucket_t) * n);
+    if ( NULL == series->buckets ) {
+        return -1;
+    }
+    series->nbuckets = n;
+
+    return 0;
+}
+
+/*
+ * Set the start time of the series
+ */
+void
+nb_rate_series_start(nb_rate_series_t *series, double t0)
+{
+    series->t0 = t0;
+    series->lasttm = t0;
+    series->lastbytes = 0;
+}
+
+/*
+ * Release the series
+ */
+void
+nb_rate_series_release(nb_rate_series_t *series)
+{
+    free(series->buckets);
+    series->buckets = NULL;
+    series->nbuckets = 0;
+    series->cnt = 0;
+}
+
+/*
+ * Get the bucket of the sequence number, or NULL (counted in dropped) if it
+ * is beyond the series
+ */
+static nb_rate_bucket_t *
+_bucket(nb_rate_series_t *series, uint64_t seq)
+{
+    nb_rate_bucket_t *b;
+
+    if ( seq >= series->nbuckets ) {
+        if ( seq - series->nbuckets + 1 > series->dropped ) {
+            series->dropped = seq - series->nbuckets + 1;
+        }
+        return NULL;
+    }
+    while ( seq >= series->cnt ) {
+        b = &series->buckets[series->cnt];
+        b->bytes = 0;
+        b->maxrate = 0.0;
+        b->minrate = 0.0;
+        b->cnt = 0;
+        series->cnt++;
+    }
+
+    return &series->buckets[seq];
+}
+
+/*
+ * Account bytes and a rate to a bucket
+ */
+static void
+_bucket_add(nb_rate_bucket_t *b, double bytes, double rate)
+{
+    b->bytes += (off_t)bytes;
+    if ( 0 == b->cnt || rate > b->maxrate ) {
+        b->maxrate = rate;
+    }
+    if ( 0 == b->cnt || rate < b->minrate ) {
+        b->minrate = rate;
+    }
+    b->cnt++;
+}
+
+/*
+ * Add a sample of the cumulative bytes at the time
+ * The bytes since the previous sample are spread over the buckets that the
+ * interval spans, in proportion to the time spent in each of them.
+ */
+void
+nb_rate_series_add(nb_rate_series_t *series, double tm, off_t bytes)
+{
+    nb_rate_bucket_t *b;
+    uint64_t seq;
+    uint64_t last;
+    double delta;
+    double rate;
+    double tstart;
+    double tend;
+    double acc;
+    double part;
+
+    if ( NULL == series->buckets || tm < series->lasttm ) {
+        return;
+    }
+    delta = (double)(bytes - series->lastbytes);
+    if ( tm > series->lasttm ) {
+        rate = delta / (tm - series->lasttm);
+    } else {
+        rate = 0.0;
+    }
+
+    seq = (uint64_t)((series->lasttm - series->t0) / series->resolution);
+    last = (uint64_t)((tm - series->t0) / series->resolution);
+    acc = 0.0;
+    for ( ; seq <= last; seq++ ) {
+        b = _bucket(series, seq);
+        if ( NULL == b ) {
+            /* Full; the rest is not kept (but counted) */
+            (void)_bucket(series, last);
+            break;
+        }
+        if ( seq == last ) {
+            /* The rest, so that the total stays exact */
+            part = delta - acc;
+        } else {
+            tstart = series->t0 + seq * series->resolution;
+            tend = tstart + series->resolution;
+            if ( tstart < series->lasttm ) {
+                tstart = series->lasttm;
+            }
+            part = (double)(int64_t)(rate * (tend - tstart));
+        }
+        _bucket_add(b, part, rate);
+        acc += part;
+    }
+
+    series->lasttm = tm;
+    series->lastbytes = bytes;
+}
+
+/*
+ * Get the i-th bucket in the series
+ */
+const nb_rate_bucket_t *
+nb_rate_series_get(const nb_rate_series_t *series, size_t i, double *tm)
+{
+    if ( i >= series->cnt ) {
+        return NULL;
+    }
+    if ( NULL != tm ) {
+        /* Start time of the bucket */
+        *tm = series->t0 + i * series->resolution;
+    }
+
+    return &series->buckets[i];
+}
+
+/*
+ * Start the first window at t0 with the bytes already counted
+ */
+void
+nb_rate_window_start(nb_rate_window_t *w, double t0, off_t bytes)
+{
+    w->wstart = t0;
+    w->wbytes = bytes;
+    w->prevrate = 0.0;
+    w->ramped = 0;
+}
+
+/*
+ * Add a sample of the cumulative bytes at the time, closing the window once
+ * it is of the width
+ * Returns NB_RATE_WINDOW_OPEN if not closed, otherwise the phase of the
+ * closed window with its rate in *rate.
+ */
+int
+nb_rate_window_add(nb_rate_window_t *w, double width, double tm, off_t bytes,
+                   double *rate)
+{
+    if ( tm - w->wstart < width ) {
+        return NB_RATE_WINDOW_OPEN;
+    }
+
+    /* Close the window */
+    *rate = (double)(bytes - w->wbytes) / (tm - w->wstart);
+    w->wstart = tm;
+    w->wbytes = bytes;
+    if ( !w->ramped ) {
+        if ( w->prevrate <= 0.0
+             || *rate > w->prevrate * (1.0 + RATE_RAMP_GROWTH) ) {
+            /* Still ramping up */
+            w->prevrate = *rate;
+            return NB_RATE_WINDOW_RAMP;
+        }
+        w->ramped = 1;
+    }
+
+    return NB_RATE_WINDOW_STEADY;
+}
+
+/*
+ * Prepare an estimator ending at the relative half-width of the tolerance
+ */
+void
+nb_estimator_init(nb_estimator_t *e, double tolerance)
+{
+    e->tolerance = tolerance;
+    nb_rate_window_start(&e->win, 0.0, 0);
+    e->head = 0;
+    e->cnt = 0;
+    bzero(&e->est, sizeof(nb_estimate_t));
+}
+
+/*
+ * Start the first window at t0 with the bytes already counted
+ */
+void
+nb_estimator_start(nb_estimator_t *e, double t0, off_t bytes)
+{
+    nb_rate_window_start(&e->win, t0, bytes);
+}
+
+/*
+ * Compute the mean and the half-width of the confidence interval of the
+ * windows in the ring
+ */
+static void
+_estimator_update(nb_estimator_t *e)
+{
+    double mean;
+    double var;
+    double d;
+    int i;
+
+    mean = 0.0;
+    for ( i = 0; i < e->cnt; i++ ) {
+        mean += e->rates[i];
+    }
+    mean /= e->cnt;
+    e->est.rate = mean;
+    e->est.nwindows = e->cnt;
+    if ( e->cnt < 2 ) {
+        e->est.halfwidth = -1.0;
+        return;
+    }
+    var = 0.0;
+    for ( i = 0; i < e->cnt; i++ ) {
+        d = e->rates[i] - mean;
+        var += d * d;
+    }
+    var /= e->cnt - 1;
+    e->est.halfwidth = _student_t[e->cnt - 2] * sqrt(var / e->cnt);
+}
+
+/*
+ * Add a sample of the cumulative bytes at the time
+ * Returns 1 once the estimate has converged (never if the tolerance is 0).
+ */
+int
+nb_estimator_add(nb_estimator_t *e, double tm, off_t bytes)
+{
+    double rate;
+
+    if ( e->est.converged ) {
+        return 1;
+    }
+    if ( NB_RATE_WINDOW_STEADY != nb_rate_window_add(&e->win, ESTIMATOR_WINDOW,
+                                                     tm, bytes, &rate) ) {
+        /* Not closed, or in the slow start */
+        return 0;
+    }
+    e->rates[e->head] = rate;
+    e->head = (e->head + 1) % NB_ESTIMATOR_WINDOWS;
+    if ( e->cnt < NB_ESTIMATOR_WINDOWS ) {
+        e->cnt++;
+    }
+    _estimator_update(e);
+
+    if ( e->tolerance > 0.0 && e->cnt >= ESTIMATOR_WINDOWS_MIN
+         && e->est.rate > 0.0
+         && e->est.halfwidth <= e->tolerance * e->est.rate ) {
+        e->est.converged = 1;
+        e->est.tm = tm;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Account the bytes saved by ending early: the estimated rate over the
+ * remaining time, bounded by the remaining bytes if known (negative if not)
+ */
+void
+nb_estimator_finish(nb_estimator_t *e, double remtime, off_t rembytes)
+{
+    off_t saved;
+
+    if ( !e->est.converged || remtime <= 0.0 ) {
+        return;
+    }
+    saved = (off_t)(e->est.rate * remtime);
+    if ( rembytes >= 0 && saved > rembytes ) {
+        saved = rembytes;
+    }
+    e->est.saved = saved;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
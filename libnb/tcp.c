@@ -0,0 +1,640 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * Bulk transfer over a raw TCP connection
+ * The payload is streamed without HTTP framing to a sink/source server:
+ * netbenchd selects the direction by a command line sent first, and a
+ * discard (RFC 863) or chargen (RFC 864) server is used in the raw mode
+ * without it.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#if TARGET_LINUX && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#define RESULT_ITEMS_RESERVE_UNIT       4096
+#define SEND_BUFFER_SIZE                65536
+#define CONTENT_SIZE                    (1024 * 1024)   /* Sent by sendfile */
+#define POLL_INTERVAL                   0.1     /* To check the cancel */
+
+/* Command lines of netbenchd */
+#define COMMAND_DOWNLOAD                "NBTCP SOURCE\r\n"
+#define COMMAND_UPLOAD                  "NBTCP SINK\r\n"
+#define COMMAND_BIDIR                   "NBTCP BIDIR\r\n"
+
+/* Prototype declarations */
+static void _result_delete(nb_tcp_result_t *);
+static int _content_open(const char *);
+static ssize_t _send(int, int *, off_t *, const char *, int *);
+static void _append(nb_tcp_result_t *, double, off_t, off_t, off_t);
+
+/*
+ * Create new tcp instance
+ */
+nb_tcp_t *
+nb_tcp_new(void)
+{
+    nb_tcp_t *obj;
+
+    obj = malloc(sizeof(nb_tcp_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->cb = NULL;
+    obj->cbfreq = 0.0;
+    obj->user = NULL;
+    obj->rmode = NB_RECV_AUTO;
+    obj->raw = 0;
+    bzero(&obj->opts, sizeof(nb_sockopt_t));
+    obj->tcpi_interval = 0.0;
+    obj->resolution = 0.0;
+    obj->connect_timeout = 0.0;
+    obj->last_result = NULL;
+    obj->cancel = 0;
+
+    return obj;
+}
+
+/*
+ * Set a callback function
+ */
+int
+nb_tcp_set_callback(nb_tcp_t *obj, nb_tcp_cb_f cbfunc, double cbfreq,
+                    void *user)
+{
+    obj->cb = cbfunc;
+    obj->cbfreq = cbfreq;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Set the receive engine for the downloaded data
+ */
+int
+nb_tcp_set_recv_mode(nb_tcp_t *obj, int rmode)
+{
+    switch ( rmode ) {
+    case NB_RECV_AUTO:
+    case NB_RECV_COPY:
+    case NB_RECV_TRUNC:
+    case NB_RECV_SPLICE:
+        obj->rmode = rmode;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Set the socket buffer sizes in bytes (the system defaults and the
+ * autotuning if zero)
+ */
+int
+nb_tcp_set_sockbuf(nb_tcp_t *obj, int sndbuf, int rcvbuf)
+{
+    if ( sndbuf < 0 || rcvbuf < 0 ) {
+        return -1;
+    }
+    obj->opts.sndbuf = sndbuf;
+    obj->opts.rcvbuf = rcvbuf;
+
+    return 0;
+}
+
+/*
+ * Set all the socket options of the connection (the system defaults if
+ * NULL)
+ */
+int
+nb_tcp_set_sockopt(nb_tcp_t *obj, const nb_sockopt_t *opts)
+{
+    if ( NULL == opts ) {
+        bzero(&obj->opts, sizeof(nb_sockopt_t));
+        return 0;
+    }
+    if ( opts->sndbuf < 0 || opts->rcvbuf < 0 || opts->notsent_lowat < 0 ) {
+        return -1;
+    }
+    obj->opts = *opts;
+    obj->opts.congestion[NB_CONGESTION_NAME_MAX - 1] = '\0';
+
+    return 0;
+}
+
+/*
+ * Enable the TCP_INFO sampling at the interval (disabled if zero)
+ */
+int
+nb_tcp_set_tcp_info(nb_tcp_t *obj, double interval)
+{
+    if ( interval < 0.0 ) {
+        return -1;
+    }
+    obj->tcpi_interval = interval;
+
+    return 0;
+}
+
+/*
+ * Record the throughput in fixed-interval buckets of the resolution instead
+ * of an item per send or receive call (disabled if zero)
+ */
+int
+nb_tcp_set_resolution(nb_tcp_t *obj, double resolution)
+{
+    if ( resolution < 0.0 ) {
+        return -1;
+    }
+    obj->resolution = resolution;
+
+    return 0;
+}
+
+/*
+ * Give up establishing the connection after the timeout in seconds (the
+ * default if zero)
+ */
+int
+nb_tcp_set_connect_timeout(nb_tcp_t *obj, double timeout)
+{
+    if ( timeout < 0.0 ) {
+        return -1;
+    }
+    obj->connect_timeout = timeout;
+
+    return 0;
+}
+
+/*
+ * Stream without the command line to a discard or chargen server
+ */
+int
+nb_tcp_set_raw(nb_tcp_t *obj, int raw)
+{
+    obj->raw = raw;
+
+    return 0;
+}
+
+/*
+ * Delete a result
+ */
+static void
+_result_delete(nb_tcp_result_t *result)
+{
+    nb_tcp_info_series_release(&result->tcpi);
+    nb_rate_series_release(&result->rate);
+    nb_rate_series_release(&result->txrate);
+    free(result->items);
+    free(result);
+}
+
+/*
+ * Delete a tcp instance
+ */
+void
+nb_tcp_delete(nb_tcp_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    free(obj);
+}
+
+/*
+ * Create the content file of the buffer repeated, which is sent by sendfile
+ * Returns -1 if sendfile is not available.
+ */
+static int
+_content_open(const char *buf)
+{
+#if TARGET_LINUX && defined(HAVE_SENDFILE)
+    int fd;
+    int i;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("nb_tcp", 0);
+#else
+    char path[] = "/tmp/nb_tcp.XXXXXX";
+
+    fd = mkstemp(path);
+    if ( fd >= 0 ) {
+        (void)unlink(path);
+    }
+#endif
+    if ( fd < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < CONTENT_SIZE / SEND_BUFFER_SIZE; i++ ) {
+        if ( write(fd, buf, SEND_BUFFER_SIZE) != SEND_BUFFER_SIZE ) {
+            (void)close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+#else
+    (void)buf;
+
+    return -1;
+#endif
+}
+
+/*
+ * Send the next chunk, by sendfile wrapping around the content file if it
+ * is open, otherwise from the buffer
+ * The content file is closed to fall back if the socket does not support
+ * sendfile, and the zero-copy flag is cleared.
+ */
+static ssize_t
+_send(int sock, int *fd, off_t *off, const char *buf, int *zerocopy)
+{
+#if TARGET_LINUX && defined(HAVE_SENDFILE)
+    ssize_t nw;
+
+    if ( *fd >= 0 ) {
+        if ( *off >= CONTENT_SIZE ) {
+            *off = 0;
+        }
+        nw = sendfile(sock, *fd, off, (size_t)(CONTENT_SIZE - *off));
+        if ( nw >= 0 || (EINVAL != errno && ENOSYS != errno) ) {
+            return nw;
+        }
+        /* Not supported for this socket */
+        (void)close(*fd);
+        *fd = -1;
+        *zerocopy = 0;
+    }
+#endif
+
+    return send(sock, buf, SEND_BUFFER_SIZE, 0);
+}
+
+/*
+ * Append a result item
+ */
+static void
+_append(nb_tcp_result_t *result, double tm, off_t btx, off_t tx, off_t rx)
+{
+    nb_tcp_result_item_t *items;
+    size_t cntres;
+
+    if ( result->cnt >= result->cntres ) {
+        /* Realloc */
+        cntres = result->cntres + RESULT_ITEMS_RESERVE_UNIT;
+        items = realloc(result->items, sizeof(nb_tcp_result_item_t) * cntres);
+        if ( NULL == items ) {
+            return;
+        }
+        result->items = items;
+        result->cntres = cntres;
+    }
+    result->items[result->cnt].tm = tm;
+    result->items[result->cnt].btx = btx;
+    result->items[result->cnt].tx = tx;
+    result->items[result->cnt].rx = rx;
+    result->cnt++;
+}
+
+/*
+ * Execute a bulk transfer in the direction (NB_TCP_*) for the duration
+ * The transfer ends early if the peer closes the connection or an error
+ * occurs, and the result is kept.  The caller is expected to ignore SIGPIPE.
+ */
+int
+nb_tcp_exec(nb_tcp_t *obj, const char *host, const char *port, int family,
+            int dir, double duration)
+{
+    nb_tcp_result_t *result;
+    char buf[SEND_BUFFER_SIZE];
+    const char *cmd;
+    struct pollfd pfd;
+    nb_discard_t dis;
+    nb_txprog_t txp;
+    socklen_t optlen;
+    uint32_t x;
+    ssize_t nr;
+    ssize_t nw;
+    size_t i;
+    off_t off;
+    off_t tx;
+    off_t btx;
+    off_t rx;
+    double t0;
+    double curtm;
+    double prevtm;
+    double wait;
+    int recving;
+    int sending;
+    int rready;
+    int wready;
+    int flags;
+    int sock;
+    int fd;
+    int opt;
+    int n;
+
+    switch ( dir ) {
+    case NB_TCP_DOWNLOAD:
+        cmd = COMMAND_DOWNLOAD;
+        break;
+    case NB_TCP_UPLOAD:
+        cmd = COMMAND_UPLOAD;
+        break;
+    case NB_TCP_BIDIR:
+        cmd = COMMAND_BIDIR;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Allocate for the results */
+    result = malloc(sizeof(nb_tcp_result_t));
+    if ( NULL == result ) {
+        return -1;
+    }
+    result->cnt = 0;
+    result->cntres = RESULT_ITEMS_RESERVE_UNIT;
+    result->items = malloc(sizeof(nb_tcp_result_item_t) * result->cntres);
+    if ( NULL == result->items ) {
+        free(result);
+        return -1;
+    }
+    result->dir = dir;
+    result->zerocopy = 0;
+    result->start = 0.0;
+    result->end = 0.0;
+    if ( 0 != nb_tcp_info_series_init(&result->tcpi, obj->tcpi_interval,
+                                      duration) ) {
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    if ( 0 != nb_rate_series_init(&result->rate, 0.0, obj->resolution,
+                                  duration) ) {
+        nb_tcp_info_series_release(&result->tcpi);
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    if ( 0 != nb_rate_series_init(&result->txrate, 0.0, obj->resolution,
+                                  duration) ) {
+        nb_rate_series_release(&result->rate);
+        nb_tcp_info_series_release(&result->tcpi);
+        free(result->items);
+        free(result);
+        return -1;
+    }
+
+    /* Open a socket with the buffer sizes */
+    sock = nb_open_stream_socket(host, port, family, obj->connect_timeout,
+                                 &obj->opts, &result->conn);
+    if ( sock < 0 ) {
+        _result_delete(result);
+        return -1;
+    }
+    /* Get MSS and the buffer sizes in effect */
+    optlen = sizeof(opt);
+    result->mss = 0 == getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &opt, &optlen)
+        ? opt : -1;
+    optlen = sizeof(opt);
+    result->sndbuf = 0 == getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt,
+                                     &optlen) ? opt : -1;
+    optlen = sizeof(opt);
+    result->rcvbuf = 0 == getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opt,
+                                     &optlen) ? opt : -1;
+
+    /* Prepare the receive engine */
+    if ( 0 != nb_discard_init(&dis, obj->rmode) ) {
+        (void)close(sock);
+        _result_delete(result);
+        return -1;
+    }
+    result->rmode = dis.mode;
+
+    /* Prepare the data to send (pseudo-random not to be compressed on the
+       path) */
+    fd = -1;
+    if ( NB_TCP_DOWNLOAD != dir ) {
+        x = 2463534242U;
+        for ( i = 0; i < sizeof(buf); i += 4 ) {
+            /* xorshift32 */
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            (void)memcpy(buf + i, &x, 4);
+        }
+        fd = _content_open(buf);
+        result->zerocopy = fd >= 0;
+    }
+    off = 0;
+
+    /* Initialize the variables for saving statistics */
+    tx = 0;
+    btx = 0;
+    rx = 0;
+
+    /* Obtain the current time */
+    t0 = nb_microtime();
+    result->start = t0;
+    nb_rate_series_start(&result->rate, t0);
+    nb_rate_series_start(&result->txrate, t0);
+    _append(result, t0, btx, tx, rx);
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, t0, 1);
+
+    /* Prepare for tracking the acknowledged bytes */
+    (void)nb_txprog_init(&txp, sock);
+
+    /* Send the command line */
+    if ( !obj->raw ) {
+        nw = send(sock, cmd, strlen(cmd), 0);
+        if ( nw != (ssize_t)strlen(cmd) ) {
+            nb_txprog_release(&txp);
+            nb_discard_release(&dis);
+            if ( fd >= 0 ) {
+                (void)close(fd);
+            }
+            (void)close(sock);
+            _result_delete(result);
+            return -1;
+        }
+        btx += nw;
+    }
+
+    /* Both directions are multiplexed on the non-blocking socket */
+    flags = fcntl(sock, F_GETFL, 0);
+    if ( flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0 ) {
+        nb_txprog_release(&txp);
+        nb_discard_release(&dis);
+        if ( fd >= 0 ) {
+            (void)close(fd);
+        }
+        (void)close(sock);
+        _result_delete(result);
+        return -1;
+    }
+
+    /* Transfer; poll only when all the active directions would block */
+    recving = 1;
+    sending = NB_TCP_DOWNLOAD != dir;
+    rready = 1;
+    wready = sending;
+    prevtm = t0;
+    curtm = t0;
+    while ( !obj->cancel && (recving || sending) ) {
+        if ( !(recving && rready) && !(sending && wready) ) {
+            wait = t0 + duration - curtm;
+            if ( wait > POLL_INTERVAL ) {
+                wait = POLL_INTERVAL;
+            }
+            if ( wait < 0.0 ) {
+                wait = 0.0;
+            }
+            pfd.fd = sock;
+            pfd.events = (recving ? POLLIN : 0) | (sending ? POLLOUT : 0);
+            pfd.revents = 0;
+            n = poll(&pfd, 1, (int)(wait * 1000 + 0.999));
+            if ( n < 0 && EINTR != errno ) {
+                break;
+            }
+            if ( n > 0 ) {
+                rready = 0 != (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+                wready = 0 != (pfd.revents & (POLLOUT | POLLHUP | POLLERR));
+            }
+        }
+
+        /* Receive */
+        nr = 0;
+        if ( recving && rready ) {
+            nr = nb_discard_recv(&dis, sock);
+            if ( 0 == nr ) {
+                /* Closed by the peer */
+                recving = 0;
+                if ( NB_TCP_DOWNLOAD == dir ) {
+                    break;
+                }
+            } else if ( nr < 0 ) {
+                if ( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                    rready = 0;
+                } else if ( EINTR != errno ) {
+                    break;
+                }
+                nr = 0;
+            }
+            rx += nr;
+        }
+
+        /* Send */
+        nw = 0;
+        if ( sending && wready ) {
+            nw = _send(sock, &fd, &off, buf, &result->zerocopy);
+            if ( nw < 0 ) {
+                if ( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                    wready = 0;
+                } else if ( EINTR != errno ) {
+                    break;
+                }
+                nw = 0;
+            }
+            btx += nw;
+        }
+
+        curtm = nb_microtime();
+        if ( nr > 0 || nw > 0 ) {
+            if ( nw > 0 && 0 != nb_txprog_get(&txp, sock, btx, &tx, NULL) ) {
+                /* Cannot track the acknowledged size */
+                tx = btx;
+            }
+
+            /* Insert a result item */
+            if ( NULL != result->rate.buckets ) {
+                /* Aggregate into the fixed-interval buckets instead */
+                if ( nr > 0 ) {
+                    nb_rate_series_add(&result->rate, curtm, rx);
+                }
+                if ( nw > 0 ) {
+                    nb_rate_series_add(&result->txrate, curtm, tx);
+                }
+            } else {
+                _append(result, curtm, btx, tx, rx);
+            }
+
+            /* Sample the TCP information */
+            (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 0);
+        }
+
+        /* Report by calling a callback function */
+        if ( NULL != obj->cb ) {
+            if ( curtm - prevtm >= obj->cbfreq ) {
+                obj->cb(obj, t0, curtm, btx, tx, rx);
+                prevtm = curtm;
+            }
+        }
+        if ( curtm - t0 >= duration ) {
+            /* End-of-measurement */
+            break;
+        }
+    }
+    if ( curtm != prevtm ) {
+        if ( NULL != obj->cb ) {
+            obj->cb(obj, t0, curtm, btx, tx, rx);
+        }
+    }
+    result->end = curtm;
+
+    /* The last sample of the TCP information */
+    (void)nb_tcp_info_series_sample(&result->tcpi, sock, curtm, 1);
+
+    /* Close the socket without waiting for the buffered data */
+    result->rmode = dis.mode;
+    nb_txprog_release(&txp);
+    nb_discard_release(&dis);
+    if ( fd >= 0 ) {
+        (void)close(fd);
+    }
+    shutdown(sock, SHUT_RDWR);
+    (void)close(sock);
+
+    /* Update the result */
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    obj->last_result = result;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,380 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <poll.h>
+#if TARGET_LINUX
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#endif
+
+#define TXPROG_WAIT_MIN                 0.0005
+#define TXPROG_WAIT_MAX                 0.05
+#define TXPROG_WAIT_DEFAULT             0.001
+#define TCP_INFO_SERIES_MAX             (1024 * 1024)
+
+/*
+ * Get the TCP_INFO of the socket
+ * Returns the length filled by the kernel, or -1 on failure.
+ */
+int
+nb_tcp_info(int sock, nb_tcp_info_t *info)
+{
+#if TARGET_LINUX
+    socklen_t optlen;
+
+    bzero(info, sizeof(nb_tcp_info_t));
+    optlen = sizeof(nb_tcp_info_t);
+    if ( 0 != getsockopt(sock, IPPROTO_TCP, TCP_INFO, info, &optlen) ) {
+        return -1;
+    }
+
+    return (int)optlen;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Prepare for tracking the transmission progress of the socket
+ */
+int
+nb_txprog_init(nb_txprog_t *txp, int sock)
+{
+    nb_tcp_info_t info;
+    int len;
+    int opt;
+    socklen_t optlen;
+
+    txp->method = NB_TXPROG_NONE;
+    txp->base = 0;
+    txp->sock = sock;
+    txp->lowat = -1;
+    txp->lowatset = 0;
+    txp->epfd = -1;
+    txp->events = 0;
+
+#if TARGET_LINUX
+    /* Bytes acknowledged in the handshake are excluded by the base */
+    len = nb_tcp_info(sock, &info);
+    if ( len >= 0 && TCP_INFO_HAS(len, tcpi_notsent_bytes) ) {
+        txp->method = NB_TXPROG_TCPINFO;
+        txp->base = info.tcpi_bytes_acked;
+    } else if ( 0 == ioctl(sock, SIOCOUTQ, &opt) ) {
+        txp->method = NB_TXPROG_OUTQ;
+    }
+    txp->epfd = epoll_create(1);
+
+    /* The not-sent low-water mark changed by the wait is restored at the
+       release, as the connection may be kept alive */
+    optlen = sizeof(opt);
+    if ( 0 == getsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt,
+                         &optlen) ) {
+        txp->lowat = opt;
+    }
+#elif defined(SO_NWRITE)
+    (void)info;
+    (void)len;
+    optlen = sizeof(opt);
+    if ( 0 == getsockopt(sock, SOL_SOCKET, SO_NWRITE, &opt, &optlen) ) {
+        txp->method = NB_TXPROG_NWRITE;
+    }
+#else
+    (void)info;
+    (void)len;
+    (void)opt;
+    (void)optlen;
+#endif
+
+    return 0;
+}
+
+/*
+ * Release the resources for tracking the transmission progress
+ */
+void
+nb_txprog_release(nb_txprog_t *txp)
+{
+#if TARGET_LINUX
+    if ( txp->lowatset ) {
+        (void)setsockopt(txp->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                         &txp->lowat, sizeof(txp->lowat));
+        txp->lowatset = 0;
+    }
+#endif
+    if ( txp->epfd >= 0 ) {
+        (void)close(txp->epfd);
+        txp->epfd = -1;
+    }
+}
+
+/*
+ * Get the bytes acknowledged by the peer (tx) out of the buffered bytes (btx)
+ * The bytes not sent yet are stored to notsent if it is available.
+ */
+int
+nb_txprog_get(nb_txprog_t *txp, int sock, off_t btx, off_t *tx,
+              off_t *notsent)
+{
+    int opt;
+    socklen_t optlen;
+#if TARGET_LINUX
+    nb_tcp_info_t info;
+    int len;
+#endif
+
+    if ( NULL != notsent ) {
+        *notsent = -1;
+    }
+
+    switch ( txp->method ) {
+#if TARGET_LINUX
+    case NB_TXPROG_TCPINFO:
+        len = nb_tcp_info(sock, &info);
+        if ( len < 0 ) {
+            break;
+        }
+        *tx = (off_t)(info.tcpi_bytes_acked - txp->base);
+        if ( *tx > btx ) {
+            /* FIN is acknowledged */
+            *tx = btx;
+        }
+        if ( NULL != notsent ) {
+            *notsent = info.tcpi_notsent_bytes;
+        }
+        return 0;
+    case NB_TXPROG_OUTQ:
+        if ( 0 != ioctl(sock, SIOCOUTQ, &opt) ) {
+            break;
+        }
+        *tx = btx - opt;
+        if ( NULL != notsent && 0 == ioctl(sock, SIOCOUTQNSD, &opt) ) {
+            *notsent = opt;
+        }
+        return 0;
+#endif
+#ifdef SO_NWRITE
+    case NB_TXPROG_NWRITE:
+        optlen = sizeof(opt);
+        if ( 0 != getsockopt(sock, SOL_SOCKET, SO_NWRITE, &opt, &optlen) ) {
+            break;
+        }
+        *tx = btx - opt;
+        return 0;
+#endif
+    default:
+        break;
+    }
+    (void)opt;
+    (void)optlen;
+
+    *tx = 0;
+
+    return -1;
+}
+
+/*
+ * Wait for a progress of the transmission, or the response from the peer
+ * Returns 1 if the socket becomes readable, 0 on timeout, -1 on failure.
+ */
+int
+nb_txprog_wait(nb_txprog_t *txp, int sock, double timeout)
+{
+#if TARGET_LINUX
+    struct epoll_event ev;
+    nb_tcp_info_t info;
+    uint32_t events;
+    double to;
+    int opt;
+    int n;
+
+    if ( txp->epfd < 0 ) {
+        (void)poll(NULL, 0, (int)(TXPROG_WAIT_DEFAULT * 1000));
+        return 0;
+    }
+
+    /* Wait for the next acknowledgement: a fraction of the smoothed RTT */
+    to = TXPROG_WAIT_DEFAULT;
+    events = EPOLLIN;
+    if ( nb_tcp_info(sock, &info) >= 0 ) {
+        to = info.tcpi_rtt / 4.0 / 1000000;
+        if ( to < TXPROG_WAIT_MIN ) {
+            to = TXPROG_WAIT_MIN;
+        } else if ( to > TXPROG_WAIT_MAX ) {
+            to = TXPROG_WAIT_MAX;
+        }
+        if ( NB_TXPROG_TCPINFO == txp->method && txp->lowat >= 0
+             && info.tcpi_notsent_bytes > 0 ) {
+            /* Get notified when all the buffered data is sent out */
+            events |= EPOLLOUT;
+        }
+    }
+    if ( to > timeout ) {
+        to = timeout > 0.0 ? timeout : 0.0;
+    }
+
+    if ( events != txp->events ) {
+        if ( (EPOLLOUT & events) && !txp->lowatset ) {
+            /* EPOLLOUT fires only when all the data has been sent */
+            opt = 1;
+            if ( 0 == setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt,
+                                 sizeof(opt)) ) {
+                txp->lowatset = 1;
+            }
+        }
+        ev.events = events;
+        ev.data.fd = sock;
+        if ( 0 == txp->events ) {
+            n = epoll_ctl(txp->epfd, EPOLL_CTL_ADD, sock, &ev);
+        } else {
+            n = epoll_ctl(txp->epfd, EPOLL_CTL_MOD, sock, &ev);
+        }
+        if ( 0 != n ) {
+            return -1;
+        }
+        txp->events = events;
+    }
+
+    n = epoll_wait(txp->epfd, &ev, 1, (int)(to * 1000 + 0.5));
+    if ( n < 0 ) {
+        return EINTR == errno ? 0 : -1;
+    } else if ( n > 0 && (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ) {
+        return 1;
+    }
+
+    return 0;
+#else
+    struct pollfd fds[1];
+    int n;
+
+    /* Poll with the constant interval */
+    if ( timeout > TXPROG_WAIT_DEFAULT ) {
+        timeout = TXPROG_WAIT_DEFAULT;
+    }
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    n = poll(fds, 1, (int)(timeout * 1000 + 0.5));
+    if ( n < 0 ) {
+        return EINTR == errno ? 0 : -1;
+    } else if ( n > 0 ) {
+        return 1;
+    }
+
+    return 0;
+#endif
+}
+
+/*
+ * Prepare a TCP_INFO series sampled at the interval for the duration
+ * The series is preallocated so that the sampling never reallocates.
+ */
+int
+nb_tcp_info_series_init(nb_tcp_info_series_t *series, double interval,
+                        double duration)
+{
+    series->interval = interval;
+    series->last = 0.0;
+    series->cnt = 0;
+    series->cntres = 0;
+    series->items = NULL;
+
+    if ( interval <= 0.0 ) {
+        /* Disabled */
+        return 0;
+    }
+#if TARGET_LINUX
+    /* +2 for the first and the last samples */
+    series->cntres = (size_t)(duration / interval) + 2;
+    if ( series->cntres > TCP_INFO_SERIES_MAX ) {
+        series->cntres = TCP_INFO_SERIES_MAX;
+    }
+    series->items = malloc(sizeof(nb_tcp_info_item_t) * series->cntres);
+    if ( NULL == series->items ) {
+        series->cntres = 0;
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Take a TCP_INFO sample if the interval has passed since the last one
+ * The sample is taken regardless of the interval if force is non-zero.
+ */
+int
+nb_tcp_info_series_sample(nb_tcp_info_series_t *series, int sock, double tm,
+                          int force)
+{
+    nb_tcp_info_t info;
+    nb_tcp_info_item_t *item;
+    int len;
+
+    if ( series->cnt >= series->cntres ) {
+        /* Disabled or full */
+        return -1;
+    }
+    if ( !force && series->cnt > 0 && tm - series->last < series->interval ) {
+        return 0;
+    }
+    len = nb_tcp_info(sock, &info);
+    if ( len < 0 ) {
+        return -1;
+    }
+    series->last = tm;
+
+    /* Members unknown to the kernel are zero */
+    item = &series->items[series->cnt];
+    item->tm = tm;
+    item->srtt = info.tcpi_rtt;
+    item->rttvar = info.tcpi_rttvar;
+    item->cwnd = info.tcpi_snd_cwnd;
+    item->retrans = info.tcpi_total_retrans;
+    item->delivery_rate = info.tcpi_delivery_rate;
+    item->pacing_rate = info.tcpi_pacing_rate;
+    item->busy = info.tcpi_busy_time;
+    item->rwnd_limited = info.tcpi_rwnd_limited;
+    item->sndbuf_limited = info.tcpi_sndbuf_limited;
+    series->cnt++;
+
+    return 0;
+}
+
+/*
+ * Release the TCP_INFO series
+ */
+void
+nb_tcp_info_series_release(nb_tcp_info_series_t *series)
+{
+    free(series->items);
+    series->items = NULL;
+    series->cnt = 0;
+    series->cntres = 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,629 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * TCP handshake RTT (tcpping)
+ * A probe is a non-blocking connect(2): the SYN to SYN-ACK (or RST) time is
+ * taken from TCP_INFO where available, and the connection is aborted by RST
+ * (SO_LINGER of zero) so that no TIME_WAIT is left on either side.  The
+ * probes to all the targets run concurrently in a single event loop.
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#if TARGET_LINUX
+#include <sys/epoll.h>
+#endif
+
+#define TCPPING_INFLIGHT_MAX            256
+#define TCPPING_WAIT_MAX                0.1     /* To check the cancel */
+#define TCPPING_RESOLVERS_MAX           16
+
+/*
+ * Resolution of the targets shared by the resolver threads
+ * The threads are detached, so the last one of the caller and the threads
+ * frees it; the caller may give up the ones not resolved yet.
+ */
+struct tcpping_resolver {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int refs;                   /* The caller and the running threads */
+    int next;                   /* Next target to resolve */
+    int pending;                /* Targets not resolved yet */
+    int ntargets;
+    char **hosts;
+    char *port;
+    int family;
+    nb_tcpping_target_t *targets;
+};
+
+/*
+ * Probe in flight
+ */
+struct tcpping_slot {
+    int sock;                   /* -1 if free */
+    size_t item;
+};
+
+/* Prototype declarations */
+static void _result_delete(nb_tcpping_result_t *);
+static int _resolve(nb_tcpping_target_t *, const char *, const char *, int);
+static void _resolver_release(struct tcpping_resolver *);
+static void * _resolver_run(void *);
+static void
+_resolve_all(nb_tcpping_target_t *, const char *const *, int, const char *,
+             int, double);
+static int _probe_start(const nb_tcpping_target_t *, double *);
+static void _probe_abort(int);
+static void _probe_finish(nb_tcpping_t *, nb_tcpping_result_item_t *, int,
+                          double);
+
+/*
+ * Create new tcpping instance
+ */
+nb_tcpping_t *
+nb_tcpping_new(void)
+{
+    nb_tcpping_t *obj;
+
+    obj = malloc(sizeof(nb_tcpping_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->cb = NULL;
+    obj->user = NULL;
+    obj->last_result = NULL;
+    obj->cancel = 0;
+
+    return obj;
+}
+
+/*
+ * Set a callback function called on each probe completed
+ */
+int
+nb_tcpping_set_callback(nb_tcpping_t *obj, nb_tcpping_cb_f cbfunc, void *user)
+{
+    obj->cb = cbfunc;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Delete a result
+ */
+static void
+_result_delete(nb_tcpping_result_t *result)
+{
+    free(result->targets);
+    free(result->items);
+    free(result);
+}
+
+/*
+ * Delete a tcpping instance
+ */
+void
+nb_tcpping_delete(nb_tcpping_t *obj)
+{
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    free(obj);
+}
+
+/*
+ * Resolve the address of a target (the first one)
+ */
+static int
+_resolve(nb_tcpping_target_t *t, const char *host, const char *port,
+         int family)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+
+    t->addrlen = 0;
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( 0 != getaddrinfo(host, port, &hints, &res) ) {
+        return -1;
+    }
+    memcpy(&t->addr, res->ai_addr, res->ai_addrlen);
+    t->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/*
+ * Drop a reference to the resolution, and free it if the last
+ */
+static void
+_resolver_release(struct tcpping_resolver *r)
+{
+    int refs;
+    int i;
+
+    (void)pthread_mutex_lock(&r->mutex);
+    refs = --r->refs;
+    (void)pthread_mutex_unlock(&r->mutex);
+    if ( refs > 0 ) {
+        return;
+    }
+    for ( i = 0; i < r->ntargets; i++ ) {
+        free(r->hosts[i]);
+    }
+    free(r->hosts);
+    free(r->port);
+    free(r->targets);
+    (void)pthread_cond_destroy(&r->cond);
+    (void)pthread_mutex_destroy(&r->mutex);
+    free(r);
+}
+
+/*
+ * Resolver thread: resolve the next targets until none is left
+ */
+static void *
+_resolver_run(void *arg)
+{
+    struct tcpping_resolver *r;
+    nb_tcpping_target_t t;
+    int i;
+
+    r = (struct tcpping_resolver *)arg;
+    for ( ;; ) {
+        (void)pthread_mutex_lock(&r->mutex);
+        i = r->next < r->ntargets ? r->next++ : -1;
+        (void)pthread_mutex_unlock(&r->mutex);
+        if ( i < 0 ) {
+            break;
+        }
+        (void)_resolve(&t, r->hosts[i], r->port, r->family);
+        (void)pthread_mutex_lock(&r->mutex);
+        r->targets[i] = t;
+        r->pending--;
+        (void)pthread_cond_signal(&r->cond);
+        (void)pthread_mutex_unlock(&r->mutex);
+    }
+    _resolver_release(r);
+
+    return NULL;
+}
+
+/*
+ * Resolve the targets concurrently, waiting for them up to the timeout
+ * The ones not resolved in the timeout are left unresolved (addrlen of 0),
+ * so a slow resolver does not delay the probes of the others.
+ */
+static void
+_resolve_all(nb_tcpping_target_t *targets, const char *const *hosts,
+             int ntargets, const char *port, int family, double timeout)
+{
+    struct tcpping_resolver *r;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct timespec ts;
+    double deadline;
+    int nthreads;
+    int i;
+
+    for ( i = 0; i < ntargets; i++ ) {
+        targets[i].addrlen = 0;
+    }
+
+    r = malloc(sizeof(struct tcpping_resolver));
+    if ( NULL == r ) {
+        return;
+    }
+    r->hosts = calloc(ntargets, sizeof(char *));
+    r->port = strdup(port);
+    r->targets = calloc(ntargets, sizeof(nb_tcpping_target_t));
+    if ( NULL == r->hosts || NULL == r->port || NULL == r->targets ) {
+        free(r->hosts);
+        free(r->port);
+        free(r->targets);
+        free(r);
+        return;
+    }
+    for ( i = 0; i < ntargets; i++ ) {
+        r->hosts[i] = strdup(hosts[i]);
+        if ( NULL == r->hosts[i] ) {
+            break;
+        }
+    }
+    (void)pthread_mutex_init(&r->mutex, NULL);
+    (void)pthread_cond_init(&r->cond, NULL);
+    r->refs = 1;
+    r->next = 0;
+    r->pending = i;
+    r->ntargets = i;
+    r->family = family;
+    if ( i < ntargets ) {
+        /* Out of memory */
+        r->pending = 0;
+        _resolver_release(r);
+        return;
+    }
+
+    /* Start the resolvers */
+    nthreads = ntargets < TCPPING_RESOLVERS_MAX
+        ? ntargets : TCPPING_RESOLVERS_MAX;
+    (void)pthread_attr_init(&attr);
+    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for ( i = 0; i < nthreads; i++ ) {
+        (void)pthread_mutex_lock(&r->mutex);
+        r->refs++;
+        (void)pthread_mutex_unlock(&r->mutex);
+        if ( 0 != pthread_create(&thread, &attr, _resolver_run, r) ) {
+            (void)pthread_mutex_lock(&r->mutex);
+            r->refs--;
+            (void)pthread_mutex_unlock(&r->mutex);
+            break;
+        }
+    }
+    (void)pthread_attr_destroy(&attr);
+    if ( 0 == i ) {
+        /* No thread; resolve them one by one */
+        r->refs++;
+        (void)_resolver_run(r);
+    }
+
+    /* Wait for them up to the timeout */
+    deadline = nb_microtime() + timeout;
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1000000000);
+    (void)pthread_mutex_lock(&r->mutex);
+    while ( r->pending > 0 ) {
+        if ( ETIMEDOUT == pthread_cond_timedwait(&r->cond, &r->mutex,
+                                                 &ts) ) {
+            break;
+        }
+    }
+    /* Not to take the rest any more */
+    r->next = r->ntargets;
+    (void)memcpy(targets, r->targets, sizeof(nb_tcpping_target_t) * ntargets);
+    (void)pthread_mutex_unlock(&r->mutex);
+    _resolver_release(r);
+}
+
+/*
+ * Send a SYN by a non-blocking connect
+ * Returns the socket, or -1 on failure.
+ */
+static int
+_probe_start(const nb_tcpping_target_t *t, double *sent)
+{
+    int sock;
+    int flags;
+    int err;
+
+    sock = socket(t->addr.ss_family, SOCK_STREAM, 0);
+    if ( sock < 0 ) {
+        return -1;
+    }
+    flags = fcntl(sock, F_GETFL, 0);
+    if ( flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0 ) {
+        (void)close(sock);
+        return -1;
+    }
+    *sent = nb_microtime();
+    if ( 0 != connect(sock, (const struct sockaddr *)&t->addr, t->addrlen)
+         && EINPROGRESS != errno ) {
+        err = errno;
+        (void)close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * Abort the connection by RST not to leave TIME_WAIT
+ */
+static void
+_probe_abort(int sock)
+{
+    struct linger l;
+
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    (void)setsockopt(sock, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    (void)close(sock);
+}
+
+/*
+ * Record the completion of the probe, and abort the connection
+ */
+static void
+_probe_finish(nb_tcpping_t *obj, nb_tcpping_result_item_t *item, int sock,
+              double tm)
+{
+    socklen_t optlen;
+    int err;
+#if TARGET_LINUX
+    nb_tcp_info_t info;
+    int len;
+#endif
+
+    optlen = sizeof(err);
+    if ( 0 != getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &optlen) ) {
+        err = errno;
+    }
+    item->recv = tm;
+    item->rtt = tm - item->sent;
+    item->err = err;
+    if ( 0 == err ) {
+        item->stat = NB_TCPPING_OK;
+#if TARGET_LINUX
+        /* The first RTT sample of the kernel is of the handshake; it is not
+           delayed by the scheduling of this process */
+        len = nb_tcp_info(sock, &info);
+        if ( len >= 0 && TCP_INFO_HAS(len, tcpi_rtt) && info.tcpi_rtt > 0 ) {
+            item->rtt = info.tcpi_rtt / 1000000.0;
+        }
+#endif
+    } else if ( ECONNREFUSED == err ) {
+        item->stat = NB_TCPPING_REFUSED;
+    } else {
+        item->stat = NB_TCPPING_ERROR;
+    }
+    _probe_abort(sock);
+
+    if ( NULL != obj->cb ) {
+        obj->cb(obj, item->target, item->stat, item->rtt);
+    }
+}
+
+/*
+ * Probe the handshake RTT of the targets count times at the interval
+ * The rounds start at the interval, and all the targets are probed at once
+ * in a round.  A probe not completed in the timeout is aborted.  The
+ * targets are resolved concurrently beforehand, and the ones not resolved
+ * in the timeout either fail (NB_TCPPING_ERROR of EHOSTUNREACH).
+ */
+int
+nb_tcpping_exec(nb_tcpping_t *obj, const char *const *targets, int ntargets,
+                const char *port, int family, int count, double interval,
+                double timeout)
+{
+    nb_tcpping_result_t *result;
+    nb_tcpping_result_item_t *item;
+    struct tcpping_slot slots[TCPPING_INFLIGHT_MAX];
+#if TARGET_LINUX
+    struct epoll_event evs[TCPPING_INFLIGHT_MAX];
+    struct epoll_event ev;
+    int epfd;
+#else
+    struct pollfd fds[TCPPING_INFLIGHT_MAX];
+    int idx[TCPPING_INFLIGHT_MAX];
+    int nfds;
+#endif
+    size_t next;
+    size_t done;
+    size_t i;
+    double t0;
+    double now;
+    double wait;
+    int inflight;
+    int sock;
+    int s;
+    int n;
+
+    if ( ntargets <= 0 || count <= 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Allocate for the results */
+    result = malloc(sizeof(nb_tcpping_result_t));
+    if ( NULL == result ) {
+        return -1;
+    }
+    result->ntargets = ntargets;
+    result->cnt = (size_t)ntargets * count;
+    result->targets = malloc(sizeof(nb_tcpping_target_t) * ntargets);
+    result->items = malloc(sizeof(nb_tcpping_result_item_t) * result->cnt);
+    if ( NULL == result->targets || NULL == result->items ) {
+        free(result->targets);
+        free(result->items);
+        free(result);
+        return -1;
+    }
+    for ( i = 0; i < result->cnt; i++ ) {
+        result->items[i].target = i % ntargets;
+        result->items[i].stat = -1;
+        result->items[i].err = 0;
+        result->items[i].sent = 0.0;
+        result->items[i].recv = 0.0;
+        result->items[i].rtt = 0.0;
+    }
+
+    /* Resolve the targets before the probes not to delay them */
+    _resolve_all(result->targets, targets, ntargets, port, family, timeout);
+
+#if TARGET_LINUX
+    epfd = epoll_create(TCPPING_INFLIGHT_MAX);
+    if ( epfd < 0 ) {
+        _result_delete(result);
+        return -1;
+    }
+#endif
+    for ( s = 0; s < TCPPING_INFLIGHT_MAX; s++ ) {
+        slots[s].sock = -1;
+    }
+
+    /* Obtain the started time */
+    t0 = nb_microtime();
+
+    next = 0;
+    done = 0;
+    inflight = 0;
+    while ( !obj->cancel && done < result->cnt ) {
+        now = nb_microtime();
+
+        /* Start the probes of the rounds due, as far as the slots allow */
+        while ( next < result->cnt && inflight < TCPPING_INFLIGHT_MAX
+                && now - t0 >= interval * (next / ntargets) ) {
+            item = &result->items[next];
+            next++;
+            if ( 0 == result->targets[item->target].addrlen ) {
+                /* Not resolved */
+                item->stat = NB_TCPPING_ERROR;
+                item->err = EHOSTUNREACH;
+                done++;
+                continue;
+            }
+            sock = _probe_start(&result->targets[item->target], &item->sent);
+            if ( sock < 0 ) {
+                item->stat = NB_TCPPING_ERROR;
+                item->err = errno;
+                item->recv = nb_microtime();
+                done++;
+                continue;
+            }
+            for ( s = 0; slots[s].sock >= 0; s++ ) {
+            }
+            slots[s].sock = sock;
+            slots[s].item = item - result->items;
+#if TARGET_LINUX
+            ev.events = EPOLLOUT;
+            ev.data.u32 = s;
+            if ( 0 != epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) ) {
+                item->stat = NB_TCPPING_ERROR;
+                item->err = errno;
+                _probe_abort(sock);
+                slots[s].sock = -1;
+                done++;
+                continue;
+            }
+#endif
+            inflight++;
+        }
+
+        /* Abort the ones timed out, and find the next deadline */
+        now = nb_microtime();
+        wait = TCPPING_WAIT_MAX;
+        if ( next < result->cnt && inflight < TCPPING_INFLIGHT_MAX
+             && t0 + interval * (next / ntargets) - now < wait ) {
+            wait = t0 + interval * (next / ntargets) - now;
+        }
+        for ( s = 0; s < TCPPING_INFLIGHT_MAX; s++ ) {
+            if ( slots[s].sock < 0 ) {
+                continue;
+            }
+            item = &result->items[slots[s].item];
+            if ( now - item->sent >= timeout ) {
+                item->stat = NB_TCPPING_TIMEOUT;
+                item->err = ETIMEDOUT;
+                _probe_abort(slots[s].sock);
+                slots[s].sock = -1;
+                inflight--;
+                done++;
+                if ( NULL != obj->cb ) {
+                    obj->cb(obj, item->target, item->stat, 0.0);
+                }
+            } else if ( item->sent + timeout - now < wait ) {
+                wait = item->sent + timeout - now;
+            }
+        }
+        if ( done >= result->cnt ) {
+            break;
+        }
+        if ( wait < 0.0 ) {
+            wait = 0.0;
+        }
+
+        /* Wait for the handshakes; completed or failed ones are writable */
+#if TARGET_LINUX
+        n = epoll_wait(epfd, evs, TCPPING_INFLIGHT_MAX,
+                       (int)(wait * 1000 + 0.999));
+        now = nb_microtime();
+        for ( i = 0; n > 0 && i < (size_t)n; i++ ) {
+            s = evs[i].data.u32;
+            _probe_finish(obj, &result->items[slots[s].item], slots[s].sock,
+                          now);
+            slots[s].sock = -1;
+            inflight--;
+            done++;
+        }
+#else
+        nfds = 0;
+        for ( s = 0; s < TCPPING_INFLIGHT_MAX; s++ ) {
+            if ( slots[s].sock >= 0 ) {
+                fds[nfds].fd = slots[s].sock;
+                fds[nfds].events = POLLOUT;
+                fds[nfds].revents = 0;
+                idx[nfds] = s;
+                nfds++;
+            }
+        }
+        n = poll(fds, nfds, (int)(wait * 1000 + 0.999));
+        now = nb_microtime();
+        for ( i = 0; n > 0 && i < (size_t)nfds; i++ ) {
+            if ( 0 == fds[i].revents ) {
+                continue;
+            }
+            s = idx[i];
+            _probe_finish(obj, &result->items[slots[s].item], slots[s].sock,
+                          now);
+            slots[s].sock = -1;
+            inflight--;
+            done++;
+        }
+#endif
+        if ( n < 0 && EINTR != errno ) {
+            break;
+        }
+    }
+
+    /* Abort the ones in flight if cancelled */
+    for ( s = 0; s < TCPPING_INFLIGHT_MAX; s++ ) {
+        if ( slots[s].sock >= 0 ) {
+            _probe_abort(slots[s].sock);
+        }
+    }
+#if TARGET_LINUX
+    (void)close(epfd);
+#endif
+
+    /* Update the result */
+    if ( NULL != obj->last_result ) {
+        _result_delete(obj->last_result);
+    }
+    obj->last_result = result;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
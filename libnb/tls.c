@@ -0,0 +1,364 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+#include "netbench_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#if HAVE_OPENSSL
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/*
+ * TLS context shared by the connections of a measurement object, which
+ * keeps the last session to resume
+ * The connections may be of concurrent threads (the segmented download), so
+ * the session is guarded by the mutex.
+ */
+struct _tls_ctx {
+    int verify;
+#if HAVE_OPENSSL
+    SSL_CTX *ctx;
+    pthread_mutex_t mutex;
+    char *host;                 /* Key of the session */
+    char *port;
+    SSL_SESSION *sess;
+#endif
+};
+
+/*
+ * TLS connection over a connected socket
+ */
+struct _tls {
+    nb_tls_ctx_t *ctx;
+#if HAVE_OPENSSL
+    SSL *ssl;
+    char *host;
+    char *port;
+#endif
+};
+
+#if HAVE_OPENSSL
+
+/* Prototype declarations */
+static void _session_save(nb_tls_ctx_t *, nb_tls_t *);
+static int _is_ip_literal(const char *);
+
+/*
+ * Create a TLS context (the peer certificate is verified if verify is
+ * non-zero)
+ */
+nb_tls_ctx_t *
+nb_tls_ctx_new(int verify)
+{
+    nb_tls_ctx_t *ctx;
+
+    ctx = malloc(sizeof(nb_tls_ctx_t));
+    if ( NULL == ctx ) {
+        return NULL;
+    }
+    ctx->verify = verify;
+    ctx->host = NULL;
+    ctx->port = NULL;
+    ctx->sess = NULL;
+    ctx->ctx = SSL_CTX_new(TLS_client_method());
+    if ( NULL == ctx->ctx ) {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    (void)pthread_mutex_init(&ctx->mutex, NULL);
+    (void)SSL_CTX_set_min_proto_version(ctx->ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* A body delimited by the close often ends without close_notify */
+    (void)SSL_CTX_set_options(ctx->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if ( verify ) {
+        (void)SSL_CTX_set_default_verify_paths(ctx->ctx);
+        SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+        SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    return ctx;
+}
+
+/*
+ * Delete the TLS context
+ */
+void
+nb_tls_ctx_delete(nb_tls_ctx_t *ctx)
+{
+    if ( NULL == ctx ) {
+        return;
+    }
+    if ( NULL != ctx->sess ) {
+        SSL_SESSION_free(ctx->sess);
+    }
+    free(ctx->host);
+    free(ctx->port);
+    (void)pthread_mutex_destroy(&ctx->mutex);
+    SSL_CTX_free(ctx->ctx);
+    free(ctx);
+}
+
+/*
+ * Is the host an IP address literal?  (not to be sent as SNI)
+ */
+static int
+_is_ip_literal(const char *host)
+{
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    return 1 == inet_pton(AF_INET, host, addr)
+        || 1 == inet_pton(AF_INET6, host, addr);
+}
+
+/*
+ * Establish a TLS connection over the connected socket
+ * The session of the previous connection to the same host and port is
+ * resumed if possible; resumed is set to 1 if it was.
+ */
+nb_tls_t *
+nb_tls_connect(nb_tls_ctx_t *ctx, int sock, const char *host,
+               const char *port, int *resumed)
+{
+    nb_tls_t *tls;
+
+    tls = malloc(sizeof(nb_tls_t));
+    if ( NULL == tls ) {
+        return NULL;
+    }
+    tls->ctx = ctx;
+    tls->host = strdup(host);
+    tls->port = strdup(port);
+    tls->ssl = SSL_new(ctx->ctx);
+    if ( NULL == tls->host || NULL == tls->port || NULL == tls->ssl ) {
+        nb_tls_close(tls);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ( 1 != SSL_set_fd(tls->ssl, sock) ) {
+        nb_tls_close(tls);
+        errno = EBADF;
+        return NULL;
+    }
+    if ( !_is_ip_literal(host) ) {
+        (void)SSL_set_tlsext_host_name(tls->ssl, host);
+    }
+    if ( ctx->verify ) {
+        (void)SSL_set1_host(tls->ssl, host);
+    }
+    /* The connection holds a reference to the session once set */
+    (void)pthread_mutex_lock(&ctx->mutex);
+    if ( NULL != ctx->sess && 0 == strcasecmp(host, ctx->host)
+         && 0 == strcmp(port, ctx->port) ) {
+        (void)SSL_set_session(tls->ssl, ctx->sess);
+    }
+    (void)pthread_mutex_unlock(&ctx->mutex);
+
+    /* Handshake */
+    if ( 1 != SSL_connect(tls->ssl) ) {
+        ERR_clear_error();
+        SSL_free(tls->ssl);
+        tls->ssl = NULL;
+        nb_tls_close(tls);
+        errno = EPROTO;
+        return NULL;
+    }
+    if ( NULL != resumed ) {
+        *resumed = SSL_session_reused(tls->ssl) ? 1 : 0;
+    }
+
+    return tls;
+}
+
+/*
+ * Receive the decrypted data
+ * Returns 0 at the end of the stream, or -1 on an error (EAGAIN at the
+ * timeout of the socket).
+ */
+ssize_t
+nb_tls_recv(nb_tls_t *tls, void *buf, size_t len)
+{
+    int n;
+
+    n = SSL_read(tls->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if ( n > 0 ) {
+        return n;
+    }
+    switch ( SSL_get_error(tls->ssl, n) ) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        break;
+    case SSL_ERROR_SYSCALL:
+        if ( 0 == errno ) {
+            errno = ECONNRESET;
+        }
+        break;
+    default:
+        errno = EPROTO;
+        break;
+    }
+    ERR_clear_error();
+
+    return -1;
+}
+
+/*
+ * Encrypt and send the data
+ */
+ssize_t
+nb_tls_send(nb_tls_t *tls, const void *buf, size_t len)
+{
+    int n;
+
+    n = SSL_write(tls->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if ( n > 0 ) {
+        return n;
+    }
+    switch ( SSL_get_error(tls->ssl, n) ) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        break;
+    case SSL_ERROR_SYSCALL:
+        if ( 0 == errno ) {
+            errno = EPIPE;
+        }
+        break;
+    default:
+        errno = EPROTO;
+        break;
+    }
+    ERR_clear_error();
+
+    return -1;
+}
+
+/*
+ * Keep the session of the connection for the next one
+ * With TLS 1.3, the ticket arrives after the handshake and is therefore
+ * taken at the close.
+ */
+static void
+_session_save(nb_tls_ctx_t *ctx, nb_tls_t *tls)
+{
+    SSL_SESSION *sess;
+
+    sess = SSL_get1_session(tls->ssl);
+    if ( NULL == sess ) {
+        return;
+    }
+    if ( !SSL_SESSION_is_resumable(sess) ) {
+        SSL_SESSION_free(sess);
+        return;
+    }
+    (void)pthread_mutex_lock(&ctx->mutex);
+    if ( NULL != ctx->sess ) {
+        SSL_SESSION_free(ctx->sess);
+    }
+    free(ctx->host);
+    free(ctx->port);
+    ctx->sess = sess;
+    ctx->host = tls->host;
+    ctx->port = tls->port;
+    (void)pthread_mutex_unlock(&ctx->mutex);
+    tls->host = NULL;
+    tls->port = NULL;
+}
+
+/*
+ * Close the TLS connection (the socket is not closed)
+ */
+void
+nb_tls_close(nb_tls_t *tls)
+{
+    if ( NULL == tls ) {
+        return;
+    }
+    if ( NULL != tls->ssl ) {
+        _session_save(tls->ctx, tls);
+        /* Send close_notify without waiting for the peer's */
+        (void)SSL_shutdown(tls->ssl);
+        ERR_clear_error();
+        SSL_free(tls->ssl);
+    }
+    free(tls->host);
+    free(tls->port);
+    free(tls);
+}
+
+#else /* !HAVE_OPENSSL */
+
+/*
+ * TLS is not available without OpenSSL
+ */
+nb_tls_ctx_t *
+nb_tls_ctx_new(int verify)
+{
+    errno = EPROTONOSUPPORT;
+    return NULL;
+}
+
+void
+nb_tls_ctx_delete(nb_tls_ctx_t *ctx)
+{
+    free(ctx);
+}
+
+nb_tls_t *
+nb_tls_connect(nb_tls_ctx_t *ctx, int sock, const char *host,
+               const char *port, int *resumed)
+{
+    errno = EPROTONOSUPPORT;
+    return NULL;
+}
+
+ssize_t
+nb_tls_recv(nb_tls_t *tls, void *buf, size_t len)
+{
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+ssize_t
+nb_tls_send(nb_tls_t *tls, const void *buf, size_t len)
+{
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+void
+nb_tls_close(nb_tls_t *tls)
+{
+    free(tls);
+}
+
+#endif /* HAVE_OPENSSL */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,911 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#if TARGET_LINUX
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+
+#define UDP_MAGIC                       0x4e425544      /* "NBUD" */
+#define UDP_DATAGRAM_MAX                65507
+#define UDP_RECV_SIZE                   65536
+#define UDP_SOCKBUF_SIZE                (4 * 1024 * 1024)
+#define UDP_BATCH_DEFAULT               32
+#define UDP_DATAGRAMS_MAX               (1 << 22)
+#define UDP_POLL_MAX                    0.1     /* To check the cancel */
+#define UDP_CONTROL_SIZE                256
+
+/*
+ * Header of the test datagram (network byte order)
+ */
+struct udp_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t total;             /* Datagrams to be sent */
+    uint32_t sec;               /* Sent time */
+    uint32_t nsec;
+    // data...
+} __attribute__ ((packed));
+
+/*
+ * State of the receiving side
+ */
+struct udp_stat {
+    uint32_t nextseq;           /* Highest sequence number + 1 */
+    double transit;             /* Transit time of the last arrival */
+    int txtime;                 /* Departures timestamped by the kernel */
+};
+
+/* Prototype declarations */
+static nb_udp_result_t * _result_new(size_t, size_t);
+static void _result_delete(nb_udp_result_t *);
+static void _set_sockbuf(int);
+static int _set_timestamp(int, int);
+static double _cmsg_time(struct msghdr *, double);
+static int _account(nb_udp_result_t *, struct udp_stat *, const uint8_t *,
+                    size_t, double);
+static int
+_send_batch(int, uint8_t *, size_t, const size_t *, int,
+            struct sockaddr_storage *, socklen_t *);
+static int
+_recv_batch(int, uint8_t *, size_t, int, size_t *, double *,
+            struct sockaddr_storage *, socklen_t *);
+static void _recv_txtime(int, nb_udp_result_t *, size_t);
+static int
+_udp_send(nb_udp_t *, int, nb_udp_result_t *, double, double, uint8_t *,
+          uint8_t *);
+static int
+_udp_listen(nb_udp_t *, int, int, double, uint8_t *, nb_udp_result_t **);
+
+/*
+ * Create new udp instance
+ */
+nb_udp_t *
+nb_udp_new(void)
+{
+    nb_udp_t *obj;
+
+    obj = malloc(sizeof(nb_udp_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->cb = NULL;
+    obj->batch = UDP_BATCH_DEFAULT;
+    obj->last_result = NULL;
+    obj->cancel = 0;
+
+    return obj;
+}
+
+/*
+ * Set a callback function
+ */
+int
+nb_udp_set_callback(nb_udp_t *obj, nb_udp_cb_f cbfunc, double cbfreq,
+                    void *user)
+{
+    /* Set the callback function */
+    obj->cb = cbfunc;
+    obj->cbfreq = cbfreq;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Set the number of datagrams sent or received by a system call
+ */
+int
+nb_udp_set_batch(nb_udp_t *obj, int batch)
+{
+    if ( batch < 1 || batch > NB_UDP_BATCH_MAX ) {
+        errno = EINVAL;
+        return -1;
+    }
+    obj->batch = batch;
+
+    return 0;
+}
+
+/*
+ * Allocate a result for cnt datagrams of sz bytes
+ */
+static nb_udp_result_t *
+_result_new(size_t cnt, size_t sz)
+{
+    nb_udp_result_t *res;
+
+    res = malloc(sizeof(nb_udp_result_t));
+    if ( NULL == res ) {
+        return NULL;
+    }
+    bzero(res, sizeof(nb_udp_result_t));
+    res->items = calloc(cnt, sizeof(nb_udp_result_item_t));
+    if ( NULL == res->items ) {
+        free(res);
+        return NULL;
+    }
+    res->cnt = cnt;
+    res->size = sz;
+
+    return res;
+}
+
+/*
+ * Free the result
+ */
+static void
+_result_delete(nb_udp_result_t *res)
+{
+    if ( NULL != res ) {
+        free(res->items);
+        free(res);
+    }
+}
+
+/*
+ * Enlarge the socket buffers not to drop the bursts (best effort)
+ */
+static void
+_set_sockbuf(int sock)
+{
+    int sz;
+
+    sz = UDP_SOCKBUF_SIZE;
+    (void)setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+}
+
+/*
+ * Timestamp the datagrams in the kernel: the arrivals, and the departures
+ * (reported to the error queue with the index of the datagram) if tx is
+ * non-zero
+ * Returns 1 if the departures are timestamped.
+ */
+static int
+_set_timestamp(int sock, int tx)
+{
+#ifdef SO_TIMESTAMPNS
+    int opt;
+
+    opt = 1;
+    (void)setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+#endif
+#if TARGET_LINUX && defined(SO_TIMESTAMPING)
+    if ( tx ) {
+        opt = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+            | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        if ( 0 == setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &opt,
+                             sizeof(opt)) ) {
+            return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Get the time of the kernel in the control messages (tm if none)
+ */
+static double
+_cmsg_time(struct msghdr *msg, double tm)
+{
+#if defined(SO_TIMESTAMPNS) || (TARGET_LINUX && defined(SO_TIMESTAMPING))
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for ( cmsg = CMSG_FIRSTHDR(msg); NULL != cmsg;
+          cmsg = CMSG_NXTHDR(msg, cmsg) ) {
+        if ( SOL_SOCKET != cmsg->cmsg_level ) {
+            continue;
+        }
+#ifdef SO_TIMESTAMPNS
+        if ( SCM_TIMESTAMPNS == cmsg->cmsg_type ) {
+            (void)memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+        }
+#endif
+#if TARGET_LINUX && defined(SO_TIMESTAMPING)
+        if ( SCM_TIMESTAMPING == cmsg->cmsg_type ) {
+            /* The software timestamp is the first one */
+            (void)memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            if ( 0 != ts.tv_sec ) {
+                return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+            }
+        }
+#endif
+    }
+#endif
+
+    return tm;
+}
+
+/*
+ * Account a received datagram
+ * The jitter is the interarrival jitter of RFC 3550, which does not depend
+ * on the offset of the clock of the sender.
+ */
+static int
+_account(nb_udp_result_t *res, struct udp_stat *st, const uint8_t *buf,
+         size_t len, double tm)
+{
+    const struct udp_hdr *hdr;
+    nb_udp_result_item_t *item;
+    uint32_t seq;
+    double transit;
+    double d;
+
+    if ( len < sizeof(struct udp_hdr) ) {
+        return -1;
+    }
+    hdr = (const struct udp_hdr *)buf;
+    if ( UDP_MAGIC != ntohl(hdr->magic) ) {
+        /* Not a test datagram */
+        return -1;
+    }
+    seq = ntohl(hdr->seq);
+    if ( seq >= res->cnt ) {
+        /* Invalid sequence */
+        return -1;
+    }
+    item = &res->items[seq];
+    if ( item->recv > 0.0 ) {
+        res->duplicates++;
+        return 0;
+    }
+    if ( 0.0 == item->sent ) {
+        /* By the clock of the sender (the sender itself knows better) */
+        item->sent = ntohl(hdr->sec) + ntohl(hdr->nsec) / 1000000000.0;
+    }
+    item->recv = tm;
+
+    if ( seq < st->nextseq ) {
+        /* Overtaken by a later one */
+        res->reordered++;
+    } else {
+        st->nextseq = seq + 1;
+    }
+    transit = tm - item->sent;
+    if ( 0 == res->received ) {
+        res->first = tm;
+        res->delay_min = transit;
+        res->delay_max = transit;
+    } else {
+        d = transit - st->transit;
+        if ( d < 0 ) {
+            d = -d;
+        }
+        res->jitter += (d - res->jitter) / 16;
+        if ( transit < res->delay_min ) {
+            res->delay_min = transit;
+        }
+        if ( transit > res->delay_max ) {
+            res->delay_max = transit;
+        }
+    }
+    st->transit = transit;
+    res->last = tm;
+    res->received++;
+    res->bytes += len;
+
+    return 0;
+}
+
+/*
+ * Send n datagrams (to the addresses if not NULL) without blocking
+ * Returns the number of datagrams sent, or -1 on failure.
+ */
+static int
+_send_batch(int sock, uint8_t *bufs, size_t bufsz, const size_t *lens, int n,
+            struct sockaddr_storage *addrs, socklen_t *addrlens)
+{
+#if HAVE_SENDMMSG
+    struct mmsghdr msgs[NB_UDP_BATCH_MAX];
+    struct iovec iovs[NB_UDP_BATCH_MAX];
+    int i;
+
+    bzero(msgs, sizeof(struct mmsghdr) * n);
+    for ( i = 0; i < n; i++ ) {
+        iovs[i].iov_base = bufs + bufsz * i;
+        iovs[i].iov_len = lens[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if ( NULL != addrs ) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = addrlens[i];
+        }
+    }
+
+    return sendmmsg(sock, msgs, n, MSG_DONTWAIT);
+#else
+    ssize_t ret;
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        if ( NULL != addrs ) {
+            ret = sendto(sock, bufs + bufsz * i, lens[i], MSG_DONTWAIT,
+                         (struct sockaddr *)&addrs[i], addrlens[i]);
+        } else {
+            ret = send(sock, bufs + bufsz * i, lens[i], MSG_DONTWAIT);
+        }
+        if ( ret < 0 ) {
+            return i > 0 ? i : -1;
+        }
+    }
+
+    return n;
+#endif
+}
+
+/*
+ * Receive up to n datagrams (and their source addresses if addrs is not
+ * NULL) without blocking, with the arrival times by the kernel if
+ * available
+ * Returns the number of datagrams received, or -1 on failure (EAGAIN if
+ * none).
+ */
+static int
+_recv_batch(int sock, uint8_t *bufs, size_t bufsz, int n, size_t *lens,
+            double *tms, struct sockaddr_storage *addrs, socklen_t *addrlens)
+{
+    char ctrls[NB_UDP_BATCH_MAX][UDP_CONTROL_SIZE];
+    struct iovec iovs[NB_UDP_BATCH_MAX];
+#if HAVE_RECVMMSG
+    struct mmsghdr msgs[NB_UDP_BATCH_MAX];
+    double tm;
+    int ret;
+    int i;
+
+    bzero(msgs, sizeof(struct mmsghdr) * n);
+    for ( i = 0; i < n; i++ ) {
+        iovs[i].iov_base = bufs + bufsz * i;
+        iovs[i].iov_len = bufsz;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrls[i];
+        msgs[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+        if ( NULL != addrs ) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+    }
+    ret = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+    tm = nb_microtime();
+    for ( i = 0; i < ret; i++ ) {
+        lens[i] = msgs[i].msg_len;
+        tms[i] = _cmsg_time(&msgs[i].msg_hdr, tm);
+        if ( NULL != addrs ) {
+            addrlens[i] = msgs[i].msg_hdr.msg_namelen;
+        }
+    }
+
+    return ret;
+#else
+    struct msghdr msg;
+    ssize_t nr;
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        bzero(&msg, sizeof(struct msghdr));
+        iovs[i].iov_base = bufs + bufsz * i;
+        iovs[i].iov_len = bufsz;
+        msg.msg_iov = &iovs[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrls[i];
+        msg.msg_controllen = UDP_CONTROL_SIZE;
+        if ( NULL != addrs ) {
+            msg.msg_name = &addrs[i];
+            msg.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+        nr = recvmsg(sock, &msg, MSG_DONTWAIT);
+        if ( nr < 0 ) {
+            return i > 0 ? i : -1;
+        }
+        lens[i] = nr;
+        tms[i] = _cmsg_time(&msg, nb_microtime());
+        if ( NULL != addrs ) {
+            addrlens[i] = msg.msg_namelen;
+        }
+    }
+
+    return n;
+#endif
+}
+
+/*
+ * Take the departure times of the datagrams (of the indices below nsent)
+ * reported to the error queue
+ */
+static void
+_recv_txtime(int sock, nb_udp_result_t *res, size_t nsent)
+{
+#if TARGET_LINUX && defined(SO_TIMESTAMPING)
+    char ctrl[UDP_CONTROL_SIZE];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err ee;
+    int found;
+    double tm;
+
+    for ( ;; ) {
+        bzero(&msg, sizeof(struct msghdr));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        if ( recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+            return;
+        }
+        found = 0;
+        for ( cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+              cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+            if ( (SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type)
+                 || (SOL_IPV6 == cmsg->cmsg_level
+                     && IPV6_RECVERR == cmsg->cmsg_type) ) {
+                (void)memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+                found = 1;
+            }
+        }
+        tm = _cmsg_time(&msg, 0.0);
+        if ( found && SO_EE_ORIGIN_TIMESTAMPING == ee.ee_origin
+             && SCM_TSTAMP_SND == ee.ee_info && ee.ee_data < nsent
+             && tm > 0.0 ) {
+            res->items[ee.ee_data].sent = tm;
+        }
+    }
+#endif
+}
+
+/*
+ * Send the datagrams at the rate and receive the reflected ones
+ * The datagrams due are sent in batches at each wake-up, so the pacing is
+ * as fine as the timeout of poll() (a millisecond).  The RTT of each
+ * datagram is from its departure to its arrival timestamped by the kernel
+ * if possible, so that the jitter is not of the batches.
+ */
+static int
+_udp_send(nb_udp_t *obj, int sock, nb_udp_result_t *res, double pps,
+          double timeout, uint8_t *sbuf, uint8_t *rbuf)
+{
+    struct udp_hdr *hdr;
+    struct udp_stat st;
+    struct pollfd fds[1];
+    size_t slens[NB_UDP_BATCH_MAX];
+    size_t rlens[NB_UDP_BATCH_MAX];
+    double rtms[NB_UDP_BATCH_MAX];
+    size_t nsent;
+    size_t due;
+    double t0;
+    double tend;
+    double curtm;
+    double prevtm;
+    double gto;
+    int events;
+    int n;
+    int i;
+
+    for ( i = 0; i < obj->batch; i++ ) {
+        slens[i] = res->size;
+    }
+    st.nextseq = 0;
+    st.transit = 0.0;
+    st.txtime = _set_timestamp(sock, 1);
+
+    t0 = nb_microtime();
+    tend = t0;
+    prevtm = t0;
+    nsent = 0;
+    while ( !obj->cancel ) {
+        curtm = nb_microtime();
+
+        /* Send the datagrams due */
+        due = (size_t)((curtm - t0) * pps) + 1;
+        if ( due > res->cnt ) {
+            due = res->cnt;
+        }
+        while ( nsent < due ) {
+            n = due - nsent < (size_t)obj->batch
+                ? (int)(due - nsent) : obj->batch;
+            for ( i = 0; i < n; i++ ) {
+                /* Each datagram by its own time (replaced by the time of
+                   the departure if timestamped by the kernel) */
+                curtm = nb_microtime();
+                hdr = (struct udp_hdr *)(sbuf + res->size * i);
+                hdr->seq = htonl(nsent + i);
+                hdr->sec = htonl((uint32_t)curtm);
+                hdr->nsec = htonl((uint32_t)((curtm - (uint32_t)curtm)
+                                             * 1000000000));
+                res->items[nsent + i].sent = curtm;
+            }
+            i = n;
+            n = _send_batch(sock, sbuf, res->size, slens, n, NULL, NULL);
+            if ( n < i ) {
+                /* The index of the departures may have been taken by the
+                   failed one; not to be trusted any more */
+                st.txtime = 0;
+            }
+            if ( n < 0 ) {
+                if ( ECONNREFUSED == errno ) {
+                    /* ICMP unreachable of a previous datagram */
+                    continue;
+                } else if ( EAGAIN == errno || EWOULDBLOCK == errno
+                            || ENOBUFS == errno ) {
+                    /* Try again at the next wake-up */
+                    break;
+                }
+                return -1;
+            }
+            nsent += n;
+            tend = curtm;
+        }
+
+        /* Take the departure times */
+        if ( st.txtime ) {
+            _recv_txtime(sock, res, nsent);
+        }
+
+        /* Receive the reflected datagrams */
+        for ( ;; ) {
+            n = _recv_batch(sock, rbuf, res->size, obj->batch, rlens, rtms,
+                            NULL, NULL);
+            if ( n <= 0 ) {
+                break;
+            }
+            for ( i = 0; i < n; i++ ) {
+                (void)_account(res, &st, rbuf + res->size * i, rlens[i],
+                               rtms[i]);
+            }
+        }
+
+        /* Report by calling a callback function */
+        curtm = nb_microtime();
+        if ( NULL != obj->cb && curtm - prevtm >= obj->cbfreq ) {
+            obj->cb(obj, t0, curtm, nsent, res->received);
+            prevtm = curtm;
+        }
+
+        /* Calculate the timeout for polling */
+        if ( nsent < res->cnt ) {
+            /* To the next datagram */
+            gto = t0 + nsent / pps - curtm;
+        } else {
+            /* To the end of the measurement */
+            if ( res->received >= res->cnt ) {
+                break;
+            }
+            gto = tend + timeout - curtm;
+            if ( gto <= 0.0 ) {
+                break;
+            }
+        }
+        if ( gto > UDP_POLL_MAX ) {
+            gto = UDP_POLL_MAX;
+        }
+        if ( gto <= 0.0 ) {
+            continue;
+        }
+
+        /* Poll */
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        events = poll(fds, 1, (int)(gto * 1000) + 1);
+        if ( events < 0 && EINTR != errno ) {
+            return -1;
+        }
+    }
+    res->cnt = nsent;
+
+    return 0;
+}
+
+/*
+ * Execute the UDP measurement: send datagrams of sz bytes at the rate (bits
+ * per second of the UDP payload) for the duration, and wait for the
+ * datagrams reflected back by the target up to timeout after the last one
+ * (set timeout to zero against a receiver that does not reflect)
+ */
+int
+nb_udp_exec(nb_udp_t *obj, const char *target, const char *port, int family,
+            size_t sz, double rate, double duration, double timeout)
+{
+    struct addrinfo hints;
+    struct addrinfo *ressave;
+    nb_udp_result_t *res;
+    struct udp_hdr *hdr;
+    uint8_t *sbuf;
+    uint8_t *rbuf;
+    size_t cnt;
+    size_t i;
+    double pps;
+    int sock;
+    int ret;
+
+    if ( sz < NB_UDP_HEADER_SIZE || sz > UDP_DATAGRAM_MAX || rate <= 0.0
+         || duration <= 0.0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    pps = rate / (8.0 * sz);
+    cnt = (size_t)(pps * duration + 0.5);
+    if ( 0 == cnt ) {
+        cnt = 1;
+    }
+    if ( cnt > UDP_DATAGRAMS_MAX ) {
+        /* Too many datagrams to record */
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Resolve the target and connect to it */
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ( 0 != getaddrinfo(target, port, &hints, &ressave) ) {
+        /* Cannot resolve the target host */
+        return -1;
+    }
+    sock = socket(ressave->ai_family, SOCK_DGRAM, 0);
+    if ( sock < 0 ) {
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    if ( 0 != connect(sock, ressave->ai_addr, ressave->ai_addrlen) ) {
+        (void)close(sock);
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    freeaddrinfo(ressave);
+    _set_sockbuf(sock);
+
+    /* Allocate for the results and the datagrams */
+    res = _result_new(cnt, sz);
+    sbuf = malloc(sz * obj->batch);
+    rbuf = malloc(sz * obj->batch);
+    if ( NULL == res || NULL == sbuf || NULL == rbuf ) {
+        _result_delete(res);
+        free(sbuf);
+        free(rbuf);
+        (void)close(sock);
+        return -1;
+    }
+    for ( i = 0; i < sz * obj->batch; i++ ) {
+        sbuf[i] = i % 0xff;
+    }
+    for ( i = 0; i < (size_t)obj->batch; i++ ) {
+        hdr = (struct udp_hdr *)(sbuf + sz * i);
+        hdr->magic = htonl(UDP_MAGIC);
+        hdr->total = htonl(cnt);
+    }
+
+    ret = _udp_send(obj, sock, res, pps, timeout, sbuf, rbuf);
+    free(sbuf);
+    free(rbuf);
+    (void)close(sock);
+    if ( 0 != ret ) {
+        _result_delete(res);
+        return -1;
+    }
+
+    /* Replace the last result */
+    _result_delete(obj->last_result);
+    obj->last_result = res;
+
+    return 0;
+}
+
+/*
+ * Receive (and reflect) the datagrams until all the ones announced by the
+ * first sender have arrived, or until timeout passes without any
+ */
+static int
+_udp_listen(nb_udp_t *obj, int sock, int reflect, double timeout,
+            uint8_t *rbuf, nb_udp_result_t **resp)
+{
+    nb_udp_result_t *res;
+    struct udp_stat st;
+    struct pollfd fds[1];
+    struct sockaddr_storage addrs[NB_UDP_BATCH_MAX];
+    socklen_t addrlens[NB_UDP_BATCH_MAX];
+    struct sockaddr_storage sender;
+    socklen_t senderlen;
+    size_t lens[NB_UDP_BATCH_MAX];
+    double tms[NB_UDP_BATCH_MAX];
+    const struct udp_hdr *hdr;
+    uint32_t total;
+    double t0;
+    double last;
+    double curtm;
+    double prevtm;
+    double gto;
+    int events;
+    int n;
+    int i;
+
+    res = NULL;
+    st.nextseq = 0;
+    st.transit = 0.0;
+    st.txtime = _set_timestamp(sock, 0);
+    senderlen = 0;
+    t0 = nb_microtime();
+    last = t0;
+    prevtm = t0;
+    while ( !obj->cancel ) {
+        for ( ;; ) {
+            n = _recv_batch(sock, rbuf, UDP_RECV_SIZE, obj->batch, lens, tms,
+                            addrs, addrlens);
+            if ( n <= 0 ) {
+                break;
+            }
+            curtm = nb_microtime();
+            last = curtm;
+            if ( reflect ) {
+                (void)_send_batch(sock, rbuf, UDP_RECV_SIZE, lens, n, addrs,
+                                  addrlens);
+            }
+            for ( i = 0; i < n; i++ ) {
+                if ( NULL == res ) {
+                    /* The first test datagram tells the sender and the
+                       number of the datagrams */
+                    hdr = (const struct udp_hdr *)(rbuf + UDP_RECV_SIZE * i);
+                    if ( lens[i] < sizeof(struct udp_hdr)
+                         || UDP_MAGIC != ntohl(hdr->magic) ) {
+                        continue;
+                    }
+                    total = ntohl(hdr->total);
+                    if ( 0 == total || total > UDP_DATAGRAMS_MAX ) {
+                        continue;
+                    }
+                    res = _result_new(total, lens[i]);
+                    if ( NULL == res ) {
+                        return -1;
+                    }
+                    (void)memcpy(&sender, &addrs[i], addrlens[i]);
+                    senderlen = addrlens[i];
+                    t0 = curtm;
+                }
+                if ( addrlens[i] != senderlen
+                     || 0 != memcmp(&sender, &addrs[i], senderlen) ) {
+                    /* From another sender */
+                    continue;
+                }
+                (void)_account(res, &st, rbuf + UDP_RECV_SIZE * i, lens[i],
+                               tms[i]);
+            }
+        }
+        curtm = nb_microtime();
+
+        if ( NULL != res ) {
+            /* Report by calling a callback function */
+            if ( NULL != obj->cb && curtm - prevtm >= obj->cbfreq ) {
+                obj->cb(obj, t0, curtm, st.nextseq, res->received);
+                prevtm = curtm;
+            }
+            if ( res->received >= res->cnt ) {
+                break;
+            }
+        }
+
+        /* Calculate the timeout for polling */
+        gto = last + timeout - curtm;
+        if ( gto <= 0.0 ) {
+            break;
+        }
+        if ( gto > UDP_POLL_MAX ) {
+            gto = UDP_POLL_MAX;
+        }
+
+        /* Poll */
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        events = poll(fds, 1, (int)(gto * 1000) + 1);
+        if ( events < 0 && EINTR != errno ) {
+            _result_delete(res);
+            return -1;
+        }
+    }
+    if ( NULL == res ) {
+        /* No datagram from any sender */
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    *resp = res;
+
+    return 0;
+}
+
+/*
+ * Execute the UDP measurement on the receiving side: bind to the address
+ * (any if NULL) and port, and receive the datagrams of a sender, reflecting
+ * them back if reflect is non-zero
+ * This returns when all the datagrams have arrived or when timeout passes
+ * without any datagram.
+ */
+int
+nb_udp_listen_exec(nb_udp_t *obj, const char *addr, const char *port,
+                   int family, int reflect, double timeout)
+{
+    struct addrinfo hints;
+    struct addrinfo *ressave;
+    nb_udp_result_t *res;
+    uint8_t *rbuf;
+    int sock;
+    int ret;
+
+    /* Bind to the address and port */
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ( 0 != getaddrinfo(addr, port, &hints, &ressave) ) {
+        return -1;
+    }
+    sock = socket(ressave->ai_family, SOCK_DGRAM, 0);
+    if ( sock < 0 ) {
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    if ( 0 != bind(sock, ressave->ai_addr, ressave->ai_addrlen) ) {
+        (void)close(sock);
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    freeaddrinfo(ressave);
+    _set_sockbuf(sock);
+
+    rbuf = malloc((size_t)UDP_RECV_SIZE * obj->batch);
+    if ( NULL == rbuf ) {
+        (void)close(sock);
+        return -1;
+    }
+    ret = _udp_listen(obj, sock, reflect, timeout, rbuf, &res);
+    free(rbuf);
+    (void)close(sock);
+    if ( 0 != ret ) {
+        return -1;
+    }
+
+    /* Replace the last result */
+    _result_delete(obj->last_result);
+    obj->last_result = res;
+
+    return 0;
+}
+
+/*
+ * Delete the udp instance
+ */
+void
+nb_udp_delete(nb_udp_t *obj)
+{
+    _result_delete(obj->last_result);
+    free(obj);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,608 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+#include "config.h"
+#include "netbench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#if HAVE_PPOLL
+#include <signal.h>
+#endif
+
+#define VOIP_MAGIC                      0x4e42564f      /* "NBVO" */
+#define VOIP_WINDOW                     8192    /* Packets in flight */
+#define VOIP_RECV_SIZE                  2048
+#define VOIP_SPIN_TIME                  0.0002  /* Spin before the send */
+#define VOIP_ADAPT_INTERVAL             1.0     /* Playout delay update */
+#define VOIP_ALPHA                      0.998002
+#define VOIP_JB_MAX                     0.5
+
+/* States of the packets in flight */
+#define VOIP_PENDING                    0
+#define VOIP_PLAYED                     1
+#define VOIP_LATE                       2
+
+/*
+ * Header of the emulated media packet (network byte order)
+ */
+struct voip_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t sec;               /* Sent time */
+    uint32_t nsec;
+    // data...
+} __attribute__ ((packed));
+
+/*
+ * Traffic profile and E-model parameters of a codec
+ */
+struct voip_profile {
+    double interval;            /* Packet (or frame) interval */
+    size_t size;                /* Packet size (RTP header included) */
+    size_t frame;               /* Mean frame size (0: a packet a frame) */
+    int keyint;                 /* Frames per key frame */
+    double delay;               /* Packetization and look-ahead */
+    double ie;                  /* Equipment impairment factor (G.113) */
+    double bpl;                 /* Packet-loss robustness factor */
+};
+static const struct voip_profile profiles[] = {
+    /* G.711 with PLC: 20 ms frames of 160 bytes */
+    { 0.020, 172, 0, 0, 0.020, 0.0, 25.1 },
+    /* G.729A: 2 frames of 10 ms a packet, 5 ms look-ahead */
+    { 0.020, 32, 0, 0, 0.025, 11.0, 19.0 },
+    /* Video: 30 fps at 1 Mbps, a key frame of 5x size every 2 seconds */
+    { 1.0 / 30, 1200, 4166, 60, 0.0, -1.0, -1.0 },
+};
+#define VOIP_NPROFILES  (sizeof(profiles) / sizeof(profiles[0]))
+
+/*
+ * Packet in flight
+ */
+struct voip_slot {
+    int stat;
+    double sent;
+};
+
+/*
+ * State of the stream; the memory does not depend on the duration
+ */
+struct voip_state {
+    const struct voip_profile *prof;
+    struct voip_slot *slots;    /* Ring of the packets in flight */
+    uint32_t nextseq;           /* Next to send */
+    uint32_t retired;           /* Next to retire */
+    double dhat;                /* Estimated one-way delay */
+    double vhat;                /* Estimated variation of the delay */
+    double playout;             /* Playout delay of the jitter buffer */
+    double adapt;               /* Next time to update the playout delay */
+    double transit;             /* One-way delay of the last arrival */
+    double jbsum;               /* Sum of the playout delays played */
+    double rttsum;
+    uint32_t rand;              /* Frame sizes of the video */
+    int prevloss;               /* Whether the last retired was lost */
+    uint64_t nstat[2];          /* Retired packets after received/lost */
+    uint64_t ntrans[2];         /* Transitions to the other state */
+};
+
+/* Prototype declarations */
+static void _retire(nb_voip_result_t *, struct voip_state *);
+static void _arrive(nb_voip_result_t *, struct voip_state *, const uint8_t *,
+                    size_t, double);
+static void _recv_all(nb_voip_result_t *, struct voip_state *, int, uint8_t *);
+static int
+_wait_until(nb_voip_t *, nb_voip_result_t *, struct voip_state *, int,
+            uint8_t *, double);
+static size_t _frame_size(struct voip_state *, uint64_t);
+static void _score(nb_voip_result_t *, const struct voip_state *);
+static int
+_voip_stream(nb_voip_t *, int, nb_voip_result_t *, struct voip_state *,
+             double, double);
+
+/*
+ * Create new voip instance
+ */
+nb_voip_t *
+nb_voip_new(void)
+{
+    nb_voip_t *obj;
+
+    obj = malloc(sizeof(nb_voip_t));
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->cb = NULL;
+    obj->last_result = NULL;
+    obj->cancel = 0;
+
+    return obj;
+}
+
+/*
+ * Set a callback function
+ */
+int
+nb_voip_set_callback(nb_voip_t *obj, nb_voip_cb_f cbfunc, double cbfreq,
+                     void *user)
+{
+    /* Set the callback function */
+    obj->cb = cbfunc;
+    obj->cbfreq = cbfreq;
+    obj->user = user;
+
+    return 0;
+}
+
+/*
+ * Retire the oldest packet in flight, which is lost if not received yet
+ * The late packets discarded by the jitter buffer are lost for the listener
+ * and therefore for the burst ratio.
+ */
+static void
+_retire(nb_voip_result_t *res, struct voip_state *vs)
+{
+    struct voip_slot *slot;
+    int loss;
+
+    slot = &vs->slots[vs->retired % VOIP_WINDOW];
+    if ( VOIP_PENDING == slot->stat ) {
+        res->lost++;
+    }
+    loss = VOIP_PLAYED != slot->stat;
+    if ( vs->retired > 0 ) {
+        vs->nstat[vs->prevloss]++;
+        if ( loss != vs->prevloss ) {
+            vs->ntrans[vs->prevloss]++;
+        }
+    }
+    vs->prevloss = loss;
+    vs->retired++;
+}
+
+/*
+ * Play a reflected packet through the simulated jitter buffer
+ * The one-way delay is taken as the half of the RTT.  The playout delay
+ * follows the estimates of the delay and its variation (d + 4v, but a frame
+ * at least), and is updated at VOIP_ADAPT_INTERVAL as an adaptive buffer
+ * does between the talkspurts.
+ */
+static void
+_arrive(nb_voip_result_t *res, struct voip_state *vs, const uint8_t *buf,
+        size_t len, double tm)
+{
+    const struct voip_hdr *hdr;
+    struct voip_slot *slot;
+    uint32_t seq;
+    double rtt;
+    double owd;
+    double d;
+
+    if ( len < sizeof(struct voip_hdr) ) {
+        return;
+    }
+    hdr = (const struct voip_hdr *)buf;
+    if ( VOIP_MAGIC != ntohl(hdr->magic) ) {
+        return;
+    }
+    seq = ntohl(hdr->seq);
+    if ( seq < vs->retired || seq >= vs->nextseq ) {
+        /* Retired already or invalid */
+        return;
+    }
+    slot = &vs->slots[seq % VOIP_WINDOW];
+    if ( VOIP_PENDING != slot->stat ) {
+        res->duplicates++;
+        return;
+    }
+    rtt = tm - slot->sent;
+    owd = rtt / 2;
+    res->received++;
+    vs->rttsum += rtt;
+    if ( 1 == res->received ) {
+        res->rtt_min = rtt;
+        res->rtt_max = rtt;
+        vs->dhat = owd;
+        vs->vhat = 0.0;
+        /* Start with a frame of the headroom */
+        vs->playout = owd + vs->prof->interval;
+        vs->adapt = slot->sent + VOIP_ADAPT_INTERVAL;
+    } else {
+        if ( rtt < res->rtt_min ) {
+            res->rtt_min = rtt;
+        }
+        if ( rtt > res->rtt_max ) {
+            res->rtt_max = rtt;
+        }
+        /* Interarrival jitter (RFC 3550) */
+        d = owd - vs->transit;
+        if ( d < 0 ) {
+            d = -d;
+        }
+        res->jitter += (d - res->jitter) / 16;
+    }
+    vs->transit = owd;
+
+    /* Update the playout delay (keeping a frame at least) */
+    if ( slot->sent >= vs->adapt ) {
+        vs->playout = vs->dhat + (4 * vs->vhat > vs->prof->interval
+                                  ? 4 * vs->vhat : vs->prof->interval);
+        if ( vs->playout > VOIP_JB_MAX ) {
+            vs->playout = VOIP_JB_MAX;
+        }
+        vs->adapt = slot->sent + VOIP_ADAPT_INTERVAL;
+    }
+    if ( owd > vs->playout ) {
+        /* Arrived after its playout time */
+        slot->stat = VOIP_LATE;
+        res->late++;
+    } else {
+        slot->stat = VOIP_PLAYED;
+        vs->jbsum += vs->playout;
+    }
+    d = vs->dhat - owd;
+    vs->dhat = VOIP_ALPHA * vs->dhat + (1 - VOIP_ALPHA) * owd;
+    vs->vhat = VOIP_ALPHA * vs->vhat + (1 - VOIP_ALPHA) * (d < 0 ? -d : d);
+}
+
+/*
+ * Receive all the reflected packets available
+ */
+static void
+_recv_all(nb_voip_result_t *res, struct voip_state *vs, int sock,
+          uint8_t *rbuf)
+{
+    ssize_t nr;
+
+    for ( ;; ) {
+        nr = recv(sock, rbuf, VOIP_RECV_SIZE, MSG_DONTWAIT);
+        if ( nr < 0 ) {
+            if ( EINTR == errno || ECONNREFUSED == errno ) {
+                continue;
+            }
+            break;
+        }
+        _arrive(res, vs, rbuf, nr, nb_monotime());
+    }
+}
+
+/*
+ * Wait until the time receiving the reflected packets
+ * The last VOIP_SPIN_TIME is spun to cancel the slack of the timer.
+ */
+static int
+_wait_until(nb_voip_t *obj, nb_voip_result_t *res, struct voip_state *vs,
+            int sock, uint8_t *rbuf, double due)
+{
+    struct pollfd fds[1];
+#if HAVE_PPOLL
+    struct timespec ts;
+#endif
+    double gto;
+    int events;
+
+    while ( !obj->cancel ) {
+        _recv_all(res, vs, sock, rbuf);
+        gto = due - nb_monotime();
+        if ( gto <= 0.0 ) {
+            break;
+        }
+        if ( gto <= VOIP_SPIN_TIME ) {
+            continue;
+        }
+        gto -= VOIP_SPIN_TIME;
+
+        /* Poll */
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+#if HAVE_PPOLL
+        ts.tv_sec = (time_t)gto;
+        ts.tv_nsec = (long)((gto - ts.tv_sec) * 1000000000);
+        events = ppoll(fds, 1, &ts, NULL);
+#else
+        events = poll(fds, 1, (int)(gto * 1000));
+#endif
+        if ( events < 0 && EINTR != errno ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Size of the k-th frame of the video (a key frame, or a predicted frame of
+ * 50% to 150% of the mean)
+ */
+static size_t
+_frame_size(struct voip_state *vs, uint64_t k)
+{
+    if ( 0 == k % vs->prof->keyint ) {
+        return vs->prof->frame * 5;
+    }
+    vs->rand = vs->rand * 1103515245 + 12345;
+
+    return vs->prof->frame / 2 + (vs->rand >> 16) % vs->prof->frame;
+}
+
+/*
+ * Compute the R-factor and the MOS with the E-model (ITU-T G.107)
+ */
+static void
+_score(nb_voip_result_t *res, const struct voip_state *vs)
+{
+    uint64_t nplayed;
+    double d;
+    double ppl;
+    double burstr;
+    double p;
+    double q;
+    double id;
+    double ieeff;
+    double r;
+
+    nplayed = res->received - res->late;
+    res->jb_delay = nplayed > 0 ? vs->jbsum / nplayed : 0.0;
+    res->rtt_avg = res->received > 0 ? vs->rttsum / res->received : 0.0;
+    if ( vs->prof->ie < 0 ) {
+        /* No E-model for the profile */
+        return;
+    }
+
+    /* Mouth-to-ear delay */
+    d = (res->jb_delay + vs->prof->delay) * 1000;
+    res->delay = d / 1000;
+
+    /* Burst ratio from the two-state Markov model of the losses */
+    burstr = 1.0;
+    if ( vs->nstat[0] > 0 && vs->nstat[1] > 0 ) {
+        p = (double)vs->ntrans[0] / vs->nstat[0];
+        q = (double)vs->ntrans[1] / vs->nstat[1];
+        if ( p + q > 0.0 ) {
+            burstr = 1.0 / (p + q);
+        }
+    }
+    res->burst_ratio = burstr;
+
+    /* Effective loss including the late packets (%) */
+    ppl = res->sent > 0 ? 100.0 * (res->lost + res->late) / res->sent : 0.0;
+    id = 0.024 * d;
+    if ( d > 177.3 ) {
+        id += 0.11 * (d - 177.3);
+    }
+    ieeff = vs->prof->ie + (95 - vs->prof->ie) * ppl
+        / (ppl / burstr + vs->prof->bpl);
+    r = 93.2 - id - ieeff;
+    res->rfactor = r;
+    if ( r < 0 ) {
+        res->mos = 1.0;
+    } else if ( r > 100 ) {
+        res->mos = 4.5;
+    } else {
+        res->mos = 1 + 0.035 * r + r * (r - 60) * (100 - r) * 7e-6;
+    }
+}
+
+/*
+ * Send the stream on the schedule and play the reflected packets
+ * The schedule and the delays are on the monotonic clock, and only the
+ * timestamps in the packets are of the wall clock.
+ */
+static int
+_voip_stream(nb_voip_t *obj, int sock, nb_voip_result_t *res,
+             struct voip_state *vs, double duration, double timeout)
+{
+    const struct voip_profile *prof;
+    struct voip_hdr *hdr;
+    uint8_t *sbuf;
+    uint8_t *rbuf;
+    struct voip_slot *slot;
+    uint64_t k;
+    uint64_t nframes;
+    size_t remain;
+    size_t sz;
+    double t0;
+    double wt0;
+    double due;
+    double curtm;
+    double wtm;
+    double prevtm;
+    double late;
+    double latesum;
+    ssize_t ret;
+    size_t i;
+
+    prof = vs->prof;
+    sbuf = malloc(prof->size);
+    rbuf = malloc(VOIP_RECV_SIZE);
+    if ( NULL == sbuf || NULL == rbuf ) {
+        free(sbuf);
+        free(rbuf);
+        return -1;
+    }
+    for ( i = 0; i < prof->size; i++ ) {
+        sbuf[i] = i % 0xff;
+    }
+    hdr = (struct voip_hdr *)sbuf;
+    hdr->magic = htonl(VOIP_MAGIC);
+
+    nframes = (uint64_t)(duration / prof->interval + 0.5);
+    latesum = 0.0;
+    wt0 = nb_microtime();
+    t0 = nb_monotime();
+    prevtm = t0;
+    for ( k = 0; k < nframes && !obj->cancel; k++ ) {
+        /* Wait for the schedule of the frame */
+        due = t0 + k * prof->interval;
+        if ( 0 != _wait_until(obj, res, vs, sock, rbuf, due) ) {
+            free(sbuf);
+            free(rbuf);
+            return -1;
+        }
+
+        /* Lateness to the schedule */
+        curtm = nb_monotime();
+        late = curtm - due;
+        latesum += late;
+        if ( late > res->pacing_max ) {
+            res->pacing_max = late;
+        }
+        res->pacing_avg = latesum / (k + 1);
+
+        /* Send the packets of the frame back to back */
+        remain = prof->frame > 0 ? _frame_size(vs, k) : prof->size;
+        while ( remain > 0 ) {
+            sz = remain < prof->size ? remain : prof->size;
+            remain -= sz;
+            if ( sz < sizeof(struct voip_hdr) ) {
+                sz = sizeof(struct voip_hdr);
+            }
+            if ( vs->nextseq - vs->retired >= VOIP_WINDOW ) {
+                _retire(res, vs);
+            }
+            slot = &vs->slots[vs->nextseq % VOIP_WINDOW];
+            wtm = nb_microtime();
+            curtm = nb_monotime();
+            hdr->seq = htonl(vs->nextseq);
+            hdr->sec = htonl((uint32_t)wtm);
+            hdr->nsec = htonl((uint32_t)((wtm - (uint32_t)wtm) * 1000000000));
+            ret = send(sock, sbuf, sz, 0);
+            if ( ret < 0 && ECONNREFUSED != errno && EINTR != errno ) {
+                free(sbuf);
+                free(rbuf);
+                return -1;
+            }
+            slot->stat = VOIP_PENDING;
+            slot->sent = curtm;
+            vs->nextseq++;
+            res->sent++;
+        }
+
+        /* Report by calling a callback function */
+        if ( NULL != obj->cb && curtm - prevtm >= obj->cbfreq ) {
+            _score(res, vs);
+            /* By the wall clock as the other measurements */
+            obj->cb(obj, wt0, wt0 + (curtm - t0), res->sent, res->received,
+                    res->mos);
+            prevtm = curtm;
+        }
+    }
+
+    /* Wait for the last reflected packets and retire all */
+    (void)_wait_until(obj, res, vs, sock, rbuf, nb_monotime() + timeout);
+    while ( vs->retired < vs->nextseq ) {
+        _retire(res, vs);
+    }
+    _score(res, vs);
+    free(sbuf);
+    free(rbuf);
+
+    return 0;
+}
+
+/*
+ * Emulate the media stream of the codec (NB_VOIP_*) to the target that
+ * reflects it for the duration, and estimate the quality of the call
+ * The packets reflected later than timeout after the end are lost.
+ */
+int
+nb_voip_exec(nb_voip_t *obj, const char *target, const char *port,
+             int family, int codec, double duration, double timeout)
+{
+    struct addrinfo hints;
+    struct addrinfo *ressave;
+    nb_voip_result_t *res;
+    struct voip_state vs;
+    int sock;
+    int ret;
+
+    if ( codec < 0 || codec >= (int)VOIP_NPROFILES || duration <= 0.0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Resolve the target and connect to it */
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ( 0 != getaddrinfo(target, port, &hints, &ressave) ) {
+        /* Cannot resolve the target host */
+        return -1;
+    }
+    sock = socket(ressave->ai_family, SOCK_DGRAM, 0);
+    if ( sock < 0 ) {
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    if ( 0 != connect(sock, ressave->ai_addr, ressave->ai_addrlen) ) {
+        (void)close(sock);
+        freeaddrinfo(ressave);
+        return -1;
+    }
+    freeaddrinfo(ressave);
+
+    /* Allocate for the result and the packets in flight */
+    res = malloc(sizeof(nb_voip_result_t));
+    if ( NULL == res ) {
+        (void)close(sock);
+        return -1;
+    }
+    bzero(res, sizeof(nb_voip_result_t));
+    res->codec = codec;
+    bzero(&vs, sizeof(struct voip_state));
+    vs.prof = &profiles[codec];
+    vs.rand = 1;
+    vs.slots = malloc(sizeof(struct voip_slot) * VOIP_WINDOW);
+    if ( NULL == vs.slots ) {
+        free(res);
+        (void)close(sock);
+        return -1;
+    }
+
+    ret = _voip_stream(obj, sock, res, &vs, duration, timeout);
+    free(vs.slots);
+    (void)close(sock);
+    if ( 0 != ret ) {
+        free(res);
+        return -1;
+    }
+
+    /* Replace the last result */
+    free(obj->last_result);
+    obj->last_result = res;
+
+    return 0;
+}
+
+/*
+ * Delete the voip instance
+ */
+void
+nb_voip_delete(nb_voip_t *obj)
+{
+    free(obj->last_result);
+    free(obj);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
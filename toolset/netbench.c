@@ -13,6 +13,7 @@
 #define API_SERVER "api.nb14.jar.jp"
 #define IPV4_SERVER "v4.nb14.jar.jp"
 #define IPV6_SERVER "v6.nb14.jar.jp"
+#define HTTP_PORT "80"
 
 void
 cb_ping(nb_ping_t *ping, int seq, double rtt)
@@ -49,6 +50,76 @@ cb_hpost(nb_http_post_t *hpost, off_t hlen, off_t clen, double t0, double cur,
            cur - t0);
 }
 
+void
+print_estimate(const nb_estimate_t *est)
+{
+    if ( est->converged ) {
+        printf("Estimated %.2lf Mbps +/- %.2lf (%d windows), ended at %.2lf "
+               "sec saving %lld bytes\n", est->rate * 8 / 1000000,
+               est->halfwidth * 8 / 1000000, est->nwindows, est->tm,
+               (long long)est->saved);
+    } else if ( est->nwindows > 0 ) {
+        printf("Estimated %.2lf Mbps (not converged in %d windows)\n",
+               est->rate * 8 / 1000000, est->nwindows);
+    }
+}
+
+void
+print_analysis(const nb_rate_analysis_t *a)
+{
+    if ( a->nwindows > 0 ) {
+        printf("Steady %.2lf Mbps after %.2lf sec of ramp-up (peak %.2lf, "
+               "5-50-95 %%ile %.2lf %.2lf %.2lf)\n", a->steady * 8 / 1000000,
+               a->rampend, a->peak * 8 / 1000000,
+               nb_rate_analysis_percentile(a, 5) * 8 / 1000000,
+               nb_rate_analysis_percentile(a, 50) * 8 / 1000000,
+               nb_rate_analysis_percentile(a, 95) * 8 / 1000000);
+    }
+}
+
+
+/*
+ * Select the server of the family from the candidates by the handshake RTT
+ * Returns the default one if none of them is reachable.
+ */
+static const char *
+select_server(const char *const *cands, int n, int family, const char *def)
+{
+    nb_server_select_t *sel;
+    nb_server_select_result_t *res;
+    const char *server;
+    int i;
+
+    sel = nb_server_select_new();
+    if ( NULL == sel ) {
+        return def;
+    }
+    server = def;
+    if ( 0 == nb_server_select_exec(sel, cands, n, HTTP_PORT, family) ) {
+        res = sel->last_result;
+        for ( i = 0; i < n; i++ ) {
+            if ( res->items[res->rank[i]].received > 0 ) {
+                printf("  %s: %lf ms (loss %.0lf %%)\n", cands[res->rank[i]],
+                       res->items[res->rank[i]].rtt_median * 1000,
+                       res->items[res->rank[i]].loss * 100);
+            } else {
+                printf("  %s: unreachable\n", cands[res->rank[i]]);
+            }
+        }
+        if ( res->winner >= 0 ) {
+            server = cands[res->winner];
+        }
+        printf("Selected %s in %.0lf ms.\n", server, res->elapsed * 1000);
+    }
+    nb_server_select_delete(sel);
+
+    return server;
+}
+
+/*
+ * The candidate servers may be specified by the arguments; the one of the
+ * lowest latency is selected for each family.
+ */
 int
 main(int argc, const char *const argv[])
 {
@@ -57,6 +128,20 @@ main(int argc, const char *const argv[])
     nb_traceroute_t *tr;
     nb_http_get_t *hget;
     nb_http_post_t *hpost;
+    nb_rate_analysis_t ana;
+    const char *server4;
+    const char *server6;
+    char url[1024];
+
+    /* Select the servers */
+    server4 = IPV4_SERVER;
+    server6 = IPV6_SERVER;
+    if ( argc > 1 ) {
+        printf("Selecting the server (IPv4)...\n");
+        server4 = select_server(argv + 1, argc - 1, AF_INET, IPV4_SERVER);
+        printf("Selecting the server (IPv6)...\n");
+        server6 = select_server(argv + 1, argc - 1, AF_INET6, IPV6_SERVER);
+    }
 
     /* Prepare the ping measurement (IPv40 */
     printf("Starting ping (IPv4)...\n");
@@ -71,7 +156,7 @@ main(int argc, const char *const argv[])
     (void)nb_ping_set_callback(ping, cb_ping, NULL);
 
     /* Execute ping */
-    ret = nb_ping_exec(ping, IPV4_SERVER, 12, 10, 1.0, 3.0);
+    ret = nb_ping_exec(ping, server4, 12, 10, 1.0, 3.0);
     if ( 0 != ret ) {
         /* Cannot execute the ping measurement */
         fprintf(stderr, "Cannot execute ping measurement.\n");
@@ -94,7 +179,7 @@ main(int argc, const char *const argv[])
     (void)nb_ping_set_callback(ping, cb_ping, NULL);
 
     /* Execute ping */
-    ret = nb_ping_exec(ping, IPV6_SERVER, 2, 10, 1.0, 3.0);
+    ret = nb_ping_exec(ping, server6, 2, 10, 1.0, 3.0);
     if ( 0 != ret ) {
         /* Cannot execute the ping measurement */
         fprintf(stderr, "Cannot execute ping measurement.\n");
@@ -117,14 +202,14 @@ main(int argc, const char *const argv[])
     (void)nb_traceroute_set_callback(tr, cb_traceroute, NULL);
 
     /* Execute traceroute (IPv4) */
-    ret = nb_traceroute_exec(tr, IPV4_SERVER, AF_INET, 32, 5.0);
+    ret = nb_traceroute_exec(tr, server4, AF_INET, 32, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the traceroute measurement */
         fprintf(stderr, "Cannot execute traceroute measurement (IPv4).\n");
     }
 
     /* Execute traceroute (IPv6) */
-    ret = nb_traceroute_exec(tr, IPV6_SERVER, AF_INET6, 32, 5.0);
+    ret = nb_traceroute_exec(tr, server6, AF_INET6, 32, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the traceroute measurement */
         fprintf(stderr, "Cannot execute traceroute measurement (IPv6).\n");
@@ -146,20 +231,33 @@ main(int argc, const char *const argv[])
     /* Set a callback function */
     (void)nb_http_get_set_callback(hget, cb_hget, 0.5, NULL);
 
+    /* End once the estimate is within 5 % */
+    (void)nb_http_get_set_early_stop(hget, 0.05);
+
     /* Execute HTTP download (IPv4) */
-    ret = nb_http_get_exec(hget, "http://"IPV4_SERVER"/scr/download.php",
-                           AF_INET, 5.0);
+    snprintf(url, sizeof(url), "http://%s/scr/download.php", server4);
+    ret = nb_http_get_exec(hget, url, AF_INET, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the HTTP (GET) measurement */
         fprintf(stderr, "Cannot execute HTTP (GET) measurement (IPv4).\n");
+    } else {
+        print_estimate(&hget->last_result->est);
+        (void)nb_rate_analysis_init(&ana, 0.0);
+        nb_rate_analysis_http_get(&ana, hget->last_result);
+        print_analysis(&ana);
     }
 
     /* Execute HTTP download (IPv6) */
-    ret = nb_http_get_exec(hget, "http://"IPV6_SERVER"/scr/download.php",
-                           AF_INET6, 5.0);
+    snprintf(url, sizeof(url), "http://%s/scr/download.php", server6);
+    ret = nb_http_get_exec(hget, url, AF_INET6, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the HTTP (GET) measurement */
         fprintf(stderr, "Cannot execute HTTP (GET) measurement (IPv6).\n");
+    } else {
+        print_estimate(&hget->last_result->est);
+        (void)nb_rate_analysis_init(&ana, 0.0);
+        nb_rate_analysis_http_get(&ana, hget->last_result);
+        print_analysis(&ana);
     }
 
     nb_http_get_delete(hget);
@@ -178,20 +276,33 @@ main(int argc, const char *const argv[])
     /* Set a callback function */
     (void)nb_http_post_set_callback(hpost, cb_hpost, 0.5, NULL);
 
+    /* End once the estimate is within 5 % */
+    (void)nb_http_post_set_early_stop(hpost, 0.05);
+
     /* Execute HTTP upload (IPv4) */
-    ret = nb_http_post_exec(hpost, "http://"IPV4_SERVER"/scr/upload.php",
-                            AF_INET, 100 * 1000 * 1000, 5.0);
+    snprintf(url, sizeof(url), "http://%s/scr/upload.php", server4);
+    ret = nb_http_post_exec(hpost, url, AF_INET, 100 * 1000 * 1000, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the HTTP (POST) measurement */
         fprintf(stderr, "Cannot execute HTTP (POST) measurement (IPv4).\n");
+    } else {
+        print_estimate(&hpost->last_result->est);
+        (void)nb_rate_analysis_init(&ana, 0.0);
+        nb_rate_analysis_http_post(&ana, hpost->last_result);
+        print_analysis(&ana);
     }
 
     /* Execute HTTP upload (IPv6) */
-    ret = nb_http_post_exec(hpost, "http://"IPV6_SERVER"/scr/upload.php",
-                            AF_INET6, 10 * 1000 * 1000, 5.0);
+    snprintf(url, sizeof(url), "http://%s/scr/upload.php", server6);
+    ret = nb_http_post_exec(hpost, url, AF_INET6, 10 * 1000 * 1000, 5.0);
     if ( 0 != ret ) {
         /* Cannot execute the HTTP (POST) measurement */
         fprintf(stderr, "Cannot execute HTTP (POST) measurement (IPv6).\n");
+    } else {
+        print_estimate(&hpost->last_result->est);
+        (void)nb_rate_analysis_init(&ana, 0.0);
+        nb_rate_analysis_http_post(&ana, hpost->last_result);
+        print_analysis(&ana);
     }
 
     nb_http_post_delete(hpost);
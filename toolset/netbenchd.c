@@ -0,0 +1,1270 @@
+/*_
+ * Copyright 2014 Scyphus Solutions Co. Ltd.  All rights reserved.
+ *
+ * Authors:
+ *      Hirochika Asai  <asai@scyphus.co.jp>
+ */
+
+/*
+ * netbenchd: test server of the netbench measurements
+ *
+ *   GET  /scr/download.php[?size=N]  the body of N bytes (sendfile); a
+ *                                    single "Range: bytes=" is served
+ *   POST /scr/upload.php             the body is discarded
+ *   NBTCP SOURCE                     raw TCP; data is sent until closed
+ *   NBTCP SINK                       raw TCP; data is discarded until closed
+ *   NBTCP BIDIR                      raw TCP; both of the above
+ *   UDP                              datagrams are echoed back
+ *
+ * The raw TCP modes are selected by the command line in place of an HTTP
+ * request.  All of the TCP services are also provided over TLS on another
+ * port with the certificate given (with OpenSSL).
+ */
+
+#include "config.h"
+#include <netbench.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+#if HAVE_OPENSSL
+#include <limits.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#define DEFAULT_PORT                    "8080"
+#define DEFAULT_SIZE                    (64 * 1024 * 1024)
+
+#define REQUEST_BUFFER_SIZE             16384
+#define RESPONSE_HEADER_SIZE            1024
+#define DISCARD_SIZE                    (1024 * 1024)
+#define SENDFILE_SIZE                   (16 * 1024 * 1024)
+#define TLS_WRITE_SIZE                  (256 * 1024)
+#define EVENTS_MAX                      64
+#define LISTEN_BACKLOG                  1024
+#define UDP_BATCH                       32
+#define UDP_DATAGRAM_MAX                65536
+#define UDP_SEND_WAIT                   10      /* ms */
+#define UDP_SOCKBUF_SIZE                (4 * 1024 * 1024)
+#define MEASUREMENT_ID_MAX              100
+
+#define DOWNLOAD_PATH                   "/scr/download.php"
+#define UPLOAD_PATH                     "/scr/upload.php"
+#define COMMAND_PREFIX                  "NBTCP "
+
+/* States of a connection */
+#define CONN_READ                       0
+#define CONN_WRITE                      1
+#define CONN_SENDFILE                   2
+#define CONN_DISCARD                    3
+#define CONN_SOURCE                     4
+#define CONN_SINK                       5
+#define CONN_BIDIR                      6
+#define CONN_HANDSHAKE                  7
+
+/*
+ * Connection
+ */
+typedef struct _conn {
+    int sock;
+    int state;
+    int keep;
+    char buf[REQUEST_BUFFER_SIZE];
+    size_t len;
+    size_t scan;                /* Searched for the end of the header */
+    char out[RESPONSE_HEADER_SIZE];
+    size_t outlen;
+    size_t outoff;
+    off_t remain;               /* Body bytes to send or to discard */
+    off_t off;                  /* Offset in the content file */
+#if HAVE_OPENSSL
+    SSL *ssl;                   /* NULL without TLS */
+    size_t tpend;               /* Length of the content write to retry */
+#endif
+} conn_t;
+
+/*
+ * Worker thread with its own listening sockets
+ */
+typedef struct _worker {
+    pthread_t thread;
+    int epfd;
+    int lsock;
+    int usock;
+    int tsock;                  /* TLS (-1 if not enabled) */
+    int trunc;                  /* MSG_TRUNC discards the stream data */
+    char *scratch;
+} worker_t;
+
+/*
+ * Server configuration
+ */
+static const char *host = NULL;
+static const char *port = DEFAULT_PORT;
+static const char *uport = NULL;
+static const char *tport = NULL;
+static const char *certfile = NULL;
+static const char *keyfile = NULL;
+static int verbose = 0;
+static int contentfd = -1;
+static off_t contentsize = DEFAULT_SIZE;
+#if HAVE_OPENSSL
+static SSL_CTX *sslctx = NULL;
+#endif
+
+/* Prototype declarations */
+static int _content_open(off_t);
+static int _listen(const char *, const char *, int);
+#if HAVE_OPENSSL
+static SSL_CTX * _tls_ctx_new(const char *, const char *);
+static ssize_t _tls_error(conn_t *, int);
+#endif
+static void _conn_close(worker_t *, conn_t *);
+static ssize_t _conn_recv(conn_t *, void *, size_t);
+static ssize_t _conn_send(conn_t *, const void *, size_t);
+static ssize_t _find_eoh(conn_t *);
+static off_t _query_size(const char *, size_t);
+static int _range(const nb_http_header_view_t *, off_t, off_t *, off_t *);
+static void _respond(conn_t *, int, const char *, off_t, const char *,
+                     const char *,
+                     size_t);
+static void _request(conn_t *, size_t);
+static void _consume(conn_t *, size_t);
+static int _command(conn_t *);
+static ssize_t _discard(worker_t *, conn_t *, size_t);
+static ssize_t _send_content(worker_t *, conn_t *, size_t);
+static int _conn_process(worker_t *, conn_t *);
+static void _accept(worker_t *, int, int);
+static void _udp_reflect(worker_t *);
+static void * _worker(void *);
+
+/*
+ * Create the content file served by sendfile
+ * The content is pseudo-random not to be compressed on the path.
+ */
+static int
+_content_open(off_t size)
+{
+    char buf[65536];
+    uint32_t x;
+    off_t off;
+    size_t i;
+    size_t n;
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("netbenchd", 0);
+#else
+    char path[] = "/tmp/netbenchd.XXXXXX";
+
+    fd = mkstemp(path);
+    if ( fd >= 0 ) {
+        (void)unlink(path);
+    }
+#endif
+    if ( fd < 0 ) {
+        return -1;
+    }
+
+    x = 2463534242U;
+    for ( off = 0; off < size; off += n ) {
+        for ( i = 0; i < sizeof(buf); i += 4 ) {
+            /* xorshift32 */
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            (void)memcpy(buf + i, &x, 4);
+        }
+        n = size - off > sizeof(buf) ? sizeof(buf) : (size_t)(size - off);
+        if ( write(fd, buf, n) != (ssize_t)n ) {
+            (void)close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/*
+ * Open a listening socket shared with the other workers by SO_REUSEPORT
+ * Both IPv4 and IPv6 are accepted if the host is not specified.
+ */
+static int
+_listen(const char *host, const char *port, int type)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    int sock;
+    int opt;
+
+    (void)memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    hints.ai_flags = AI_PASSIVE;
+    if ( 0 != getaddrinfo(NULL != host ? host : "::", port, &hints, &res) ) {
+        if ( NULL != host
+             || 0 != getaddrinfo("0.0.0.0", port, &hints, &res) ) {
+            return -1;
+        }
+    }
+
+    sock = -1;
+    for ( ai = res; NULL != ai; ai = ai->ai_next ) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK
+                      | SOCK_CLOEXEC, ai->ai_protocol);
+        if ( sock < 0 ) {
+            continue;
+        }
+        opt = 1;
+        (void)setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if ( 0 != setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt,
+                             sizeof(opt)) ) {
+            (void)close(sock);
+            sock = -1;
+            continue;
+        }
+        if ( SOCK_DGRAM == type ) {
+            /* Not to drop the bursts of the datagrams (best effort) */
+            opt = UDP_SOCKBUF_SIZE;
+            (void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+            (void)setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+        }
+        if ( AF_INET6 == ai->ai_family && NULL == host ) {
+            /* Dual stack */
+            opt = 0;
+            (void)setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt,
+                             sizeof(opt));
+        }
+        if ( 0 != bind(sock, ai->ai_addr, ai->ai_addrlen)
+             || (SOCK_STREAM == type
+                 && 0 != listen(sock, LISTEN_BACKLOG)) ) {
+            (void)close(sock);
+            sock = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(res);
+
+    return sock;
+}
+
+#if HAVE_OPENSSL
+/*
+ * Create the TLS context of the certificate (chain) and the private key
+ * The sessions are cached for the resumption, and the tickets are issued
+ * by default.
+ */
+static SSL_CTX *
+_tls_ctx_new(const char *cert, const char *key)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if ( NULL == ctx ) {
+        return NULL;
+    }
+    (void)SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* The content is read again into the scratch buffer to retry a write */
+    (void)SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                           | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    (void)SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"nbd",
+                                         3);
+    if ( 1 != SSL_CTX_use_certificate_chain_file(ctx, cert)
+         || 1 != SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM)
+         || 1 != SSL_CTX_check_private_key(ctx) ) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/*
+ * Map the error of the TLS operation to the return value of recv/send
+ * Returns 0 at the end of the stream, or -1 with errno (EAGAIN if it would
+ * block).
+ */
+static ssize_t
+_tls_error(conn_t *c, int ret)
+{
+    switch ( SSL_get_error(c->ssl, ret) ) {
+    case SSL_ERROR_ZERO_RETURN:
+        ERR_clear_error();
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        break;
+    case SSL_ERROR_SYSCALL:
+        if ( 0 == errno ) {
+            /* Closed without close_notify */
+            ERR_clear_error();
+            return 0;
+        }
+        break;
+    default:
+        errno = EPROTO;
+        break;
+    }
+    ERR_clear_error();
+
+    return -1;
+}
+#endif
+
+/*
+ * Close and free the connection
+ */
+static void
+_conn_close(worker_t *w, conn_t *c)
+{
+    (void)epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+#if HAVE_OPENSSL
+    if ( NULL != c->ssl ) {
+        /* Send close_notify if possible, without waiting */
+        if ( CONN_HANDSHAKE != c->state ) {
+            (void)SSL_shutdown(c->ssl);
+        }
+        ERR_clear_error();
+        SSL_free(c->ssl);
+    }
+#endif
+    (void)close(c->sock);
+    free(c);
+}
+
+/*
+ * Receive from the connection (decrypted on TLS)
+ */
+static ssize_t
+_conn_recv(conn_t *c, void *buf, size_t sz)
+{
+#if HAVE_OPENSSL
+    int n;
+
+    if ( NULL != c->ssl ) {
+        n = SSL_read(c->ssl, buf, sz > INT_MAX ? INT_MAX : (int)sz);
+        return n > 0 ? n : _tls_error(c, n);
+    }
+#endif
+
+    return recv(c->sock, buf, sz, 0);
+}
+
+/*
+ * Send to the connection (encrypted on TLS)
+ * A send would block must be retried with the same data.
+ */
+static ssize_t
+_conn_send(conn_t *c, const void *buf, size_t len)
+{
+#if HAVE_OPENSSL
+    int n;
+
+    if ( NULL != c->ssl ) {
+        n = SSL_write(c->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+        return n > 0 ? n : _tls_error(c, n);
+    }
+#endif
+
+    return send(c->sock, buf, len, MSG_NOSIGNAL);
+}
+
+/*
+ * Search the end of the request header
+ * Returns the header length, or -1 if it is not complete yet.
+ */
+static ssize_t
+_find_eoh(conn_t *c)
+{
+    const char *p;
+    const char *end;
+
+    end = c->buf + c->len;
+    p = c->buf + c->scan;
+    while ( NULL != (p = memchr(p, '\n', end - p)) ) {
+        p++;
+        if ( p < end && '\n' == *p ) {
+            return p + 1 - c->buf;
+        }
+        if ( p + 1 < end && '\r' == p[0] && '\n' == p[1] ) {
+            return p + 2 - c->buf;
+        }
+    }
+    /* Resume at the last two bytes, which may begin the empty line */
+    c->scan = c->len > 2 ? c->len - 2 : 0;
+
+    return -1;
+}
+
+/*
+ * Get the size parameter of the query string (-1 if not specified)
+ */
+static off_t
+_query_size(const char *uri, size_t len)
+{
+    const char *q;
+    const char *end;
+    off_t size;
+    int ndigits;
+
+    end = uri + len;
+    q = memchr(uri, '?', len);
+    while ( NULL != q && q < end ) {
+        q++;
+        if ( end - q > 5 && 0 == memcmp(q, "size=", 5) ) {
+            size = 0;
+            ndigits = 0;
+            for ( q += 5; q < end && *q >= '0' && *q <= '9'; q++ ) {
+                if ( ++ndigits > 18 ) {
+                    /* Too large */
+                    return -1;
+                }
+                size = size * 10 + (*q - '0');
+            }
+            return ndigits > 0 ? size : -1;
+        }
+        q = memchr(q, '&', end - q);
+    }
+
+    return -1;
+}
+
+/*
+ * Get the byte range [first, last] of the content of the size requested by
+ * "Range: bytes=" (a single range only)
+ * Returns 1 if satisfiable, 0 if not requested (or invalid, to be ignored),
+ * or -1 if not satisfiable.
+ */
+static int
+_range(const nb_http_header_view_t *view, off_t size, off_t *first,
+       off_t *last)
+{
+    const nb_http_header_field_t *f;
+    const char *p;
+    const char *end;
+    off_t v[2];
+    int nd[2];
+    int i;
+
+    f = nb_http_header_view_find(view, "range");
+    if ( NULL == f || f->value.len < 6
+         || 0 != strncasecmp(view->buf + f->value.off, "bytes=", 6) ) {
+        return 0;
+    }
+    p = view->buf + f->value.off + 6;
+    end = view->buf + f->value.off + f->value.len;
+    for ( i = 0; i < 2; i++ ) {
+        v[i] = 0;
+        nd[i] = 0;
+        for ( ; p < end && *p >= '0' && *p <= '9'; p++ ) {
+            if ( ++nd[i] > 18 ) {
+                return 0;
+            }
+            v[i] = v[i] * 10 + (*p - '0');
+        }
+        if ( 0 == i ) {
+            if ( p >= end || '-' != *p ) {
+                return 0;
+            }
+            p++;
+        }
+    }
+    if ( p != end || (0 == nd[0] && 0 == nd[1]) ) {
+        /* Multiple ranges or invalid */
+        return 0;
+    }
+
+    if ( 0 == nd[0] ) {
+        /* The suffix of the length */
+        if ( 0 == v[1] || 0 == size ) {
+            return -1;
+        }
+        *first = v[1] < size ? size - v[1] : 0;
+        *last = size - 1;
+        return 1;
+    }
+    if ( v[0] >= size || (nd[1] > 0 && v[1] < v[0]) ) {
+        return -1;
+    }
+    *first = v[0];
+    *last = nd[1] > 0 && v[1] < size ? v[1] : size - 1;
+
+    return 1;
+}
+
+/*
+ * Build the response header with the content length of size (and the
+ * content range unless NULL)
+ */
+static void
+_respond(conn_t *c, int status, const char *reason, off_t size,
+         const char *range, const char *mid, size_t midlen)
+{
+    int n;
+
+    n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 %d %s\r\n"
+                 "Server: netbenchd/%s\r\n"
+                 "Content-Type: application/octet-stream\r\n"
+                 "Content-Length: %lld\r\n"
+                 "Cache-Control: no-store\r\n",
+                 status, reason, PACKAGE_VERSION, (long long)size);
+    if ( NULL != range ) {
+        n += snprintf(c->out + n, sizeof(c->out) - n,
+                      "Content-Range: %s\r\n", range);
+    }
+    if ( NULL != mid ) {
+        n += snprintf(c->out + n, sizeof(c->out) - n,
+                      "X-Measurement-Id: %.*s\r\n", (int)midlen, mid);
+    }
+    n += snprintf(c->out + n, sizeof(c->out) - n, "Connection: %s\r\n\r\n",
+                  c->keep ? "keep-alive" : "close");
+    c->outlen = n;
+    c->outoff = 0;
+    c->state = CONN_WRITE;
+}
+
+/*
+ * Remove the bytes of the processed request from the buffer, keeping the
+ * pipelined ones
+ */
+static void
+_consume(conn_t *c, size_t n)
+{
+    (void)memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+    c->scan = 0;
+}
+
+/*
+ * Handle the request of the header length
+ */
+static void
+_request(conn_t *c, size_t hdrlen)
+{
+    nb_http_header_view_t view;
+    const nb_http_header_field_t *f;
+    const char *method;
+    const char *uri;
+    const char *mid;
+    size_t midlen;
+    size_t pathlen;
+    size_t n;
+    off_t size;
+    off_t first;
+    off_t last;
+    char range[64];
+
+    if ( 0 != nb_http_header_view_parse(&view, c->buf, hdrlen) ) {
+        c->keep = 0;
+        c->remain = 0;
+        _respond(c, 400, "Bad Request", 0, NULL, NULL, 0);
+        _consume(c, c->len);
+        return;
+    }
+    method = c->buf + view.method.off;
+    uri = c->buf + view.uri.off;
+    c->keep = nb_http_header_view_is_keepalive(&view);
+
+    /* Echo the measurement ID back */
+    mid = NULL;
+    midlen = 0;
+    f = nb_http_header_view_find(&view, "x-measurement-id");
+    if ( NULL != f ) {
+        mid = c->buf + f->value.off;
+        midlen = f->value.len > MEASUREMENT_ID_MAX
+            ? MEASUREMENT_ID_MAX : f->value.len;
+    }
+    if ( verbose ) {
+        printf("%.*s %.*s (%.*s)\n", (int)view.method.len, method,
+               (int)view.uri.len, uri, (int)midlen, NULL != mid ? mid : "");
+    }
+
+    /* Path without the query */
+    for ( pathlen = 0; pathlen < view.uri.len && '?' != uri[pathlen];
+          pathlen++ ) {
+    }
+
+    if ( 3 == view.method.len && 0 == memcmp(method, "GET", 3)
+         && sizeof(DOWNLOAD_PATH) - 1 == pathlen
+         && 0 == memcmp(uri, DOWNLOAD_PATH, pathlen) ) {
+        /* Download */
+        size = _query_size(uri, view.uri.len);
+        if ( size < 0 ) {
+            size = contentsize;
+        }
+        switch ( _range(&view, size, &first, &last) ) {
+        case 1:
+            /* Partial content; the offset wraps around the content file */
+            snprintf(range, sizeof(range), "bytes %lld-%lld/%lld",
+                     (long long)first, (long long)last, (long long)size);
+            c->remain = last - first + 1;
+            c->off = first % contentsize;
+            _respond(c, 206, "Partial Content", c->remain, range, mid,
+                     midlen);
+            break;
+        case -1:
+            snprintf(range, sizeof(range), "bytes */%lld", (long long)size);
+            c->remain = 0;
+            _respond(c, 416, "Range Not Satisfiable", 0, range, mid, midlen);
+            break;
+        default:
+            c->remain = size;
+            c->off = 0;
+            _respond(c, 200, "OK", size, NULL, mid, midlen);
+        }
+        _consume(c, hdrlen);
+    } else if ( 4 == view.method.len && 0 == memcmp(method, "POST", 4)
+                && sizeof(UPLOAD_PATH) - 1 == pathlen
+                && 0 == memcmp(uri, UPLOAD_PATH, pathlen) ) {
+        /* Upload */
+        size = nb_http_header_view_get_content_length(&view);
+        if ( size < 0 || nb_http_header_view_is_chunked(&view) ) {
+            c->keep = 0;
+            c->remain = 0;
+            _respond(c, 411, "Length Required", 0, NULL, mid, midlen);
+            _consume(c, c->len);
+            return;
+        }
+        /* The body bytes received together with the header */
+        n = c->len - hdrlen;
+        if ( (off_t)n > size ) {
+            n = (size_t)size;
+        }
+        c->remain = size - n;
+        _respond(c, 200, "OK", 0, NULL, mid, midlen);
+        _consume(c, hdrlen + n);
+        if ( c->remain > 0 ) {
+            /* Respond after the body */
+            c->state = CONN_DISCARD;
+        }
+    } else {
+        c->remain = 0;
+        _respond(c, 404, "Not Found", 0, NULL, mid, midlen);
+        _consume(c, hdrlen);
+    }
+}
+
+/*
+ * Switch to the raw TCP mode of the command line
+ * Returns 1 if switched, 0 if it is not a command (or not complete yet), or
+ * -1 if it is an unknown command.
+ */
+static int
+_command(conn_t *c)
+{
+    const char *eol;
+    size_t len;
+
+    if ( c->len < sizeof(COMMAND_PREFIX) - 1
+         || 0 != memcmp(c->buf, COMMAND_PREFIX, sizeof(COMMAND_PREFIX) - 1) ) {
+        return 0;
+    }
+    eol = memchr(c->buf, '\n', c->len);
+    if ( NULL == eol ) {
+        return 0;
+    }
+    len = eol - c->buf;
+    if ( len > 0 && '\r' == c->buf[len - 1] ) {
+        len--;
+    }
+    if ( verbose ) {
+        printf("%.*s\n", (int)len, c->buf);
+    }
+    len -= sizeof(COMMAND_PREFIX) - 1;
+    eol = c->buf + sizeof(COMMAND_PREFIX) - 1;
+    if ( 6 == len && 0 == memcmp(eol, "SOURCE", 6) ) {
+        c->state = CONN_SOURCE;
+    } else if ( 4 == len && 0 == memcmp(eol, "SINK", 4) ) {
+        c->state = CONN_SINK;
+    } else if ( 5 == len && 0 == memcmp(eol, "BIDIR", 5) ) {
+        c->state = CONN_BIDIR;
+    } else {
+        return -1;
+    }
+    c->off = 0;
+    /* The data received together with the command is discarded */
+    _consume(c, c->len);
+
+    return 1;
+}
+
+/*
+ * Receive and discard up to sz bytes, without copying if MSG_TRUNC is
+ * supported (and not on TLS, which must be decrypted)
+ */
+static ssize_t
+_discard(worker_t *w, conn_t *c, size_t sz)
+{
+    ssize_t n;
+
+#if HAVE_OPENSSL
+    if ( NULL != c->ssl ) {
+        return _conn_recv(c, w->scratch, sz);
+    }
+#endif
+    n = recv(c->sock, w->scratch, sz, w->trunc ? MSG_TRUNC : 0);
+    if ( n < 0 && w->trunc && (EINVAL == errno || EOPNOTSUPP == errno) ) {
+        /* Copy instead */
+        w->trunc = 0;
+        n = recv(c->sock, w->scratch, sz, 0);
+    }
+
+    return n;
+}
+
+/*
+ * Send up to sz bytes of the content file, wrapping around it
+ * On TLS, the content is read into the scratch buffer and encrypted; a
+ * write would block is retried with the same length at the same offset.
+ */
+static ssize_t
+_send_content(worker_t *w, conn_t *c, size_t sz)
+{
+#if HAVE_OPENSSL
+    ssize_t n;
+#endif
+
+    if ( c->off >= contentsize ) {
+        c->off = 0;
+    }
+    if ( (off_t)sz > contentsize - c->off ) {
+        sz = (size_t)(contentsize - c->off);
+    }
+    if ( sz > SENDFILE_SIZE ) {
+        sz = SENDFILE_SIZE;
+    }
+#if HAVE_OPENSSL
+    if ( NULL != c->ssl ) {
+        if ( c->tpend > 0 ) {
+            sz = c->tpend;
+        } else if ( sz > TLS_WRITE_SIZE ) {
+            sz = TLS_WRITE_SIZE;
+        }
+        if ( pread(contentfd, w->scratch, sz, c->off) != (ssize_t)sz ) {
+            return -1;
+        }
+        n = _conn_send(c, w->scratch, sz);
+        if ( n > 0 ) {
+            c->off += n;
+            c->tpend = 0;
+        } else if ( n < 0 && EAGAIN == errno ) {
+            c->tpend = sz;
+        }
+        return n;
+    }
+#endif
+
+    return sendfile(c->sock, contentfd, &c->off, sz);
+}
+
+/*
+ * Proceed the connection as far as possible without blocking
+ * Returns -1 if the connection is to be closed.
+ */
+static int
+_conn_process(worker_t *w, conn_t *c)
+{
+    ssize_t n;
+    ssize_t m;
+    ssize_t eoh;
+    size_t sz;
+    int rblocked;
+    int err;
+
+    for ( ;; ) {
+        switch ( c->state ) {
+        case CONN_READ:
+            /* Raw TCP */
+            err = _command(c);
+            if ( err < 0 ) {
+                return -1;
+            } else if ( err > 0 ) {
+                break;
+            }
+            /* Process a pipelined request first */
+            eoh = _find_eoh(c);
+            if ( eoh > 0 ) {
+                _request(c, (size_t)eoh);
+                break;
+            }
+            if ( c->len >= sizeof(c->buf) ) {
+                /* Too long header */
+                return -1;
+            }
+            n = _conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            } else if ( 0 == n ) {
+                return -1;
+            }
+            c->len += n;
+            break;
+        case CONN_DISCARD:
+            sz = c->remain > DISCARD_SIZE ? DISCARD_SIZE : (size_t)c->remain;
+            n = _discard(w, c, sz);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            } else if ( 0 == n ) {
+                return -1;
+            }
+            c->remain -= n;
+            if ( 0 == c->remain ) {
+                /* Send the response prepared */
+                c->state = CONN_WRITE;
+            }
+            break;
+        case CONN_WRITE:
+            n = _conn_send(c, c->out + c->outoff, c->outlen - c->outoff);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            }
+            c->outoff += n;
+            if ( c->outoff < c->outlen ) {
+                break;
+            }
+            if ( c->remain > 0 ) {
+                c->state = CONN_SENDFILE;
+            } else if ( !c->keep ) {
+                return -1;
+            } else {
+                c->state = CONN_READ;
+            }
+            break;
+        case CONN_SENDFILE:
+            sz = c->remain > SENDFILE_SIZE ? SENDFILE_SIZE : (size_t)c->remain;
+            n = _send_content(w, c, sz);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            } else if ( 0 == n ) {
+                return -1;
+            }
+            c->remain -= n;
+            if ( 0 == c->remain ) {
+                if ( !c->keep ) {
+                    return -1;
+                }
+                c->state = CONN_READ;
+            }
+            break;
+        case CONN_SOURCE:
+            n = _send_content(w, c, SENDFILE_SIZE);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            } else if ( 0 == n ) {
+                return -1;
+            }
+            break;
+        case CONN_SINK:
+            n = _discard(w, c, DISCARD_SIZE);
+            if ( n < 0 ) {
+                if ( EINTR == errno ) {
+                    break;
+                }
+                return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+            } else if ( 0 == n ) {
+                return -1;
+            }
+            break;
+        case CONN_BIDIR:
+            /* Proceed both directions until both would block, since the
+               events are edge-triggered */
+            n = _discard(w, c, DISCARD_SIZE);
+            if ( 0 == n ) {
+                return -1;
+            }
+            rblocked = 0;
+            if ( n < 0 ) {
+                if ( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                    rblocked = 1;
+                } else if ( EINTR != errno ) {
+                    return -1;
+                }
+            }
+            m = _send_content(w, c, SENDFILE_SIZE);
+            if ( m < 0 ) {
+                if ( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                    if ( rblocked ) {
+                        return 0;
+                    }
+                } else if ( EINTR != errno ) {
+                    return -1;
+                }
+            } else if ( 0 == m ) {
+                return -1;
+            }
+            break;
+        case CONN_HANDSHAKE:
+#if HAVE_OPENSSL
+            err = SSL_accept(c->ssl);
+            if ( 1 != err ) {
+                n = _tls_error(c, err);
+                return (n < 0 && EAGAIN == errno) ? 0 : -1;
+            }
+            c->state = CONN_READ;
+            break;
+#else
+            return -1;
+#endif
+        default:
+            return -1;
+        }
+    }
+}
+
+/*
+ * Accept the pending connections on the listening socket (of TLS if tls is
+ * non-zero)
+ */
+static void
+_accept(worker_t *w, int lsock, int tls)
+{
+    struct epoll_event ev;
+    conn_t *c;
+    int sock;
+    int opt;
+
+    for ( ;; ) {
+        sock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( sock < 0 ) {
+            if ( EINTR == errno || ECONNABORTED == errno ) {
+                continue;
+            }
+            return;
+        }
+        opt = 1;
+        (void)setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        c = malloc(sizeof(conn_t));
+        if ( NULL == c ) {
+            (void)close(sock);
+            continue;
+        }
+        c->sock = sock;
+        c->state = CONN_READ;
+        c->keep = 0;
+        c->len = 0;
+        c->scan = 0;
+        c->outlen = 0;
+        c->outoff = 0;
+        c->remain = 0;
+        c->off = 0;
+#if HAVE_OPENSSL
+        c->ssl = NULL;
+        c->tpend = 0;
+        if ( tls ) {
+            c->ssl = SSL_new(sslctx);
+            if ( NULL == c->ssl || 1 != SSL_set_fd(c->ssl, sock) ) {
+                SSL_free(c->ssl);
+                ERR_clear_error();
+                (void)close(sock);
+                free(c);
+                continue;
+            }
+            c->state = CONN_HANDSHAKE;
+        }
+#endif
+
+        /* Edge-triggered; the connection is always proceeded until it
+           would block */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if ( 0 != epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev) ) {
+            c->state = CONN_HANDSHAKE;
+            _conn_close(w, c);
+        }
+    }
+}
+
+/*
+ * Echo the datagrams back to the senders
+ * The echoes are not dropped when the send buffer is full, but wait for the
+ * room for a while, so that the loss is of the path only.
+ */
+static void
+_udp_reflect(worker_t *w)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    struct pollfd pfd;
+    int sent;
+    int i;
+    int n;
+    int m;
+
+    for ( ;; ) {
+        for ( i = 0; i < UDP_BATCH; i++ ) {
+            iovs[i].iov_base = w->scratch + (size_t)i * UDP_DATAGRAM_MAX;
+            iovs[i].iov_len = UDP_DATAGRAM_MAX;
+            (void)memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(w->usock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if ( n <= 0 ) {
+            return;
+        }
+        for ( i = 0; i < n; i++ ) {
+            iovs[i].iov_len = msgs[i].msg_len;
+        }
+        sent = 0;
+        while ( sent < n ) {
+            m = sendmmsg(w->usock, msgs + sent, n - sent, MSG_DONTWAIT);
+            if ( m > 0 ) {
+                sent += m;
+                continue;
+            }
+            if ( m < 0 && EINTR == errno ) {
+                continue;
+            }
+            if ( m < 0 && (EAGAIN == errno || EWOULDBLOCK == errno
+                           || ENOBUFS == errno) ) {
+                pfd.fd = w->usock;
+                pfd.events = POLLOUT;
+                if ( poll(&pfd, 1, UDP_SEND_WAIT) > 0 ) {
+                    continue;
+                }
+                /* Still full; give up the rest */
+                break;
+            }
+            /* The first one cannot be sent (e.g., to an unreachable
+               sender); skip it */
+            sent++;
+        }
+    }
+}
+
+/*
+ * Event loop of a worker
+ */
+static void *
+_worker(void *arg)
+{
+    worker_t *w;
+    struct epoll_event evs[EVENTS_MAX];
+    conn_t *c;
+    int n;
+    int i;
+
+    w = (worker_t *)arg;
+    for ( ;; ) {
+        n = epoll_wait(w->epfd, evs, EVENTS_MAX, -1);
+        if ( n < 0 ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            break;
+        }
+        for ( i = 0; i < n; i++ ) {
+            if ( &w->lsock == evs[i].data.ptr ) {
+                _accept(w, w->lsock, 0);
+            } else if ( &w->tsock == evs[i].data.ptr ) {
+                _accept(w, w->tsock, 1);
+            } else if ( &w->usock == evs[i].data.ptr ) {
+                _udp_reflect(w);
+            } else {
+                c = (conn_t *)evs[i].data.ptr;
+                if ( 0 != _conn_process(w, c) ) {
+                    _conn_close(w, c);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Usage
+ */
+static void
+_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-u udp-port] "
+            "[-S tls-port -C cert -K key] [-t threads] [-s size] [-v]\n"
+            "  -a  Address to listen (default: all)\n"
+            "  -p  TCP port of HTTP and raw TCP (default: %s)\n"
+            "  -u  UDP port of the echo (default: the TCP port)\n"
+            "  -S  TCP port of the TLS (default: disabled)\n"
+            "  -C  Certificate (chain) file of the TLS in PEM\n"
+            "  -K  Private key file of the TLS in PEM\n"
+            "  -t  Number of worker threads (default: online CPUs)\n"
+            "  -s  Default download size in bytes (default: %d)\n"
+            "  -v  Print each request\n", prog, DEFAULT_PORT, DEFAULT_SIZE);
+}
+
+int
+main(int argc, char *const argv[])
+{
+    worker_t *workers;
+    struct epoll_event ev;
+    long nthreads;
+    int opt;
+    int i;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ( -1 != (opt = getopt(argc, argv, "a:p:u:S:C:K:t:s:vh")) ) {
+        switch ( opt ) {
+        case 'a':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'u':
+            uport = optarg;
+            break;
+        case 'S':
+            tport = optarg;
+            break;
+        case 'C':
+            certfile = optarg;
+            break;
+        case 'K':
+            keyfile = optarg;
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            contentsize = (off_t)strtoll(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            _usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ( NULL == uport ) {
+        uport = port;
+    }
+    if ( nthreads <= 0 || contentsize <= 0
+         || (NULL != tport && (NULL == certfile || NULL == keyfile)) ) {
+        _usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ( verbose ) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    /* TLS */
+    if ( NULL != tport ) {
+#if HAVE_OPENSSL
+        sslctx = _tls_ctx_new(certfile, keyfile);
+        if ( NULL == sslctx ) {
+            fprintf(stderr, "Cannot load the certificate and the key.\n");
+            return EXIT_FAILURE;
+        }
+#else
+        fprintf(stderr, "TLS is not supported without OpenSSL.\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    /* Content of the downloads */
+    contentfd = _content_open(contentsize);
+    if ( contentfd < 0 ) {
+        fprintf(stderr, "Cannot prepare the content: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    workers = malloc(sizeof(worker_t) * nthreads);
+    if ( NULL == workers ) {
+        return EXIT_FAILURE;
+    }
+    for ( i = 0; i < nthreads; i++ ) {
+        workers[i].trunc = 1;
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].lsock = _listen(host, port, SOCK_STREAM);
+        workers[i].usock = _listen(host, uport, SOCK_DGRAM);
+        workers[i].tsock = NULL != tport
+            ? _listen(host, tport, SOCK_STREAM) : -1;
+        workers[i].scratch = malloc((size_t)UDP_BATCH * UDP_DATAGRAM_MAX);
+        if ( workers[i].epfd < 0 || workers[i].lsock < 0
+             || workers[i].usock < 0
+             || (NULL != tport && workers[i].tsock < 0)
+             || NULL == workers[i].scratch ) {
+            fprintf(stderr, "Cannot listen on the port: %s\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &workers[i].lsock;
+        (void)epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].lsock, &ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &workers[i].usock;
+        (void)epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].usock, &ev);
+        if ( workers[i].tsock >= 0 ) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = &workers[i].tsock;
+            (void)epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].tsock,
+                            &ev);
+        }
+    }
+    for ( i = 1; i < nthreads; i++ ) {
+        if ( 0 != pthread_create(&workers[i].thread, NULL, _worker,
+                                 &workers[i]) ) {
+            fprintf(stderr, "Cannot create a thread.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("netbenchd: listening on TCP %s and UDP %s with %ld thread(s)\n",
+           port, uport, nthreads);
+    if ( NULL != tport ) {
+        printf("netbenchd: listening on TLS %s\n", tport);
+    }
+    fflush(stdout);
+
+    /* The main thread is the first worker */
+    (void)_worker(&workers[0]);
+
+    return EXIT_FAILURE;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */